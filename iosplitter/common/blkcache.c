@@ -0,0 +1,623 @@
+/*
+ * blkcache.c
+ *	DRAM block cache in front of the SSD
+ *
+ * Blocks of BLKCACHE_BLKSZ are keyed by (device, lba) and live in frames
+ * carved out of one slab sized by the memory budget, so the cache never
+ * allocates block memory after init.
+ *
+ * Replacement is CLOCK-Pro (Jiang, Chen, Zhang; USENIX 2005). All entries
+ * sit on one clock:
+ *	hot	resident, reused within the test period of an earlier visit
+ *	cold	resident, seen once recently
+ *	test	non resident, metadata of a recently evicted cold block
+ * hand_cold evicts cold blocks without the reference bit (they stay on the
+ * clock as test entries) and promotes referenced ones to hot. hand_hot
+ * demotes hot blocks that were not referenced since its last pass.
+ * hand_test removes test entries. A miss on a test entry means the cold
+ * area was too small: cold_target grows, an expiring test entry shrinks it.
+ * A hit only sets the reference bit, nothing is moved.
+ *
+ * Writes are write-through. blkcache_write_begin(), before the SSD write,
+ * bumps the write generation of the regions written, drops partially
+ * covered blocks and hides fully covered ones from reads. After the SSD
+ * write blkcache_write_end() updates those only if no other write to the
+ * regions was in flight at any time in between, else two writes could
+ * land on the SSD in the other order; otherwise they are dropped too.
+ * Blocks are not allocated on write.
+ *
+ * A read miss takes a ticket of the write generations of the region it
+ * reads before going to the SSD, blkcache_fill() only inserts the data if
+ * no write touched the region in the meantime or is still in flight.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "blkcache.h"
+
+#define BC_HOT		1
+#define BC_COLD		2
+#define BC_TEST		3
+
+#define BC_BLKMASK	((uint64_t) BLKCACHE_BLKSZ - 1)
+
+/* write generation region, a request never spans more than two of them */
+#define BC_REGIONSHIFT	20
+#define BC_MAXREQ	(1ULL << BC_REGIONSHIFT)
+
+typedef struct blkcache_entry {
+	hash_entry_t	h_entry;
+	dll_t		clock;
+	int		dev;
+	uint64_t	lba;
+	char		*blk;		/* NULL for test entries */
+	uint8_t		type;
+	uint8_t		ref;
+	uint8_t		wpend;		/* being written, not readable */
+} bc_entry_t;
+
+typedef struct bc_key {
+	int		dev;
+	uint64_t	lba;
+} bc_key_t;
+
+static inline int bc_cmp(hash_entry_t *h, void *opaque)
+{
+	bc_entry_t	*e = container_of(h, bc_entry_t, h_entry);
+	bc_key_t	*k = opaque;
+
+	return (e->dev == k->dev && e->lba == k->lba);
+}
+
+static inline int bc_bucket(blkcache_t *bc, int dev, uint64_t lba)
+{
+	uint64_t	h = (lba ^ ((uint64_t) dev << 48)) * 0x9e3779b97f4a7c15ULL;
+
+	return ((h >> 32) % hash_no_buckets(&bc->hash));
+}
+
+static inline uint32_t *bc_wgen(blkcache_t *bc, int dev, uint64_t off)
+{
+	uint64_t	r = (off >> BC_REGIONSHIFT) + (uint64_t) dev * 7919;
+
+	return (&bc->wgen[r % BLKCACHE_NSTRIPES]);
+}
+
+static inline uint32_t *bc_wbusy(blkcache_t *bc, int dev, uint64_t off)
+{
+	return (bc->wbusy + (bc_wgen(bc, dev, off) - bc->wgen));
+}
+
+int blkcache_init(blkcache_t *bc, size_t budget)
+{
+	void	*slab;
+	size_t	i;
+	int	rc;
+
+	memset(bc, 0, sizeof(*bc));
+
+	bc->nblocks = budget / BLKCACHE_BLKSZ;
+	if (bc->nblocks < 2) {
+		return (-1);
+	}
+
+	if (posix_memalign(&slab, BLKCACHE_BLKSZ,
+			bc->nblocks * BLKCACHE_BLKSZ) != 0) {
+		return (-1);
+	}
+	bc->slab     = slab;
+	bc->freeblks = malloc(bc->nblocks * sizeof(*bc->freeblks));
+	assert(bc->freeblks != NULL);
+	for (i = 0; i < bc->nblocks; i++) {
+		bc->freeblks[i] = bc->slab + i * BLKCACHE_BLKSZ;
+	}
+	bc->nfree = bc->nblocks;
+
+	/* resident and test entries together never exceed 2 * nblocks */
+	rc = hash_init(&bc->hash, bc->nblocks * 2 < (1 << 30) ?
+			bc->nblocks * 2 : (1 << 30), bc_cmp);
+	assert(rc == 0);
+
+	DLL_INIT(&bc->clock);
+	bc->cold_target = bc->nblocks;
+
+	rc = pthread_mutex_init(&bc->lock, NULL);
+	assert(rc == 0);
+
+	init_stats(&bc->stats);
+	bc->st_hits     = stat_create(&bc->stats, "blkcache read hits", RATIO);
+	bc->st_hit_lat  = stat_create(&bc->stats, "blkcache hit", LATENCY);
+	bc->st_miss_lat = stat_create(&bc->stats, "blkcache miss", LATENCY);
+	return (0);
+}
+
+static void bc_entry_free(hash_entry_t *h)
+{
+	free(container_of(h, bc_entry_t, h_entry));
+}
+
+void blkcache_deinit(blkcache_t *bc)
+{
+	hash_cleanup(&bc->hash, bc_entry_free);
+	hash_deinit(&bc->hash);
+
+	stat_delete(bc->st_hits);
+	stat_delete(bc->st_hit_lat);
+	stat_delete(bc->st_miss_lat);
+	deinit_stats(&bc->stats);
+
+	pthread_mutex_destroy(&bc->lock);
+	free(bc->freeblks);
+	free(bc->slab);
+}
+
+/* clock navigation, skipping the list head */
+static inline bc_entry_t *bc_next(blkcache_t *bc, bc_entry_t *e)
+{
+	dll_t	*l = DLL_NEXT(&e->clock);
+
+	if (l == &bc->clock) {
+		l = DLL_NEXT(l);
+	}
+	return (container_of(l, bc_entry_t, clock));
+}
+
+static inline bc_entry_t *bc_prev(blkcache_t *bc, bc_entry_t *e)
+{
+	dll_t	*l = DLL_PREV(&e->clock);
+
+	if (l == &bc->clock) {
+		l = DLL_PREV(l);
+	}
+	return (container_of(l, bc_entry_t, clock));
+}
+
+static bc_entry_t *bc_lookup(blkcache_t *bc, int dev, uint64_t lba)
+{
+	hash_entry_t	*h;
+	bc_key_t	k;
+
+	k.dev = dev;
+	k.lba = lba;
+	if (hash_lookup(&bc->hash, bc_bucket(bc, dev, lba), &h, &k) != 0) {
+		return (NULL);
+	}
+	return (container_of(h, bc_entry_t, h_entry));
+}
+
+static void bc_frame_put(blkcache_t *bc, bc_entry_t *e)
+{
+	assert(e->blk != NULL && bc->nfree < bc->nblocks);
+	bc->freeblks[bc->nfree++] = e->blk;
+	e->blk = NULL;
+}
+
+static void bc_meta_del(blkcache_t *bc, bc_entry_t *e)
+{
+	hash_rem(&bc->hash, &e->h_entry);
+
+	if (e == bc->hand_hot) {
+		bc->hand_hot = bc_prev(bc, e);
+	}
+	if (e == bc->hand_cold) {
+		bc->hand_cold = bc_prev(bc, e);
+	}
+	if (e == bc->hand_test) {
+		bc->hand_test = bc_prev(bc, e);
+	}
+	DLL_REM(&e->clock);
+	if (DLL_ISEMPTY(&bc->clock)) {
+		bc->hand_hot  = NULL;
+		bc->hand_cold = NULL;
+		bc->hand_test = NULL;
+	}
+	free(e);
+}
+
+static void bc_run_hand_cold(blkcache_t *bc);
+
+static void bc_run_hand_test(blkcache_t *bc)
+{
+	bc_entry_t	*e;
+
+	if (bc->hand_test == bc->hand_cold) {
+		bc_run_hand_cold(bc);
+	}
+
+	e = bc->hand_test;
+	if (e->type == BC_TEST) {
+		/* test period over without a reuse */
+		bc_meta_del(bc, e);
+		bc->ntest--;
+		if (bc->cold_target > 1) {
+			bc->cold_target--;
+		}
+	}
+	if (bc->hand_test != NULL) {
+		bc->hand_test = bc_next(bc, bc->hand_test);
+	}
+}
+
+static void bc_run_hand_hot(blkcache_t *bc)
+{
+	bc_entry_t	*e;
+
+	if (bc->hand_hot == bc->hand_test) {
+		bc_run_hand_test(bc);
+	}
+
+	e = bc->hand_hot;
+	if (e->type == BC_HOT) {
+		if (e->ref) {
+			e->ref = 0;
+		} else {
+			e->type = BC_COLD;
+			bc->nhot--;
+			bc->ncold++;
+		}
+	}
+	bc->hand_hot = bc_next(bc, bc->hand_hot);
+}
+
+static void bc_run_hand_cold(blkcache_t *bc)
+{
+	bc_entry_t	*e = bc->hand_cold;
+
+	if (e->type == BC_COLD) {
+		if (e->ref) {
+			e->type = BC_HOT;
+			e->ref  = 0;
+			bc->ncold--;
+			bc->nhot++;
+		} else {
+			e->type = BC_TEST;
+			bc_frame_put(bc, e);
+			bc->ncold--;
+			bc->ntest++;
+			while (bc->ntest > bc->nblocks) {
+				bc_run_hand_test(bc);
+			}
+		}
+	}
+	bc->hand_cold = bc_next(bc, bc->hand_cold);
+
+	while (bc->nhot > bc->nblocks - bc->cold_target) {
+		bc_run_hand_hot(bc);
+	}
+}
+
+/*
+ * link a new entry in front of hand_hot, evicting first so that a frame is
+ * free afterwards
+ */
+static void bc_meta_add(blkcache_t *bc, bc_entry_t *e)
+{
+	while (bc->nhot + bc->ncold >= bc->nblocks) {
+		bc_run_hand_cold(bc);
+	}
+
+	hash_entry_init(&e->h_entry);
+	hash_add(&bc->hash, &e->h_entry, bc_bucket(bc, e->dev, e->lba));
+
+	if (bc->hand_hot == NULL) {
+		DLL_ADD(&bc->clock, &e->clock);
+		bc->hand_hot  = e;
+		bc->hand_cold = e;
+		bc->hand_test = e;
+	} else {
+		DLL_REVADD(&bc->hand_hot->clock, &e->clock);
+	}
+	if (bc->hand_cold == bc->hand_hot) {
+		bc->hand_cold = bc_prev(bc, bc->hand_cold);
+	}
+
+	assert(bc->nfree > 0);
+	e->blk = bc->freeblks[--bc->nfree];
+}
+
+static void bc_insert(blkcache_t *bc, int dev, uint64_t lba, char *data)
+{
+	bc_entry_t	*e;
+	int		type = BC_COLD;
+
+	e = bc_lookup(bc, dev, lba);
+	if (e != NULL && e->blk != NULL) {
+		memcpy(e->blk, data, BLKCACHE_BLKSZ);
+		return;
+	}
+	if (e != NULL) {
+		/* reuse within test period, cold area should be larger */
+		assert(e->type == BC_TEST);
+		if (bc->cold_target < bc->nblocks) {
+			bc->cold_target++;
+		}
+		bc_meta_del(bc, e);
+		bc->ntest--;
+		type = BC_HOT;
+	}
+
+	e = calloc(1, sizeof(*e));
+	assert(e != NULL);
+	e->dev  = dev;
+	e->lba  = lba;
+	e->type = type;
+	bc_meta_add(bc, e);
+	if (type == BC_HOT) {
+		bc->nhot++;
+	} else {
+		bc->ncold++;
+	}
+	memcpy(e->blk, data, BLKCACHE_BLKSZ);
+}
+
+static void bc_invalidate(blkcache_t *bc, bc_entry_t *e)
+{
+	if (e->type == BC_HOT) {
+		bc->nhot--;
+	} else {
+		assert(e->type == BC_COLD);
+		bc->ncold--;
+	}
+	bc_frame_put(bc, e);
+	bc_meta_del(bc, e);
+}
+
+/*
+ * copy [off, off + len) into buf if every block of it is cached.
+ * Returns 0 on a hit, -1 otherwise.
+ */
+int blkcache_read(blkcache_t *bc, int dev, uint64_t off, uint64_t len,
+		char *buf)
+{
+	bc_entry_t	*e;
+	uint64_t	lba;
+	uint64_t	end = off + len;
+	uint64_t	o;
+	uint64_t	n;
+
+	pthread_mutex_lock(&bc->lock);
+	for (lba = off / BLKCACHE_BLKSZ; lba * BLKCACHE_BLKSZ < end; lba++) {
+		e = bc_lookup(bc, dev, lba);
+		if (e == NULL || e->blk == NULL || e->wpend) {
+			stat_ratio_add(bc->st_hits, 0);
+			pthread_mutex_unlock(&bc->lock);
+			return (-1);
+		}
+	}
+
+	for (o = off; o < end; o += n) {
+		e = bc_lookup(bc, dev, o / BLKCACHE_BLKSZ);
+		n = BLKCACHE_BLKSZ - (o & BC_BLKMASK);
+		if (n > end - o) {
+			n = end - o;
+		}
+		memcpy(buf + (o - off), e->blk + (o & BC_BLKMASK), n);
+		e->ref = 1;
+	}
+	stat_ratio_add(bc->st_hits, 1);
+	pthread_mutex_unlock(&bc->lock);
+	return (0);
+}
+
+/*
+ * called before a read miss goes to the SSD
+ */
+void blkcache_ticket(blkcache_t *bc, int dev, uint64_t off, uint64_t len,
+		blkcache_ticket_t *tkt)
+{
+	pthread_mutex_lock(&bc->lock);
+	tkt->wgen[0] = *bc_wgen(bc, dev, off);
+	tkt->wgen[1] = *bc_wgen(bc, dev, off + len - 1);
+	pthread_mutex_unlock(&bc->lock);
+}
+
+/*
+ * insert the blocks fully covered by a completed SSD read
+ */
+void blkcache_fill(blkcache_t *bc, int dev, uint64_t off, uint64_t len,
+		char *buf, blkcache_ticket_t *tkt)
+{
+	uint64_t	o;
+
+	if (len > BC_MAXREQ) {
+		return;
+	}
+
+	pthread_mutex_lock(&bc->lock);
+	if (tkt->wgen[0] != *bc_wgen(bc, dev, off) ||
+			tkt->wgen[1] != *bc_wgen(bc, dev, off + len - 1) ||
+			*bc_wbusy(bc, dev, off) != 0 ||
+			*bc_wbusy(bc, dev, off + len - 1) != 0) {
+		/* raced with a write, data may be stale */
+		pthread_mutex_unlock(&bc->lock);
+		return;
+	}
+
+	for (o = (off + BC_BLKMASK) & ~BC_BLKMASK; o + BLKCACHE_BLKSZ <= off + len;
+			o += BLKCACHE_BLKSZ) {
+		bc_insert(bc, dev, o / BLKCACHE_BLKSZ, buf + (o - off));
+	}
+	pthread_mutex_unlock(&bc->lock);
+}
+
+/*
+ * called before a write goes to the SSD, blkcache_write_end() has to
+ * follow with the same ticket whether the write succeeded or not
+ */
+void blkcache_write_begin(blkcache_t *bc, int dev, uint64_t off,
+		uint64_t len, blkcache_ticket_t *tkt)
+{
+	bc_entry_t	*e;
+	uint64_t	end = off + len;
+	uint64_t	r;
+	uint64_t	o;
+
+	pthread_mutex_lock(&bc->lock);
+	tkt->excl = 1;
+	for (r = off >> BC_REGIONSHIFT; r <= (end - 1) >> BC_REGIONSHIFT; r++) {
+		if ((*bc_wbusy(bc, dev, r << BC_REGIONSHIFT))++ != 0) {
+			tkt->excl = 0;
+		}
+		(*bc_wgen(bc, dev, r << BC_REGIONSHIFT))++;
+	}
+	tkt->wgen[0] = *bc_wgen(bc, dev, off);
+	tkt->wgen[1] = *bc_wgen(bc, dev, end - 1);
+
+	for (o = off & ~BC_BLKMASK; o < end; o += BLKCACHE_BLKSZ) {
+		e = bc_lookup(bc, dev, o / BLKCACHE_BLKSZ);
+		if (e == NULL || e->blk == NULL) {
+			continue;
+		}
+		if (o >= off && o + BLKCACHE_BLKSZ <= end) {
+			e->wpend = 1;
+		} else {
+			bc_invalidate(bc, e);
+		}
+	}
+	pthread_mutex_unlock(&bc->lock);
+}
+
+/*
+ * called once the SSD write is done, buf NULL if it failed
+ */
+void blkcache_write_end(blkcache_t *bc, int dev, uint64_t off, uint64_t len,
+		char *buf, blkcache_ticket_t *tkt)
+{
+	bc_entry_t	*e;
+	uint64_t	end = off + len;
+	uint64_t	r;
+	uint64_t	o;
+	int		update;
+
+	pthread_mutex_lock(&bc->lock);
+	update = buf != NULL && tkt->excl &&
+			tkt->wgen[0] == *bc_wgen(bc, dev, off) &&
+			tkt->wgen[1] == *bc_wgen(bc, dev, end - 1);
+
+	for (o = off & ~BC_BLKMASK; o < end; o += BLKCACHE_BLKSZ) {
+		e = bc_lookup(bc, dev, o / BLKCACHE_BLKSZ);
+		if (e == NULL || e->blk == NULL || !e->wpend) {
+			continue;
+		}
+		if (update) {
+			memcpy(e->blk, buf + (o - off), BLKCACHE_BLKSZ);
+			e->wpend = 0;
+		} else {
+			bc_invalidate(bc, e);
+		}
+	}
+
+	for (r = off >> BC_REGIONSHIFT; r <= (end - 1) >> BC_REGIONSHIFT; r++) {
+		(*bc_wbusy(bc, dev, r << BC_REGIONSHIFT))--;
+		(*bc_wgen(bc, dev, r << BC_REGIONSHIFT))++;
+	}
+	pthread_mutex_unlock(&bc->lock);
+}
+
+void blkcache_latency(blkcache_t *bc, int hit, uint64_t ns)
+{
+	stat_latency_add(hit ? bc->st_hit_lat : bc->st_miss_lat, ns);
+}
+
+/*
+ * call once a second, prints every few seconds if show is set
+ */
+void blkcache_stats(blkcache_t *bc, int show)
+{
+	pthread_mutex_lock(&bc->lock);
+	stat_display(&bc->stats, show);
+	stats_update_all(&bc->stats);
+	pthread_mutex_unlock(&bc->lock);
+}
+
+#ifdef SOLOTEST_BLKCACHE
+
+/*
+ * Scan resistance: a small hot set is read over and over while a long
+ * sequential scan passes through. With CLOCK-Pro the hot set must stay
+ * resident, so the hot set hit ratio has to stay close to 100%.
+ * Then check write-through and the stale fill guard.
+ *
+ *	cc -DSOLOTEST_BLKCACHE -I../include blkcache.c hash.c stats.c -lpthread
+ */
+int main(int argc, char **argv)
+{
+	blkcache_t		bc;
+	blkcache_ticket_t	t, t2;
+	char			blk[BLKCACHE_BLKSZ];
+	char			out[BLKCACHE_BLKSZ];
+	uint64_t		i;
+	uint64_t		hits = 0;
+	uint64_t		tries = 0;
+	int			rc;
+
+	rc = blkcache_init(&bc, 256 * BLKCACHE_BLKSZ);
+	assert(rc == 0);
+	memset(blk, 'h', sizeof(blk));
+
+	for (i = 0; i < 200000; i++) {
+		uint64_t lba = (i % 2) ? (i % 64) : 1000 + i;
+
+		if (blkcache_read(&bc, 0, lba * BLKCACHE_BLKSZ,
+				BLKCACHE_BLKSZ, out) == 0) {
+			hits += (lba < 64);
+		} else {
+			blkcache_ticket(&bc, 0, lba * BLKCACHE_BLKSZ,
+					BLKCACHE_BLKSZ, &t);
+			blkcache_fill(&bc, 0, lba * BLKCACHE_BLKSZ,
+					BLKCACHE_BLKSZ, blk, &t);
+		}
+		tries += (lba < 64);
+	}
+	printf("hot set hit ratio %.2f%% (hot %zu cold %zu test %zu "
+			"cold_target %zu)\n", 100.0 * hits / tries, bc.nhot,
+			bc.ncold, bc.ntest, bc.cold_target);
+	assert(hits * 100 > tries * 95);
+	assert(bc.nhot + bc.ncold <= bc.nblocks && bc.ntest <= bc.nblocks);
+
+	/* write-through: full block updated, partial block dropped */
+	memset(blk, 'w', sizeof(blk));
+	blkcache_write_begin(&bc, 0, 5 * BLKCACHE_BLKSZ, BLKCACHE_BLKSZ, &t);
+	rc = blkcache_read(&bc, 0, 5 * BLKCACHE_BLKSZ + 100, 10, out);
+	assert(rc == -1);
+	blkcache_write_end(&bc, 0, 5 * BLKCACHE_BLKSZ, BLKCACHE_BLKSZ, blk, &t);
+	rc = blkcache_read(&bc, 0, 5 * BLKCACHE_BLKSZ + 100, 10, out);
+	assert(rc == 0 && out[0] == 'w');
+	blkcache_write_begin(&bc, 0, 6 * BLKCACHE_BLKSZ + 512, 512, &t);
+	blkcache_write_end(&bc, 0, 6 * BLKCACHE_BLKSZ + 512, 512, blk, &t);
+	rc = blkcache_read(&bc, 0, 6 * BLKCACHE_BLKSZ, BLKCACHE_BLKSZ, out);
+	assert(rc == -1);
+
+	/* overlapping writes may reach the SSD in either order: dropped */
+	rc = blkcache_read(&bc, 0, 9 * BLKCACHE_BLKSZ, BLKCACHE_BLKSZ, out);
+	assert(rc == 0);
+	blkcache_write_begin(&bc, 0, 9 * BLKCACHE_BLKSZ, BLKCACHE_BLKSZ, &t);
+	blkcache_write_begin(&bc, 0, 9 * BLKCACHE_BLKSZ, BLKCACHE_BLKSZ, &t2);
+	blkcache_write_end(&bc, 0, 9 * BLKCACHE_BLKSZ, BLKCACHE_BLKSZ, blk, &t2);
+	blkcache_write_end(&bc, 0, 9 * BLKCACHE_BLKSZ, BLKCACHE_BLKSZ, blk, &t);
+	rc = blkcache_read(&bc, 0, 9 * BLKCACHE_BLKSZ, BLKCACHE_BLKSZ, out);
+	assert(rc == -1);
+
+	/* a fill that raced with a write, or ran during one, is dropped */
+	blkcache_ticket(&bc, 0, 6 * BLKCACHE_BLKSZ, BLKCACHE_BLKSZ, &t);
+	blkcache_write_begin(&bc, 0, 7 * BLKCACHE_BLKSZ, BLKCACHE_BLKSZ, &t2);
+	blkcache_write_end(&bc, 0, 7 * BLKCACHE_BLKSZ, BLKCACHE_BLKSZ, blk, &t2);
+	blkcache_fill(&bc, 0, 6 * BLKCACHE_BLKSZ, BLKCACHE_BLKSZ, blk, &t);
+	rc = blkcache_read(&bc, 0, 6 * BLKCACHE_BLKSZ, BLKCACHE_BLKSZ, out);
+	assert(rc == -1);
+	blkcache_write_begin(&bc, 0, 7 * BLKCACHE_BLKSZ, BLKCACHE_BLKSZ, &t2);
+	blkcache_ticket(&bc, 0, 6 * BLKCACHE_BLKSZ, BLKCACHE_BLKSZ, &t);
+	blkcache_fill(&bc, 0, 6 * BLKCACHE_BLKSZ, BLKCACHE_BLKSZ, blk, &t);
+	blkcache_write_end(&bc, 0, 7 * BLKCACHE_BLKSZ, BLKCACHE_BLKSZ, blk, &t2);
+	rc = blkcache_read(&bc, 0, 6 * BLKCACHE_BLKSZ, BLKCACHE_BLKSZ, out);
+	assert(rc == -1);
+
+	blkcache_deinit(&bc);
+	printf("PASS\n");
+	return (0);
+}
+
+#endif /* SOLOTEST_BLKCACHE */
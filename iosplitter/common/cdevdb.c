@@ -0,0 +1,1003 @@
+/*
+ * cdevdb.c
+ *	cva database, see cdevdb.h
+ *
+ * Each table is a hashtable_t on its key kept by a binary phash_t in the
+ * database directory: a snapshot and a log of the records changed since.
+ * The VSSD table also has an index on VSSD.cdevid for db_vssd_find().
+ *
+ * Writers are serialized by db_wmu. A writer changes the table under the
+ * table's rwlock, queues the record for the log and drops db_wmu, then
+ * waits in db_commit() for the record to be on disk. The first writer to
+ * get there appends the records queued by all writers and syncs the log
+ * once for them, the others wait for that sync; writers coming in during
+ * a sync are batched into the next one.
+ *
+ * Readers only take the table's rwlock for reading, db_cdev_lookup() in
+ * the I/O path never waits for a writer's log I/O. A reader may see a
+ * change before its writer is told it is durable.
+ *
+ * Once a log write fails every later change fails with DB_EIO, the tables
+ * in memory stay readable.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "container.h"
+#include "cdevdb.h"
+
+int db_ctab_size = 1021;
+int db_vtab_size = 1021;
+int db_ptab_size = 1021;
+
+#define DB_PATHMAX	4096
+
+struct dbtab {
+	char			*fname;
+	char			*tempname;
+	hashtable_t		ht;
+	phash_t			ph;
+	pthread_rwlock_t	rw;	/* ht, and db_cref for the VSSD table */
+	uint64_t		wseq;	/* records queued, under db_wmu */
+	uint64_t		sseq;	/* records on disk, under db_smu */
+	int			syncing;
+	uint64_t		nsync;
+};
+
+struct dbcdev {
+	hashbucket_t	hb;
+	db_cdev_t	c;
+};
+
+struct dbvssd {
+	hashbucket_t	hb;
+	db_vssd_t	v;
+	dll_t		cdl;	/* on dbcref.vssds */
+};
+
+/* VSSD records with one cdevid */
+struct dbcref {
+	hashbucket_t	hb;
+	dll_t		vssds;
+	int		n;
+};
+
+/* VSSDPATH record, also its form in the log */
+struct dbvpath_rec {
+	uint32_t	pattr;
+	uint32_t	pathlen;
+	char		path[0];
+};
+
+struct dbvpath {
+	hashbucket_t		hb;
+	struct dbvpath_rec	p;
+};
+
+static pthread_mutex_t	db_wmu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t	db_smu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	db_scond = PTHREAD_COND_INITIALIZER;
+static volatile int	db_isopen;
+static int		db_err;
+
+static struct dbtab	db_ctab;
+static struct dbtab	db_vtab;
+static struct dbtab	db_ptab;
+static hashtable_t	db_cref;
+
+/*------------------------ secondary index ---------------------------*/
+
+/*
+ * entry for a cdevid, created empty if there is none
+ */
+static struct dbcref *db_cref_get(cdevid_t id)
+{
+	struct dbcref	*crp;
+	hashbucket_t	*hbp;
+
+	if (hashtable_lookup(&db_cref, id, &hbp) == 0) {
+		return (container_of(hbp, struct dbcref, hb));
+	}
+	if ((crp = malloc(sizeof(*crp))) == NULL) {
+		return (NULL);
+	}
+	HASHBUCKET_INIT(&crp->hb, id);
+	DLL_INIT(&crp->vssds);
+	crp->n = 0;
+	hashtable_add(&db_cref, &crp->hb);
+	return (crp);
+}
+
+static void db_cref_put(struct dbcref *crp)
+{
+	if (crp->n == 0) {
+		hashtable_drop(&db_cref, &crp->hb);
+		free(crp);
+	}
+}
+
+static int db_cref_link(struct dbvssd *vp)
+{
+	struct dbcref	*crp;
+
+	DLL_INIT(&vp->cdl);
+	if (vp->v.cdevid == 0) {
+		return (0);
+	}
+	if ((crp = db_cref_get(vp->v.cdevid)) == NULL) {
+		return (-1);
+	}
+	DLL_REVADD(&crp->vssds, &vp->cdl);
+	crp->n++;
+	return (0);
+}
+
+static void db_cref_unlink(struct dbvssd *vp)
+{
+	struct dbcref	*crp;
+	hashbucket_t	*hbp;
+
+	if (vp->v.cdevid == 0) {
+		return;
+	}
+	if (hashtable_lookup(&db_cref, vp->v.cdevid, &hbp) != 0) {
+		assert(0);
+		return;
+	}
+	crp = container_of(hbp, struct dbcref, hb);
+	DLL_REM(&vp->cdl);
+	crp->n--;
+	db_cref_put(crp);
+}
+
+static int db_cref_count(cdevid_t id)
+{
+	hashbucket_t	*hbp;
+
+	if (hashtable_lookup(&db_cref, id, &hbp) != 0) {
+		return (0);
+	}
+	return ((container_of(hbp, struct dbcref, hb))->n);
+}
+
+/*------------------------ phash_t callbacks -------------------------*/
+
+static int db_cdev_h2b(hashbucket_t *hbp, void *buf, int buflen)
+{
+	struct dbcdev	*cp = container_of(hbp, struct dbcdev, hb);
+
+	if (buflen >= (int) sizeof(cp->c)) {
+		memcpy(buf, &cp->c, sizeof(cp->c));
+	}
+	return (sizeof(cp->c));
+}
+
+static hashbucket_t *db_cdev_b2h(hashkey_t key, const void *buf, int len)
+{
+	struct dbcdev	*cp;
+
+	if (len != sizeof(cp->c) || (cp = malloc(sizeof(*cp))) == NULL) {
+		return (NULL);
+	}
+	HASHBUCKET_INIT(&cp->hb, key);
+	memcpy(&cp->c, buf, sizeof(cp->c));
+	return (&cp->hb);
+}
+
+static void db_cdev_free(hashbucket_t *hbp)
+{
+	free(container_of(hbp, struct dbcdev, hb));
+}
+
+static int db_vssd_h2b(hashbucket_t *hbp, void *buf, int buflen)
+{
+	struct dbvssd	*vp = container_of(hbp, struct dbvssd, hb);
+
+	if (buflen >= (int) sizeof(vp->v)) {
+		memcpy(buf, &vp->v, sizeof(vp->v));
+	}
+	return (sizeof(vp->v));
+}
+
+static hashbucket_t *db_vssd_b2h(hashkey_t key, const void *buf, int len)
+{
+	struct dbvssd	*vp;
+
+	if (len != sizeof(vp->v) || (vp = malloc(sizeof(*vp))) == NULL) {
+		return (NULL);
+	}
+	HASHBUCKET_INIT(&vp->hb, key);
+	memcpy(&vp->v, buf, sizeof(vp->v));
+	if (db_cref_link(vp) != 0) {
+		free(vp);
+		return (NULL);
+	}
+	return (&vp->hb);
+}
+
+static void db_vssd_free(hashbucket_t *hbp)
+{
+	struct dbvssd	*vp = container_of(hbp, struct dbvssd, hb);
+
+	db_cref_unlink(vp);
+	free(vp);
+}
+
+static int db_vpath_h2b(hashbucket_t *hbp, void *buf, int buflen)
+{
+	struct dbvpath	*pp = container_of(hbp, struct dbvpath, hb);
+	int		len = sizeof(pp->p) + pp->p.pathlen;
+
+	if (buflen >= len) {
+		memcpy(buf, &pp->p, len);
+	}
+	return (len);
+}
+
+static hashbucket_t *db_vpath_b2h(hashkey_t key, const void *buf, int len)
+{
+	const struct dbvpath_rec	*rp = buf;
+	struct dbvpath			*pp;
+
+	if (len < (int) sizeof(*rp) || len != sizeof(*rp) + rp->pathlen ||
+	    (pp = malloc(sizeof(*pp) + rp->pathlen + 1)) == NULL) {
+		return (NULL);
+	}
+	HASHBUCKET_INIT(&pp->hb, key);
+	memcpy(&pp->p, rp, len);
+	pp->p.path[pp->p.pathlen] = '\0';
+	return (&pp->hb);
+}
+
+static void db_vpath_free(hashbucket_t *hbp)
+{
+	free(container_of(hbp, struct dbvpath, hb));
+}
+
+/*------------------------ commit ------------------------------------*/
+
+/*
+ * called with db_wmu held after queueing a record, drops db_wmu and
+ * returns when the record is on disk
+ */
+static int db_commit(struct dbtab *tp)
+{
+	uint64_t	seq = ++tp->wseq, target;
+	int		rc;
+
+	pthread_mutex_unlock(&db_wmu);
+	pthread_mutex_lock(&db_smu);
+	while (tp->sseq < seq && db_err == 0) {
+		if (tp->syncing) {
+			pthread_cond_wait(&db_scond, &db_smu);
+			continue;
+		}
+		tp->syncing = 1;
+		pthread_mutex_unlock(&db_smu);
+
+		pthread_mutex_lock(&db_wmu);
+		target = tp->wseq;
+		rc = phash_append(&tp->ph);
+		pthread_mutex_unlock(&db_wmu);
+		if (rc == 0) {
+			rc = fdatasync(tp->ph.logfd);
+		}
+		if (rc == 0) {
+			pthread_mutex_lock(&db_wmu);
+			if (PHASH_WANTSNAP(&tp->ph)) {
+				rc = phash_flush(&tp->ph);
+			}
+			pthread_mutex_unlock(&db_wmu);
+		}
+
+		pthread_mutex_lock(&db_smu);
+		tp->syncing = 0;
+		tp->nsync++;
+		if (rc != 0) {
+			db_err = DB_EIO;
+		} else {
+			tp->sseq = target;
+		}
+		pthread_cond_broadcast(&db_scond);
+	}
+	rc = tp->sseq >= seq ? 0 : DB_EIO;
+	pthread_mutex_unlock(&db_smu);
+	return (rc);
+}
+
+/*
+ * take db_wmu for a change, fails if the database can not take one
+ */
+static int db_wbegin(void)
+{
+	pthread_mutex_lock(&db_wmu);
+	if (!db_isopen) {
+		pthread_mutex_unlock(&db_wmu);
+		return (DB_ENOPEN);
+	}
+	if (db_err != 0) {
+		pthread_mutex_unlock(&db_wmu);
+		return (DB_EIO);
+	}
+	return (0);
+}
+
+/*------------------------ open / close ------------------------------*/
+
+static void db_tab_drain(struct dbtab *tp, hfree_ptr_t hfree)
+{
+	queue_entry_t	*e;
+	size_t		i;
+
+	for (i = 0; i < HASHTABLESZ(&tp->ht); i++) {
+		while (queue_rem(&tp->ht.h_tab[i], &e) == 0) {
+			tp->ht.h_count--;
+			hfree(container_of(e, hashbucket_t, dll));
+		}
+	}
+}
+
+static void db_tab_close(struct dbtab *tp, hfree_ptr_t hfree)
+{
+	if (tp->ph.hp != NULL) {
+		phash_deinit(&tp->ph);
+	}
+	if (tp->ht.h_tab != NULL) {
+		db_tab_drain(tp, hfree);
+		hashtable_deinit(&tp->ht);
+		pthread_rwlock_destroy(&tp->rw);
+	}
+	free(tp->fname);
+	free(tp->tempname);
+	memset(tp, 0, sizeof(*tp));
+}
+
+static int db_tab_open(struct dbtab *tp, char *dir, char *name, int size,
+	h2b_ptr_t h2b, b2h_ptr_t b2h, hfree_ptr_t hfree)
+{
+	size_t	len = strlen(dir) + strlen(name) + 8;
+
+	memset(tp, 0, sizeof(*tp));
+	tp->fname = malloc(len);
+	tp->tempname = malloc(len);
+	if (tp->fname == NULL || tp->tempname == NULL ||
+	    hashtable_init(&tp->ht, size) != 0) {
+		return (DB_ENOMEM);
+	}
+	pthread_rwlock_init(&tp->rw, NULL);
+	snprintf(tp->fname, len, "%s/%s", dir, name);
+	snprintf(tp->tempname, len, "%s/%s.tmp", dir, name);
+	if (phash_init_bin(&tp->ph, &tp->ht, tp->fname, tp->tempname,
+			h2b, b2h, hfree, NULL) != 0) {
+		return (DB_EIO);
+	}
+	return (0);
+}
+
+static void db_close_all(void)
+{
+	queue_entry_t	*e;
+	size_t		i;
+
+	db_tab_close(&db_ptab, db_vpath_free);
+	db_tab_close(&db_vtab, db_vssd_free);
+	db_tab_close(&db_ctab, db_cdev_free);
+	if (db_cref.h_tab != NULL) {
+		for (i = 0; i < HASHTABLESZ(&db_cref); i++) {
+			while (queue_rem(&db_cref.h_tab[i], &e) == 0) {
+				free(container_of(e, struct dbcref, hb.dll));
+			}
+		}
+		hashtable_deinit(&db_cref);
+	}
+}
+
+int cdevdb_open(char *dbdirname)
+{
+	int	rc;
+
+	if (dbdirname == NULL || db_ctab_size <= 0 || db_vtab_size <= 0 ||
+	    db_ptab_size <= 0) {
+		return (DB_EINVAL);
+	}
+	pthread_mutex_lock(&db_wmu);
+	if (db_isopen) {
+		pthread_mutex_unlock(&db_wmu);
+		return (DB_EEXIST);
+	}
+	if (hashtable_init(&db_cref, db_vtab_size) != 0) {
+		rc = DB_ENOMEM;
+	} else if ((rc = db_tab_open(&db_ctab, dbdirname, "cdev.db",
+			db_ctab_size, db_cdev_h2b, db_cdev_b2h,
+			db_cdev_free)) == 0 &&
+		   (rc = db_tab_open(&db_vtab, dbdirname, "vssd.db",
+			db_vtab_size, db_vssd_h2b, db_vssd_b2h,
+			db_vssd_free)) == 0) {
+		rc = db_tab_open(&db_ptab, dbdirname, "vpath.db",
+			db_ptab_size, db_vpath_h2b, db_vpath_b2h,
+			db_vpath_free);
+	}
+	if (rc != 0) {
+		db_close_all();
+	} else {
+		db_err = 0;
+		db_isopen = 1;
+	}
+	pthread_mutex_unlock(&db_wmu);
+	return (rc);
+}
+
+/*
+ * no command may run or start during cdevdb_close
+ */
+void cdevdb_close(void)
+{
+	pthread_mutex_lock(&db_wmu);
+	if (db_isopen) {
+		db_isopen = 0;
+		db_close_all();
+	}
+	pthread_mutex_unlock(&db_wmu);
+}
+
+/*------------------------ CDEV --------------------------------------*/
+
+int db_cdev_lookup(db_cdev_t *dcp)
+{
+	hashbucket_t	*hbp;
+	int		rc = DB_ENOENT;
+
+	if (!db_isopen) {
+		return (DB_ENOPEN);
+	}
+	pthread_rwlock_rdlock(&db_ctab.rw);
+	if (hashtable_lookup(&db_ctab.ht, dcp->cdevid, &hbp) == 0) {
+		*dcp = (container_of(hbp, struct dbcdev, hb))->c;
+		rc = 0;
+	}
+	pthread_rwlock_unlock(&db_ctab.rw);
+	return (rc);
+}
+
+int db_cdev_cmd(int cmd, db_cdev_t *dcp)
+{
+	struct dbcdev	*cp, tmp;
+	hashbucket_t	*hbp;
+	int		rc;
+
+	if (dcp == NULL || dcp->cdevid == 0) {
+		return (DB_EINVAL);
+	}
+	if (cmd == DB_CMD_LOOKUP) {
+		return (db_cdev_lookup(dcp));
+	}
+	if (cmd != DB_CMD_INSERT && cmd != DB_CMD_UPDATE &&
+	    cmd != DB_CMD_DELETE) {
+		return (DB_EINVAL);
+	}
+	if ((rc = db_wbegin()) != 0) {
+		return (rc);
+	}
+	cp = NULL;
+	if (hashtable_lookup(&db_ctab.ht, dcp->cdevid, &hbp) == 0) {
+		cp = container_of(hbp, struct dbcdev, hb);
+	}
+	switch (cmd) {
+	case DB_CMD_INSERT:
+		if (cp != NULL) {
+			rc = DB_EEXIST;
+			break;
+		}
+		if ((cp = malloc(sizeof(*cp))) == NULL) {
+			rc = DB_ENOMEM;
+			break;
+		}
+		HASHBUCKET_INIT(&cp->hb, dcp->cdevid);
+		cp->c = *dcp;
+		if (phash_put(&db_ctab.ph, &cp->hb) != 0) {
+			free(cp);
+			rc = DB_ENOMEM;
+			break;
+		}
+		pthread_rwlock_wrlock(&db_ctab.rw);
+		hashtable_add(&db_ctab.ht, &cp->hb);
+		pthread_rwlock_unlock(&db_ctab.rw);
+		return (db_commit(&db_ctab));
+
+	case DB_CMD_UPDATE:
+		if (cp == NULL) {
+			rc = DB_ENOENT;
+			break;
+		}
+		tmp.hb.key = dcp->cdevid;
+		tmp.c = *dcp;
+		if (phash_put(&db_ctab.ph, &tmp.hb) != 0) {
+			rc = DB_ENOMEM;
+			break;
+		}
+		pthread_rwlock_wrlock(&db_ctab.rw);
+		cp->c = *dcp;
+		pthread_rwlock_unlock(&db_ctab.rw);
+		return (db_commit(&db_ctab));
+
+	case DB_CMD_DELETE:
+		if (cp == NULL) {
+			rc = DB_ENOENT;
+			break;
+		}
+		/* VSSD records naming it must go first */
+		if (db_cref_count(dcp->cdevid) > 0) {
+			rc = DB_EINVAL;
+			break;
+		}
+		if (phash_del(&db_ctab.ph, dcp->cdevid) != 0) {
+			rc = DB_ENOMEM;
+			break;
+		}
+		pthread_rwlock_wrlock(&db_ctab.rw);
+		hashtable_drop(&db_ctab.ht, &cp->hb);
+		pthread_rwlock_unlock(&db_ctab.rw);
+		free(cp);
+		return (db_commit(&db_ctab));
+	}
+	pthread_mutex_unlock(&db_wmu);
+	return (rc);
+}
+
+/*------------------------ VSSD --------------------------------------*/
+
+/*
+ * with db_wmu held, VSSD.cdevid must name a CDEV record
+ */
+static int db_vssd_keyok(db_vssd_t *dvcp)
+{
+	hashbucket_t	*hbp;
+
+	return (dvcp->cdevid == 0 ||
+		hashtable_lookup(&db_ctab.ht, dvcp->cdevid, &hbp) == 0);
+}
+
+/*
+ * before a VSSD insert or update, make sure linking the record to its
+ * cdevid can not fail and queue its log record (hbp)
+ */
+static int db_vssd_prep(db_vssd_t *dvcp, hashbucket_t *hbp)
+{
+	struct dbcref	*crp = NULL;
+
+	if (dvcp->cdevid != 0) {
+		pthread_rwlock_wrlock(&db_vtab.rw);
+		crp = db_cref_get(dvcp->cdevid);
+		pthread_rwlock_unlock(&db_vtab.rw);
+		if (crp == NULL) {
+			return (-1);
+		}
+	}
+	if (phash_put(&db_vtab.ph, hbp) != 0) {
+		if (crp != NULL) {
+			pthread_rwlock_wrlock(&db_vtab.rw);
+			db_cref_put(crp);
+			pthread_rwlock_unlock(&db_vtab.rw);
+		}
+		return (-1);
+	}
+	return (0);
+}
+
+int db_vssd_cmd(int cmd, db_vssd_t *dvcp)
+{
+	struct dbvssd	*vp, tmp;
+	hashbucket_t	*hbp;
+	int		rc;
+
+	if (dvcp == NULL || dvcp->vssdid == 0) {
+		return (DB_EINVAL);
+	}
+	if (cmd == DB_CMD_LOOKUP) {
+		if (!db_isopen) {
+			return (DB_ENOPEN);
+		}
+		rc = DB_ENOENT;
+		pthread_rwlock_rdlock(&db_vtab.rw);
+		if (hashtable_lookup(&db_vtab.ht, dvcp->vssdid, &hbp) == 0) {
+			*dvcp = (container_of(hbp, struct dbvssd, hb))->v;
+			rc = 0;
+		}
+		pthread_rwlock_unlock(&db_vtab.rw);
+		return (rc);
+	}
+	if (cmd != DB_CMD_INSERT && cmd != DB_CMD_UPDATE &&
+	    cmd != DB_CMD_DELETE) {
+		return (DB_EINVAL);
+	}
+	if ((rc = db_wbegin()) != 0) {
+		return (rc);
+	}
+	vp = NULL;
+	if (hashtable_lookup(&db_vtab.ht, dvcp->vssdid, &hbp) == 0) {
+		vp = container_of(hbp, struct dbvssd, hb);
+	}
+	switch (cmd) {
+	case DB_CMD_INSERT:
+		if (vp != NULL) {
+			rc = DB_EEXIST;
+			break;
+		}
+		if (!db_vssd_keyok(dvcp)) {
+			rc = DB_ENOKEY;
+			break;
+		}
+		if ((vp = malloc(sizeof(*vp))) == NULL) {
+			rc = DB_ENOMEM;
+			break;
+		}
+		HASHBUCKET_INIT(&vp->hb, dvcp->vssdid);
+		vp->v = *dvcp;
+		if (db_vssd_prep(dvcp, &vp->hb) != 0) {
+			free(vp);
+			rc = DB_ENOMEM;
+			break;
+		}
+		pthread_rwlock_wrlock(&db_vtab.rw);
+		db_cref_link(vp);
+		hashtable_add(&db_vtab.ht, &vp->hb);
+		pthread_rwlock_unlock(&db_vtab.rw);
+		return (db_commit(&db_vtab));
+
+	case DB_CMD_UPDATE:
+		if (vp == NULL) {
+			rc = DB_ENOENT;
+			break;
+		}
+		if (!db_vssd_keyok(dvcp)) {
+			rc = DB_ENOKEY;
+			break;
+		}
+		tmp.hb.key = dvcp->vssdid;
+		tmp.v = *dvcp;
+		if (db_vssd_prep(dvcp, &tmp.hb) != 0) {
+			rc = DB_ENOMEM;
+			break;
+		}
+		/* the cdevid entry exists, linking can not fail */
+		pthread_rwlock_wrlock(&db_vtab.rw);
+		db_cref_unlink(vp);
+		vp->v = *dvcp;
+		db_cref_link(vp);
+		pthread_rwlock_unlock(&db_vtab.rw);
+		return (db_commit(&db_vtab));
+
+	case DB_CMD_DELETE:
+		if (vp == NULL) {
+			rc = DB_ENOENT;
+			break;
+		}
+		if (phash_del(&db_vtab.ph, dvcp->vssdid) != 0) {
+			rc = DB_ENOMEM;
+			break;
+		}
+		pthread_rwlock_wrlock(&db_vtab.rw);
+		hashtable_drop(&db_vtab.ht, &vp->hb);
+		db_cref_unlink(vp);
+		pthread_rwlock_unlock(&db_vtab.rw);
+		free(vp);
+		return (db_commit(&db_vtab));
+	}
+	pthread_mutex_unlock(&db_wmu);
+	return (rc);
+}
+
+int db_vssd_find(cdevid_t id, int *np, db_vssd_t *dvp)
+{
+	struct dbcref	*crp;
+	hashbucket_t	*hbp;
+	dll_t		*dp;
+	int		i, rc;
+
+	if (!db_isopen) {
+		return (DB_ENOPEN);
+	}
+	pthread_rwlock_rdlock(&db_vtab.rw);
+	if (id == 0 || hashtable_lookup(&db_cref, id, &hbp) != 0) {
+		*np = 0;
+		rc = DB_ENOENT;
+	} else {
+		crp = container_of(hbp, struct dbcref, hb);
+		rc = 0;
+		if (dvp != NULL) {
+			if (crp->n > *np) {
+				rc = DB_E2BIG;
+			} else {
+				i = 0;
+				for (dp = DLL_NEXT(&crp->vssds);
+				     dp != &crp->vssds; dp = DLL_NEXT(dp)) {
+					dvp[i++] = (container_of(dp,
+						struct dbvssd, cdl))->v;
+				}
+			}
+		}
+		*np = crp->n;
+	}
+	pthread_rwlock_unlock(&db_vtab.rw);
+	return (rc);
+}
+
+/*------------------------ VSSDPATH ----------------------------------*/
+
+int db_vpath_name_in(int cmd)
+{
+	return (cmd == DB_CMD_INSERT);
+}
+
+int db_vpath_name_out(int cmd)
+{
+	return (cmd == DB_CMD_LOOKUP);
+}
+
+/*
+ * INSERT: the path is vpathp->pathlen bytes of buf.
+ * LOOKUP: the path is copied to buf and NUL terminated when there is room,
+ *	vpathp->pathlen is set to its length; DB_E2BIG if buflen is short.
+ */
+int db_vpath_cmd(int cmd, db_vpath_t *vpathp, char *buf, int buflen)
+{
+	struct dbvpath	*pp;
+	hashbucket_t	*hbp;
+	int		rc;
+
+	if (vpathp == NULL || vpathp->vssdid == 0) {
+		return (DB_EINVAL);
+	}
+	if (cmd == DB_CMD_LOOKUP) {
+		if (!db_isopen) {
+			return (DB_ENOPEN);
+		}
+		rc = DB_ENOENT;
+		pthread_rwlock_rdlock(&db_ptab.rw);
+		if (hashtable_lookup(&db_ptab.ht, vpathp->vssdid, &hbp) == 0) {
+			pp = container_of(hbp, struct dbvpath, hb);
+			vpathp->pattr = pp->p.pattr;
+			vpathp->pathlen = pp->p.pathlen;
+			if (buf == NULL || buflen < (int) pp->p.pathlen) {
+				rc = DB_E2BIG;
+			} else {
+				memcpy(buf, pp->p.path, pp->p.pathlen);
+				if (buflen > (int) pp->p.pathlen) {
+					buf[pp->p.pathlen] = '\0';
+				}
+				rc = 0;
+			}
+		}
+		pthread_rwlock_unlock(&db_ptab.rw);
+		return (rc);
+	}
+	if (cmd != DB_CMD_INSERT && cmd != DB_CMD_DELETE) {
+		return (DB_EINVAL);
+	}
+	if (cmd == DB_CMD_INSERT && (buf == NULL || vpathp->pathlen == 0 ||
+	    vpathp->pathlen > DB_PATHMAX || (int) vpathp->pathlen > buflen)) {
+		return (DB_EINVAL);
+	}
+	if ((rc = db_wbegin()) != 0) {
+		return (rc);
+	}
+	pp = NULL;
+	if (hashtable_lookup(&db_ptab.ht, vpathp->vssdid, &hbp) == 0) {
+		pp = container_of(hbp, struct dbvpath, hb);
+	}
+	if (cmd == DB_CMD_INSERT) {
+		if (pp != NULL) {
+			rc = DB_EEXIST;
+		} else if ((pp = malloc(sizeof(*pp) + vpathp->pathlen + 1)) ==
+				NULL) {
+			rc = DB_ENOMEM;
+		} else {
+			HASHBUCKET_INIT(&pp->hb, vpathp->vssdid);
+			pp->p.pattr = vpathp->pattr;
+			pp->p.pathlen = vpathp->pathlen;
+			memcpy(pp->p.path, buf, vpathp->pathlen);
+			pp->p.path[pp->p.pathlen] = '\0';
+			if (phash_put(&db_ptab.ph, &pp->hb) != 0) {
+				free(pp);
+				rc = DB_ENOMEM;
+			} else {
+				pthread_rwlock_wrlock(&db_ptab.rw);
+				hashtable_add(&db_ptab.ht, &pp->hb);
+				pthread_rwlock_unlock(&db_ptab.rw);
+				return (db_commit(&db_ptab));
+			}
+		}
+	} else {
+		if (pp == NULL) {
+			rc = DB_ENOENT;
+		} else if (phash_del(&db_ptab.ph, vpathp->vssdid) != 0) {
+			rc = DB_ENOMEM;
+		} else {
+			pthread_rwlock_wrlock(&db_ptab.rw);
+			hashtable_drop(&db_ptab.ht, &pp->hb);
+			pthread_rwlock_unlock(&db_ptab.rw);
+			free(pp);
+			return (db_commit(&db_ptab));
+		}
+	}
+	pthread_mutex_unlock(&db_wmu);
+	return (rc);
+}
+
+#ifdef SOLOTEST_CDEVDB
+/*
+ * tables, secondary index, concurrent writers, reopen; container.c
+ * needs the cJSON library, which is not in the tree
+ *	cc -DSOLOTEST_CDEVDB -I../include cdevdb.c container.c queue.c \
+ *		-lcjson -lpthread
+ */
+#include <sys/stat.h>
+#include <time.h>
+
+#define NWRITERS	8
+#define NPERWRITER	256
+
+static void *writer(void *arg)
+{
+	long		w = (long) arg;
+	db_vssd_t	v;
+	int		i, rc;
+
+	for (i = 0; i < NPERWRITER; i++) {
+		v.vssdid = 1000 + w * NPERWRITER + i;
+		v.cdevid = 1 + (i % 4);
+		v.vattr = w;
+		rc = db_vssd_cmd(DB_CMD_INSERT, &v);
+		assert(rc == 0);
+	}
+	return (NULL);
+}
+
+static void *reader(void *arg)
+{
+	volatile int	*stop = arg;
+	db_cdev_t	c;
+	long		n = 0;
+	int		rc;
+
+	while (!*stop) {
+		c.cdevid = 1 + n++ % 4;
+		rc = db_cdev_lookup(&c);
+		assert(rc == 0 && c.vmid == 10 * c.cdevid);
+	}
+	return ((void *) n);
+}
+
+int main(int argc, char **argv)
+{
+	static char	dir[] = "/tmp/cdevdb_solo";
+	pthread_t	t[NWRITERS], rt;
+	struct timespec	t0, t1;
+	volatile int	stop = 0;
+	db_cdev_t	c;
+	db_vssd_t	v, found[NWRITERS * NPERWRITER];
+	db_vpath_t	p;
+	char		buf[64];
+	void		*nreads;
+	long		w;
+	int		n, rc;
+
+	system("rm -rf /tmp/cdevdb_solo");
+	mkdir(dir, 0755);
+	rc = db_cdev_lookup(&c);
+	assert(rc == DB_ENOPEN);
+	rc = cdevdb_open(dir);
+	assert(rc == 0);
+
+	for (c.cdevid = 1; c.cdevid <= 4; c.cdevid++) {
+		c.vmid = 10 * c.cdevid;
+		c.hddid = 0;
+		rc = db_cdev_cmd(DB_CMD_INSERT, &c);
+		assert(rc == 0);
+	}
+	rc = db_cdev_cmd(DB_CMD_INSERT, &c);
+	assert(rc == 0);
+	rc = db_cdev_cmd(DB_CMD_INSERT, &c);
+	assert(rc == DB_EEXIST);
+	c.hddid = 77;
+	rc = db_cdev_cmd(DB_CMD_UPDATE, &c);
+	assert(rc == 0);
+	rc = db_cdev_cmd(DB_CMD_DELETE, &c);
+	assert(rc == 0);
+	rc = db_cdev_lookup(&c);
+	assert(rc == DB_ENOENT);
+
+	v.vssdid = 1;
+	v.cdevid = 99;
+	v.vattr = 0;
+	rc = db_vssd_cmd(DB_CMD_INSERT, &v);
+	assert(rc == DB_ENOKEY);
+	v.cdevid = 0;
+	rc = db_vssd_cmd(DB_CMD_INSERT, &v);
+	assert(rc == 0);
+	v.cdevid = 2;
+	rc = db_vssd_cmd(DB_CMD_UPDATE, &v);
+	assert(rc == 0);
+	c.cdevid = 2;
+	rc = db_cdev_cmd(DB_CMD_DELETE, &c);
+	assert(rc == DB_EINVAL);
+
+	p.vssdid = 1;
+	p.pattr = 1;
+	p.pathlen = strlen("ip:10.0.0.1");
+	rc = db_vpath_cmd(DB_CMD_INSERT, &p, "ip:10.0.0.1", p.pathlen);
+	assert(rc == 0);
+	p.pathlen = 0;
+	rc = db_vpath_cmd(DB_CMD_LOOKUP, &p, buf, 4);
+	assert(rc == DB_E2BIG);
+	rc = db_vpath_cmd(DB_CMD_LOOKUP, &p, buf, sizeof(buf));
+	assert(rc == 0);
+	assert(strcmp(buf, "ip:10.0.0.1") == 0 && VPATH_IS_REMOTE(&p));
+
+	/* writers batched into shared log syncs, a reader alongside */
+	pthread_create(&rt, NULL, reader, (void *) &stop);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (w = 0; w < NWRITERS; w++) {
+		pthread_create(&t[w], NULL, writer, (void *) w);
+	}
+	for (w = 0; w < NWRITERS; w++) {
+		pthread_join(t[w], NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	stop = 1;
+	pthread_join(rt, &nreads);
+	printf("%d inserts in %.3fs, %" PRIu64 " log syncs, %ld lookups\n",
+		NWRITERS * NPERWRITER, (t1.tv_sec - t0.tv_sec) +
+		(t1.tv_nsec - t0.tv_nsec) / 1e9, db_vtab.nsync,
+		(long) nreads);
+
+	n = 0;
+	rc = db_vssd_find(2, &n, found);
+	assert(rc == DB_E2BIG);
+	assert(n == NWRITERS * NPERWRITER / 4 + 1);
+	rc = db_vssd_find(2, &n, found);
+	assert(rc == 0);
+	rc = db_vssd_find(99, &n, NULL);
+	assert(rc == DB_ENOENT && n == 0);
+	cdevdb_close();
+
+	rc = cdevdb_open(dir);
+	assert(rc == 0);
+	n = NWRITERS * NPERWRITER;
+	rc = db_vssd_find(3, &n, found);
+	assert(rc == 0);
+	assert(n == NWRITERS * NPERWRITER / 4);
+	v.vssdid = 1;
+	rc = db_vssd_cmd(DB_CMD_LOOKUP, &v);
+	assert(rc == 0 && v.cdevid == 2);
+	rc = db_vssd_cmd(DB_CMD_DELETE, &v);
+	assert(rc == 0);
+	p.vssdid = 1;
+	rc = db_vpath_cmd(DB_CMD_LOOKUP, &p, buf, sizeof(buf));
+	assert(rc == 0);
+	c.cdevid = 4;
+	rc = db_cdev_lookup(&c);
+	assert(rc == 0 && c.vmid == 40);
+	cdevdb_close();
+
+	rc = cdevdb_open(dir);
+	assert(rc == 0);
+	v.vssdid = 1;
+	rc = db_vssd_cmd(DB_CMD_LOOKUP, &v);
+	assert(rc == DB_ENOENT);
+	n = 0;
+	rc = db_vssd_find(2, &n, NULL);
+	assert(rc == 0);
+	assert(n == NWRITERS * NPERWRITER / 4);
+	cdevdb_close();
+	system("rm -rf /tmp/cdevdb_solo");
+	printf("cdevdb solo test passed\n");
+	return (0);
+}
+#endif /* SOLOTEST_CDEVDB */
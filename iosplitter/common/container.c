@@ -0,0 +1,1008 @@
+/*
+ * container.c
+ *	hash table of hashbucket_t chains and its persistent form phash_t
+ *
+ * A phash_t is kept either as JSON, the whole table rewritten by every
+ * phash_flush(), or in binary: a snapshot and a log of changes.
+ *
+ *	fname:		struct phash_hdr, then a phash_rec and its data for
+ *			every element; checked by the crc in the header
+ *	fname.log:	struct phash_hdr naming the snapshot generation,
+ *			then a phash_rec and data for every phash_put() and
+ *			phash_del(), each with its own crc
+ *
+ * phash_put() and phash_del() only queue a record, phash_flush() appends
+ * the queue to the log with one write and syncs it. When the log has
+ * grown past the snapshot, phash_flush() writes a new snapshot from the
+ * table to tempname, renames it over fname and starts an empty log of the
+ * next generation. A crash before the rename leaves the old snapshot and
+ * log, a crash after it leaves a log of an older generation which is
+ * ignored.
+ *
+ * phash_reload() maps the snapshot, then the log of the same generation
+ * and applies its records up to the first one that is torn; the log is
+ * cut there so later records follow valid ones.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "container.h"
+
+#define PHASH_ALIGN(n)		(((n) + 7) & ~7)
+#define PHASH_WBUFSZ		(64 * 1024)
+
+/*------------------------ hashtable_t -------------------------------*/
+
+int hashtable_init(hashtable_t *hashp, size_t tablesize)
+{
+	size_t	i;
+
+	assert(tablesize > 0);
+	hashp->h_tab = malloc(tablesize * sizeof(struct queue));
+	if (hashp->h_tab == NULL) {
+		return (-1);
+	}
+	for (i = 0; i < tablesize; i++) {
+		queue_init(&hashp->h_tab[i]);
+	}
+	hashp->h_tabsize = tablesize;
+	hashp->h_count = 0;
+	return (0);
+}
+
+/*
+ * elements still in the table belong to the caller
+ */
+void hashtable_deinit(hashtable_t *hashp)
+{
+	free(hashp->h_tab);
+	memset(hashp, 0, sizeof(*hashp));
+}
+
+void hashtable_add(hashtable_t *hashp, hashbucket_t *hbp)
+{
+	queue_add(&hashp->h_tab[HASHFN(hashp, hbp->key)], &hbp->dll);
+	hashp->h_count++;
+}
+
+int hashtable_lookup(hashtable_t *hashp, hashkey_t key, hashbucket_t **hbpp)
+{
+	queue_t		*qp = &hashp->h_tab[HASHFN(hashp, key)];
+	dll_t		*dp;
+	hashbucket_t	*hbp;
+
+	for (dp = DLL_NEXT(&qp->q_dll); dp != &qp->q_dll; dp = DLL_NEXT(dp)) {
+		hbp = container_of(dp, hashbucket_t, dll);
+		if (hbp->key == key) {
+			*hbpp = hbp;
+			return (0);
+		}
+	}
+	*hbpp = NULL;
+	return (-1);
+}
+
+int hashtable_rem(hashtable_t *hashp, hashkey_t key,  hashbucket_t **hbpp)
+{
+	if (hashtable_lookup(hashp, key, hbpp) != 0) {
+		return (-1);
+	}
+	hashtable_drop(hashp, *hbpp);
+	return (0);
+}
+
+void hashtable_drop(hashtable_t *hashp, hashbucket_t *hbp)
+{
+	queue_t		*qp = &hashp->h_tab[HASHFN(hashp, hbp->key)];
+
+	assert(qp->q_len > 0);
+	DLL_REM(&hbp->dll);
+	qp->q_len--;
+	hashp->h_count--;
+}
+
+void hashtable_iter_init(hashtable_iter_t *hip, hashtable_t *hp)
+{
+	hip->hi_hp = hp;
+	hip->hi_ndx = 0;
+	queue_iter_init(&hip->hi_qiter, &hp->h_tab[0]);
+}
+
+/*
+ * returns the next hashbucket_t, NULL at the end.
+ * the table must not change during the iteration.
+ */
+void *hashtable_iter_next(hashtable_iter_t *hip)
+{
+	hashtable_t	*hp = hip->hi_hp;
+	dll_t		*dp;
+
+	while (HASH_NDX_VALID(hp, (size_t) hip->hi_ndx)) {
+		dp = queue_iter_next(&hip->hi_qiter);
+		if (dp != NULL) {
+			return (container_of(dp, hashbucket_t, dll));
+		}
+		if (!HASH_NDX_VALID(hp, (size_t) ++hip->hi_ndx)) {
+			break;
+		}
+		queue_iter_init(&hip->hi_qiter, &hp->h_tab[hip->hi_ndx]);
+	}
+	return (NULL);
+}
+
+int filesize(int fd, off_t *size)
+{
+	struct stat	st;
+
+	if (fstat(fd, &st) != 0) {
+		return (-1);
+	}
+	*size = st.st_size;
+	return (0);
+}
+
+/*------------------------ phash_t helpers ---------------------------*/
+
+/* prepend, cJSON_AddItemToArray walks the whole array for each item */
+static void phash_json_push(cJSON *array, cJSON *item)
+{
+	item->prev = NULL;
+	item->next = array->child;
+	if (array->child != NULL) {
+		array->child->prev = item;
+	}
+	array->child = item;
+}
+
+static uint32_t phash_crc(uint32_t h, const void *p, size_t n)
+{
+	const uint8_t	*b = p;
+
+	while (n-- > 0) {
+		h = (h ^ *b++) * 16777619;
+	}
+	return (h);
+}
+#define PHASH_CRCINIT		2166136261U
+
+static int phash_pwrite(int fd, const void *buf, size_t n, off_t off)
+{
+	const char	*p = buf;
+	ssize_t		rc;
+
+	while (n > 0) {
+		rc = pwrite(fd, p, n, off);
+		if (rc < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return (-1);
+		}
+		p += rc;
+		off += rc;
+		n -= rc;
+	}
+	return (0);
+}
+
+static int phash_dirsync(char *fname)
+{
+	char	*copy;
+	int	fd, rc;
+
+	if ((copy = strdup(fname)) == NULL) {
+		return (-1);
+	}
+	fd = open(dirname(copy), O_RDONLY | O_DIRECTORY);
+	free(copy);
+	if (fd < 0) {
+		return (-1);
+	}
+	rc = fsync(fd);
+	close(fd);
+	return (rc);
+}
+
+static void phash_sethdr(struct phash_hdr *hdr, uint32_t magic, uint64_t gen)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->magic = magic;
+	hdr->version = PHASH_VERSION;
+	hdr->gen = gen;
+}
+
+static void phash_sealhdr(struct phash_hdr *hdr)
+{
+	hdr->hcrc = 0;
+	hdr->hcrc = phash_crc(PHASH_CRCINIT, hdr, sizeof(*hdr));
+}
+
+static int phash_hdrok(struct phash_hdr *hdr, uint32_t magic)
+{
+	struct phash_hdr	h = *hdr;
+
+	if (h.magic != magic || h.version != PHASH_VERSION) {
+		return (0);
+	}
+	h.hcrc = 0;
+	return (phash_crc(PHASH_CRCINIT, &h, sizeof(h)) == hdr->hcrc);
+}
+
+/*
+ * serialize an element into php->rbuf, returns the data length
+ */
+static int phash_h2b(phash_t *php, hashbucket_t *hbp)
+{
+	char	*nb;
+	int	n;
+
+	for (;;) {
+		n = php->h2b(hbp, php->rbuf, php->rbuflen);
+		assert(n >= 0);
+		if (n <= php->rbuflen) {
+			return (n);
+		}
+		nb = realloc(php->rbuf, PHASH_ALIGN(n));
+		if (nb == NULL) {
+			return (-1);
+		}
+		php->rbuf = nb;
+		php->rbuflen = PHASH_ALIGN(n);
+	}
+}
+
+/*
+ * apply one record to the table
+ */
+static int phash_apply(phash_t *php, uint32_t op, hashkey_t key,
+	const void *data, int len)
+{
+	hashbucket_t	*hbp;
+
+	if (hashtable_rem(php->hp, key, &hbp) == 0 && php->hfree != NULL) {
+		php->hfree(hbp);
+	}
+	if (op == PHASH_DEL) {
+		return (0);
+	}
+	if ((hbp = php->b2h(key, data, len)) == NULL) {
+		return (-1);
+	}
+	hbp->key = key;
+	hashtable_add(php->hp, hbp);
+	return (0);
+}
+
+/*------------------------ phash_t, binary ---------------------------*/
+
+static int phash_logreset(phash_t *php)
+{
+	struct phash_hdr	hdr;
+
+	phash_sethdr(&hdr, PHASH_LOGMAGIC, php->gen);
+	phash_sealhdr(&hdr);
+	if (phash_pwrite(php->logfd, &hdr, sizeof(hdr), 0) != 0 ||
+	    ftruncate(php->logfd, sizeof(hdr)) != 0 ||
+	    fdatasync(php->logfd) != 0) {
+		return (-1);
+	}
+	php->logsize = sizeof(hdr);
+	return (0);
+}
+
+/*
+ * write the table to tempname, rename it over fname and start the log of
+ * the new generation
+ */
+static int phash_snapshot(phash_t *php)
+{
+	struct phash_hdr	hdr;
+	struct phash_rec	rec;
+	hashtable_iter_t	hi;
+	hashbucket_t		*hbp;
+	char			*wbuf;
+	size_t			nw = 0;
+	off_t			off = sizeof(hdr);
+	uint32_t		crc = PHASH_CRCINIT;
+	uint64_t		count = 0;
+	int			fd, len, alen, rc = -1;
+
+	if ((wbuf = malloc(PHASH_WBUFSZ)) == NULL) {
+		return (-1);
+	}
+	fd = open(php->tempname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		free(wbuf);
+		return (-1);
+	}
+	hashtable_iter_init(&hi, php->hp);
+	while ((hbp = hashtable_iter_next(&hi)) != NULL) {
+		if ((len = phash_h2b(php, hbp)) < 0) {
+			goto out;
+		}
+		alen = PHASH_ALIGN(len);
+		memset(php->rbuf + len, 0, alen - len);
+		memset(&rec, 0, sizeof(rec));
+		rec.len = len;
+		rec.key = hbp->key;
+		rec.op = PHASH_PUT;
+		crc = phash_crc(crc, &rec, sizeof(rec));
+		crc = phash_crc(crc, php->rbuf, alen);
+		if (nw + sizeof(rec) + alen > PHASH_WBUFSZ) {
+			if (phash_pwrite(fd, wbuf, nw, off) != 0) {
+				goto out;
+			}
+			off += nw;
+			nw = 0;
+		}
+		if (sizeof(rec) + alen > PHASH_WBUFSZ) {
+			if (phash_pwrite(fd, &rec, sizeof(rec), off) != 0 ||
+			    phash_pwrite(fd, php->rbuf, alen,
+					off + sizeof(rec)) != 0) {
+				goto out;
+			}
+			off += sizeof(rec) + alen;
+		} else {
+			memcpy(wbuf + nw, &rec, sizeof(rec));
+			memcpy(wbuf + nw + sizeof(rec), php->rbuf, alen);
+			nw += sizeof(rec) + alen;
+		}
+		count++;
+	}
+	if (nw > 0 && phash_pwrite(fd, wbuf, nw, off) != 0) {
+		goto out;
+	}
+	off += nw;
+
+	phash_sethdr(&hdr, PHASH_SNAPMAGIC, php->gen + 1);
+	hdr.count = count;
+	hdr.bytes = off - sizeof(hdr);
+	hdr.crc = crc;
+	phash_sealhdr(&hdr);
+	if (phash_pwrite(fd, &hdr, sizeof(hdr), 0) != 0 || fsync(fd) != 0) {
+		goto out;
+	}
+	close(fd);
+	fd = -1;
+	if (rename(php->tempname, php->fname) != 0 ||
+	    phash_dirsync(php->fname) != 0) {
+		goto out;
+	}
+	php->gen++;
+	php->snapsize = off;
+	rc = phash_logreset(php);
+out:
+	if (fd >= 0) {
+		close(fd);
+		unlink(php->tempname);
+	}
+	free(wbuf);
+	return (rc);
+}
+
+static int phash_pendgrow(phash_t *php, size_t n)
+{
+	size_t	max;
+	char	*np;
+
+	if (php->npend + n <= php->pendmax) {
+		return (0);
+	}
+	for (max = php->pendmax ? php->pendmax : 4096; max < php->npend + n;
+			max *= 2)
+		;
+	if ((np = realloc(php->pend, max)) == NULL) {
+		return (-1);
+	}
+	php->pend = np;
+	php->pendmax = max;
+	return (0);
+}
+
+static int phash_log(phash_t *php, uint32_t op, hashkey_t key,
+	const void *data, int len)
+{
+	struct phash_rec	rec;
+	int			alen = PHASH_ALIGN(len);
+	char			*p;
+
+	if (phash_pendgrow(php, sizeof(rec) + alen) != 0) {
+		return (-1);
+	}
+	p = php->pend + php->npend;
+	memset(&rec, 0, sizeof(rec));
+	rec.len = len;
+	rec.key = key;
+	rec.op = op;
+	memcpy(p, &rec, sizeof(rec));
+	memcpy(p + sizeof(rec), data, len);
+	memset(p + sizeof(rec) + len, 0, alen - len);
+	rec.crc = phash_crc(PHASH_CRCINIT, p, sizeof(rec) + alen);
+	memcpy(p, &rec, sizeof(rec));
+	php->npend += sizeof(rec) + alen;
+	return (0);
+}
+
+/*
+ * queue a record of the current contents of an element in the table.
+ * durable after the next phash_flush().
+ */
+int phash_put(phash_t *php, hashbucket_t *hbp)
+{
+	int	len;
+
+	assert(php->h2b != NULL);
+	if ((len = phash_h2b(php, hbp)) < 0) {
+		return (-1);
+	}
+	return (phash_log(php, PHASH_PUT, hbp->key, php->rbuf, len));
+}
+
+/*
+ * queue a record of an element removed from the table
+ */
+int phash_del(phash_t *php, hashkey_t key)
+{
+	assert(php->h2b != NULL);
+	return (phash_log(php, PHASH_DEL, key, NULL, 0));
+}
+
+/*
+ * write queued records to the log without syncing it; a caller batching
+ * syncs of several writers does fdatasync(php->logfd) itself, and calls
+ * phash_flush() when PHASH_WANTSNAP().
+ */
+int phash_append(phash_t *php)
+{
+	assert(php->h2b != NULL);
+	if (php->npend == 0) {
+		return (0);
+	}
+	if (phash_pwrite(php->logfd, php->pend, php->npend,
+			php->logsize) != 0) {
+		return (-1);
+	}
+	php->logsize += php->npend;
+	php->npend = 0;
+	return (0);
+}
+
+static int phash_flush_bin(phash_t *php)
+{
+	if (php->npend > 0) {
+		if (phash_append(php) != 0 || fdatasync(php->logfd) != 0) {
+			return (-1);
+		}
+	}
+	if (PHASH_WANTSNAP(php)) {
+		return (phash_snapshot(php));
+	}
+	return (0);
+}
+
+static int phash_load_snap(phash_t *php)
+{
+	struct phash_hdr	*hdr;
+	struct phash_rec	*rec;
+	char			*map, *p, *end;
+	off_t			size;
+	uint64_t		n;
+	int			fd, rc = -1;
+
+	if ((fd = open(php->fname, O_RDONLY)) < 0) {
+		if (errno != ENOENT) {
+			return (-1);
+		}
+		php->gen = 0;
+		php->snapsize = 0;
+		return (0);
+	}
+	if (filesize(fd, &size) != 0) {
+		close(fd);
+		return (-1);
+	}
+	if (size < (off_t) sizeof(*hdr)) {
+		close(fd);
+		errno = EINVAL;
+		return (-1);
+	}
+	map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return (-1);
+	}
+	errno = EINVAL;
+	hdr = (struct phash_hdr *) map;
+	if (!phash_hdrok(hdr, PHASH_SNAPMAGIC) ||
+	    hdr->bytes > size - sizeof(*hdr)) {
+		goto out;
+	}
+	p = map + sizeof(*hdr);
+	end = p + hdr->bytes;
+	if (phash_crc(PHASH_CRCINIT, p, hdr->bytes) != hdr->crc) {
+		goto out;
+	}
+	madvise(p, hdr->bytes, MADV_SEQUENTIAL);
+	for (n = 0; n < hdr->count; n++) {
+		rec = (struct phash_rec *) p;
+		if (end - p < (ssize_t) sizeof(*rec) ||
+		    end - p - sizeof(*rec) < PHASH_ALIGN(rec->len) ||
+		    rec->op != PHASH_PUT) {
+			goto out;
+		}
+		if (phash_apply(php, PHASH_PUT, rec->key, rec + 1,
+				rec->len) != 0) {
+			goto out;
+		}
+		p += sizeof(*rec) + PHASH_ALIGN(rec->len);
+	}
+	php->gen = hdr->gen;
+	php->snapsize = size;
+	rc = 0;
+out:
+	munmap(map, size);
+	return (rc);
+}
+
+static int phash_load_log(phash_t *php)
+{
+	struct phash_hdr	*hdr;
+	struct phash_rec	rec;
+	char			*map, *p, *end;
+	off_t			size;
+	size_t			alen;
+
+	php->logfd = open(php->logname, O_RDWR | O_CREAT, 0644);
+	if (php->logfd < 0 || filesize(php->logfd, &size) != 0) {
+		return (-1);
+	}
+	if (size < (off_t) sizeof(*hdr)) {
+		return (phash_logreset(php));
+	}
+	map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, php->logfd, 0);
+	if (map == MAP_FAILED) {
+		return (-1);
+	}
+	hdr = (struct phash_hdr *) map;
+	if (!phash_hdrok(hdr, PHASH_LOGMAGIC) || hdr->gen != php->gen) {
+		munmap(map, size);
+		return (phash_logreset(php));
+	}
+	p = map + sizeof(*hdr);
+	end = map + size;
+	while (end - p >= (ssize_t) sizeof(rec)) {
+		memcpy(&rec, p, sizeof(rec));
+		alen = PHASH_ALIGN((size_t) rec.len);
+		if (end - p - sizeof(rec) < alen ||
+		    (rec.op != PHASH_PUT && rec.op != PHASH_DEL)) {
+			break;
+		}
+		rec.crc = 0;
+		if (phash_crc(phash_crc(PHASH_CRCINIT, &rec, sizeof(rec)),
+				p + sizeof(rec), alen) !=
+		    ((struct phash_rec *) p)->crc) {
+			break;
+		}
+		if (phash_apply(php, rec.op, rec.key, p + sizeof(rec),
+				rec.len) != 0) {
+			munmap(map, size);
+			return (-1);
+		}
+		p += sizeof(rec) + alen;
+	}
+	php->logsize = p - map;
+	munmap(map, size);
+	if (php->logsize < size &&
+	    (ftruncate(php->logfd, php->logsize) != 0 ||
+	     fdatasync(php->logfd) != 0)) {
+		return (-1);
+	}
+	return (0);
+}
+
+static int phash_reload_bin(phash_t *php)
+{
+	if (php->logfd >= 0) {
+		close(php->logfd);
+		php->logfd = -1;
+	}
+	php->npend = 0;
+	if (phash_load_snap(php) != 0) {
+		return (-1);
+	}
+	return (phash_load_log(php));
+}
+
+/*------------------------ phash_t, JSON -----------------------------*/
+
+static int phash_json_write(phash_t *php, char *fname, char *tempname)
+{
+	hashtable_iter_t	hi;
+	hashbucket_t		*hbp;
+	cJSON			*root, *item;
+	char			*text;
+	int			fd, rc = -1;
+
+	assert(php->h2j != NULL);
+	if ((root = cJSON_CreateArray()) == NULL) {
+		return (-1);
+	}
+	hashtable_iter_init(&hi, php->hp);
+	while ((hbp = hashtable_iter_next(&hi)) != NULL) {
+		if ((item = php->h2j(hbp)) == NULL) {
+			cJSON_Delete(root);
+			return (-1);
+		}
+		phash_json_push(root, item);
+	}
+	text = cJSON_Print(root);
+	cJSON_Delete(root);
+	if (text == NULL) {
+		return (-1);
+	}
+	fd = open(tempname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd >= 0) {
+		if (phash_pwrite(fd, text, strlen(text), 0) == 0 &&
+		    fsync(fd) == 0 && rename(tempname, fname) == 0) {
+			rc = 0;
+		}
+		close(fd);
+		if (rc != 0) {
+			unlink(tempname);
+		}
+	}
+	free(text);
+	return (rc);
+}
+
+static int phash_json_reload(phash_t *php)
+{
+	hashbucket_t	*hbp;
+	cJSON		*root, *item;
+	char		*text;
+	off_t		size;
+	ssize_t		rc;
+	int		fd;
+
+	if ((fd = open(php->fname, O_RDONLY)) < 0) {
+		return (errno == ENOENT ? 0 : -1);
+	}
+	if (filesize(fd, &size) != 0 || (text = malloc(size + 1)) == NULL) {
+		close(fd);
+		return (-1);
+	}
+	rc = pread(fd, text, size, 0);
+	close(fd);
+	if (rc != size) {
+		free(text);
+		return (-1);
+	}
+	text[size] = '\0';
+	root = cJSON_Parse(text);
+	free(text);
+	if (root == NULL) {
+		errno = EINVAL;
+		return (-1);
+	}
+	for (item = root->child; item != NULL; item = item->next) {
+		if ((hbp = php->j2h(item)) == NULL) {
+			cJSON_Delete(root);
+			return (-1);
+		}
+		hashtable_add(php->hp, hbp);
+	}
+	cJSON_Delete(root);
+	return (0);
+}
+
+/*------------------------ phash_t -----------------------------------*/
+
+int phash_init(
+	phash_t		*php,
+	hashtable_t	*hp,
+	char 		*fname,
+	char		*tempname,
+	j2h_ptr_t	j2h,
+	h2j_ptr_t	h2j
+	)
+{
+	BZERO(php);
+	php->hp = hp;
+	php->fname = fname;
+	php->tempname = tempname;
+	php->j2h = j2h;
+	php->h2j = h2j;
+	php->logfd = -1;
+	return (phash_reload(php));
+}
+
+/*
+ * h2j may be NULL if the table is never exported
+ */
+int phash_init_bin(
+	phash_t		*php,
+	hashtable_t	*hp,
+	char		*fname,
+	char		*tempname,
+	h2b_ptr_t	h2b,
+	b2h_ptr_t	b2h,
+	hfree_ptr_t	hfree,
+	h2j_ptr_t	h2j
+	)
+{
+	assert(h2b != NULL && b2h != NULL);
+	BZERO(php);
+	php->hp = hp;
+	php->fname = fname;
+	php->tempname = tempname;
+	php->h2j = h2j;
+	php->h2b = h2b;
+	php->b2h = b2h;
+	php->hfree = hfree;
+	php->logfd = -1;
+	if ((php->logname = malloc(strlen(fname) + 5)) == NULL) {
+		return (-1);
+	}
+	sprintf(php->logname, "%s.log", fname);
+	if (phash_reload(php) != 0) {
+		phash_deinit(php);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * flushes queued records; the elements stay in the table
+ */
+int phash_deinit(phash_t *php)
+{
+	int	rc = 0;
+
+	if (php->logfd >= 0) {
+		rc = phash_flush_bin(php);
+		close(php->logfd);
+	}
+	free(php->logname);
+	free(php->pend);
+	free(php->rbuf);
+	BZERO(php);
+	php->logfd = -1;
+	return (rc);
+}
+
+int phash_flush(phash_t *php)
+{
+	if (php->h2b != NULL) {
+		return (phash_flush_bin(php));
+	}
+	return (phash_json_write(php, php->fname, php->tempname));
+}
+
+int phash_reload(phash_t *php)
+{
+	if (php->h2b != NULL) {
+		return (phash_reload_bin(php));
+	}
+	return (phash_json_reload(php));
+}
+
+/*
+ * write the table as JSON through h2j, for inspection or for a JSON
+ * phash_t to load
+ */
+int phash_export(phash_t *php, char *fname)
+{
+	char	*tempname;
+	int	rc;
+
+	if ((tempname = malloc(strlen(fname) + 5)) == NULL) {
+		return (-1);
+	}
+	sprintf(tempname, "%s.tmp", fname);
+	rc = phash_json_write(php, fname, tempname);
+	free(tempname);
+	return (rc);
+}
+
+#ifdef SOLOTEST_CONTAINER
+/*
+ * binary phash_t: snapshot, log, reload after a torn log write. The JSON
+ * code still needs the cJSON library, which is not in the tree.
+ *	cc -DSOLOTEST_CONTAINER -I../include container.c queue.c -lcjson
+ */
+#include <inttypes.h>
+
+typedef struct {
+	hashbucket_t	hb;
+	int		len;
+	char		data[64];
+} elem_t;
+
+static int e_h2b(hashbucket_t *hbp, void *buf, int buflen)
+{
+	elem_t	*e = container_of(hbp, elem_t, hb);
+
+	if (e->len <= buflen) {
+		memcpy(buf, e->data, e->len);
+	}
+	return (e->len);
+}
+
+static hashbucket_t *e_b2h(hashkey_t key, const void *buf, int len)
+{
+	elem_t	*e = calloc(1, sizeof(*e));
+
+	assert(len <= (int) sizeof(e->data));
+	HASHBUCKET_INIT(&e->hb, key);
+	e->len = len;
+	memcpy(e->data, buf, len);
+	return (&e->hb);
+}
+
+static void e_free(hashbucket_t *hbp)
+{
+	free(container_of(hbp, elem_t, hb));
+}
+
+static void e_set(phash_t *php, hashkey_t key, int v)
+{
+	hashbucket_t	*hbp;
+	elem_t		*e;
+	int		rc;
+
+	if (hashtable_lookup(php->hp, key, &hbp) != 0) {
+		e = calloc(1, sizeof(*e));
+		HASHBUCKET_INIT(&e->hb, key);
+		hashtable_add(php->hp, &e->hb);
+	} else {
+		e = container_of(hbp, elem_t, hb);
+	}
+	e->len = snprintf(e->data, sizeof(e->data), "elem %" PRIu64 " %d",
+			key, v);
+	rc = phash_put(php, &e->hb);
+	assert(rc == 0);
+}
+
+static void e_drain(hashtable_t *hp)
+{
+	hashtable_iter_t	hi;
+	hashbucket_t		*hbp;
+
+	while (HASHTABLECOUNT(hp) > 0) {
+		hashtable_iter_init(&hi, hp);
+		hbp = hashtable_iter_next(&hi);
+		hashtable_drop(hp, hbp);
+		e_free(hbp);
+	}
+}
+
+static void e_check(hashtable_t *hp, hashkey_t key, int v)
+{
+	hashbucket_t	*hbp;
+	elem_t		*e;
+	char		want[64];
+	int		rc;
+
+	rc = hashtable_lookup(hp, key, &hbp);
+	if (v < 0) {
+		assert(rc != 0);
+		return;
+	}
+	assert(rc == 0);
+	e = container_of(hbp, elem_t, hb);
+	snprintf(want, sizeof(want), "elem %" PRIu64 " %d", key, v);
+	assert(e->len == (int) strlen(want));
+	assert(memcmp(e->data, want, e->len) == 0);
+}
+
+int main(int argc, char **argv)
+{
+	static char	fname[] = "/tmp/phash_solo", tname[] = "/tmp/phash_solo.t";
+	static int	model[4096];
+	hashtable_t	ht;
+	phash_t		ph;
+	off_t		size;
+	hashkey_t	k;
+	uint64_t	gen;
+	int		i, round, rc;
+
+	unlink(fname);
+	unlink("/tmp/phash_solo.log");
+	rc = hashtable_init(&ht, 257);
+	assert(rc == 0);
+	rc = phash_init_bin(&ph, &ht, fname, tname, e_h2b, e_b2h, e_free, NULL);
+	assert(rc == 0);
+	assert(ph.gen == 0 && HASHTABLECOUNT(&ht) == 0);
+	for (k = 0; k < 4096; k++) {
+		model[k] = -1;
+	}
+
+	/* updates, some rounds of which outgrow the snapshot */
+	srandom(1);
+	for (round = 0; round < 40; round++) {
+		for (i = 0; i < 500; i++) {
+			k = random() % 4096;
+			if (random() % 5 == 0) {
+				hashbucket_t	*hbp;
+
+				if (hashtable_rem(&ht, k, &hbp) == 0) {
+					e_free(hbp);
+				}
+				rc = phash_del(&ph, k);
+				assert(rc == 0);
+				model[k] = -1;
+			} else {
+				model[k] = round * 1000 + i;
+				e_set(&ph, k, model[k]);
+			}
+		}
+		rc = phash_flush(&ph);
+		assert(rc == 0);
+	}
+	gen = ph.gen;
+	printf("gen %" PRIu64 " count %d snapshot %ld log %ld\n", gen,
+		HASHTABLECOUNT(&ht), (long) ph.snapsize, (long) ph.logsize);
+	assert(gen > 0);
+	rc = phash_deinit(&ph);
+	assert(rc == 0);
+	e_drain(&ht);
+
+	rc = phash_init_bin(&ph, &ht, fname, tname, e_h2b, e_b2h, e_free, NULL);
+	assert(rc == 0);
+	assert(ph.gen == gen);
+	for (k = 0; k < 4096; k++) {
+		e_check(&ht, k, model[k]);
+	}
+
+	/* a torn last record is dropped, the ones before it kept */
+	e_set(&ph, 1, 111);
+	e_set(&ph, 2, 222);
+	rc = phash_flush(&ph);
+	assert(rc == 0);
+	rc = filesize(ph.logfd, &size);
+	assert(rc == 0);
+	rc = ftruncate(ph.logfd, size - 3);
+	assert(rc == 0);
+	rc = phash_deinit(&ph);
+	assert(rc == 0);
+	e_drain(&ht);
+	rc = phash_init_bin(&ph, &ht, fname, tname, e_h2b, e_b2h, e_free, NULL);
+	assert(rc == 0);
+	e_check(&ht, 1, 111);
+	e_check(&ht, 2, model[2]);
+	model[1] = 111;
+	rc = filesize(ph.logfd, &size);
+	assert(rc == 0 && size == ph.logsize);
+
+	/* records after the cut are appended where it was */
+	e_set(&ph, 3, 333);
+	model[3] = 333;
+	rc = phash_flush(&ph);
+	assert(rc == 0);
+	rc = phash_deinit(&ph);
+	assert(rc == 0);
+	e_drain(&ht);
+	rc = phash_init_bin(&ph, &ht, fname, tname, e_h2b, e_b2h, e_free, NULL);
+	assert(rc == 0);
+	for (k = 0; k < 4096; k++) {
+		e_check(&ht, k, model[k]);
+	}
+	rc = phash_deinit(&ph);
+	assert(rc == 0);
+	e_drain(&ht);
+	hashtable_deinit(&ht);
+	unlink(fname);
+	unlink("/tmp/phash_solo.log");
+	printf("phash solo test passed\n");
+	return (0);
+}
+#endif /* SOLOTEST_CONTAINER */
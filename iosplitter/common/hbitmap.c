@@ -0,0 +1,467 @@
+/*
+ * hbitmap.c
+ *	hierarchical bitmap, see hbitmap.h
+ *
+ * Within a word set bits are found with tzcnt (__builtin_ctzll) and
+ * counted with popcnt (__builtin_popcountll). Long runs of words, the top
+ * level and interior words of ranges, go through hb_find() and
+ * hb_popcount() which use AVX2 when the CPU supports it, the library
+ * itself is built without -mavx2.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <immintrin.h>
+
+#include "hbitmap.h"
+
+#define HB_WORDS(nbits)	(((nbits) + 63) >> 6)
+#define HB_MASK_FROM(b)	(~0ULL << ((b) & 63))		/* bits >= b */
+#define HB_MASK_TO(b)	(~0ULL >> (63 - ((b) & 63)))	/* bits <= b */
+
+static int	hb_avx2 = -1;
+
+static inline int hb_has_avx2(void)
+{
+	if (hb_avx2 < 0) {
+		__builtin_cpu_init();
+		hb_avx2 = __builtin_cpu_supports("avx2") &&
+			__builtin_cpu_supports("popcnt");
+	}
+	return (hb_avx2);
+}
+
+__attribute__((target("avx2")))
+static uint64_t hb_find_avx2(const uint64_t *w, uint64_t i, uint64_t n)
+{
+	__m256i	v;
+
+	for (; i + 4 <= n; i += 4) {
+		v = _mm256_loadu_si256((const __m256i *) (w + i));
+		if (!_mm256_testz_si256(v, v)) {
+			break;
+		}
+	}
+	for (; i < n && w[i] == 0; i++)
+		;
+	return (i);
+}
+
+/*
+ * Mula's nibble lookup, per byte counts summed with vpsadbw
+ */
+__attribute__((target("avx2")))
+static uint64_t hb_popcount_avx2(const uint64_t *w, uint64_t n)
+{
+	const __m256i	lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3,
+				1, 2, 2, 3, 2, 3, 3, 4, 0, 1, 1, 2, 1, 2, 2, 3,
+				1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i	low = _mm256_set1_epi8(0x0f);
+	__m256i		acc = _mm256_setzero_si256();
+	__m256i		v;
+	__m256i		c;
+	uint64_t	i;
+	uint64_t	cnt;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		v   = _mm256_loadu_si256((const __m256i *) (w + i));
+		c   = _mm256_add_epi8(
+			_mm256_shuffle_epi8(lut, _mm256_and_si256(v, low)),
+			_mm256_shuffle_epi8(lut,
+				_mm256_and_si256(_mm256_srli_epi16(v, 4), low)));
+		acc = _mm256_add_epi64(acc,
+				_mm256_sad_epu8(c, _mm256_setzero_si256()));
+	}
+	cnt = _mm256_extract_epi64(acc, 0) + _mm256_extract_epi64(acc, 1) +
+		_mm256_extract_epi64(acc, 2) + _mm256_extract_epi64(acc, 3);
+	for (; i < n; i++) {
+		cnt += __builtin_popcountll(w[i]);
+	}
+	return (cnt);
+}
+
+/* first non zero word of w[i, n), n if none */
+static uint64_t hb_find(const uint64_t *w, uint64_t i, uint64_t n)
+{
+	if (hb_has_avx2()) {
+		return (hb_find_avx2(w, i, n));
+	}
+	for (; i < n && w[i] == 0; i++)
+		;
+	return (i);
+}
+
+static uint64_t hb_popcount(const uint64_t *w, uint64_t n)
+{
+	uint64_t	cnt = 0;
+	uint64_t	i;
+
+	if (hb_has_avx2()) {
+		return (hb_popcount_avx2(w, n));
+	}
+	for (i = 0; i < n; i++) {
+		cnt += __builtin_popcountll(w[i]);
+	}
+	return (cnt);
+}
+
+int hbitmap_init(hbitmap_t *hb, uint64_t nbits)
+{
+	uint64_t	n;
+	int		l;
+
+	if (nbits == 0) {
+		return (-1);
+	}
+
+	memset(hb, 0, sizeof(*hb));
+	hb->nbits = nbits;
+
+	for (l = 0, n = nbits; l < HBITMAP_MAXLEVELS; l++) {
+		hb->nwords[l] = HB_WORDS(n);
+		if (posix_memalign((void **) &hb->level[l], 32,
+				hb->nwords[l] * sizeof(uint64_t)) != 0) {
+			hbitmap_deinit(hb);
+			return (-1);
+		}
+		memset(hb->level[l], 0, hb->nwords[l] * sizeof(uint64_t));
+		hb->nlevels++;
+
+		if (hb->nwords[l] <= HBITMAP_TOPWORDS) {
+			return (0);
+		}
+		n = hb->nwords[l];
+	}
+
+	hbitmap_deinit(hb);
+	return (-1);
+}
+
+void hbitmap_deinit(hbitmap_t *hb)
+{
+	int	l;
+
+	for (l = 0; l < hb->nlevels; l++) {
+		free(hb->level[l]);
+		hb->level[l] = NULL;
+	}
+	hb->nlevels = 0;
+}
+
+/*
+ * set [start, start + n) of level l and the summary bits of the words
+ * touched, returns the number of bits that were clear
+ */
+static uint64_t hb_set(hbitmap_t *hb, int l, uint64_t start, uint64_t n)
+{
+	uint64_t	*w = hb->level[l];
+	uint64_t	end = start + n - 1;
+	uint64_t	w0 = start >> 6;
+	uint64_t	w1 = end >> 6;
+	uint64_t	m;
+	uint64_t	added;
+
+	if (w0 == w1) {
+		m     = HB_MASK_FROM(start) & HB_MASK_TO(end);
+		added = __builtin_popcountll(m & ~w[w0]);
+		w[w0] |= m;
+	} else {
+		added  = __builtin_popcountll(HB_MASK_FROM(start) & ~w[w0]);
+		w[w0] |= HB_MASK_FROM(start);
+		added += __builtin_popcountll(HB_MASK_TO(end) & ~w[w1]);
+		w[w1] |= HB_MASK_TO(end);
+		if (w1 - w0 > 1) {
+			added += (w1 - w0 - 1) * 64 -
+				hb_popcount(w + w0 + 1, w1 - w0 - 1);
+			memset(w + w0 + 1, 0xff,
+					(w1 - w0 - 1) * sizeof(uint64_t));
+		}
+	}
+
+	if (l + 1 < hb->nlevels) {
+		hb_set(hb, l + 1, w0, w1 - w0 + 1);
+	}
+	return (added);
+}
+
+/*
+ * clear [start, start + n) of level l, then the summary bits of the words
+ * that became zero, returns the number of bits that were set
+ */
+static uint64_t hb_clear(hbitmap_t *hb, int l, uint64_t start, uint64_t n)
+{
+	uint64_t	*w = hb->level[l];
+	uint64_t	end = start + n - 1;
+	uint64_t	w0 = start >> 6;
+	uint64_t	w1 = end >> 6;
+	uint64_t	m;
+	uint64_t	removed;
+
+	if (w0 == w1) {
+		m       = HB_MASK_FROM(start) & HB_MASK_TO(end);
+		removed = __builtin_popcountll(m & w[w0]);
+		w[w0]  &= ~m;
+	} else {
+		removed  = __builtin_popcountll(HB_MASK_FROM(start) & w[w0]);
+		w[w0]   &= ~HB_MASK_FROM(start);
+		removed += __builtin_popcountll(HB_MASK_TO(end) & w[w1]);
+		w[w1]   &= ~HB_MASK_TO(end);
+		if (w1 - w0 > 1) {
+			removed += hb_popcount(w + w0 + 1, w1 - w0 - 1);
+			memset(w + w0 + 1, 0,
+					(w1 - w0 - 1) * sizeof(uint64_t));
+		}
+	}
+
+	if (l + 1 < hb->nlevels && removed != 0) {
+		if (w1 - w0 > 1) {
+			hb_clear(hb, l + 1, w0 + 1, w1 - w0 - 1);
+		}
+		if (w[w0] == 0) {
+			hb_clear(hb, l + 1, w0, 1);
+		}
+		if (w1 != w0 && w[w1] == 0) {
+			hb_clear(hb, l + 1, w1, 1);
+		}
+	}
+	return (removed);
+}
+
+void hbitmap_set_range(hbitmap_t *hb, uint64_t start, uint64_t n)
+{
+	assert(start + n <= hb->nbits);
+	if (n != 0) {
+		hb->count += hb_set(hb, 0, start, n);
+	}
+}
+
+void hbitmap_clear_range(hbitmap_t *hb, uint64_t start, uint64_t n)
+{
+	assert(start + n <= hb->nbits);
+	if (n != 0) {
+		hb->count -= hb_clear(hb, 0, start, n);
+	}
+}
+
+uint64_t hbitmap_count_range(hbitmap_t *hb, uint64_t start, uint64_t n)
+{
+	uint64_t	*w = hb->level[0];
+	uint64_t	end = start + n - 1;
+	uint64_t	w0 = start >> 6;
+	uint64_t	w1 = end >> 6;
+	uint64_t	cnt;
+
+	assert(start + n <= hb->nbits);
+	if (n == 0) {
+		return (0);
+	}
+	if (w0 == w1) {
+		return (__builtin_popcountll(w[w0] & HB_MASK_FROM(start) &
+				HB_MASK_TO(end)));
+	}
+	cnt  = __builtin_popcountll(w[w0] & HB_MASK_FROM(start));
+	cnt += __builtin_popcountll(w[w1] & HB_MASK_TO(end));
+	if (w1 - w0 > 1) {
+		cnt += hb_popcount(w + w0 + 1, w1 - w0 - 1);
+	}
+	return (cnt);
+}
+
+/*
+ * first set bit >= pos of level l, -1 if none
+ */
+static int64_t hb_next(hbitmap_t *hb, int l, uint64_t pos)
+{
+	uint64_t	*w = hb->level[l];
+	uint64_t	i = pos >> 6;
+	uint64_t	v;
+	int64_t		j;
+
+	if (i >= hb->nwords[l]) {
+		return (-1);
+	}
+	v = w[i] & HB_MASK_FROM(pos);
+	if (v != 0) {
+		return ((i << 6) + __builtin_ctzll(v));
+	}
+
+	if (l + 1 == hb->nlevels) {
+		i = hb_find(w, i + 1, hb->nwords[l]);
+		if (i == hb->nwords[l]) {
+			return (-1);
+		}
+	} else {
+		j = hb_next(hb, l + 1, i + 1);
+		if (j < 0) {
+			return (-1);
+		}
+		i = j;
+	}
+	assert(w[i] != 0);
+	return ((i << 6) + __builtin_ctzll(w[i]));
+}
+
+int64_t hbitmap_next(hbitmap_t *hb, uint64_t start)
+{
+	if (start >= hb->nbits) {
+		return (-1);
+	}
+	return (hb_next(hb, 0, start));
+}
+
+void hbitmap_iter_init(hbitmap_iter_t *it, hbitmap_t *hb, uint64_t start)
+{
+	it->hb   = hb;
+	it->widx = start >> 6;
+	it->cur  = 0;
+	if (start < hb->nbits) {
+		it->cur = hb->level[0][it->widx] & HB_MASK_FROM(start);
+	}
+}
+
+int64_t hbitmap_iter_next(hbitmap_iter_t *it)
+{
+	hbitmap_t	*hb = it->hb;
+	int64_t		j;
+	int		b;
+
+	if (it->cur == 0) {
+		/* next non zero word, found in the summary levels */
+		if (hb->nlevels == 1) {
+			j = hb_find(hb->level[0], it->widx + 1, hb->nwords[0]);
+			if (j == hb->nwords[0]) {
+				return (-1);
+			}
+		} else {
+			j = hb_next(hb, 1, it->widx + 1);
+			if (j < 0) {
+				return (-1);
+			}
+		}
+		it->widx = j;
+		it->cur  = hb->level[0][j];
+	}
+
+	b        = __builtin_ctzll(it->cur);
+	it->cur &= it->cur - 1;
+	return ((it->widx << 6) + b);
+}
+
+#ifdef SOLOTEST_HBITMAP
+
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * Random range operations are checked against a plain bitmap, then all
+ * dirty blocks of a 1TB cache at 4K granularity are walked, once with the
+ * summary levels and once word by word.
+ *
+ *	cc -O2 -DSOLOTEST_HBITMAP -I../include hbitmap.c
+ */
+#define NBITS	(1000 * 64 + 17)
+#define NOPS	20000
+#define BIGBITS	((1ULL << 40) >> 12)
+#define NDIRTY	100000
+
+static uint64_t now_us(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000);
+}
+
+int main(int argc, char **argv)
+{
+	hbitmap_t	hb;
+	hbitmap_iter_t	it;
+	char		*ref;
+	uint64_t	s;
+	uint64_t	n;
+	uint64_t	i;
+	uint64_t	cnt;
+	uint64_t	t0;
+	int64_t		b;
+	int		rc;
+	int		k;
+
+	rc = hbitmap_init(&hb, NBITS);
+	assert(rc == 0);
+	ref = calloc(1, NBITS);
+	assert(ref != NULL);
+
+	for (k = 0; k < NOPS; k++) {
+		s = random() % NBITS;
+		n = random() % 3 == 0 ? random() % (NBITS - s + 1) :
+			random() % 200 % (NBITS - s + 1);
+		if (random() % 2) {
+			hbitmap_set_range(&hb, s, n);
+			memset(ref + s, 1, n);
+		} else {
+			hbitmap_clear_range(&hb, s, n);
+			memset(ref + s, 0, n);
+		}
+
+		s = random() % NBITS;
+		for (i = s; i < NBITS && !ref[i]; i++)
+			;
+		b = hbitmap_next(&hb, s);
+		assert(b == (i == NBITS ? -1 : (int64_t) i));
+
+		if (k % 1000 == 0) {
+			for (i = 0, cnt = 0; i < NBITS; i++) {
+				cnt += ref[i];
+				assert(hbitmap_get(&hb, i) == ref[i]);
+			}
+			assert(hbitmap_count(&hb) == cnt);
+			assert(hbitmap_count_range(&hb, 0, NBITS) == cnt);
+
+			hbitmap_iter_init(&it, &hb, 0);
+			for (i = 0; (b = hbitmap_iter_next(&it)) >= 0; i++) {
+				assert(ref[b]);
+			}
+			assert(i == cnt);
+		}
+	}
+	hbitmap_deinit(&hb);
+	free(ref);
+	printf("%d random ops: PASS\n", NOPS);
+
+	rc = hbitmap_init(&hb, BIGBITS);
+	assert(rc == 0);
+	for (k = 0; k < NDIRTY; k++) {
+		hbitmap_set(&hb, ((uint64_t) random() << 8 ^ random()) %
+				BIGBITS);
+	}
+
+	t0 = now_us();
+	hbitmap_iter_init(&it, &hb, 0);
+	for (cnt = 0; hbitmap_iter_next(&it) >= 0; cnt++)
+		;
+	printf("1TB/4K, %lu dirty: hbitmap walk %lu us, levels %d, avx2 %d\n",
+			cnt, now_us() - t0, hb.nlevels, hb_has_avx2());
+	assert(cnt == hbitmap_count(&hb));
+
+	t0 = now_us();
+	for (i = 0, n = 0; i < hb.nwords[0]; i++) {
+		for (s = hb.level[0][i]; s != 0; s &= s - 1) {
+			n++;
+		}
+	}
+	printf("1TB/4K, %lu dirty: word scan %lu us\n", n, now_us() - t0);
+	assert(n == cnt);
+
+	t0 = now_us();
+	cnt = hbitmap_count_range(&hb, 1, BIGBITS - 1);
+	printf("1TB/4K: count_range %lu us\n", now_us() - t0);
+
+	hbitmap_clear_range(&hb, 0, BIGBITS);
+	assert(hbitmap_count(&hb) == 0 && hbitmap_next(&hb, 0) == -1);
+	hbitmap_deinit(&hb);
+	printf("PASS\n");
+	return (0);
+}
+
+#endif /* SOLOTEST_HBITMAP */
@@ -0,0 +1,564 @@
+/*
+ * lbaindex.c
+ *	LBA index, see lbaindex.h
+ *
+ * The home bucket of a key is the top of its hash scaled to nslots, so
+ * keys are stored in hash order and doubling the table roughly doubles
+ * every home. There is no wraparound: LBAI_SLACK buckets past the last
+ * home take what is displaced off the end. A tag is the low 7 bits of the
+ * hash with the top bit set, 0 marks an empty bucket.
+ *
+ * A lookup scans the tags of [home, home + maxdist] for its tag, so it
+ * does not depend on Robin Hood order and holes left in a table being
+ * migrated are harmless. Only inserts keep the order, and they only go to
+ * the current table; removes shift the following run back by one.
+ *
+ * A migrated table goes on the retired list. The next modification moves
+ * the list to grace and bumps the epoch, lookups starting after that
+ * count themselves in the other epoch and cannot find those tables. The
+ * grace list is freed once the lookups of the old epoch drained, and only
+ * then is the epoch bumped again, so a resize never waits for readers.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "lbaindex.h"
+
+#define LBAI_SLACK	1024		/* overflow buckets */
+#define LBAI_MAXDIST	256		/* grow beyond this displacement */
+#define LBAI_MIGRATE	16		/* buckets moved per modification */
+#define LBAI_MINSLOTS	64
+
+static inline uint64_t lbai_hash(uint64_t k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return (k);
+}
+
+static inline uint64_t lbai_home(lbai_tab_t *t, uint64_t h)
+{
+	return (((unsigned __int128) h * t->nslots) >> 64);
+}
+
+static inline uint8_t lbai_tag(uint64_t h)
+{
+	return (0x80 | (h & 0x7f));
+}
+
+static lbai_tab_t *lbai_alloc(uint64_t nslots)
+{
+	lbai_tab_t	*t;
+
+	t = calloc(1, sizeof(*t));
+	if (t == NULL) {
+		return (NULL);
+	}
+	t->nslots = nslots;
+	t->nalloc = nslots + LBAI_SLACK;
+	/* 16 more tags, a scan may load past the last bucket */
+	t->tag = calloc(t->nalloc + 16, 1);
+	t->b   = malloc(t->nalloc * sizeof(*t->b));
+	if (t->tag == NULL || t->b == NULL) {
+		free(t->tag);
+		free(t->b);
+		free(t);
+		return (NULL);
+	}
+	return (t);
+}
+
+static void lbai_free(lbai_tab_t *t)
+{
+	lbai_tab_t	*n;
+
+	for (; t != NULL; t = n) {
+		n = t->next;
+		free(t->tag);
+		free(t->b);
+		free(t);
+	}
+}
+
+/* bucket of key in t or -1 */
+static int64_t lbai_find(lbai_tab_t *t, uint64_t key, uint64_t h)
+{
+	uint64_t	p = lbai_home(t, h);
+	uint64_t	end = p + t->maxdist + 1;
+	uint8_t		tag = lbai_tag(h);
+#ifdef __SSE2__
+	__m128i		tv = _mm_set1_epi8(tag);
+	uint32_t	m;
+
+	if (end > t->nalloc) {
+		end = t->nalloc;
+	}
+	for (; p < end; p += 16) {
+		m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(
+				(const __m128i *) (t->tag + p)), tv));
+		if (end - p < 16) {
+			m &= (1u << (end - p)) - 1;
+		}
+		while (m != 0) {
+			if (t->b[p + __builtin_ctz(m)].key == key) {
+				return (p + __builtin_ctz(m));
+			}
+			m &= m - 1;
+		}
+	}
+#else
+	if (end > t->nalloc) {
+		end = t->nalloc;
+	}
+	for (; p < end; p++) {
+		if (t->tag[p] == tag && t->b[p].key == key) {
+			return (p);
+		}
+	}
+#endif
+	return (-1);
+}
+
+/* add a key not in t, taking buckets from the less displaced */
+static void lbai_put(lbai_tab_t *t, uint64_t key, uint32_t val, uint64_t h)
+{
+	struct lbai_bucket	e;
+	struct lbai_bucket	x;
+	uint64_t		p = lbai_home(t, h);
+	uint8_t			tag = lbai_tag(h);
+	uint8_t			xt;
+
+	e.key  = key;
+	e.val  = val;
+	e.dist = 0;
+	e.pad  = 0;
+	for (;; p++, e.dist++) {
+		assert(p < t->nalloc);
+		if (t->tag[p] == 0 || t->b[p].dist < e.dist) {
+			if (e.dist > t->maxdist) {
+				t->maxdist = e.dist;
+			}
+			if (t->tag[p] == 0) {
+				t->b[p]   = e;
+				t->tag[p] = tag;
+				t->count++;
+				return;
+			}
+			x  = t->b[p];
+			xt = t->tag[p];
+			t->b[p]   = e;
+			t->tag[p] = tag;
+			e   = x;
+			tag = xt;
+		}
+	}
+}
+
+/* remove bucket p, pulling the displaced run after it back */
+static void lbai_del(lbai_tab_t *t, uint64_t p)
+{
+	uint64_t	q;
+
+	for (q = p + 1; q < t->nalloc && t->tag[q] != 0 && t->b[q].dist != 0;
+			p = q++) {
+		t->b[p] = t->b[q];
+		t->b[p].dist--;
+		t->tag[p] = t->tag[q];
+	}
+	t->tag[p] = 0;
+	t->count--;
+}
+
+static inline void lbai_write_begin(lbaindex_t *ix)
+{
+	__atomic_store_n(&ix->seq, ix->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void lbai_write_end(lbaindex_t *ix)
+{
+	__atomic_store_n(&ix->seq, ix->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* free migrated tables no lookup can still read, never waits */
+static void lbai_reap(lbaindex_t *ix)
+{
+	uint64_t	e = ix->epoch;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (ix->grace != NULL && __atomic_load_n(&ix->nreaders[(e - 1) & 1],
+			__ATOMIC_SEQ_CST) == 0) {
+		lbai_free(ix->grace);
+		ix->grace = NULL;
+	}
+	if (ix->grace == NULL && ix->retired != NULL) {
+		ix->grace   = ix->retired;
+		ix->retired = NULL;
+		__atomic_store_n(&ix->epoch, e + 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&ix->nreaders[e & 1],
+				__ATOMIC_SEQ_CST) == 0) {
+			lbai_free(ix->grace);
+			ix->grace = NULL;
+		}
+	}
+}
+
+/* move up to n buckets of the old table */
+static void lbai_migrate(lbaindex_t *ix, uint64_t n)
+{
+	lbai_tab_t	*o = ix->old;
+	struct lbai_bucket *b;
+
+	for (; n > 0 && ix->mpos < o->nalloc; ix->mpos++) {
+		if (o->tag[ix->mpos] == 0) {
+			continue;
+		}
+		b = &o->b[ix->mpos];
+		lbai_put(ix->cur, b->key, b->val, lbai_hash(b->key));
+		o->tag[ix->mpos] = 0;
+		o->count--;
+		n--;
+	}
+	if (ix->mpos == o->nalloc) {
+		assert(o->count == 0);
+		__atomic_store_n(&ix->old, NULL, __ATOMIC_RELEASE);
+		o->next     = ix->retired;
+		ix->retired = o;
+		lbai_reap(ix);
+	}
+}
+
+static int lbai_grow(lbaindex_t *ix)
+{
+	lbai_tab_t	*t;
+
+	while (ix->old != NULL) {
+		lbai_migrate(ix, ~0ULL);
+	}
+	t = lbai_alloc(ix->cur->nslots * 2);
+	if (t == NULL) {
+		return (-1);
+	}
+	ix->mpos = 0;
+	__atomic_store_n(&ix->old, ix->cur, __ATOMIC_RELEASE);
+	__atomic_store_n(&ix->cur, t, __ATOMIC_RELEASE);
+	ix->nresize++;
+	return (0);
+}
+
+int lbaindex_init(lbaindex_t *ix, uint64_t nexpected)
+{
+	uint64_t	nslots = nexpected + nexpected / 7 + 1;
+
+	memset(ix, 0, sizeof(*ix));
+	ix->cur = lbai_alloc(nslots < LBAI_MINSLOTS ? LBAI_MINSLOTS : nslots);
+	return (ix->cur == NULL ? -1 : 0);
+}
+
+void lbaindex_deinit(lbaindex_t *ix)
+{
+	assert(ix->nreaders[0] == 0 && ix->nreaders[1] == 0);
+	lbai_free(ix->cur);
+	lbai_free(ix->old);
+	lbai_free(ix->retired);
+	lbai_free(ix->grace);
+	memset(ix, 0, sizeof(*ix));
+}
+
+int lbaindex_insert(lbaindex_t *ix, uint64_t key, uint32_t val)
+{
+	lbai_tab_t	*t;
+	uint64_t	h = lbai_hash(key);
+	int64_t		p;
+	int		rc = 0;
+
+	lbai_write_begin(ix);
+	if (ix->old != NULL) {
+		lbai_migrate(ix, LBAI_MIGRATE);
+	} else if (ix->retired != NULL || ix->grace != NULL) {
+		lbai_reap(ix);
+	}
+
+	t = ix->cur;
+	p = lbai_find(t, key, h);
+	if (p >= 0) {
+		t->b[p].val = val;
+		goto out;
+	}
+	if (ix->old != NULL && (p = lbai_find(ix->old, key, h)) >= 0) {
+		ix->old->tag[p] = 0;
+		ix->old->count--;
+	}
+
+	/* the overflow buckets keep room for a failed grow */
+	if ((t->count >= t->nslots - t->nslots / 8 ||
+			t->maxdist > LBAI_MAXDIST) && lbai_grow(ix) != 0 &&
+			t->count + LBAI_SLACK / 2 >= t->nalloc) {
+		rc = -1;
+		goto out;
+	}
+	lbai_put(ix->cur, key, val, h);
+out:
+	lbai_write_end(ix);
+	return (rc);
+}
+
+int lbaindex_remove(lbaindex_t *ix, uint64_t key)
+{
+	uint64_t	h = lbai_hash(key);
+	int64_t		p;
+	int		rc = 0;
+
+	lbai_write_begin(ix);
+	if (ix->old != NULL) {
+		lbai_migrate(ix, LBAI_MIGRATE);
+	} else if (ix->retired != NULL || ix->grace != NULL) {
+		lbai_reap(ix);
+	}
+	if ((p = lbai_find(ix->cur, key, h)) >= 0) {
+		lbai_del(ix->cur, p);
+	} else if (ix->old != NULL && (p = lbai_find(ix->old, key, h)) >= 0) {
+		/* no shift, nothing is inserted into the old table */
+		ix->old->tag[p] = 0;
+		ix->old->count--;
+	} else {
+		rc = -1;
+	}
+	lbai_write_end(ix);
+	return (rc);
+}
+
+int lbaindex_get(lbaindex_t *ix, uint64_t key, uint32_t *val)
+{
+	uint64_t	h = lbai_hash(key);
+	int64_t		p;
+
+	if ((p = lbai_find(ix->cur, key, h)) >= 0) {
+		*val = ix->cur->b[p].val;
+		return (0);
+	}
+	if (ix->old != NULL && (p = lbai_find(ix->old, key, h)) >= 0) {
+		*val = ix->old->b[p].val;
+		return (0);
+	}
+	return (-1);
+}
+
+int lbaindex_lookup(lbaindex_t *ix, uint64_t key, uint32_t *val)
+{
+	lbai_tab_t	*t;
+	uint64_t	h = lbai_hash(key);
+	uint64_t	s;
+	uint64_t	e;
+	uint32_t	v = 0;
+	int64_t		p;
+	int		rc;
+
+	/* counted in the epoch current once counted, see lbai_reap */
+	for (;;) {
+		e = __atomic_load_n(&ix->epoch, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&ix->nreaders[e & 1], 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&ix->epoch, __ATOMIC_SEQ_CST) == e) {
+			break;
+		}
+		__atomic_sub_fetch(&ix->nreaders[e & 1], 1, __ATOMIC_SEQ_CST);
+	}
+	for (;;) {
+		s = __atomic_load_n(&ix->seq, __ATOMIC_ACQUIRE);
+		if (s & 1) {
+			__builtin_ia32_pause();
+			continue;
+		}
+		rc = -1;
+		t  = __atomic_load_n(&ix->cur, __ATOMIC_ACQUIRE);
+		if ((p = lbai_find(t, key, h)) >= 0) {
+			v  = t->b[p].val;
+			rc = 0;
+		} else if ((t = __atomic_load_n(&ix->old, __ATOMIC_ACQUIRE)) !=
+				NULL && (p = lbai_find(t, key, h)) >= 0) {
+			v  = t->b[p].val;
+			rc = 0;
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&ix->seq, __ATOMIC_RELAXED) == s) {
+			break;
+		}
+	}
+	__atomic_sub_fetch(&ix->nreaders[e & 1], 1, __ATOMIC_SEQ_CST);
+
+	if (rc == 0) {
+		*val = v;
+	}
+	return (rc);
+}
+
+uint64_t lbaindex_bytes(lbaindex_t *ix)
+{
+	uint64_t	n = sizeof(*ix);
+	lbai_tab_t	*t[4] = { ix->cur, ix->old, ix->retired, ix->grace };
+	lbai_tab_t	*l;
+	int		i;
+
+	for (i = 0; i < 4; i++) {
+		for (l = t[i]; l != NULL; l = l->next) {
+			n += sizeof(*l) + l->nalloc *
+					(sizeof(struct lbai_bucket) + 1) + 16;
+		}
+	}
+	return (n);
+}
+
+#ifdef SOLOTEST_LBAINDEX
+
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+/*
+ * Random inserts, updates and removes on an index started tiny, so it
+ * resizes many times, are checked against a plain array while a second
+ * thread looks up keys that never change. Then NKEYS random LBAs go into
+ * an index sized for them, for memory per key and lookup speed.
+ *
+ *	cc -O2 -DSOLOTEST_LBAINDEX -I../include lbaindex.c -lpthread
+ */
+#define NREF	200000
+#define NOPS	3000000
+#define NSTABLE	10000
+#define STABLE	(1ULL << 40)	/* keys of the reader thread */
+#define NKEYS	(10 * 1000 * 1000)
+
+static lbaindex_t	ix;
+static volatile int	stop;
+
+static uint64_t now_ns(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static void *solo_reader(void *arg)
+{
+	uint64_t	n = 0;
+	uint64_t	k;
+	uint32_t	v;
+	int		rc;
+
+	while (!stop) {
+		k = n++ % NSTABLE;
+		rc = lbaindex_lookup(&ix, STABLE + k, &v);
+		assert(rc == 0 && v == k * 3);
+	}
+	*(uint64_t *) arg = n;
+	return (NULL);
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t	*ref;
+	uint64_t	*keys;
+	uint64_t	nkeys = argc > 1 ? atoll(argv[1]) : NKEYS;
+	uint64_t	nread;
+	uint64_t	k;
+	uint64_t	i;
+	uint64_t	t0;
+	uint32_t	v;
+	pthread_t	th;
+	int		rc;
+
+	/* churn against a reference, stable keys read concurrently */
+	rc = lbaindex_init(&ix, 0);
+	assert(rc == 0);
+	for (k = 0; k < NSTABLE; k++) {
+		rc = lbaindex_insert(&ix, STABLE + k, k * 3);
+		assert(rc == 0);
+	}
+	ref = malloc(NREF * sizeof(*ref));
+	assert(ref != NULL);
+	memset(ref, 0xff, NREF * sizeof(*ref));
+	pthread_create(&th, NULL, solo_reader, &nread);
+
+	srandom(1);
+	for (i = 0; i < NOPS; i++) {
+		k = random() % NREF;
+		if (random() % 3 == 0) {
+			rc = lbaindex_remove(&ix, k);
+			assert((rc == 0) == (ref[k] != ~0U));
+			ref[k] = ~0U;
+		} else {
+			v = random() & 0x7fffffff;
+			rc = lbaindex_insert(&ix, k, v);
+			assert(rc == 0);
+			ref[k] = v;
+		}
+		if (i % 100000 == 0) {
+			sched_yield();
+		}
+	}
+	stop = 1;
+	pthread_join(th, NULL);
+	for (k = 0; k < NREF; k++) {
+		rc = lbaindex_get(&ix, k, &v);
+		assert(ref[k] == ~0U ? rc != 0 : rc == 0 && v == ref[k]);
+	}
+	printf("%d ops, %lu resizes, %lu keys, %lu concurrent lookups\n",
+			NOPS, ix.nresize, lbaindex_count(&ix), nread);
+	lbaindex_deinit(&ix);
+	free(ref);
+
+	/* sized index, random LBAs */
+	keys = malloc(nkeys * sizeof(*keys));
+	assert(keys != NULL);
+	for (i = 0; i < nkeys; i++) {
+		keys[i] = ((uint64_t) random() << 31 | random()) & ~7ULL;
+	}
+	rc = lbaindex_init(&ix, nkeys);
+	assert(rc == 0);
+	t0 = now_ns();
+	for (i = 0; i < nkeys; i++) {
+		rc = lbaindex_insert(&ix, keys[i], i);
+		assert(rc == 0);
+	}
+	printf("%lu inserts: %.1f ns each, %.2f bytes/key, maxdist %u\n",
+			nkeys, (double) (now_ns() - t0) / nkeys,
+			(double) lbaindex_bytes(&ix) / lbaindex_count(&ix),
+			ix.cur->maxdist);
+
+	t0 = now_ns();
+	for (i = 0; i < nkeys; i++) {
+		k = keys[(i * 7919) % nkeys];
+		rc = lbaindex_get(&ix, k, &v);
+		assert(rc == 0);
+	}
+	printf("hits: %.1f ns each\n", (double) (now_ns() - t0) / nkeys);
+	t0 = now_ns();
+	for (i = 0; i < nkeys; i++) {
+		rc = lbaindex_get(&ix, keys[i] | 1, &v);
+		assert(rc != 0);
+	}
+	printf("misses: %.1f ns each\n", (double) (now_ns() - t0) / nkeys);
+	t0 = now_ns();
+	for (i = 0; i < nkeys; i++) {
+		rc = lbaindex_lookup(&ix, keys[(i * 7919) % nkeys], &v);
+		assert(rc == 0);
+	}
+	printf("hits, any thread: %.1f ns each\n",
+			(double) (now_ns() - t0) / nkeys);
+
+	lbaindex_deinit(&ix);
+	free(keys);
+	printf("PASS\n");
+	return (0);
+}
+
+#endif /* SOLOTEST_LBAINDEX */
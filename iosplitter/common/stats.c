@@ -1,14 +1,147 @@
 #include "stats.h"
 #include <time.h>
 #include <assert.h>
-#include "../qemu-queue.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
 #include "dll.h"
-#include "except.h"
+
+#define STAT_ADD(p, n)	__atomic_fetch_add((p), (n), __ATOMIC_RELAXED)
+#define STAT_LOAD(p)	__atomic_load_n((p), __ATOMIC_RELAXED)
+
+/*
+ * shard fields by type
+ *	QUEUE:		v[0] issued, v[1] done
+ *	COUNTER:	v[0] starts, v[1] sum of counts
+ *	RATIO:		v[0] hits, v[1] total
+ *	LATENCY, PROFILER: the histogram
+ */
+static __thread int	stat_shard_id = -1;
+static int		stat_nthreads;
+
+/* every statinfo_t and exported uint64_t of the process */
+static pthread_mutex_t	stat_reg_lock = PTHREAD_MUTEX_INITIALIZER;
+static dll_t		stat_reg = { &stat_reg, &stat_reg };
+
+struct stat_u64 {
+	dll_t			reg;
+	char			*name;
+	const volatile uint64_t	*p;
+};
+static dll_t		stat_u64s = { &stat_u64s, &stat_u64s };
+
+static int		stat_tsc = -1;		/* ticks are TSC cycles */
+static double		stat_ns_per_tick;
+static pthread_once_t	stat_once = PTHREAD_ONCE_INIT;
+
+static uint64_t stat_mono_ns(void)
+{
+	struct timespec	ts;
+	int		rc;
+
+	rc = clock_gettime(CLOCK_MONOTONIC, &ts);
+	assert(rc == 0);
+	return (ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/*
+ * use the TSC if the CPU says it runs at a constant rate in all states,
+ * calibrated against CLOCK_MONOTONIC over 10ms
+ */
+static void stat_tsc_init(void)
+{
+	int		tsc = 0;
+#if defined(__x86_64__) || defined(__i386__)
+	struct timespec	d = { 0, 10000000 };
+	unsigned int	eax, ebx, ecx, edx;
+	uint64_t	n0, n1, t0, t1;
+
+	if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) &&
+	    (edx & (1 << 8)) != 0) {
+		n0 = stat_mono_ns();
+		t0 = __rdtsc();
+		nanosleep(&d, NULL);
+		n1 = stat_mono_ns();
+		t1 = __rdtsc();
+		if (t1 > t0) {
+			stat_ns_per_tick = (double) (n1 - n0) / (t1 - t0);
+			tsc = 1;
+		}
+	}
+#endif
+	__atomic_store_n(&stat_tsc, tsc, __ATOMIC_RELEASE);
+}
+
+uint64_t stat_ticks(void)
+{
+	if (__atomic_load_n(&stat_tsc, __ATOMIC_ACQUIRE) < 0) {
+		pthread_once(&stat_once, stat_tsc_init);
+	}
+#if defined(__x86_64__) || defined(__i386__)
+	if (stat_tsc) {
+		return (__rdtsc());
+	}
+#endif
+	return (stat_mono_ns());
+}
+
+uint64_t stat_ticks_ns(uint64_t ticks)
+{
+	return (stat_tsc > 0 ? (uint64_t) (ticks * stat_ns_per_tick) : ticks);
+}
+
+static int stat_has_hist(statinfo_t *s)
+{
+	return (s->type == LATENCY || s->type == PROFILER);
+}
+
+static struct stat_shard *stat_shard_alloc(statinfo_t *s, int id)
+{
+	struct stat_shard	*sh, *cur = NULL;
+	size_t			sz = sizeof(*sh);
+	int			rc;
+
+	if (stat_has_hist(s)) {
+		sz += STAT_LAT_NBUCKETS * sizeof(sh->lat_buckets[0]);
+	}
+	rc = posix_memalign((void **) &sh, 64, sz);
+	assert(rc == 0);
+	memset(sh, 0, sz);
+	if (!__atomic_compare_exchange_n(&s->shards[id], &cur, sh, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		free(sh);
+		sh = cur;
+	}
+	return (sh);
+}
+
+/* shard of the calling thread */
+static inline struct stat_shard *stat_shard(statinfo_t *s)
+{
+	struct stat_shard	*sh;
+	int			id = stat_shard_id;
+
+	if (id < 0) {
+		id = STAT_ADD(&stat_nthreads, 1) % STAT_NSHARDS;
+		stat_shard_id = id;
+	}
+	sh = __atomic_load_n(&s->shards[id], __ATOMIC_ACQUIRE);
+	if (sh == NULL) {
+		sh = stat_shard_alloc(s, id);
+	}
+	return (sh);
+}
 
 void init_stats(stats_t *stats)
 {
@@ -17,12 +150,12 @@ void init_stats(stats_t *stats)
 	memset(stats, 0, sizeof(*stats));
 	DLL_INIT(&stats->statlist);
 	rc = time(&stats->wall_clock);
-	ASSERT_SIGN(rc, !=, -1);
+	assert(rc != -1);
 }
 
 void deinit_stats(stats_t *stats)
 {
-	ASSERT_SIGN(DLL_ISEMPTY(&stats->statlist), !=, 0);
+	assert(DLL_ISEMPTY(&stats->statlist));
 }
 
 statinfo_t *stat_create(stats_t *stats, const char *name, stat_type_t type)
@@ -31,15 +164,17 @@ statinfo_t *stat_create(stats_t *stats, const char *name, stat_type_t type)
 	int        rc;
 
 	s = calloc(1, sizeof(*s));
-	ASSERT_PTR(s, !=, NULL);
+	assert(s != NULL);
 
 	switch (type) {
 	case COUNTER:
 		rc = time(&s->last_move);
-		ASSERT_SIGN(rc, !=, -1);
+		assert(rc != -1);
 		break;
 	case QUEUE:
 	case PROFILER:
+	case LATENCY:
+	case RATIO:
 		break;
 	default:
 		assert(0);
@@ -50,19 +185,111 @@ statinfo_t *stat_create(stats_t *stats, const char *name, stat_type_t type)
 	DLL_INIT(&s->nxt);
 
 	DLL_ADD(&stats->statlist, &s->nxt);
+
+	pthread_mutex_lock(&stat_reg_lock);
+	DLL_REVADD(&stat_reg, &s->reg);
+	pthread_mutex_unlock(&stat_reg_lock);
 	return s;
 }
 
 void stat_delete(statinfo_t *s)
 {
+	int	i;
+
+	pthread_mutex_lock(&stat_reg_lock);
+	DLL_REM(&s->reg);
+	pthread_mutex_unlock(&stat_reg_lock);
+
+	for (i = 0; i < STAT_NSHARDS; i++) {
+		free(s->shards[i]);
+	}
 	DLL_REM(&s->nxt);
 	free(s->name);
 	free(s);
 }
 
+/*
+ * sum the shards into e; lat_count is the sum of the buckets so that
+ * percentiles stay within the histogram while updates go on
+ */
+static void stat_sum(statinfo_t *s, struct statshm_ent *e)
+{
+	struct stat_shard	*sh;
+	uint64_t		n, max;
+	int			hist = stat_has_hist(s);
+	int			i, b;
+
+	e->type = s->type;
+	e->v[0] = e->v[1] = 0;
+	e->lat_count = e->lat_max = e->lat_total = 0;
+	if (hist) {
+		memset(e->lat_buckets, 0, sizeof(e->lat_buckets));
+	}
+	for (i = 0; i < STAT_NSHARDS; i++) {
+		sh = __atomic_load_n(&s->shards[i], __ATOMIC_ACQUIRE);
+		if (sh == NULL) {
+			continue;
+		}
+		e->v[0] += STAT_LOAD(&sh->v[0]);
+		e->v[1] += STAT_LOAD(&sh->v[1]);
+		if (!hist) {
+			continue;
+		}
+		for (b = 0; b < STAT_LAT_NBUCKETS; b++) {
+			n = STAT_LOAD(&sh->lat_buckets[b]);
+			e->lat_buckets[b] += n;
+			e->lat_count += n;
+		}
+		e->lat_total += STAT_LOAD(&sh->lat_total);
+		if ((max = STAT_LOAD(&sh->lat_max)) > e->lat_max) {
+			e->lat_max = max;
+		}
+	}
+}
+
+/*
+ * sum the shards into the fields of s
+ */
+static void stat_merge(statinfo_t *s)
+{
+	struct statshm_ent	e;
+
+	stat_sum(s, &e);
+	if (stat_has_hist(s)) {
+		memcpy(s->lat_buckets, e.lat_buckets, sizeof(s->lat_buckets));
+		s->lat_count = e.lat_count;
+		s->lat_max = e.lat_max;
+	}
+
+	switch (s->type) {
+	case QUEUE:
+		s->qd_running = e.v[0] - e.v[1];
+		break;
+	case COUNTER:
+		s->c_starts = e.v[0];
+		s->c_running = e.v[1];
+		s->c_avg = e.v[0] ? e.v[1] / e.v[0] : 0;
+		break;
+	case PROFILER:
+		s->count = e.lat_count;
+		s->total_ns = e.lat_total;
+		break;
+	case RATIO:
+		s->r_hits = e.v[0];
+		s->r_total = e.v[1];
+		break;
+	case LATENCY:
+		break;
+	default:
+		assert(0);
+	}
+}
+
+static uint64_t lat_pct(statinfo_t *s, double pct);
+
 static void stat_print(statinfo_t *s)
 {
-	char b[128] = {0};
+	char b[256] = {0};
 
 	switch (s->type) {
 	case QUEUE:
@@ -74,8 +301,24 @@ static void stat_print(statinfo_t *s)
 				s->name, s->c_avg, s->c_starts);
 		break;
 	case PROFILER:
-		snprintf(b, sizeof(b), "### profiler %s avg %f starts %"PRIu64"",
-				s->name, s->avg_ns, s->count);
+		snprintf(b, sizeof(b), "### profiler %s avg %f starts %"PRIu64
+				" ns p50 %"PRIu64" p99 %"PRIu64" p99.9 %"PRIu64
+				" max %"PRIu64"", s->name, s->avg_ns, s->count,
+				lat_pct(s, 50), lat_pct(s, 99), lat_pct(s, 99.9),
+				s->lat_max);
+		break;
+	case LATENCY:
+		snprintf(b, sizeof(b), "@@@ latency %s count %"PRIu64" ns p50 %"
+				PRIu64" p90 %"PRIu64" p99 %"PRIu64" p99.9 %"
+				PRIu64" max %"PRIu64"", s->name, s->lat_count,
+				lat_pct(s, 50), lat_pct(s, 90),
+				lat_pct(s, 99), lat_pct(s, 99.9),
+				s->lat_max);
+		break;
+	case RATIO:
+		snprintf(b, sizeof(b), "%%%%%% ratio %s %.2f%% of %"PRIu64"",
+				s->name, s->r_total ? 100.0 * s->r_hits /
+				s->r_total : 0.0, s->r_total);
 		break;
 	default:
 		assert(0);
@@ -128,6 +371,7 @@ static void update_profiler(stats_t *stats, statinfo_t *s)
 
 static void update(stats_t *stats, statinfo_t *s)
 {
+	stat_merge(s);
 	switch (s->type) {
 	case QUEUE:
 		update_queue(stats, s);
@@ -138,6 +382,9 @@ static void update(stats_t *stats, statinfo_t *s)
 	case PROFILER:
 		update_profiler(stats, s);
 		break;
+	case LATENCY:
+	case RATIO:
+		break;
 	default:
 		assert(0);
 	}
@@ -168,53 +415,386 @@ void stats_update_all(stats_t *stats)
 	}
 }
 
+/* SHARED MEMORY EXPORT */
+static struct statshm_hdr	*stat_shm;
+static size_t			stat_shmsize;
+static char			stat_shmname[64];
+static pthread_t		stat_shmthread;
+static int			stat_shmstop;
+static int			stat_shmms;
+
+/*
+ * bare counters updated elsewhere, published with the statistics.
+ * p must stay valid for the life of the process. Threads exporting their
+ * own __thread counter under one name are published as the sum, such a
+ * thread must not exit.
+ */
+void stat_export_u64(const char *name, const volatile uint64_t *p)
+{
+	struct stat_u64	*u;
+
+	u = calloc(1, sizeof(*u));
+	assert(u != NULL);
+	u->name = strdup(name);
+	u->p = p;
+	pthread_mutex_lock(&stat_reg_lock);
+	DLL_REVADD(&stat_u64s, &u->reg);
+	pthread_mutex_unlock(&stat_reg_lock);
+}
+
+static struct statshm_ent *stat_shm_ent(const char *name, uint32_t type)
+{
+	struct statshm_hdr	*h = stat_shm;
+	struct statshm_ent	*e;
+
+	if (h->nents == h->maxents) {
+		h->ndropped++;
+		return (NULL);
+	}
+	e = &h->e[h->nents++];
+	strncpy(e->name, name, sizeof(e->name) - 1);
+	e->name[sizeof(e->name) - 1] = '\0';
+	e->type = type;
+	return (e);
+}
+
+void stats_shm_publish(void)
+{
+	struct statshm_hdr	*h = stat_shm;
+	struct statshm_ent	*e;
+	struct stat_u64		*u;
+	statinfo_t		*s;
+	dll_t			*f;
+	uint32_t		first, i;
+
+	if (h == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&stat_reg_lock);
+	__atomic_store_n(&h->seq, h->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	h->nents = 0;
+	h->ndropped = 0;
+	for (f = DLL_NEXT(&stat_reg); f != &stat_reg; f = DLL_NEXT(f)) {
+		s = container_of(f, statinfo_t, reg);
+		if ((e = stat_shm_ent(s->name, s->type)) != NULL) {
+			stat_sum(s, e);
+		}
+	}
+	first = h->nents;
+	for (f = DLL_NEXT(&stat_u64s); f != &stat_u64s; f = DLL_NEXT(f)) {
+		u = container_of(f, struct stat_u64, reg);
+		for (i = first; i < h->nents; i++) {
+			if (strncmp(h->e[i].name, u->name,
+					sizeof(h->e[i].name) - 1) == 0) {
+				break;
+			}
+		}
+		if (i < h->nents) {
+			h->e[i].v[0] += *u->p;
+		} else if ((e = stat_shm_ent(u->name, STATSHM_U64)) != NULL) {
+			e->v[0] = *u->p;
+			e->v[1] = e->lat_count = e->lat_max = e->lat_total = 0;
+		}
+	}
+	h->stamp_ns = stat_mono_ns();
+	h->npublish++;
+
+	__atomic_store_n(&h->seq, h->seq + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&stat_reg_lock);
+}
+
+static void *stat_shm_thread(void *arg)
+{
+	struct timespec	d;
+
+	d.tv_sec = stat_shmms / 1000;
+	d.tv_nsec = (stat_shmms % 1000) * 1000000L;
+	while (!__atomic_load_n(&stat_shmstop, __ATOMIC_ACQUIRE)) {
+		stats_shm_publish();
+		nanosleep(&d, NULL);
+	}
+	return (NULL);
+}
+
+/*
+ * name NULL for /cbstat.<pid>; returns 0 or an errno
+ */
+int stats_shm_start(const char *name, int interval_ms)
+{
+	struct statshm_hdr	*h;
+	size_t			size;
+	int			fd, rc;
+
+	assert(stat_shm == NULL && interval_ms > 0);
+	if (name == NULL) {
+		snprintf(stat_shmname, sizeof(stat_shmname), "/cbstat.%d",
+				(int) getpid());
+	} else {
+		snprintf(stat_shmname, sizeof(stat_shmname), "%s", name);
+	}
+	size = sizeof(*h) + STATSHM_MAXSTATS * sizeof(struct statshm_ent);
+	fd = shm_open(stat_shmname, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		return (errno);
+	}
+	if (ftruncate(fd, size) != 0) {
+		rc = errno;
+		close(fd);
+		shm_unlink(stat_shmname);
+		return (rc);
+	}
+	h = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (h == MAP_FAILED) {
+		rc = errno;
+		shm_unlink(stat_shmname);
+		return (rc);
+	}
+	h->hdrsize = sizeof(*h);
+	h->entsize = sizeof(struct statshm_ent);
+	h->maxents = STATSHM_MAXSTATS;
+	h->pid = getpid();
+	h->version = STATSHM_VERSION;
+	__atomic_store_n(&h->magic, STATSHM_MAGIC, __ATOMIC_RELEASE);
+	stat_shm = h;
+	stat_shmsize = size;
+	stat_shmms = interval_ms;
+	stat_shmstop = 0;
+	rc = pthread_create(&stat_shmthread, NULL, stat_shm_thread, NULL);
+	if (rc != 0) {
+		stat_shmms = 0;
+		stats_shm_stop();
+	}
+	return (rc);
+}
+
+void stats_shm_stop(void)
+{
+	if (stat_shm == NULL) {
+		return;
+	}
+	if (stat_shmms > 0) {
+		__atomic_store_n(&stat_shmstop, 1, __ATOMIC_RELEASE);
+		pthread_join(stat_shmthread, NULL);
+		stat_shmms = 0;
+	}
+	munmap(stat_shm, stat_shmsize);
+	shm_unlink(stat_shmname);
+	stat_shm = NULL;
+}
+
 /* QUEUE */
 void stat_qd_issue(statinfo_t *s)
 {
 	assert(s->type == QUEUE);
-	s->qd_running++;
+	STAT_ADD(&stat_shard(s)->v[0], 1);
 }
 
 void stat_qd_done(statinfo_t *s)
 {
 	assert(s->type == QUEUE);
-	assert(s->qd_running > 0);
-	s->qd_running--;
+	STAT_ADD(&stat_shard(s)->v[1], 1);
 }
 
 /* COUNTER */
 void stat_counter_incr(statinfo_t *s, int count)
 {
-	s->c_starts++;
-	s->c_running += count;
-	s->c_avg = s->c_running / s->c_starts;
+	struct stat_shard	*sh = stat_shard(s);
+
+	STAT_ADD(&sh->v[0], 1);
+	STAT_ADD(&sh->v[1], count);
+}
+
+/* LATENCY */
+static void lat_add(struct stat_shard *sh, uint64_t ns)
+{
+	uint64_t	max = STAT_LOAD(&sh->lat_max);
+
+	STAT_ADD(&sh->lat_buckets[stat_lat_bucket(ns)], 1);
+	STAT_ADD(&sh->lat_count, 1);
+	STAT_ADD(&sh->lat_total, ns);
+	while (ns > max && !__atomic_compare_exchange_n(&sh->lat_max, &max,
+			ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+void stat_latency_add(statinfo_t *s, uint64_t ns)
+{
+	assert(s->type == LATENCY);
+	lat_add(stat_shard(s), ns);
+}
+
+/* percentile of the histogram as last merged */
+static uint64_t lat_pct(statinfo_t *s, double pct)
+{
+	uint64_t	want;
+	uint64_t	seen;
+	int		b;
+
+	if (s->lat_count == 0) {
+		return (0);
+	}
+
+	want = (uint64_t) (s->lat_count * pct / 100.0);
+	if (want == 0) {
+		want = 1;
+	}
+	for (seen = 0, b = 0; b < STAT_LAT_NBUCKETS; b++) {
+		seen += s->lat_buckets[b];
+		if (seen >= want) {
+			break;
+		}
+	}
+	return (stat_lat_bucket_max(b) < s->lat_max ? stat_lat_bucket_max(b) : s->lat_max);
+}
+
+uint64_t stat_latency_pct(statinfo_t *s, double pct)
+{
+	assert(stat_has_hist(s));
+	stat_merge(s);
+	return (lat_pct(s, pct));
 }
 
 /* PROFILER */
-void stat_prof_enter(statinfo_t *s)
+stat_prof_t stat_prof_enter(statinfo_t *s)
 {
-	uint64_t        sec_to_nsec = 1000000000;
-	int             rc;
-	struct timespec ts;
+	assert(s->type == PROFILER);
+	return (stat_ticks());
+}
 
-	rc = clock_gettime(CLOCK_MONOTONIC, &ts);
-	assert(rc == 0);
+void stat_prof_exit(statinfo_t *s, stat_prof_t h)
+{
+	lat_add(stat_shard(s), stat_ticks_ns(stat_ticks() - h));
+}
+
+/* RATIO */
+void stat_ratio_add(statinfo_t *s, int hit)
+{
+	struct stat_shard	*sh = stat_shard(s);
 
-	s->s_ns = ts.tv_sec * sec_to_nsec + ts.tv_nsec;
-	s->count++;
+	assert(s->type == RATIO);
+	STAT_ADD(&sh->v[1], 1);
+	if (hit) {
+		STAT_ADD(&sh->v[0], 1);
+	}
 }
 
-void stat_prof_exit(statinfo_t *s)
+double stat_ratio(statinfo_t *s)
 {
-	uint64_t        sec_to_nsec = 1000000000;
-	int             rc;
-	struct timespec ts;
-	uint64_t        e_ns;
+	assert(s->type == RATIO);
+	stat_merge(s);
+	return (s->r_total ? (double) s->r_hits / s->r_total : 0.0);
+}
 
-	rc = clock_gettime(CLOCK_MONOTONIC, &ts);
-	assert(rc == 0);
+#ifdef SOLOTEST_STATS
+/*
+ * threads updating shared statistics, totals after merging, and their
+ * own exported counters summed when published
+ *	cc -O2 -DSOLOTEST_STATS -I../include stats.c -lpthread -lrt
+ */
+#define NTHREADS	8
+#define NOPS		1000000
 
-	e_ns = ts.tv_sec * sec_to_nsec + ts.tv_nsec;
+static statinfo_t	*t_cnt, *t_qd, *t_lat, *t_prof, *t_ratio;
+static __thread uint64_t t_ops;
+static pthread_barrier_t t_bar;
+
+static void *worker(void *arg)
+{
+	stat_prof_t	h;
+	int		i;
+
+	stat_export_u64("thread ops", &t_ops);
+	for (i = 0; i < NOPS; i++) {
+		t_ops++;
+		stat_counter_incr(t_cnt, 2);
+		stat_qd_issue(t_qd);
+		stat_latency_add(t_lat, i % 1000);
+		stat_ratio_add(t_ratio, i & 1);
+		stat_qd_done(t_qd);
+	}
+	for (i = 0; i < 1000; i++) {
+		h = stat_prof_enter(t_prof);
+		stat_prof_exit(t_prof, h);
+	}
+	/* t_ops goes away with the thread, stay until published */
+	pthread_barrier_wait(&t_bar);
+	pthread_barrier_wait(&t_bar);
+	return (NULL);
+}
 
-	s->total_ns += (e_ns - s->s_ns);
+int main(int argc, char **argv)
+{
+	pthread_t	t[NTHREADS];
+	stats_t		st;
+	uint64_t	t0, ns;
+	stat_prof_t	h;
+	int		i;
+	int		rc;
+
+	init_stats(&st);
+	pthread_barrier_init(&t_bar, NULL, NTHREADS + 1);
+	t_cnt = stat_create(&st, "counter", COUNTER);
+	t_qd = stat_create(&st, "queue", QUEUE);
+	t_lat = stat_create(&st, "latency", LATENCY);
+	t_prof = stat_create(&st, "prof", PROFILER);
+	t_ratio = stat_create(&st, "ratio", RATIO);
+
+	t0 = stat_ticks();
+	for (i = 0; i < NTHREADS; i++) {
+		pthread_create(&t[i], NULL, worker, NULL);
+	}
+	pthread_barrier_wait(&t_bar);
+	ns = stat_ticks_ns(stat_ticks() - t0);
+	rc = stats_shm_start("/cbstat.solotest", 100);
+	assert(rc == 0);
+	stats_shm_publish();
+	for (i = 0; i < (int) stat_shm->nents; i++) {
+		if (strcmp(stat_shm->e[i].name, "thread ops") == 0) {
+			break;
+		}
+	}
+	/* one entry for the counters of all threads */
+	assert(stat_shm->nents == 6 && i < 6);
+	assert(stat_shm->e[i].v[0] == (uint64_t) NTHREADS * NOPS);
+	stats_shm_stop();
+	pthread_barrier_wait(&t_bar);
+	for (i = 0; i < NTHREADS; i++) {
+		pthread_join(t[i], NULL);
+	}
+	printf("tsc %d, %.1f ns per update\n", stat_tsc,
+		(double) ns / (NTHREADS * NOPS * 5.0));
+
+	stat_merge(t_cnt);
+	assert(t_cnt->c_starts == NTHREADS * NOPS);
+	assert(t_cnt->c_running == 2 * NTHREADS * NOPS);
+	stat_merge(t_qd);
+	assert(t_qd->qd_running == 0);
+	assert(stat_ratio(t_ratio) == 0.5);
+	assert(t_ratio->r_total == (uint64_t) NTHREADS * NOPS);
+	assert(stat_latency_pct(t_lat, 50) >= 400 &&
+		stat_latency_pct(t_lat, 50) <= 625);
+	assert(t_lat->lat_count == (uint64_t) NTHREADS * NOPS);
+	assert(t_lat->lat_max == 999 && stat_latency_pct(t_lat, 100) == 999);
+
+	h = stat_prof_enter(t_prof);
+	usleep(20000);
+	stat_prof_exit(t_prof, h);
+	stat_merge(t_prof);
+	assert(t_prof->count == NTHREADS * 1000 + 1);
+	assert(t_prof->lat_max >= 20000000 && t_prof->lat_max < 200000000);
+	printf("prof p50 %" PRIu64 " ns max %" PRIu64 " ns\n",
+		stat_latency_pct(t_prof, 50), t_prof->lat_max);
+
+	stat_delete(t_cnt);
+	stat_delete(t_qd);
+	stat_delete(t_lat);
+	stat_delete(t_prof);
+	stat_delete(t_ratio);
+	deinit_stats(&st);
+	printf("stats solo test passed\n");
+	return (0);
 }
+#endif /* SOLOTEST_STATS */
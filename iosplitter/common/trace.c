@@ -0,0 +1,297 @@
+/*
+ * trace.c
+ *	sampled request tracing, see trace.h
+ *
+ * Each thread owns a ring only it writes; head is published with a
+ * release store. The export thread copies [tail, head) and rereads head:
+ * slots the writer may have reused meanwhile are dropped, not reported.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define TRACE_MASK		(TRACE_RINGSZ - 1)
+#define TRACE_EXPORT_MS		100
+
+struct trace_ring {
+	struct trace_ring	*next;
+	uint64_t		head;		/* written by the owner */
+	uint64_t		tail;		/* read by the exporter */
+	uint16_t		tid;
+	struct trace_rec	rec[TRACE_RINGSZ];
+};
+
+const char *trace_stage_name[TR_NSTAGES] = {
+	"mpp_enqueue",
+	"rpc_send",
+	"srv_recv",
+	"handler",
+	"io_submit",
+	"io_done",
+	"rsp_send",
+	"cli_done",
+};
+
+int				trace_rate;
+
+static __thread struct trace_ring	*trace_ring;
+static __thread uint32_t		trace_count;
+
+static pthread_mutex_t		trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_ring	*trace_rings;	/* pushed under trace_lock */
+static uint16_t			trace_ntids;
+static uint32_t			trace_nextid;
+static uint64_t			trace_nrecs;
+static uint64_t			trace_ndropped;
+
+static FILE			*trace_fp;
+static pthread_t		trace_thread;
+static int			trace_stopping;
+static struct trace_rec		trace_buf[TRACE_RINGSZ];
+
+uint64_t trace_now(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/*
+ * a new trace id for 1 in trace_rate calls of each thread, else 0
+ */
+uint32_t trace_sample(void)
+{
+	uint32_t	id;
+
+	if (trace_rate == 0 || ++trace_count % trace_rate != 0) {
+		return (0);
+	}
+	do {
+		id = __atomic_add_fetch(&trace_nextid, 1, __ATOMIC_RELAXED);
+	} while (id == 0);
+	return (id);
+}
+
+static struct trace_ring *trace_ring_new(void)
+{
+	struct trace_ring	*r;
+
+	if ((r = calloc(1, sizeof(*r))) == NULL) {
+		return (NULL);
+	}
+	pthread_mutex_lock(&trace_lock);
+	r->tid = trace_ntids++;
+	r->next = trace_rings;
+	__atomic_store_n(&trace_rings, r, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&trace_lock);
+	return (r);
+}
+
+void trace_rec(uint32_t id, int stage, uint64_t ns)
+{
+	struct trace_ring	*r = trace_ring;
+	struct trace_rec	*t;
+	uint64_t		h;
+
+	assert(stage >= 0 && stage < TR_NSTAGES);
+	if (trace_rate == 0) {
+		return;
+	}
+	if (r == NULL && (r = trace_ring = trace_ring_new()) == NULL) {
+		return;
+	}
+	h = r->head;
+	t = &r->rec[h & TRACE_MASK];
+	t->id = id;
+	t->stage = stage;
+	t->tid = r->tid;
+	t->ns = ns;
+	__atomic_store_n(&r->head, h + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * copy out what one ring holds past tail, returns the records kept
+ */
+static int trace_drain(struct trace_ring *r, struct trace_rec *buf)
+{
+	uint64_t	h, t, h2;
+	int		n;
+
+	h = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	t = r->tail;
+	if (h - t > TRACE_RINGSZ) {
+		trace_ndropped += h - t - TRACE_RINGSZ;
+		t = h - TRACE_RINGSZ;
+	}
+	for (n = 0; t + n < h; n++) {
+		buf[n] = r->rec[(t + n) & TRACE_MASK];
+	}
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	h2 = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	if (h2 - t >= TRACE_RINGSZ) {
+		/*
+		 * the first records were overwritten while copying; the one
+		 * in slot h2 may be half written, it goes too
+		 */
+		uint64_t	lost = h2 + 1 - t - TRACE_RINGSZ;
+
+		if (lost > (uint64_t) n) {
+			lost = n;
+		}
+		memmove(buf, buf + lost, (n - lost) * sizeof(*buf));
+		n -= lost;
+		trace_ndropped += lost;
+	}
+	r->tail = h;
+	return (n);
+}
+
+/*
+ * write everything recorded so far to the file
+ */
+void trace_flush(void)
+{
+	struct trace_ring	*r;
+	struct trace_rec	*t;
+	int			i, n;
+
+	pthread_mutex_lock(&trace_lock);
+	if (trace_fp == NULL) {
+		pthread_mutex_unlock(&trace_lock);
+		return;
+	}
+	for (r = trace_rings; r != NULL; r = r->next) {
+		n = trace_drain(r, trace_buf);
+		for (i = 0; i < n; i++) {
+			t = &trace_buf[i];
+			fprintf(trace_fp, "%08x %s %" PRIu64 " %u\n", t->id,
+					trace_stage_name[t->stage], t->ns,
+					t->tid);
+		}
+		trace_nrecs += n;
+	}
+	fflush(trace_fp);
+	pthread_mutex_unlock(&trace_lock);
+}
+
+static void *trace_export(void *arg)
+{
+	struct timespec	d;
+
+	d.tv_sec = 0;
+	d.tv_nsec = TRACE_EXPORT_MS * 1000000L;
+	while (!__atomic_load_n(&trace_stopping, __ATOMIC_ACQUIRE)) {
+		nanosleep(&d, NULL);
+		trace_flush();
+	}
+	return (NULL);
+}
+
+/*
+ * trace 1 in rate requests into fname; returns 0 or an errno
+ */
+int trace_start(const char *fname, int rate)
+{
+	int	rc;
+
+	assert(trace_fp == NULL && rate > 0);
+	if ((trace_fp = fopen(fname, "a")) == NULL) {
+		return (errno);
+	}
+	fprintf(trace_fp, "# cbtrace pid %d rate %d\n", (int) getpid(), rate);
+	/* ids of different processes should not meet in one report */
+	trace_nextid = (uint32_t) getpid() << 16;
+	trace_stopping = 0;
+	rc = pthread_create(&trace_thread, NULL, trace_export, NULL);
+	if (rc != 0) {
+		fclose(trace_fp);
+		trace_fp = NULL;
+		return (rc);
+	}
+	trace_rate = rate;
+	return (0);
+}
+
+void trace_stop(void)
+{
+	if (trace_fp == NULL) {
+		return;
+	}
+	trace_rate = 0;
+	__atomic_store_n(&trace_stopping, 1, __ATOMIC_RELEASE);
+	pthread_join(trace_thread, NULL);
+	trace_flush();
+	fprintf(trace_fp, "# %" PRIu64 " records, %" PRIu64 " dropped\n",
+			trace_nrecs, trace_ndropped);
+	fclose(trace_fp);
+	trace_fp = NULL;
+}
+
+#ifdef SOLOTEST_TRACE
+/*
+ * cc -DSOLOTEST_TRACE -I../include trace.c -lpthread
+ */
+#define NTHREADS	4
+#define NREQ		100000
+
+static void *worker(void *arg)
+{
+	uint32_t	id;
+	int		i, s;
+
+	for (i = 0; i < NREQ; i++) {
+		if ((id = trace_sample()) == 0) {
+			continue;
+		}
+		for (s = TR_RPC_SEND; s <= TR_CLI_DONE; s++) {
+			trace(id, s);
+		}
+	}
+	return (NULL);
+}
+
+int main(void)
+{
+	pthread_t	t[NTHREADS];
+	char		line[128], name[32];
+	unsigned	id, tid;
+	uint64_t	ns;
+	FILE		*fp;
+	int		i, n = 0;
+
+	unlink("/tmp/trace.solotest");
+	assert(trace_start("/tmp/trace.solotest", 8) == 0);
+	for (i = 0; i < NTHREADS; i++) {
+		pthread_create(&t[i], NULL, worker, NULL);
+	}
+	for (i = 0; i < NTHREADS; i++) {
+		pthread_join(t[i], NULL);
+	}
+	trace_stop();
+
+	fp = fopen("/tmp/trace.solotest", "r");
+	assert(fp != NULL);
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (line[0] == '#') {
+			continue;
+		}
+		assert(sscanf(line, "%x %31s %" SCNu64 " %u", &id, name, &ns,
+				&tid) == 4 && id != 0 && tid < NTHREADS);
+		n++;
+	}
+	fclose(fp);
+	printf("%d records, %" PRIu64 " dropped\n", n, trace_ndropped);
+	assert(n + trace_ndropped == NTHREADS * NREQ / 8 * 7);
+	return (0);
+}
+#endif
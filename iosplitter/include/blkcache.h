@@ -0,0 +1,79 @@
+/*
+ * blkcache.h
+ *	DRAM block cache in front of the SSD, CLOCK-Pro replacement
+ */
+
+#ifndef BLKCACHE_H
+#define BLKCACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "dll.h"
+#include "hash.h"
+#include "stats.h"
+
+#define BLKCACHE_BLKSZ		(1 << 12)
+#define BLKCACHE_NSTRIPES	1024	/* write generation stripes */
+
+struct blkcache_entry;
+
+/*
+ * one cache shared by all sessions and worker threads of the server,
+ * everything below is protected by lock
+ */
+typedef struct blkcache {
+	pthread_mutex_t		lock;
+
+	char			*slab;		/* nblocks * BLKCACHE_BLKSZ */
+	char			**freeblks;	/* free frames of slab */
+	size_t			nfree;
+	size_t			nblocks;	/* memory budget in blocks */
+
+	hash_table_t		hash;		/* (dev, lba) -> entry */
+	dll_t			clock;		/* hot, cold and test entries */
+	struct blkcache_entry	*hand_hot;
+	struct blkcache_entry	*hand_cold;
+	struct blkcache_entry	*hand_test;
+	size_t			nhot;
+	size_t			ncold;
+	size_t			ntest;		/* non resident, metadata only */
+	size_t			cold_target;	/* adaptive resident cold size */
+
+	/* bumped by writes, a fill that raced with a write is dropped */
+	uint32_t		wgen[BLKCACHE_NSTRIPES];
+	uint32_t		wbusy[BLKCACHE_NSTRIPES];	/* in flight */
+
+	stats_t			stats;
+	statinfo_t		*st_hits;	/* RATIO of reads served */
+	statinfo_t		*st_hit_lat;	/* LATENCY, served from DRAM */
+	statinfo_t		*st_miss_lat;	/* LATENCY, read from SSD */
+} blkcache_t;
+
+/*
+ * snapshot of write generations covering a read miss or a write, see
+ * blkcache_fill and blkcache_write_end
+ */
+typedef struct blkcache_ticket {
+	uint32_t		wgen[2];
+	int			excl;	/* write: no other one in flight */
+} blkcache_ticket_t;
+
+int blkcache_init(blkcache_t *bc, size_t budget);
+void blkcache_deinit(blkcache_t *bc);
+
+int blkcache_read(blkcache_t *bc, int dev, uint64_t off, uint64_t len,
+		char *buf);
+void blkcache_ticket(blkcache_t *bc, int dev, uint64_t off, uint64_t len,
+		blkcache_ticket_t *tkt);
+void blkcache_fill(blkcache_t *bc, int dev, uint64_t off, uint64_t len,
+		char *buf, blkcache_ticket_t *tkt);
+void blkcache_write_begin(blkcache_t *bc, int dev, uint64_t off,
+		uint64_t len, blkcache_ticket_t *tkt);
+void blkcache_write_end(blkcache_t *bc, int dev, uint64_t off, uint64_t len,
+		char *buf, blkcache_ticket_t *tkt);
+
+void blkcache_latency(blkcache_t *bc, int hit, uint64_t ns);
+void blkcache_stats(blkcache_t *bc, int show);
+
+#endif /* BLKCACHE_H */
@@ -59,22 +59,77 @@ typedef struct
  * j2h_ptr_t callback is given a cJSON array or object constructed
  * from disk file. It should construct a hash table element from it.
  * Do not free 'item'; phash_reload or phash_init will take care of that.
- *
- * NOTE: if a cJSON array is constructed using cJSON_InsertInArray(),
- * the array elements will be stored in LIFO order. So j2h_ptr_t should
- * expect to get array elements in the reverse order to what h2j_ptr_t
- * inserted.
  */
 
 typedef hashbucket_t *	(*j2h_ptr_t)(cJSON *item);
 typedef cJSON *		(*h2j_ptr_t)(hashbucket_t *hbp);
 
+/*
+ * Binary persistence, set up with phash_init_bin():
+ * fname holds a snapshot of the table, fname.log the records of
+ * phash_put() and phash_del() since that snapshot.
+ *
+ * h2b_ptr_t copies the data of an element, without its key, into buf and
+ * returns its length; if that is more than buflen it is called again with
+ * a larger buffer.
+ * b2h_ptr_t constructs an element from a key and the data h2b returned.
+ * buf points into a mapping of the file, copy what is kept.
+ * hfree_ptr_t frees an element that phash_reload replaced or deleted.
+ */
+typedef int		(*h2b_ptr_t)(hashbucket_t *hbp, void *buf, int buflen);
+typedef hashbucket_t *	(*b2h_ptr_t)(hashkey_t key, const void *buf, int len);
+typedef void		(*hfree_ptr_t)(hashbucket_t *hbp);
+
+#define PHASH_SNAPMAGIC		0x50485350	/* PHSP */
+#define PHASH_LOGMAGIC		0x50484c47	/* PHLG */
+#define PHASH_VERSION		1
+
+/* head of the snapshot and of the log */
+struct phash_hdr {
+	uint32_t	magic;
+	uint32_t	version;
+	uint64_t	gen;		/* of the snapshot, log replays on it */
+	uint64_t	count;		/* snapshot records */
+	uint64_t	bytes;		/* snapshot records, with their data */
+	uint32_t	crc;		/* snapshot records */
+	uint32_t	hcrc;		/* of this header with hcrc 0 */
+};
+
+/* record of the snapshot and of the log, data padded to 8 bytes follows */
+struct phash_rec {
+	uint32_t	crc;		/* log: of the record with crc 0 and data */
+	uint32_t	len;		/* of data */
+	uint64_t	key;
+	uint32_t	op;
+	uint32_t	pad;
+};
+#define PHASH_PUT		1
+#define PHASH_DEL		2
+
+#define PHASH_LOGMIN		(64 * 1024)	/* log size to snapshot at */
+#define PHASH_WANTSNAP(php)	((php)->logsize > PHASH_LOGMIN && \
+				 (php)->logsize > (php)->snapsize)
+
 typedef struct {
 	hashtable_t	*hp;
 	char		*fname;
 	char		*tempname;
 	j2h_ptr_t	j2h;	// JSON to hashbucket_t
 	h2j_ptr_t	h2j; 	// hashbucket_t to JSON
+
+	h2b_ptr_t	h2b;	// hashbucket_t to binary, NULL for JSON
+	b2h_ptr_t	b2h;	// binary to hashbucket_t
+	hfree_ptr_t	hfree;
+	char		*logname;
+	int		logfd;
+	uint64_t	gen;
+	off_t		logsize;	/* on disk */
+	off_t		snapsize;
+	char		*pend;		/* log records not written yet */
+	size_t		npend;
+	size_t		pendmax;
+	char		*rbuf;		/* for h2b */
+	int		rbuflen;
 } phash_t;
 
 
@@ -93,7 +148,6 @@ void hashtable_iter_init(hashtable_iter_t *hip, hashtable_t *hp);
 void *hashtable_iter_next(hashtable_iter_t *hip);
 
 int filesize(int fd, off_t *size); /* do fstat and set st_size */
-void cJSON_InsertItemInArray(cJSON *array, cJSON *item);
 int phash_init(
 	phash_t		*php,
 	hashtable_t	*hp,
@@ -102,9 +156,23 @@ int phash_init(
 	j2h_ptr_t	j2h,
 	h2j_ptr_t	h2j
 	);
+int phash_init_bin(
+	phash_t		*php,
+	hashtable_t	*hp,
+	char		*fname,
+	char		*tempname,
+	h2b_ptr_t	h2b,
+	b2h_ptr_t	b2h,
+	hfree_ptr_t	hfree,
+	h2j_ptr_t	h2j
+	);
 int phash_deinit(phash_t *php);
 int phash_flush(phash_t *php);
 int phash_reload(phash_t *php);
+int phash_put(phash_t *php, hashbucket_t *hbp);
+int phash_del(phash_t *php, hashkey_t key);
+int phash_append(phash_t *php);
+int phash_export(phash_t *php, char *fname);
 
 
 #endif /*CONTAINER_H*/
@@ -0,0 +1,75 @@
+/*
+ * hbitmap.h
+ *	hierarchical bitmap, fast iteration over sparse set bits
+ *
+ *	hbitmap_init():		a zeroed hbitmap_t of nbits
+ *	hbitmap_set(), hbitmap_clear(), hbitmap_get():	one bit
+ *	hbitmap_set_range(), hbitmap_clear_range():	a run of bits
+ *	hbitmap_count(), hbitmap_count_range():		population count
+ *	hbitmap_next():		first set bit at or after a position
+ *	hbitmap_iter_init(), hbitmap_iter_next():	walk set bits in order
+ *
+ * Level 0 holds the bits. A bit of level l + 1 is set iff word i of level
+ * l is not zero, so every summary word covers 64 words below it and a scan
+ * skips 4096 clear bits per clear summary bit, 262144 one level up. Levels
+ * are added until the top one fits in HBITMAP_TOPWORDS words, which are
+ * scanned linearly (AVX2 where the CPU has it).
+ */
+#ifndef _HBITMAP_H
+#define _HBITMAP_H
+
+#include <stdint.h>
+
+#define HBITMAP_MAXLEVELS	8
+#define HBITMAP_TOPWORDS	64
+
+typedef struct hbitmap {
+	uint64_t	nbits;
+	uint64_t	count;		/* bits set */
+	int		nlevels;
+	uint64_t	nwords[HBITMAP_MAXLEVELS];
+	uint64_t	*level[HBITMAP_MAXLEVELS];
+} hbitmap_t;
+
+/*
+ * Iterator over a bitmap that is not modified meanwhile, bits of the word
+ * being walked are a snapshot.
+ */
+typedef struct hbitmap_iter {
+	hbitmap_t	*hb;
+	uint64_t	widx;		/* level 0 word of cur */
+	uint64_t	cur;		/* bits of it not returned yet */
+} hbitmap_iter_t;
+
+int hbitmap_init(hbitmap_t *hb, uint64_t nbits);
+void hbitmap_deinit(hbitmap_t *hb);
+
+void hbitmap_set_range(hbitmap_t *hb, uint64_t start, uint64_t n);
+void hbitmap_clear_range(hbitmap_t *hb, uint64_t start, uint64_t n);
+uint64_t hbitmap_count_range(hbitmap_t *hb, uint64_t start, uint64_t n);
+int64_t hbitmap_next(hbitmap_t *hb, uint64_t start);
+
+void hbitmap_iter_init(hbitmap_iter_t *it, hbitmap_t *hb, uint64_t start);
+int64_t hbitmap_iter_next(hbitmap_iter_t *it);
+
+static inline int hbitmap_get(hbitmap_t *hb, uint64_t k)
+{
+	return ((hb->level[0][k >> 6] >> (k & 63)) & 1);
+}
+
+static inline void hbitmap_set(hbitmap_t *hb, uint64_t k)
+{
+	hbitmap_set_range(hb, k, 1);
+}
+
+static inline void hbitmap_clear(hbitmap_t *hb, uint64_t k)
+{
+	hbitmap_clear_range(hb, k, 1);
+}
+
+static inline uint64_t hbitmap_count(hbitmap_t *hb)
+{
+	return (hb->count);
+}
+
+#endif /* _HBITMAP_H */
@@ -0,0 +1,69 @@
+/*
+ * lbaindex.h
+ *	compact index from a 64 bit LBA to a 32 bit cache location
+ *
+ *	lbaindex_init():	empty index sized for an expected count
+ *	lbaindex_insert():	add or update a key
+ *	lbaindex_lookup():	value of a key, safe from any thread
+ *	lbaindex_get():		same, from the thread modifying the index
+ *	lbaindex_remove():	drop a key
+ *
+ * Open addressing with Robin Hood displacement in 16 byte buckets, plus
+ * one tag byte per bucket kept in a separate array that lookups scan 16
+ * at a time with SSE2. Sized for nexpected keys an index takes under 20
+ * bytes per key. Past 7/8 load the index grows to twice the buckets, the
+ * old table is migrated a few buckets per insert or remove.
+ *
+ * One thread modifies an index. Lookups from other threads retry on a
+ * sequence count bumped around every modification. They are counted per
+ * epoch, a table dropped by a resize is freed by a later modification
+ * once the lookups of the epoch it was dropped in are done.
+ */
+#ifndef _LBAINDEX_H
+#define _LBAINDEX_H
+
+#include <stdint.h>
+
+struct lbai_bucket {
+	uint64_t	key;
+	uint32_t	val;
+	uint16_t	dist;		/* from the home bucket */
+	uint16_t	pad;
+};
+
+typedef struct lbai_tab {
+	uint64_t		nslots;		/* home buckets */
+	uint64_t		nalloc;		/* nslots plus overflow */
+	uint64_t		count;
+	uint32_t		maxdist;
+	uint8_t			*tag;		/* 0: empty */
+	struct lbai_bucket	*b;
+	struct lbai_tab		*next;		/* on a retired list */
+} lbai_tab_t;
+
+typedef struct lbaindex {
+	lbai_tab_t	*cur;
+	lbai_tab_t	*old;		/* being migrated into cur, or NULL */
+	uint64_t	mpos;		/* next bucket of old to migrate */
+	lbai_tab_t	*retired;	/* migrated in this epoch */
+	lbai_tab_t	*grace;		/* migrated, lookups may still use them */
+	uint64_t	seq;		/* odd while modified */
+	uint64_t	epoch;
+	uint64_t	nreaders[2];	/* in lbaindex_lookup(), by epoch */
+	uint64_t	nresize;
+} lbaindex_t;
+
+int lbaindex_init(lbaindex_t *ix, uint64_t nexpected);
+void lbaindex_deinit(lbaindex_t *ix);
+int lbaindex_insert(lbaindex_t *ix, uint64_t key, uint32_t val);
+int lbaindex_lookup(lbaindex_t *ix, uint64_t key, uint32_t *val);
+int lbaindex_get(lbaindex_t *ix, uint64_t key, uint32_t *val);
+int lbaindex_remove(lbaindex_t *ix, uint64_t key);
+uint64_t lbaindex_bytes(lbaindex_t *ix);
+
+static inline uint64_t lbaindex_count(lbaindex_t *ix)
+{
+	return (ix->cur->count + (ix->old != NULL ? ix->old->count : 0));
+}
+
+#endif /* _LBAINDEX_H */
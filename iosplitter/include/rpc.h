@@ -8,6 +8,7 @@
 
 #include "bufpool.h"
 #include "hash.h"
+#include "libtask/timer.h"
 
 #define RPC_PORT  12333
 #define NTASK     128
@@ -31,14 +32,24 @@
 #define RPC_EDISABLED	(1 + RPC_EBASE)
 #define RPC_ENOMEM		(2 + RPC_EBASE)
 #define RPC_ENOSYS		(3 + RPC_EBASE)
-//#define RPC_ENOMEM		(4 + RPC_EBASE)
-//#define RPC_ENOMEM		(5 + RPC_EBASE)
+#define RPC_ETIMEDOUT	(4 + RPC_EBASE)
+#define RPC_ECANCELED	(5 + RPC_EBASE)
 
 /*
  *  handler task is passed a rpc_msg_t * as the arg.
  */
 typedef void (*rpchandler_t)(void *);
 
+/*
+ *  optional, called by the recv task for every request before a handler task
+ *  is created. Returns 0 if it has answered the request inline (it must not
+ *  block except for sending the response) or started a continuation that
+ *  will (see task_cont_aiorw), non zero to pass the request on to the
+ *  handler task.
+ */
+struct rpc_msg;
+typedef int (*rpcfastpath_t)(struct rpc_msg *);
+
 /*
  * clients will build their own msg header structures where the first member
  * is struct rpc_msg_hdr.
@@ -53,6 +64,8 @@ typedef struct rpc_msghdr {
 	uint16_t	msglen;		/* 16 bit, number of bytes of full msg hdr */
 	uint16_t	payloadlen;	/* 16 bit, number of bytes; n < 64K */
 	uint16_t	status;		/* 16 bit status code in response */
+	uint32_t	traceid;	/* nonzero when sampled, see trace.h */
+	uint64_t	tsend;		/* sender's trace_now() of a traced msg */
 } rpc_msghdr_t;
 
 #define RPC_MSG_SEQID(msgp) (msgp->hdr.seqid)
@@ -69,6 +82,8 @@ typedef struct rpc_msg {
 	struct rpc_msg		*resp;		/* resp is stored in request. */
 	struct rpc_chan		*rcp;
 	Rendez			rendez;		/* sleep for response */
+	task_timeout_t		to;		/* request deadline */
+	int			err;		/* request ended without resp */
 	rpc_msghdr_t		hdr;		/* over the wire header. MUST BE LAST MEMBER */
 } rpc_msg_t;
 
@@ -86,13 +101,12 @@ typedef struct rpc_chan {
 	bufpool_t		datapool;	/* fixed size data buffers */
 	//Rendez		rendez;		/* drain out channel users */
 	rpchandler_t		handler;	/* recv task will pass request to handler task*/
-	QLock			fdlock;		/* taken by writers on this fd */
+	rpcfastpath_t		fastpath;	/* tried by recv task before handler */
+	QCombine		sendq;		/* writers on this fd, see rpc_send_batch */
+	uint64_t		timeout;	/* ns per request, 0: none */
 	void			*usrcntxt;	/* user context */
 } rpc_chan_t;
 
-#define RPC_CHAN_LOCK(rcp) { qlock(&rcp->fdlock); }
-#define RPC_CHAN_UNLOCK(rcp) { qunlock(&rcp->fdlock); }
-
 rpc_chan_t * rpc_chan_new(void);
 void rpc_chan_free(rpc_chan_t *rcp);
 int rpc_chan_init(rpc_chan_t *rcp, int infd, int outfd,
@@ -100,6 +114,8 @@ int rpc_chan_init(rpc_chan_t *rcp, int infd, int outfd,
 		  rpchandler_t, void *usrcntxt);
 void rpc_chan_deinit(rpc_chan_t *rcp);
 void rpc_chan_close(rpc_chan_t *rcp);
+void rpc_chan_set_fastpath(rpc_chan_t *rcp, rpcfastpath_t fastpath);
+void rpc_chan_set_timeout(rpc_chan_t *rcp, uint64_t ns);
 void rpc_default_handler(void *arg);
 
 void rpc_databuf_get(rpc_chan_t *rcp, char **bufp);
@@ -110,9 +126,21 @@ void rpc_msg_get(rpc_chan_t *rcp, int msgtype, size_t msglen, size_t payloadlen,
 void rpc_msg_put(rpc_chan_t *rcp, rpc_msg_t *msgp);
 
 int rpc_request(rpc_chan_t *rcp, rpc_msg_t *msgp);
+int rpc_request_timed(rpc_chan_t *rcp, rpc_msg_t *msgp, uint64_t ns);
+int rpc_request_retry(rpc_chan_t *rcp, rpc_msg_t *msgp, uint64_t ns, int ntries);
+int rpc_cancel(rpc_chan_t *rcp, rpc_msg_t *msgp);
 void rpc_response(rpc_chan_t *rcp, rpc_msg_t *msgp);
 
 void dump_rpc_msghdr(rpc_msghdr_t *p);
 void dump_rpc_msg(rpc_msg_t *p);
 
+/* event counts of the calling thread */
+extern __thread uint64_t g_rsp_sent;
+extern __thread uint64_t g_rpc_recv_task_reads_done;
+extern __thread uint64_t g_rpc_recv_task_reads_issued;
+extern __thread uint64_t g_rpc_timeouts;
+extern __thread uint64_t g_rpc_late_rsp;
+extern __thread uint64_t g_rpc_send_msgs;
+extern __thread uint64_t g_rpc_send_writevs;
+
 #endif /*RPC_H*/
@@ -18,14 +18,46 @@ typedef enum {
 	QUEUE,
 	COUNTER,
 	PROFILER,
+	LATENCY,
+	RATIO,
 } stat_type_t;
 
+/*
+ * latency histogram: 4 linear sub buckets per power of two nanoseconds,
+ * percentiles are accurate to within 25%
+ */
+#define STAT_LAT_SUBBITS	2
+#define STAT_LAT_NBUCKETS	(64 << STAT_LAT_SUBBITS)
+
+/*
+ * Updates go to a shard of the statinfo_t owned by the calling thread,
+ * allocated on its first update, with relaxed atomic adds; no lock is
+ * taken and threads do not share cache lines. Threads past STAT_NSHARDS
+ * share shards, still atomically.
+ *
+ * Readers sum the shards into the fields below: stats_update_all() for
+ * all statistics, stat_latency_pct() and stat_ratio() for their own.
+ * Those fields are only consistent for one reader at a time.
+ */
+#define STAT_NSHARDS		64
+
+struct stat_shard {
+	uint64_t	v[2];		/* by type, see stats.c */
+	uint64_t	lat_count;
+	uint64_t	lat_max;
+	uint64_t	lat_total;	/* ns */
+	uint64_t	lat_buckets[0];	/* LATENCY, PROFILER */
+} __attribute__((aligned(64)));
+
 typedef struct statinfo {
 	dll_t nxt;
+	dll_t reg;	/* on the registry of all statistics */
 	char *name;
 
 	stat_type_t type;
+	struct stat_shard *shards[STAT_NSHARDS];
 
+	/* summed from the shards */
 	union {
 		struct {
 			/* que depth */
@@ -43,15 +75,98 @@ typedef struct statinfo {
 		};
 
 		struct {
-			/* function profiler */
-			uint64_t s_ns;     /* start nanosecond */
+			/* function profiler, also fills the histogram */
 			uint64_t total_ns; /* total nanoseconds */
 			uint64_t count;
 			double   avg_ns;
 		};
+
+		struct {
+			/* ratio, e.g. cache hits out of lookups */
+			uint64_t r_hits;
+			uint64_t r_total;
+		};
 	};
+
+	/* latency histogram, LATENCY and PROFILER */
+	uint64_t lat_count;
+	uint64_t lat_max;
+	uint64_t lat_buckets[STAT_LAT_NBUCKETS];
 } statinfo_t;
 
+/* bucket of ns and the largest value falling into bucket b */
+static inline int stat_lat_bucket(uint64_t ns)
+{
+	int	msb;
+
+	if (ns < (1 << STAT_LAT_SUBBITS)) {
+		return (ns);
+	}
+	msb = 63 - __builtin_clzll(ns);
+	return (((msb - STAT_LAT_SUBBITS + 1) << STAT_LAT_SUBBITS) |
+		((ns >> (msb - STAT_LAT_SUBBITS)) & ((1 << STAT_LAT_SUBBITS) - 1)));
+}
+
+static inline uint64_t stat_lat_bucket_max(int b)
+{
+	int	shift;
+
+	if (b < (1 << STAT_LAT_SUBBITS)) {
+		return (b);
+	}
+	shift = (b >> STAT_LAT_SUBBITS) - 1;
+	return ((((uint64_t) ((1 << STAT_LAT_SUBBITS) |
+		(b & ((1 << STAT_LAT_SUBBITS) - 1))) + 1) << shift) - 1);
+}
+
+/*
+ * Shared memory export, read by tools/cbstat.
+ * stats_shm_start() creates the segment (default /cbstat.<pid>) and
+ * publishes every statinfo_t of the process and every exported uint64_t
+ * into it each interval. A reader copies the segment and keeps the copy
+ * if seq was even and unchanged around it.
+ */
+#define STATSHM_MAGIC		0x43425354	/* CBST */
+#define STATSHM_VERSION		1
+#define STATSHM_NAMELEN		64
+#define STATSHM_MAXSTATS	256
+#define STATSHM_U64		16		/* type of an exported uint64_t */
+
+struct statshm_ent {
+	char		name[STATSHM_NAMELEN];
+	uint32_t	type;		/* stat_type_t or STATSHM_U64 */
+	uint32_t	pad;
+	uint64_t	v[2];		/* as struct stat_shard, U64: v[0] */
+	uint64_t	lat_count;
+	uint64_t	lat_max;
+	uint64_t	lat_total;
+	uint64_t	lat_buckets[STAT_LAT_NBUCKETS];
+};
+
+struct statshm_hdr {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	hdrsize;
+	uint32_t	entsize;
+	uint32_t	maxents;
+	uint32_t	nents;
+	uint64_t	seq;		/* odd while publishing */
+	uint64_t	pid;
+	uint64_t	stamp_ns;	/* CLOCK_MONOTONIC of the publish */
+	uint64_t	npublish;
+	uint64_t	ndropped;	/* statistics past maxents */
+	struct statshm_ent e[0];
+};
+
+/*
+ * cheap timestamps: the TSC when it is invariant, else CLOCK_MONOTONIC
+ * in nanoseconds
+ */
+typedef uint64_t stat_prof_t;
+
+uint64_t stat_ticks(void);
+uint64_t stat_ticks_ns(uint64_t ticks);
+
 void init_stats(stats_t *stats);
 void deinit_stats(stats_t *stats);
 statinfo_t *stat_create(stats_t *stats, const char *name, stat_type_t type);
@@ -61,8 +176,20 @@ void stats_update_all(stats_t *stats);
 void stat_qd_issue(statinfo_t *s);
 void stat_qd_done(statinfo_t *s);
 void stat_counter_incr(statinfo_t *s, int count);
+stat_prof_t stat_prof_enter(statinfo_t *s);
+void stat_prof_exit(statinfo_t *s, stat_prof_t h);
+
+void stat_latency_add(statinfo_t *s, uint64_t ns);
+uint64_t stat_latency_pct(statinfo_t *s, double pct);
+void stat_ratio_add(statinfo_t *s, int hit);
+double stat_ratio(statinfo_t *s);
 
 void stat_display(stats_t *stats, int show);
 void stat_display_toggle(stats_t *stats);
 
+void stat_export_u64(const char *name, const volatile uint64_t *p);
+int stats_shm_start(const char *name, int interval_ms);
+void stats_shm_publish(void);
+void stats_shm_stop(void);
+
 #endif /* STATS_H */
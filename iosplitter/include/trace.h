@@ -0,0 +1,57 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/*
+ * Sampled per-request latency tracing.
+ *
+ * A client picks 1 in trace_rate requests and gives them a nonzero trace
+ * id, carried in the rpc header with the sender's timestamp. Every stage
+ * the request passes appends { id, stage, ns } to a ring of the running
+ * thread; an export thread drains the rings into a text file, one record
+ * per line, that tools/cbtrace turns into per-stage latencies.
+ *
+ * Timestamps are CLOCK_REALTIME so records of different processes (and
+ * of the MPP) line up; only traced requests pay for them.
+ */
+
+#include <stdint.h>
+
+enum trace_stage {
+	TR_MPP_ENQUEUE,		/* MPP: command queued to the send pool */
+	TR_RPC_SEND,		/* client: request written */
+	TR_SRV_RECV,		/* server: request read */
+	TR_HANDLER,		/* server: handler starts */
+	TR_IO_SUBMIT,		/* server: backend I/O issued */
+	TR_IO_DONE,		/* server: backend I/O complete */
+	TR_RSP_SEND,		/* server: response written */
+	TR_CLI_DONE,		/* client: response matched to the request */
+	TR_NSTAGES
+};
+
+struct trace_rec {
+	uint32_t	id;
+	uint16_t	stage;
+	uint16_t	tid;		/* tracing thread, for the file only */
+	uint64_t	ns;
+};
+
+#define TRACE_RINGSZ	4096		/* records per thread, power of 2 */
+
+extern const char	*trace_stage_name[TR_NSTAGES];
+extern int		trace_rate;	/* 0: off, nothing recorded */
+
+uint64_t trace_now(void);
+uint32_t trace_sample(void);
+void trace_rec(uint32_t id, int stage, uint64_t ns);
+int trace_start(const char *fname, int rate);
+void trace_flush(void);
+void trace_stop(void);
+
+static inline void trace(uint32_t id, int stage)
+{
+	if (id != 0) {
+		trace_rec(id, stage, trace_now());
+	}
+}
+
+#endif /* TRACE_H */
@@ -40,6 +40,7 @@ enum vioerr {
 	VE_METAIOERR,	// 6 metadata io failure
 	VE_INVALID_BLK,	// 7 ssd does not have the required block data
 	VE_ELSEEK,	// 8 lseek failure
+	VE_NOSPC,	// 9 no clean block left to evict
 };
 
 enum vioreqtype {
@@ -179,6 +180,14 @@ err_t voi_flush(vssd_t *vssd, cache_flush_fn_t cb, void *opaque);
 
 void vssd_stats_display(int ssd_id, vssd_t *vssd);
 
+/*
+ * bind a vssd to the SSD (file or device) at path, formatting it if it
+ * holds no vssd yet; the vssd is then used by tasks of the calling thread
+ */
+int vssd_attach(vssdid_t vssdid, cdevid_t cdevid, const char *path);
+int vssd_detach(vssdid_t vssdid);
+vssd_t *vio_vssd(devhandle_t h);
+
 #endif /* __VSSD_H__ */
 
 
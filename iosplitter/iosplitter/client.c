@@ -10,6 +10,7 @@
 #include "libtask/task.h"
 #include "libtask/taskio.h"
 #include "tst-rpc.h"
+#include "trace.h"
 
 typedef struct props {
 	char *serverip;
@@ -18,6 +19,9 @@ typedef struct props {
 
 props_t p = {0};
 
+#define READ_TIMEOUT	(1000000000ULL)	/* ns per try */
+#define READ_TRIES	3
+
 rpc_chan_t      rcp;
 
 Rendez tmain_cond;
@@ -82,9 +86,9 @@ int do_read(uint64_t len, uint64_t offset)
 	r->offset	= offset;
 	r->len          = len;
 
-	rc = rpc_request(&rcp, rm);
+	rc = rpc_request_retry(&rcp, rm, READ_TIMEOUT, READ_TRIES);
 	if (rc != 0) {
-		fprintf(stderr, "rpc_request failed. rerun.\n");
+		fprintf(stderr, "rpc_request failed with %d. rerun.\n", rc);
 		rc = -1;
 		goto error;
 	}
@@ -263,7 +267,14 @@ int main(int argc, char **argv)
 	p.serverip = strdup(argv[1]);
 	p.port      = SPORT;
 
+	/* client <serverip> [tracefile]: trace 1 in 16 requests */
+	if (argc > 2 && trace_start(argv[2], 16) != 0) {
+		perror(argv[2]);
+		exit(1);
+	}
+
 	libtask_start(tmain, NULL);
 	tasksleep(&tmain_cond);
+	trace_stop();
 	return 0;
 }
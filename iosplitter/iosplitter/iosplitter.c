@@ -2,12 +2,16 @@
 #define _FILE_OFFSET_BITS 64
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
 #include <assert.h>
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
@@ -16,8 +20,19 @@
 #include "libtask/task.h"
 #include "libtask/taskio.h"
 #include "tst-rpc.h"
+#include "splitter.h"
+#include "blkcache.h"
+#include "stats.h"
+#include "readahead.h"
+#include "wlog.h"
+#include "trace.h"
 
 #define NO_THREADS 32
+#define ACCEPT_RETRY_MS	10	/* after EMFILE and the like */
+
+/* worker pool mode */
+#define NO_WORKERS_MAX	64
+#define WORKER_PENDMAX	256
 
 /* TODO:
    	0. Change tst-rpc.h so that mpp<-->iosplitter comn would work.
@@ -26,7 +41,7 @@
 	2. Design RPC messages structures which gets communicated in
 	   MPP and IOsplitter
 	3. CVA can only handle 4k IOs. Split and communicate IOs from iosplitter
-	   to MPP 
+	   to MPP (-s, see splitter.c)
 */
 
 struct thread_data {
@@ -39,6 +54,63 @@ struct thread_data {
 static struct thread_data	td[NO_THREADS];
 static int			tcount = 0;
 
+/*
+ * Worker pool mode (-w <n>)
+ *
+ * A fixed number of worker pthreads is started at boot. Each of them runs its
+ * own libtask scheduler and taskio instance (epoll fd, libaio context). The
+ * acceptor task in the main thread sleeps in tasknet_accept_raw() until a
+ * client connects, picks the worker owning the fewest sessions, queues the fd
+ * on worker->pend[] and rings worker->efd. The eventfd is registered with the
+ * worker's taskio, so aiotask there spawns worker_session_task() which adopts
+ * the connection. All tasks of a session stay on one thread for its lifetime.
+ */
+struct worker {
+	pthread_t	thread;
+	int		id;
+	int		efd;		/* eventfd doorbell for session handoff */
+	pthread_mutex_t	lock;		/* protects pend[], phead, ptail */
+	int		pend[WORKER_PENDMAX];
+	int		phead;
+	int		ptail;
+	int		nsessions;	/* sessions owned, updated atomically */
+	Rendez		cond;
+};
+
+/* a session accepted by the worker itself, see worker_accept_task */
+struct worker_conn {
+	struct worker	*w;
+	int		fd;
+};
+
+/* w is NULL in thread per session mode */
+struct srv_session {
+	struct worker	*w;
+	int		fd;
+	rpc_chan_t	*rcp;
+	struct splitter	sp;
+	struct readahead ra;
+};
+
+static struct worker		*workers;
+static int			nworkers = 0;
+static int			reuseport = 0;	/* listener per worker */
+static int			qdepth = NTASK;	/* per session */
+static int			splitfanout = 0; /* -s, 0: splitter not used */
+static size_t			rabudget = 0;	/* -a, 0: no read-ahead */
+static uint64_t			spinns = 0;	/* -p, 0: sessions block */
+static int			stackless = 0;	/* -k: no handler task for I/O */
+static int			stackauto = 0;	/* -z: size task stacks by use */
+
+/* -c: DRAM read cache shared by all sessions, dev_handle is device 0 */
+static blkcache_t		*cache;
+
+/* -l: writes are staged in a log at the end of the SSD */
+static wlog_t			*wlog;
+
+/* -a: read-ahead of all sessions is invalidated by writes from any */
+static struct ra_dev		radev;
+
 Rendez main_end;
 
 int dev_handle = -1;
@@ -108,13 +180,22 @@ static ssize_t safe_pread(int fd, char *buf, size_t count, uint64_t off)
 	return bc;
 }
 
-static inline int ssd_write(int dev_handle, rpc_msg_t *msgp)
+static inline int ssd_write(int dev_handle, struct splitter *sp,
+		rpc_msg_t *msgp)
 {
 	write_cmd_t *w     = (write_cmd_t *) &msgp->hdr;
 	char        *buf   = msgp->payload;
 	uint64_t    offset = w->offset;
 	uint64_t    len    = w->len;
 
+	if (wlog != NULL) {
+		return wlog_write(wlog, buf, len, offset);
+	}
+
+	if (sp != NULL) {
+		return splitter_write(sp, buf, len, offset);
+	}
+
 	if (len != safe_pwrite(dev_handle, buf, len, offset)) {
 		return -1;
 	}
@@ -122,12 +203,12 @@ static inline int ssd_write(int dev_handle, rpc_msg_t *msgp)
 	return 0;
 }
 
-static inline int ssd_read(int dev_handle, rpc_msg_t *msgp)
+static inline int ssd_read_home(int dev_handle, struct splitter *sp,
+		char *buf, uint64_t len, uint64_t offset)
 {
-	read_cmd_t  *r     = (read_cmd_t *) &msgp->hdr;
-	char        *buf   = msgp->payload;
-	uint64_t    offset = r->offset;
-	uint64_t    len    = r->len;
+	if (sp != NULL) {
+		return splitter_read(sp, buf, len, offset);
+	}
 
 	if (len != safe_pread(dev_handle, buf, len, offset)) {
 		return -1;
@@ -135,19 +216,313 @@ static inline int ssd_read(int dev_handle, rpc_msg_t *msgp)
 	return 0;
 }
 
+static inline int ssd_read(int dev_handle, struct splitter *sp,
+		rpc_msg_t *msgp)
+{
+	read_cmd_t    *r     = (read_cmd_t *) &msgp->hdr;
+	char          *buf   = msgp->payload;
+	uint64_t      offset = r->offset;
+	uint64_t      len    = r->len;
+	wlog_ticket_t tkt;
+	int           rc;
+
+	/* staged writes are not at home yet */
+	do {
+		if (wlog != NULL) {
+			wlog_ticket(wlog, offset, len, &tkt);
+		}
+		rc = ssd_read_home(dev_handle, sp, buf, len, offset);
+	} while (rc == 0 && wlog != NULL &&
+			wlog_overlay(wlog, buf, len, offset, &tkt) != 0);
+
+	return rc;
+}
+
+/* read-ahead reader when writes are staged */
+static ssize_t wlog_ra_reader(void *arg, char *buf, uint64_t len,
+		uint64_t offset)
+{
+	wlog_ticket_t	tkt;
+	ssize_t		n;
+
+	do {
+		wlog_ticket(wlog, offset, len, &tkt);
+		if (task_aioread(dev_handle, buf, len, offset, &n) != 0 ||
+				n <= 0) {
+			return (-1);
+		}
+	} while (wlog_overlay(wlog, buf, n, offset, &tkt) != 0);
+
+	return (n);
+}
+
+static struct srv_session *session_new(struct worker *w, int fd)
+{
+	struct srv_session	*s;
+	int			rc;
+
+	s = calloc(1, sizeof(*s));
+	assert(s != NULL);
+
+	s->w   = w;
+	s->fd  = fd;
+	s->rcp = rpc_chan_new();
+	assert(s->rcp != NULL);
+
+	if (splitfanout != 0) {
+		rc = splitter_init(&s->sp, dev_handle, splitfanout, SPL_MAXIO);
+		assert(rc == 0);
+	}
+	if (rabudget != 0) {
+		rc = ra_init(&s->ra, &radev, dev_handle, rabudget);
+		assert(rc == 0);
+		if (wlog != NULL) {
+			ra_set_reader(&s->ra, wlog_ra_reader, NULL);
+		}
+	}
+	return (s);
+}
+
+/* waits for read-ahead still in flight */
+static void session_free(struct srv_session *s)
+{
+	char	name[32];
+
+	if (splitfanout != 0) {
+		splitter_deinit(&s->sp);
+	}
+	if (rabudget != 0) {
+		ra_deinit(&s->ra);
+		snprintf(name, sizeof(name), "session %d", s->fd);
+		ra_stats(&s->ra, name);
+	}
+	if (stackauto) {
+		/* of the session's thread */
+		taskstackprint(1);
+	}
+	free(s);
+}
+
+static void session_closed(struct srv_session *s)
+{
+	struct worker *w = s->w;
+
+	rpc_chan_close(s->rcp);
+	rpc_chan_deinit(s->rcp);
+	rpc_chan_free(s->rcp);
+	session_free(s);
+
+	__sync_fetch_and_sub(&w->nsessions, 1);
+}
+
 static void rpc_conn_closed(rpc_chan_t *rcp)
 {
+	struct srv_session *s = rcp->usrcntxt;
+
+	if (s->w != NULL) {
+		/* worker pool mode: taskio is shared by all sessions of worker */
+		session_closed(s);
+		return;
+	}
+
 	rpc_chan_close(rcp);
 	rpc_chan_deinit(rcp);
+	session_free(s);
 	taskio_deinit();
 }
 
+static struct splitter *msg_splitter(rpc_msg_t *msgp)
+{
+	struct srv_session *s = msgp->rcp->usrcntxt;
 
-void rpc_msg_handler(void *arg)
+	return (splitfanout != 0 ? &s->sp : NULL);
+}
+
+static struct readahead *msg_readahead(rpc_msg_t *msgp)
+{
+	struct srv_session *s = msgp->rcp->usrcntxt;
+
+	return (rabudget != 0 ? &s->ra : NULL);
+}
+
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static void msg_respond(rpc_msg_t *msgp)
 {
 	uint64_t r;
+
+	r = req_recv++;
+	if (r % 100 == 0) {
+		printf("r = %lu\n", r);
+	}
+	rpc_response(msgp->rcp, msgp);
+}
+
+/*
+ * rpc fastpath, runs in the recv task: answer reads that hit the DRAM
+ * cache without creating a handler task
+ */
+static int cache_fastpath(rpc_msg_t *msgp)
+{
+	read_cmd_t	*rd = (read_cmd_t *) &msgp->hdr;
+	uint64_t	t0;
+
+	if (RPC_GETMSGTYPE(msgp) != RPC_READ_MSG) {
+		return (-1);
+	}
+
+	if (wlog != NULL && wlog_inlog(wlog, rd->offset, rd->len)) {
+		return (-1);
+	}
+
+	trace(msgp->hdr.traceid, TR_HANDLER);
+	t0 = now_ns();
+	rpc_databuf_get(msgp->rcp, &msgp->payload);
+	if (blkcache_read(cache, 0, rd->offset, rd->len, msgp->payload) != 0) {
+		rpc_databuf_put(msgp->rcp, msgp->payload);
+		msgp->payload = NULL;
+		return (-1);
+	}
+	blkcache_latency(cache, 1, now_ns() - t0);
+
+	msgp->hdr.payloadlen = rd->len;
+	msgp->hdr.status     = 0;
+	msg_respond(msgp);
+	return (0);
+}
+
+static void cont_done(taskcont_t *k)
+{
+	rpc_msg_t	*msgp = k->arg;
+
+	trace(msgp->hdr.traceid, TR_IO_DONE);
+	msgp->hdr.status = (k->res == 0) ? 0 : -1;
+	if (RPC_GETMSGTYPE(msgp) == RPC_WRITE_MSG) {
+		rpc_databuf_put(msgp->rcp, msgp->payload);
+		msgp->payload = NULL;
+		msgp->hdr.payloadlen = 0;
+	}
+	free(k);
+	msg_respond(msgp);
+}
+
+/*
+ * -k: rpc fastpath, runs in the recv task: reads and writes that go
+ * straight to the device are answered from their aio completion, with
+ * no handler task and its stack in between
+ */
+static int cont_fastpath(rpc_msg_t *msgp)
+{
+	read_cmd_t	*rd;
+	write_cmd_t	*wr;
+	taskcont_t	*k;
+	uint64_t	offset, len;
+	tirw_t		rw;
+	int		rc;
+
+	switch (RPC_GETMSGTYPE(msgp)) {
+	case RPC_READ_MSG:
+		assert(msgp->payload == NULL && msgp->hdr.payloadlen == 0);
+		rd = (read_cmd_t *) &msgp->hdr;
+		offset = rd->offset;
+		len = rd->len;
+		rw = TASKIO_READ;
+		rpc_databuf_get(msgp->rcp, &msgp->payload);
+		msgp->hdr.payloadlen = len;
+		break;
+	case RPC_WRITE_MSG:
+		wr = (write_cmd_t *) &msgp->hdr;
+		offset = wr->offset;
+		len = wr->len;
+		rw = TASKIO_WRITE;
+		assert(msgp->payload != NULL && msgp->hdr.payloadlen == len);
+		break;
+	default:
+		return (-1);
+	}
+
+	k = malloc(sizeof(*k));
+	assert(k != NULL);
+	task_cont_init(k, cont_done, msgp);
+	trace(msgp->hdr.traceid, TR_HANDLER);
+	trace(msgp->hdr.traceid, TR_IO_SUBMIT);
+	rc = task_cont_aiorw(k, dev_handle, msgp->payload, len, offset, rw);
+	assert(rc == 0);
+	return (0);
+}
+
+static void cache_read(rpc_msg_t *msgp)
+{
+	read_cmd_t		*rd = (read_cmd_t *) &msgp->hdr;
+	blkcache_ticket_t	tkt;
+	uint64_t		t0;
+
+	t0 = now_ns();
+	blkcache_ticket(cache, 0, rd->offset, rd->len, &tkt);
+	msgp->hdr.status = ssd_read(dev_handle, msg_splitter(msgp), msgp);
+	if (msgp->hdr.status == 0) {
+		blkcache_fill(cache, 0, rd->offset, rd->len, msgp->payload,
+				&tkt);
+	}
+	blkcache_latency(cache, 0, now_ns() - t0);
+}
+
+/*
+ * the rpc and taskio counters of the calling thread, summed over the
+ * threads by name. Every thread running sessions calls this once.
+ */
+static void thread_stats_export(void)
+{
+	stat_export_u64("rpc responses sent", &g_rsp_sent);
+	stat_export_u64("rpc msgs sent", &g_rpc_send_msgs);
+	stat_export_u64("rpc send writevs", &g_rpc_send_writevs);
+	stat_export_u64("rpc reads issued", &g_rpc_recv_task_reads_issued);
+	stat_export_u64("rpc reads done", &g_rpc_recv_task_reads_done);
+	stat_export_u64("task net io sleeps", &g_task_net_io_sleep);
+	stat_export_u64("task aio io sleeps", &g_task_aio_io_sleep);
+	stat_export_u64("libaio completions", &g_libaio_done);
+	if (spinns != 0) {
+		stat_export_u64("taskio poll ns", &g_taskio_spin_ns);
+		stat_export_u64("taskio poll hits", &g_taskio_spin_hits);
+		stat_export_u64("taskio poll ns in hits", &g_taskio_spin_hit_ns);
+		stat_export_u64("taskio poll misses", &g_taskio_spin_misses);
+		stat_export_u64("taskio epoll sleeps", &g_taskio_blocks);
+	}
+	if (stackless) {
+		stat_export_u64("task continuations", &g_task_cont_runs);
+		stat_export_u64("task aio slot waits", &g_task_aio_waits);
+	}
+}
+
+static void *stats_thread(void *arg)
+{
+	while (1) {
+		sleep(1);
+		if (cache != NULL) {
+			blkcache_stats(cache, 1);
+		}
+		if (wlog != NULL) {
+			wlog_stats(wlog);
+		}
+	}
+	return (NULL);
+}
+
+void rpc_msg_handler(void *arg)
+{
 	uint64_t len = 0;
 	rpc_msg_t *msgp = arg;
+	struct readahead *ra;
+	read_cmd_t *rd;
+	write_cmd_t *wr;
+	blkcache_ticket_t tkt;
 
 	if (RPC_IS_CONNCLOSED(msgp)) {
 		rpc_msg_put(msgp->rcp, msgp);
@@ -156,6 +531,8 @@ void rpc_msg_handler(void *arg)
 		printf("%s: <== rpc connection closed\n", __func__);
 		return;
 	}
+	taskclass("rpc_msg_handler");
+	trace(msgp->hdr.traceid, TR_HANDLER);
 
 	switch (RPC_GETMSGTYPE(msgp)) {
 	case RPC_OPEN_MSG:
@@ -164,17 +541,48 @@ void rpc_msg_handler(void *arg)
 		break;
 	case RPC_READ_MSG:
 		assert(msgp->payload == NULL && msgp->hdr.payloadlen == 0);
-		len = ((read_cmd_t*)&msgp->hdr)->len;
+		rd  = (read_cmd_t *) &msgp->hdr;
+		len = rd->len;
 		rpc_databuf_get(msgp->rcp, &msgp->payload);
 		msgp->hdr.payloadlen = len;
 
-		msgp->hdr.status = ssd_read(dev_handle, msgp);
-		assert(msgp->hdr.status == 0);
+		trace(msgp->hdr.traceid, TR_IO_SUBMIT);
+		ra = msg_readahead(msgp);
+		if (wlog != NULL && wlog_inlog(wlog, rd->offset, len)) {
+			msgp->hdr.status = -1;
+		} else if (ra != NULL &&
+				ra_read(ra, msgp->payload, len, rd->offset) == 0) {
+			msgp->hdr.status = 0;
+		} else if (cache != NULL) {
+			cache_read(msgp);
+		} else {
+			msgp->hdr.status = ssd_read(dev_handle,
+					msg_splitter(msgp), msgp);
+		}
+		trace(msgp->hdr.traceid, TR_IO_DONE);
 		break;
 	case RPC_WRITE_MSG:
-		len = ((write_cmd_t *)&msgp->hdr)->len;
+		wr  = (write_cmd_t *) &msgp->hdr;
+		len = wr->len;
 		assert(msgp->payload != NULL && msgp->hdr.payloadlen == len);
-		msgp->hdr.status = ssd_write(dev_handle, msgp);
+		trace(msgp->hdr.traceid, TR_IO_SUBMIT);
+		if (cache != NULL) {
+			blkcache_write_begin(cache, 0, wr->offset, len, &tkt);
+		}
+		if (rabudget != 0) {
+			ra_write_begin(&radev, len, wr->offset);
+		}
+		msgp->hdr.status = ssd_write(dev_handle, msg_splitter(msgp),
+				msgp);
+		trace(msgp->hdr.traceid, TR_IO_DONE);
+		if (cache != NULL) {
+			blkcache_write_end(cache, 0, wr->offset, len,
+					msgp->hdr.status == 0 ?
+					msgp->payload : NULL, &tkt);
+		}
+		if (rabudget != 0) {
+			ra_write_end(&radev, len, wr->offset);
+		}
 
 		rpc_databuf_put(msgp->rcp, msgp->payload);
 		msgp->payload = NULL;
@@ -184,12 +592,7 @@ void rpc_msg_handler(void *arg)
 		assert(0);
 	}
 
-	r = req_recv++;
-	if (r % 100 == 0) {
-		printf("r = %lu\n", r);
-	}
-	rpc_response(msgp->rcp, msgp);
-
+	msg_respond(msgp);
 }
 
 void server_resp_handler(rpc_msg_t *msgp)
@@ -207,6 +610,7 @@ int open_ssd(char *dev)
 void task_new_session(void *arg)
 {
 	struct thread_data	*t = arg;
+	struct srv_session	*s;
 	int			rc;
 	session_t		client_session;
 
@@ -222,20 +626,27 @@ void task_new_session(void *arg)
 
 	rc = taskio_init();
 	assert(rc == 0);
+	taskio_set_spin(spinns);
+	thread_stats_export();
 
 	taskio_start();
 	rc = tasknet_setnoblock(t->fd);
 	assert(rc == 0);
 
-	t->rcp = rpc_chan_new();
-	assert(t->rcp != NULL);
+	s = session_new(NULL, t->fd);
+	t->rcp = s->rcp;
 
 	rc = task_sockfd_register(t->fd);
 	assert(rc == 0);
 
-	rc = rpc_chan_init(t->rcp, t->fd, t->fd, NTASK, MAXMSGSZ, PAYLOADSZ,
-			NTASK * 2, rpc_msg_handler, NULL);
+	rc = rpc_chan_init(t->rcp, t->fd, t->fd, qdepth, MAXMSGSZ, PAYLOADSZ,
+			qdepth * 2, rpc_msg_handler, s);
 	assert(rc == 0);
+	if (cache != NULL) {
+		rpc_chan_set_fastpath(t->rcp, cache_fastpath);
+	} else if (stackless) {
+		rpc_chan_set_fastpath(t->rcp, cont_fastpath);
+	}
 
 	memset(&t->cond, 0, sizeof(t->cond));
 
@@ -260,14 +671,263 @@ void *trd_new_session(void *arg)
 	   mpp-iosplitter works with multiple block sizes.
  */
 
+static int worker_pend_pop(struct worker *w)
+{
+	int fd;
+
+	pthread_mutex_lock(&w->lock);
+	assert(w->phead != w->ptail);
+	fd = w->pend[w->phead];
+	w->phead = (w->phead + 1) % WORKER_PENDMAX;
+	pthread_mutex_unlock(&w->lock);
+	return fd;
+}
+
+static int worker_pend_push(struct worker *w, int fd)
+{
+	int next;
+
+	pthread_mutex_lock(&w->lock);
+	next = (w->ptail + 1) % WORKER_PENDMAX;
+	if (next == w->phead) {
+		pthread_mutex_unlock(&w->lock);
+		return -1;
+	}
+	w->pend[w->ptail] = fd;
+	w->ptail = next;
+	pthread_mutex_unlock(&w->lock);
+	return 0;
+}
+
+/*
+ * read the session establishment message and start the rpc channel.
+ * fd is registered with taskio of the calling thread.
+ */
+static void session_setup(struct worker *w, int fd)
+{
+	struct srv_session	*s;
+	session_t		client_session;
+	int			rc;
+
+	rc = task_netread(fd, (char *) &client_session, sizeof(client_session));
+	if (rc != 0 || client_session.type != SESSION_CLIENT) {
+		printf("worker %d: client session establishment failed\n",
+				w->id);
+		close(fd);
+		task_fd_deregister(fd);
+		__sync_fetch_and_sub(&w->nsessions, 1);
+		return;
+	}
+
+	s = session_new(w, fd);
+
+	rc = rpc_chan_init(s->rcp, fd, fd, qdepth, MAXMSGSZ, PAYLOADSZ,
+			qdepth * 2, rpc_msg_handler, s);
+	assert(rc == 0);
+	if (cache != NULL) {
+		rpc_chan_set_fastpath(s->rcp, cache_fastpath);
+	} else if (stackless) {
+		rpc_chan_set_fastpath(s->rcp, cont_fastpath);
+	}
+}
+
+/*
+ * spawned by aiotask of the worker, once for every fd handed off to it
+ */
+static void worker_session_task(void *arg)
+{
+	struct worker	*w = arg;
+	int		fd;
+	int		rc;
+
+	taskname("%s", __func__);
+
+	fd = worker_pend_pop(w);
+
+	rc = task_sockfd_register(fd);
+	assert(rc == 0);
+
+	session_setup(w, fd);
+}
+
+static void worker_conn_task(void *arg)
+{
+	struct worker_conn	*c = arg;
+	struct worker		*w = c->w;
+	int			fd = c->fd;
+
+	taskname("%s", __func__);
+	free(c);
+	session_setup(w, fd);
+}
+
+/*
+ * reuseport mode: every worker owns a SO_REUSEPORT listener on SPORT and
+ * accepts its own sessions, no handoff between threads.
+ */
+/* the listening socket itself is broken, accepting again cannot help */
+static int accept_fatal(int err)
+{
+	return (err == EBADF || err == EINVAL || err == ENOTSOCK);
+}
+
+static void worker_accept_task(void *arg)
+{
+	struct worker		*w = arg;
+	struct worker_conn	*c;
+	int			pubfd;
+	int			fd;
+	int			rc;
+
+	taskname("%s %d", __func__, w->id);
+
+	rc = tasknet_announce_reuseport(SIP, SPORT, &pubfd);
+	assert(rc == 0);
+
+	while (1) {
+		rc = tasknet_accept(pubfd, NULL, NULL, &fd);
+		if (rc != 0) {
+			fprintf(stderr, "worker %d: accept failed: %s\n",
+					w->id, strerror(rc));
+			if (accept_fatal(rc)) {
+				break;
+			}
+			taskdelay(ACCEPT_RETRY_MS);
+			continue;
+		}
+
+		c = malloc(sizeof(*c));
+		assert(c != NULL);
+		c->w  = w;
+		c->fd = fd;
+		__sync_fetch_and_add(&w->nsessions, 1);
+		taskcreate(worker_conn_task, c, 32 * 1024);
+	}
+}
+
+static void worker_main(void *arg)
+{
+	struct worker	*w = arg;
+	int		rc;
+
+	taskname("worker_main %d", w->id);
+
+	rc = taskio_init();
+	assert(rc == 0);
+	taskio_set_spin(spinns);
+	thread_stats_export();
+
+	taskio_start();
+
+	rc = task_eventfd_register(w->efd, worker_session_task, w);
+	assert(rc == 0);
+
+	if (reuseport) {
+		taskcreate(worker_accept_task, w, 32 * 1024);
+	}
+
+	memset(&w->cond, 0, sizeof(w->cond));
+	tasksleep(&w->cond);
+}
+
+void *trd_worker(void *arg)
+{
+	libtask_start(worker_main, arg);
+	pthread_exit(NULL);
+}
+
+static void workers_start(int n)
+{
+	struct worker	*w;
+	int		i;
+	int		rc;
+
+	assert(n > 0 && n <= NO_WORKERS_MAX);
+
+	workers = calloc(n, sizeof(*workers));
+	assert(workers != NULL);
+
+	for (i = 0; i < n; i++) {
+		w      = &workers[i];
+		w->id  = i;
+		w->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		assert(w->efd >= 0);
+
+		rc = pthread_mutex_init(&w->lock, NULL);
+		assert(rc == 0);
+
+		rc = pthread_create(&w->thread, NULL, trd_worker, w);
+		assert(rc == 0);
+	}
+	nworkers = n;
+}
+
+static struct worker *worker_least_loaded(void)
+{
+	struct worker	*w;
+	int		i;
+	int		n;
+	int		min;
+
+	w   = &workers[0];
+	min = __sync_fetch_and_add(&w->nsessions, 0);
+	for (i = 1; i < nworkers && min != 0; i++) {
+		n = __sync_fetch_and_add(&workers[i].nsessions, 0);
+		if (n < min) {
+			min = n;
+			w   = &workers[i];
+		}
+	}
+	return w;
+}
+
+static int worker_handoff(int fd)
+{
+	struct worker	*w;
+	uint64_t	v = 1;
+
+	w = worker_least_loaded();
+	if (worker_pend_push(w, fd) < 0) {
+		return -1;
+	}
+
+	__sync_fetch_and_add(&w->nsessions, 1);
+	if (write(w->efd, &v, sizeof(v)) != sizeof(v)) {
+		perror("worker_handoff: eventfd write");
+		assert(0);
+	}
+	return 0;
+}
+
+static int thread_per_session(int fd)
+{
+	int            t;
+	int            rc;
+	pthread_attr_t a;
+
+	if (tcount >= NO_THREADS) {
+		return -1;
+	}
+
+	t = tcount++;
+	td[t].fd = fd;
+	rc = pthread_attr_init(&a);
+	assert(rc == 0);
+
+	rc = pthread_attr_setdetachstate(&a, PTHREAD_CREATE_DETACHED);
+	assert(rc == 0);
+
+	rc = pthread_create(&td[t].thread, &a, trd_new_session, &td[t]);
+	assert(rc == 0);
+	return 0;
+}
+
 void server_setup(void *arg)
 {
 	char           *ip = arg;
 	int            rc;
 	int            pubfd;
 	int            infd;
-	int            t;
-	pthread_attr_t a;
 
 	taskname("%s", __func__);
 
@@ -283,30 +943,29 @@ void server_setup(void *arg)
 	assert(pubfd >= 0);
 
 	while (1) {
-
-		while(1) {
-			if ((infd = accept(pubfd, NULL, NULL)) == -1) {
-				if (errno != EAGAIN || errno != EWOULDBLOCK) {
-					perror("accpet:");
-					assert(0);
-				}
-			} else {
-				assert(infd >= 0);
+		/* sleeps in epoll until a connection shows up */
+		rc = tasknet_accept_raw(pubfd, NULL, NULL, &infd);
+		if (rc != 0) {
+			fprintf(stderr, "accept failed: %s\n", strerror(rc));
+			if (accept_fatal(rc)) {
 				break;
 			}
+			/* out of fds or an aborted connection, try again */
+			taskdelay(ACCEPT_RETRY_MS);
+			continue;
 		}
+		assert(infd >= 0);
 
-		t = tcount++;
-		td[t].fd = infd;
-		rc = pthread_attr_init(&a);
-		assert(rc == 0);
-
-		rc = pthread_attr_setdetachstate(&a, PTHREAD_CREATE_DETACHED);
-		assert(rc == 0);
-
-		rc = pthread_create(&td[t].thread, &a, trd_new_session, &td[t]);
-		assert(rc == 0);
+		if (nworkers > 0) {
+			rc = worker_handoff(infd);
+		} else {
+			rc = thread_per_session(infd);
+		}
 
+		if (rc < 0) {
+			fprintf(stderr, "too many sessions, connection refused\n");
+			close(infd);
+		}
 	}
 
 	taskwakeup(&main_end);
@@ -315,30 +974,128 @@ void server_setup(void *arg)
 static void usage(const char *s)
 {
 	fprintf(stderr, "Usage:\n");
-	fprintf(stderr, "%s [-d <SSD>]\n", s);
+	fprintf(stderr, "%s [-d <SSD>] [-w <nworkers> [-r]] [-q <depth>] "
+			"[-s <fanout>] [-c <MB>] [-a <KB>] [-l <MB>] [-t <file>] "
+			"[-p <us>] [-k] [-z]\n",
+			s);
+	fprintf(stderr, "\t-w: serve sessions from a fixed pool of nworkers "
+			"threads (max %d)\n", NO_WORKERS_MAX);
+	fprintf(stderr, "\t-r: each worker listens on its own SO_REUSEPORT "
+			"socket\n");
+	fprintf(stderr, "\t-q: requests in flight per session (default %d)\n",
+			NTASK);
+	fprintf(stderr, "\t-s: split/merge I/O on %d byte blocks, up to fanout "
+			"backend I/Os in flight per batch\n", SPL_BLKSZ);
+	fprintf(stderr, "\t-c: DRAM read cache of MB megabytes, stats are "
+			"printed every 5 seconds\n");
+	fprintf(stderr, "\t-a: detect sequential streams and read ahead of "
+			"them, up to KB kilobytes buffered per session\n");
+	fprintf(stderr, "\t-l: stage writes in a log of MB megabytes at the "
+			"end of the SSD, acked once logged\n");
+	fprintf(stderr, "\t-t: append the stages of traced requests to file, "
+			"see tools/cbtrace\n");
+	fprintf(stderr, "\t-p: session threads poll for up to us microseconds "
+			"before sleeping in epoll, window adapted to the load\n");
+	fprintf(stderr, "\t-k: serve reads and writes from their aio "
+			"completion, no handler task each; not with -s, -a, "
+			"-c or -l\n");
+	fprintf(stderr, "\t-z: measure task stack use, and give tasks the "
+			"smallest stack that fits what they used so far\n");
 }
 
 int main(int argc, char *argv[])
 {
+	struct rlimit	rl;
 	char	*ssd;
 	int	opt;
 	int     rc;
-
-	ssd = NULL;
-
-	while ((opt = getopt(argc, argv, "d:h")) != -1) {
+	int	nw;
+	int	cachemb;
+	int	logmb;
+	char	*tracefile;
+
+	ssd     = NULL;
+	nw      = 0;
+	cachemb = 0;
+	logmb   = 0;
+	tracefile = NULL;
+
+	while ((opt = getopt(argc, argv, "d:w:rq:s:c:a:l:t:p:kzh")) != -1) {
 		switch (opt) {
 			case 'd':
 				ssd = strdup(optarg);
 				assert(ssd != NULL);
 				break;
+			case 'w':
+				nw = atoi(optarg);
+				if (nw <= 0 || nw > NO_WORKERS_MAX) {
+					usage(argv[0]);
+					return (EINVAL);
+				}
+				break;
+			case 'r':
+				reuseport = 1;
+				break;
+			case 'q':
+				qdepth = atoi(optarg);
+				if (qdepth <= 0) {
+					usage(argv[0]);
+					return (EINVAL);
+				}
+				break;
+			case 's':
+				splitfanout = atoi(optarg);
+				if (splitfanout <= 0) {
+					usage(argv[0]);
+					return (EINVAL);
+				}
+				break;
+			case 'c':
+				cachemb = atoi(optarg);
+				if (cachemb <= 0) {
+					usage(argv[0]);
+					return (EINVAL);
+				}
+				break;
+			case 'a':
+				rabudget = (size_t) atoi(optarg) << 10;
+				if (rabudget < RA_MINWIN) {
+					usage(argv[0]);
+					return (EINVAL);
+				}
+				break;
+			case 'l':
+				logmb = atoi(optarg);
+				if (logmb <= 0) {
+					usage(argv[0]);
+					return (EINVAL);
+				}
+				break;
+			case 't':
+				tracefile = optarg;
+				break;
+			case 'p':
+				spinns = (uint64_t) atoi(optarg) * 1000;
+				if (spinns == 0) {
+					usage(argv[0]);
+					return (EINVAL);
+				}
+				break;
+			case 'k':
+				stackless = 1;
+				break;
+			case 'z':
+				stackauto = 1;
+				taskstackmode(TASKSTACK_AUTO);
+				break;
 			case 'h':
 				usage(argv[0]);
 				return (0);
 		}
 	}
 
-	if (ssd == NULL) {
+	if (ssd == NULL || (reuseport && nw == 0) || (stackless &&
+			(splitfanout || rabudget || cachemb || logmb))) {
 		usage(argv[0]);
 		return (EINVAL);
 	}
@@ -346,6 +1103,78 @@ int main(int argc, char *argv[])
 	rc = open_ssd(ssd);
 	assert(rc == 0);
 
+	if (logmb > 0) {
+		uint64_t	devsz;
+		uint64_t	logsz = (uint64_t) logmb << 20;
+
+		devsz = lseek(dev_handle, 0, SEEK_END);
+		if (devsz == (uint64_t) -1 || devsz < 2 * logsz) {
+			fprintf(stderr, "%s: too small for a %d MB log\n", ssd,
+					logmb);
+			return (EINVAL);
+		}
+		wlog = malloc(sizeof(*wlog));
+		assert(wlog != NULL);
+		rc = wlog_init(wlog, dev_handle, (devsz - logsz) & ~4095ULL,
+				logsz);
+		if (rc != 0) {
+			fprintf(stderr, "%s: cannot set up a %d MB log\n", ssd,
+					logmb);
+			return (EINVAL);
+		}
+		printf("write log at %lu, replayed %lu records\n",
+				wlog->base, wlog->nreplayed);
+	}
+
+	if (cachemb > 0) {
+		cache = malloc(sizeof(*cache));
+		assert(cache != NULL);
+		rc = blkcache_init(cache, (size_t) cachemb << 20);
+		assert(rc == 0);
+	}
+
+	/* live counters for tools/cbstat */
+	thread_stats_export();
+	if (wlog != NULL) {
+		stat_export_u64("wlog commits", &wlog->ncommits);
+		stat_export_u64("wlog records", &wlog->nrecs);
+		stat_export_u64("wlog bytes logged", &wlog->nlogged);
+		stat_export_u64("wlog records destaged", &wlog->ndestaged);
+	}
+	rc = stats_shm_start(NULL, 1000);
+	if (rc != 0) {
+		fprintf(stderr, "statistics not exported: %s\n", strerror(rc));
+	}
+
+	/* clients pick the requests, trace every one that carries an id */
+	if (tracefile != NULL && (rc = trace_start(tracefile, 1)) != 0) {
+		fprintf(stderr, "%s: %s\n", tracefile, strerror(rc));
+		return (rc);
+	}
+
+	if (cache != NULL || wlog != NULL) {
+		pthread_t	st;
+
+		rc = pthread_create(&st, NULL, stats_thread, NULL);
+		assert(rc == 0);
+	}
+
+	/* a session costs one fd, allow as many as the hard limit does */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	if (nw > 0) {
+		workers_start(nw);
+	}
+
+	if (reuseport) {
+		/* workers accept on their own, nothing to do for main thread */
+		pthread_join(workers[0].thread, NULL);
+		return (0);
+	}
+
 	libtask_start(server_setup, SIP);
 	memset(&main_end, 0, sizeof(main_end));
 	tasksleep(&main_end);
@@ -0,0 +1,584 @@
+/*
+ * readahead.c
+ *	sequential stream detection and read-ahead into a per session
+ *	prefetch buffer
+ *
+ * Every read of a session is fed to the stream detector. A stream is the
+ * offset its next read is expected at; a read landing on it, or slightly
+ * behind it (rpc handler tasks of one sequential reader run and complete
+ * out of order), continues the stream, any other read starts a new one and
+ * evicts the least recently used of the RA_NSTREAMS streams.
+ *
+ * Once a stream has seen RA_TRIGGER reads, a fill task reads the next
+ * window of the device into a chunk of the prefetch buffer. A stream keeps
+ * at most two chunks: the one being consumed and the one after it, which
+ * is issued as soon as the reader is within half a window of the end of
+ * the first, so the backend read overlaps the consumption of the previous
+ * window. Reads covered by chunks are copied out of them, waiting for a
+ * fill still in flight, instead of going to the SSD.
+ *
+ * A chunk is retired when the stream moves past it. The window doubles, up
+ * to RA_MAXWIN, when every byte of the retired chunk was read and halves,
+ * down to RA_MINWIN, when most of it was not. All chunks of a session
+ * together never exceed the budget, a stream that does not fit does not
+ * read ahead.
+ *
+ * Sessions of one device share a struct ra_dev, a write from any of them
+ * bumps the generations of the regions it covers before it goes to the
+ * device and again once it is there. A chunk notes them before it is
+ * filled and is dropped when a read finds them changed, its data may
+ * predate the write.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "libtask/taskio.h"
+#include "readahead.h"
+
+#define RA_TASKSZ	(32 * 1024)
+
+#define RA_BLKMASK	((uint64_t) RA_BLKSZ - 1)
+#define RA_ROUNDDOWN(x)	((x) & ~RA_BLKMASK)
+
+struct ra_chunk {
+	struct readahead	*ra;
+	uint64_t		off;		/* block aligned */
+	uint64_t		len;
+	uint64_t		hi;		/* read up to here */
+	size_t			size;		/* charged to the budget */
+	char			*buf;
+	int			filling;
+	int			stale;		/* dropped while filling */
+	int			refs;		/* stream, fill task, waiters */
+	uint32_t		wgen[2];	/* of the first and last region */
+	Rendez			ready;
+};
+
+#define RA_CHUNK_END(c)	((c)->off + (c)->len)
+
+#define RA_REGIONSHIFT	20		/* a chunk spans at most two */
+
+static inline uint32_t *ra_wgen(struct ra_dev *dev, uint64_t off)
+{
+	return (&dev->wgen[(off >> RA_REGIONSHIFT) % RA_NSTRIPES]);
+}
+
+/* no write touched the chunk since it was issued */
+static int ra_chunk_fresh(struct ra_chunk *c)
+{
+	struct ra_dev	*dev = c->ra->dev;
+
+	return (__atomic_load_n(ra_wgen(dev, c->off), __ATOMIC_ACQUIRE) ==
+			c->wgen[0] && __atomic_load_n(ra_wgen(dev,
+			c->off + c->size - 1), __ATOMIC_ACQUIRE) == c->wgen[1]);
+}
+
+int ra_init(struct readahead *ra, struct ra_dev *dev, int fd,
+		size_t budget)
+{
+	if (dev == NULL || fd < 0 || budget < RA_BLKSZ) {
+		return (-1);
+	}
+
+	memset(ra, 0, sizeof(*ra));
+	ra->dev    = dev;
+	ra->fd     = fd;
+	ra->budget = budget;
+	return (0);
+}
+
+/*
+ * for devices that do not hold all of their data at home, see wlog.c
+ */
+void ra_set_reader(struct readahead *ra, ra_reader_t reader, void *arg)
+{
+	ra->reader = reader;
+	ra->rdarg  = arg;
+}
+
+static void ra_chunk_put(struct ra_chunk *c)
+{
+	struct readahead	*ra = c->ra;
+
+	assert(c->refs > 0);
+	if (--c->refs != 0) {
+		return;
+	}
+
+	ra->inuse -= c->size;
+	free(c->buf);
+	free(c);
+
+	if (--ra->nalloc == 0 && ra->closing) {
+		taskwakeup(&ra->drain);
+	}
+}
+
+/*
+ * detach chunk i from the stream, adapt the window if the stream moved past
+ * it, as opposed to a write or an eviction dropping it
+ */
+static void ra_retire(struct readahead *ra, struct ra_stream *st, int i,
+		int adapt)
+{
+	struct ra_chunk	*c = st->chunk[i];
+	uint64_t	unread;
+
+	unread      = c->stale ? c->len : RA_CHUNK_END(c) - c->hi;
+	ra->wasted += unread;
+
+	if (adapt && !c->stale) {
+		if (unread == 0 && st->win < RA_MAXWIN) {
+			st->win *= 2;
+		} else if (unread > c->len / 2 && st->win > RA_MINWIN) {
+			st->win /= 2;
+		}
+	}
+
+	if (c->filling) {
+		c->stale = 1;
+	}
+	if (i == 0 && st->nchunks == 2) {
+		st->chunk[0] = st->chunk[1];
+	}
+	st->chunk[--st->nchunks] = NULL;
+	ra_chunk_put(c);
+}
+
+static void ra_fill_task(void *arg)
+{
+	struct ra_chunk		*c = arg;
+	struct readahead	*ra = c->ra;
+	ssize_t			n;
+	int			rc;
+
+	taskname("%s", __func__);
+
+	if (ra->reader != NULL) {
+		n  = ra->reader(ra->rdarg, c->buf, c->len, c->off);
+		rc = 0;
+	} else {
+		rc = task_aioread(ra->fd, c->buf, c->len, c->off, &n);
+	}
+	if (rc != 0 || n <= 0) {
+		/* past the end of the device or I/O error */
+		ra->prefetched -= c->len;
+		c->len   = 0;
+		c->stale = 1;
+	} else if ((uint64_t) n < c->len) {
+		ra->prefetched -= c->len - n;
+		c->len = n;
+	}
+
+	c->filling = 0;
+	taskwakeupall(&c->ready);
+	ra_chunk_put(c);
+}
+
+static void ra_issue(struct readahead *ra, struct ra_stream *st,
+		uint64_t off)
+{
+	struct ra_chunk	*c;
+	uint64_t	len;
+
+	len = st->win;
+	if (ra->inuse + len > ra->budget) {
+		len = RA_ROUNDDOWN(ra->budget - ra->inuse);
+		if (len == 0) {
+			return;
+		}
+	}
+
+	c = calloc(1, sizeof(*c));
+	if (c == NULL) {
+		return;
+	}
+	if (posix_memalign((void **) &c->buf, RA_BLKSZ, len) != 0) {
+		free(c);
+		return;
+	}
+
+	c->ra      = ra;
+	c->off     = off;
+	c->len     = len;
+	c->hi      = off;
+	c->size    = len;
+	c->filling = 1;
+	c->refs    = 2;
+	c->wgen[0] = __atomic_load_n(ra_wgen(ra->dev, off), __ATOMIC_ACQUIRE);
+	c->wgen[1] = __atomic_load_n(ra_wgen(ra->dev, off + len - 1),
+			__ATOMIC_ACQUIRE);
+
+	ra->inuse      += len;
+	ra->prefetched += len;
+	ra->nalloc++;
+
+	st->chunk[st->nchunks++] = c;
+	taskcreate(ra_fill_task, c, RA_TASKSZ);
+}
+
+/*
+ * retire chunks the stream is done with and read ahead of it
+ */
+static void ra_advance(struct readahead *ra, struct ra_stream *st)
+{
+	struct ra_chunk	*c;
+	uint64_t	start;
+	int		i;
+
+	for (i = st->nchunks - 1; i >= 0; i--) {
+		c = st->chunk[i];
+		if (c->stale || st->next >= RA_CHUNK_END(c)) {
+			ra_retire(ra, st, i, 1);
+		}
+	}
+
+	switch (st->nchunks) {
+	case 0:
+		start = RA_ROUNDDOWN(st->next);
+		break;
+	case 1:
+		start = RA_CHUNK_END(st->chunk[0]);
+		if (st->next + st->win / 2 < start) {
+			return;
+		}
+		break;
+	default:
+		return;
+	}
+
+	ra_issue(ra, st, start);
+}
+
+static struct ra_stream *ra_stream_find(struct readahead *ra, uint64_t off)
+{
+	struct ra_stream	*st;
+	struct ra_chunk		*c;
+	int			i;
+
+	for (i = 0; i < RA_NSTREAMS; i++) {
+		st = &ra->stream[i];
+		if (st->seq == 0) {
+			continue;
+		}
+		if (off <= st->next && off + st->win >= st->next) {
+			return (st);
+		}
+		if (st->nchunks != 0) {
+			c = st->chunk[st->nchunks - 1];
+			if (st->chunk[0]->off <= off &&
+					off < RA_CHUNK_END(c)) {
+				return (st);
+			}
+		}
+	}
+	return (NULL);
+}
+
+static struct ra_stream *ra_stream_new(struct readahead *ra)
+{
+	struct ra_stream	*st;
+	struct ra_stream	*victim = NULL;
+	int			i;
+
+	for (i = 0; i < RA_NSTREAMS; i++) {
+		st = &ra->stream[i];
+		if (st->seq == 0) {
+			victim = st;
+			break;
+		}
+		if (victim == NULL || st->lru < victim->lru) {
+			victim = st;
+		}
+	}
+
+	while (victim->nchunks != 0) {
+		ra_retire(ra, victim, victim->nchunks - 1, 0);
+	}
+	victim->win = RA_MINWIN;
+	victim->seq = 0;
+	return (victim);
+}
+
+/*
+ * copy [off, off + len) out of the chunks covering it, 0 if all of it was
+ */
+static int ra_copy(struct readahead *ra, char *buf, uint64_t len,
+		uint64_t off)
+{
+	struct ra_stream	*st;
+	struct ra_chunk		*c;
+	uint64_t		p;
+	uint64_t		n;
+	int			i;
+	int			j;
+
+again:
+	for (p = off; p < off + len; p += n) {
+		c = NULL;
+		for (i = 0; i < RA_NSTREAMS && c == NULL; i++) {
+			st = &ra->stream[i];
+			for (j = 0; j < st->nchunks; j++) {
+				c = st->chunk[j];
+				if (!c->stale && c->off <= p &&
+						p < RA_CHUNK_END(c)) {
+					if (c->filling || ra_chunk_fresh(c)) {
+						break;
+					}
+					/* retired by ra_advance */
+					c->stale = 1;
+				}
+				c = NULL;
+			}
+		}
+		if (c == NULL) {
+			return (-1);
+		}
+
+		if (c->filling) {
+			c->refs++;
+			while (c->filling) {
+				tasksleep(&c->ready);
+			}
+			ra_chunk_put(c);
+			/* chunks may have been retired meanwhile, start over */
+			goto again;
+		}
+
+		n = RA_CHUNK_END(c) - p;
+		if (n > off + len - p) {
+			n = off + len - p;
+		}
+		memcpy(buf + (p - off), c->buf + (p - c->off), n);
+
+		if (p + n > c->hi) {
+			ra->used += p + n - (p > c->hi ? p : c->hi);
+			c->hi     = p + n;
+		}
+	}
+	return (0);
+}
+
+/*
+ * 0 if the read was served from the prefetch buffer, -1 if the caller has
+ * to read from the device
+ */
+int ra_read(struct readahead *ra, char *buf, uint64_t len, uint64_t offset)
+{
+	struct ra_stream	*st;
+	int			rc;
+
+	ra->nreads++;
+	rc = ra_copy(ra, buf, len, offset);
+	if (rc == 0) {
+		ra->nhits++;
+	}
+
+	st = ra_stream_find(ra, offset);
+	if (st == NULL) {
+		st = ra_stream_new(ra);
+		st->next = offset;
+	}
+
+	if (offset + len > st->next) {
+		st->next = offset + len;
+	}
+	st->lru = ++ra->tick;
+	if (++st->seq == RA_TRIGGER) {
+		ra->nstreams++;
+	}
+	if (st->seq >= RA_TRIGGER) {
+		ra_advance(ra, st);
+	}
+	return (rc);
+}
+
+static void ra_wbump(struct ra_dev *dev, uint64_t len, uint64_t offset)
+{
+	uint64_t	r;
+
+	for (r = offset >> RA_REGIONSHIFT;
+			r <= (offset + len - 1) >> RA_REGIONSHIFT; r++) {
+		__atomic_add_fetch(ra_wgen(dev, r << RA_REGIONSHIFT), 1,
+				__ATOMIC_RELEASE);
+	}
+}
+
+/*
+ * called by the session of a write before it goes to the device, and
+ * ra_write_end() once it is there or failed
+ */
+void ra_write_begin(struct ra_dev *dev, uint64_t len, uint64_t offset)
+{
+	ra_wbump(dev, len, offset);
+}
+
+void ra_write_end(struct ra_dev *dev, uint64_t len, uint64_t offset)
+{
+	ra_wbump(dev, len, offset);
+}
+
+void ra_deinit(struct readahead *ra)
+{
+	struct ra_stream	*st;
+	int			i;
+
+	ra->closing = 1;
+	for (i = 0; i < RA_NSTREAMS; i++) {
+		st = &ra->stream[i];
+		while (st->nchunks != 0) {
+			ra_retire(ra, st, st->nchunks - 1, 0);
+		}
+	}
+
+	/* fill tasks still hold their chunks */
+	while (ra->nalloc != 0) {
+		tasksleep(&ra->drain);
+	}
+	assert(ra->inuse == 0);
+}
+
+void ra_stats(struct readahead *ra, const char *name)
+{
+	printf("%s: readahead reads %lu hits %lu streams %lu "
+			"prefetched %lu used %lu wasted %lu accuracy %.1f%%\n",
+			name, ra->nreads, ra->nhits, ra->nstreams,
+			ra->prefetched, ra->used, ra->wasted,
+			ra->prefetched ? 100.0 * ra->used / ra->prefetched : 0);
+}
+
+#ifdef SOLOTEST_READAHEAD
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+ * NTASKS tasks read their own region of a scratch file sequentially with
+ * random request sizes, alternately through one of two sessions of the
+ * file, while a writer task overwrites random blocks of it with pwrite,
+ * so no write is in flight while a reader runs. Reads that miss the
+ * prefetch buffer go to the file. Every read must return what the shadow
+ * copy holds.
+ *
+ *	cc -DSOLOTEST_READAHEAD -I.. -I../include readahead.c \
+ *		-L../libtask -ltask -laio
+ */
+#define NTASKS	4
+#define REGION	(4 << 20)
+#define NWRITES	200
+
+static struct ra_dev	dev;
+static struct readahead	ra[2];
+static char		*shadow;
+static int		fd;
+static int		ndone;
+static Rendez		alldone;
+
+static void solo_done(void)
+{
+	if (++ndone == NTASKS + 1) {
+		taskwakeup(&alldone);
+	}
+}
+
+static void solo_reader(void *arg)
+{
+	uint64_t	base = (uintptr_t) arg * REGION;
+	uint64_t	off;
+	uint64_t	len;
+	char		*buf;
+	int		rc;
+
+	buf = malloc(64 * 1024);
+	assert(buf != NULL);
+
+	for (off = base; off < base + REGION; off += len) {
+		len = 512 * (1 + random() % 128);
+		if (off + len > base + REGION) {
+			len = base + REGION - off;
+		}
+
+		if (ra_read(&ra[(uintptr_t) arg % 2], buf, len, off) != 0) {
+			rc = pread(fd, buf, len, off);
+			assert(rc == len);
+		}
+		assert(memcmp(buf, shadow + off, len) == 0);
+		taskyield();
+	}
+	free(buf);
+	solo_done();
+}
+
+static void solo_writer(void *arg)
+{
+	char		buf[RA_BLKSZ];
+	uint64_t	off;
+	int		rc;
+	int		i;
+
+	for (i = 0; i < NWRITES; i++) {
+		off = (random() % (NTASKS * REGION / RA_BLKSZ)) * RA_BLKSZ;
+		memset(buf, 'a' + random() % 26, sizeof(buf));
+		memcpy(shadow + off, buf, sizeof(buf));
+		ra_write_begin(&dev, sizeof(buf), off);
+		rc = pwrite(fd, buf, sizeof(buf), off);
+		assert(rc == sizeof(buf));
+		ra_write_end(&dev, sizeof(buf), off);
+		taskyield();
+	}
+	solo_done();
+}
+
+static void solo_main(void *arg)
+{
+	char	*path = arg;
+	int	rc;
+	int	i;
+
+	rc = taskio_init();
+	assert(rc == 0);
+	taskio_start();
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	assert(fd >= 0);
+	shadow = malloc(NTASKS * REGION);
+	assert(shadow != NULL);
+	for (i = 0; i < NTASKS * REGION; i++) {
+		shadow[i] = random();
+	}
+	rc = pwrite(fd, shadow, NTASKS * REGION, 0);
+	assert(rc == NTASKS * REGION);
+
+	for (i = 0; i < 2; i++) {
+		rc = ra_init(&ra[i], &dev, fd, 4 * RA_MAXWIN);
+		assert(rc == 0);
+	}
+
+	for (i = 0; i < NTASKS; i++) {
+		taskcreate(solo_reader, (void *) (uintptr_t) i, RA_TASKSZ);
+	}
+	taskcreate(solo_writer, NULL, RA_TASKSZ);
+	tasksleep(&alldone);
+
+	for (i = 0; i < 2; i++) {
+		ra_stats(&ra[i], "solo");
+		assert(ra[i].nstreams >= NTASKS / 2 && ra[i].nhits != 0);
+		ra_deinit(&ra[i]);
+	}
+	printf("PASS\n");
+	close(fd);
+	unlink(path);
+	exit(0);
+}
+
+int main(int argc, char **argv)
+{
+	libtask_start(solo_main, argc > 1 ? argv[1] : "/tmp/readahead.img");
+	return (0);
+}
+
+#endif /* SOLOTEST_READAHEAD */
@@ -0,0 +1,79 @@
+/*
+ * readahead.h
+ *	sequential stream detection and read-ahead into a per session
+ *	prefetch buffer
+ */
+
+#ifndef __READAHEAD_H__
+#define __READAHEAD_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "libtask/task.h"
+
+#define RA_BLKSZ	(1 << 12)
+#define RA_NSTREAMS	8		/* streams tracked per session */
+#define RA_TRIGGER	2		/* sequential reads before read-ahead */
+#define RA_MINWIN	(64 << 10)	/* read-ahead window bounds */
+#define RA_MAXWIN	(1 << 20)
+#define RA_NSTRIPES	1024		/* write generation stripes */
+
+struct ra_chunk;
+
+/*
+ * shared by the sessions of a device, on any thread: write generations
+ * of its 1MB regions, bumped before and after every write
+ */
+struct ra_dev {
+	uint32_t	wgen[RA_NSTRIPES];
+};
+
+/* fills buf from the device, returns bytes read or -1 */
+typedef ssize_t (*ra_reader_t)(void *arg, char *buf, uint64_t len,
+		uint64_t offset);
+
+struct ra_stream {
+	uint64_t	next;		/* expected offset of next read */
+	uint64_t	win;		/* adaptive read-ahead window */
+	int		seq;		/* sequential reads seen */
+	uint64_t	lru;
+	struct ra_chunk	*chunk[2];	/* consumed, read ahead of it */
+	int		nchunks;
+};
+
+/*
+ * one per session, only used by tasks of the thread owning the session
+ */
+struct readahead {
+	struct ra_dev	*dev;
+	int		fd;		/* backend device */
+	ra_reader_t	reader;		/* NULL: read fd directly */
+	void		*rdarg;
+	size_t		budget;		/* bytes of prefetch buffers */
+	size_t		inuse;
+	uint64_t	tick;
+	struct ra_stream stream[RA_NSTREAMS];
+
+	int		nalloc;		/* chunks not yet freed */
+	int		closing;
+	Rendez		drain;
+
+	uint64_t	nreads;
+	uint64_t	nhits;		/* reads served from prefetch buffer */
+	uint64_t	nstreams;	/* sequential streams detected */
+	uint64_t	prefetched;	/* bytes read ahead */
+	uint64_t	used;		/* bytes read ahead and then read */
+	uint64_t	wasted;		/* bytes read ahead and dropped unread */
+};
+
+int ra_init(struct readahead *ra, struct ra_dev *dev, int fd,
+		size_t budget);
+void ra_set_reader(struct readahead *ra, ra_reader_t reader, void *arg);
+void ra_deinit(struct readahead *ra);
+int ra_read(struct readahead *ra, char *buf, uint64_t len, uint64_t offset);
+void ra_write_begin(struct ra_dev *dev, uint64_t len, uint64_t offset);
+void ra_write_end(struct ra_dev *dev, uint64_t len, uint64_t offset);
+void ra_stats(struct readahead *ra, const char *name);
+
+#endif
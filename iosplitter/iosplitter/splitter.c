@@ -0,0 +1,615 @@
+/*
+ * splitter.c
+ *	request splitting and merging between MPP request sizes and the 4K
+ *	blocks handled by CVA
+ *
+ * MPP sends reads and writes of any size at 512 byte granularity, CVA only
+ * deals in SPL_BLKSZ blocks. Every request passes through three steps, all
+ * of them run by the rpc handler task that owns the request:
+ *
+ * 1. split
+ *	The request is widened to block boundaries and described by at most
+ *	three slices: a partial head block, the block aligned body and a
+ *	partial tail block (one slice if the request lies within one block).
+ *	The body points into the rpc payload buffer (zero copy), partial
+ *	blocks use a private bounce block. For writes the partial blocks are
+ *	read first and the new bytes copied in (read-modify-write). A write
+ *	holds a range lock on each block it read-modify-writes until it
+ *	completes, so two writes to different sectors of one block do not
+ *	lose each other's data. Full block writes are not serialized, like
+ *	on a disk the outcome of overlapping writes in flight is undefined.
+ *
+ * 2. merge
+ *	The request is queued on the session. If fewer than SPL_MAXBATCH
+ *	batches are in flight the task becomes leader and takes the whole
+ *	queue as a new batch right away, so an idle session adds no latency.
+ *	Otherwise the request waits in the queue, and requests pile up there
+ *	until a leader finishes its batch and wakes the oldest queued request
+ *	to lead the next one. The batch is sorted by offset and slices that
+ *	are adjacent on disk are packed into one backend preadv/pwritev,
+ *	bounded by maxio bytes and SPL_MAXIOV iovecs. Large slices are cut at
+ *	block aligned maxio boundaries, so every sub-I/O covers whole blocks.
+ *
+ * 3. dispatch
+ *	The leader and up to fanout - 1 helper tasks pull backend I/Os off
+ *	the batch, so up to fanout of them are in flight. A request counts
+ *	its outstanding sub-I/Os and completes, with one wakeup, when the
+ *	last one finishes. Partial blocks of reads are copied out then.
+ *
+ * While batches are dispatched the next one is collected in the queue, so
+ * merging only kicks in when the session is busy enough to benefit.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/uio.h>
+
+#include "libtask/taskio.h"
+#include "splitter.h"
+
+#define SPL_TASKSZ	(32 * 1024)
+
+#define SPL_BLKMASK	((uint64_t) SPL_BLKSZ - 1)
+#define SPL_ROUNDDOWN(x) ((x) & ~SPL_BLKMASK)
+#define SPL_ROUNDUP(x)	(((x) + SPL_BLKMASK) & ~SPL_BLKMASK)
+
+enum {
+	SPL_HEAD = 0,
+	SPL_TAIL = 1,
+};
+
+struct spl_slice {
+	uint64_t	off;		/* block aligned */
+	size_t		len;		/* multiple of SPL_BLKSZ */
+	char		*buf;
+};
+
+struct spl_req {
+	dll_t			list;
+	tirw_t			rw;
+	char			*buf;
+	uint64_t		off;
+	uint64_t		len;
+	uint64_t		aoff;		/* aligned start */
+	uint64_t		aend;		/* aligned end */
+
+	struct spl_slice	slice[3];
+	int			nslices;
+	char			*bounce[2];	/* partial head and tail block */
+	struct range		*range[2];	/* RMW block locks, writes */
+
+	int			pending;	/* sub-I/Os in flight */
+	int			status;
+	int			finished;
+	int			lead;		/* build the next batch */
+	Rendez			done;
+};
+
+struct spl_io {
+	tirw_t		rw;
+	uint64_t	off;
+	size_t		len;
+	int		niov;
+	struct iovec	iov[SPL_MAXIOV];
+	struct spl_req	*req[SPL_MAXIOV];
+};
+
+struct spl_batch {
+	struct splitter	*sp;
+	struct spl_io	*ios;
+	int		nios;
+	int		next;		/* next io to dispatch */
+	int		nrunning;	/* dispatching tasks */
+	Rendez		done;
+};
+
+int splitter_init(struct splitter *sp, int fd, int fanout, size_t maxio)
+{
+	if (fanout <= 0 || maxio < SPL_BLKSZ || (maxio & SPL_BLKMASK) != 0) {
+		return (-1);
+	}
+
+	memset(sp, 0, sizeof(*sp));
+	sp->fd     = fd;
+	sp->fanout = fanout;
+	sp->maxio  = maxio;
+	DLL_INIT(&sp->pending);
+	return (0);
+}
+
+void splitter_deinit(struct splitter *sp)
+{
+	assert(sp->npending == 0 && sp->nbatches == 0);
+	assert(sp->rl.root.node == NULL);
+}
+
+static char *spl_bounce_alloc(void)
+{
+	void	*b;
+
+	if (posix_memalign(&b, SPL_BLKSZ, SPL_BLKSZ) != 0) {
+		return (NULL);
+	}
+	return (b);
+}
+
+/*
+ * step 1: widen request to block boundaries, set up bounce blocks
+ */
+static int spl_req_split(struct splitter *sp, struct spl_req *r)
+{
+	uint64_t	end = r->off + r->len;
+	uint64_t	body;
+	uint64_t	bend;
+	ssize_t		ret;
+	int		rc;
+	int		i;
+
+	r->aoff = SPL_ROUNDDOWN(r->off);
+	r->aend = SPL_ROUNDUP(end);
+
+	body = r->off;
+	bend = end;
+	if (r->off != r->aoff || (end != r->aend && r->aend - r->aoff ==
+			SPL_BLKSZ)) {
+		r->bounce[SPL_HEAD] = spl_bounce_alloc();
+		if (r->bounce[SPL_HEAD] == NULL) {
+			return (-1);
+		}
+		r->slice[r->nslices].off = r->aoff;
+		r->slice[r->nslices].len = SPL_BLKSZ;
+		r->slice[r->nslices].buf = r->bounce[SPL_HEAD];
+		r->nslices++;
+		body = r->aoff + SPL_BLKSZ;
+	}
+	if (end != r->aend && r->aend - SPL_BLKSZ >= body) {
+		r->bounce[SPL_TAIL] = spl_bounce_alloc();
+		if (r->bounce[SPL_TAIL] == NULL) {
+			return (-1);
+		}
+		bend = r->aend - SPL_BLKSZ;
+	}
+	if (bend > body) {
+		r->slice[r->nslices].off = body;
+		r->slice[r->nslices].len = bend - body;
+		r->slice[r->nslices].buf = r->buf + (body - r->off);
+		r->nslices++;
+	}
+	if (r->bounce[SPL_TAIL] != NULL) {
+		r->slice[r->nslices].off = bend;
+		r->slice[r->nslices].len = SPL_BLKSZ;
+		r->slice[r->nslices].buf = r->bounce[SPL_TAIL];
+		r->nslices++;
+	}
+
+	if (r->rw == TASKIO_READ) {
+		return (0);
+	}
+
+	/* read-modify-write partial blocks, head is locked before tail */
+	for (i = 0; i < r->nslices; i++) {
+		struct spl_slice	*s = &r->slice[i];
+		uint64_t		from;
+		uint64_t		to;
+		int			k;
+
+		if (s->buf == r->bounce[SPL_HEAD]) {
+			k = SPL_HEAD;
+		} else if (s->buf == r->bounce[SPL_TAIL]) {
+			k = SPL_TAIL;
+		} else {
+			continue;
+		}
+		r->range[k] = range_lock(&sp->rl, s->off,
+				s->off + SPL_BLKSZ - 1);
+		rc = task_aioread(sp->fd, s->buf, SPL_BLKSZ, s->off, &ret);
+		if (rc != 0 || ret != SPL_BLKSZ) {
+			return (-1);
+		}
+		from = r->off > s->off ? r->off : s->off;
+		to   = end < s->off + SPL_BLKSZ ? end : s->off + SPL_BLKSZ;
+		memcpy(s->buf + (from - s->off), r->buf + (from - r->off),
+				to - from);
+		sp->nrmw++;
+	}
+	return (0);
+}
+
+static void spl_req_finish(struct splitter *sp, struct spl_req *r)
+{
+	uint64_t	end = r->off + r->len;
+	int		i;
+
+	for (i = 0; i < r->nslices; i++) {
+		struct spl_slice	*s = &r->slice[i];
+		uint64_t		from;
+		uint64_t		to;
+
+		if (r->rw != TASKIO_READ || r->status != 0 ||
+				(s->buf != r->bounce[SPL_HEAD] &&
+				s->buf != r->bounce[SPL_TAIL])) {
+			continue;
+		}
+		from = r->off > s->off ? r->off : s->off;
+		to   = end < s->off + SPL_BLKSZ ? end : s->off + SPL_BLKSZ;
+		memcpy(r->buf + (from - r->off), s->buf + (from - s->off),
+				to - from);
+	}
+
+	r->finished = 1;
+	taskwakeup(&r->done);
+}
+
+static int spl_req_cmp(const void *a, const void *b)
+{
+	const struct spl_req	*ra = *(struct spl_req * const *) a;
+	const struct spl_req	*rb = *(struct spl_req * const *) b;
+
+	if (ra->rw != rb->rw) {
+		return (ra->rw < rb->rw ? -1 : 1);
+	}
+	if (ra->aoff != rb->aoff) {
+		return (ra->aoff < rb->aoff ? -1 : 1);
+	}
+	return (0);
+}
+
+static struct spl_io *spl_batch_newio(struct spl_batch *b, int *nalloc,
+		tirw_t rw, uint64_t off)
+{
+	struct spl_io	*io;
+
+	if (b->nios == *nalloc) {
+		*nalloc *= 2;
+		b->ios = realloc(b->ios, *nalloc * sizeof(*b->ios));
+		assert(b->ios != NULL);
+	}
+	io = &b->ios[b->nios++];
+	io->rw   = rw;
+	io->off  = off;
+	io->len  = 0;
+	io->niov = 0;
+	return (io);
+}
+
+/*
+ * step 2: take all queued requests and pack them into backend I/Os
+ */
+static struct spl_batch *spl_batch_build(struct splitter *sp)
+{
+	struct spl_batch	*b;
+	struct spl_req		**reqs;
+	struct spl_io		*io = NULL;
+	dll_t			*l;
+	int			nalloc;
+	int			nreqs;
+	int			i;
+	int			j;
+
+	nreqs = sp->npending;
+	reqs  = malloc(nreqs * sizeof(*reqs));
+	assert(reqs != NULL);
+
+	for (i = 0; i < nreqs; i++) {
+		l = sp->pending.dll_next;
+		DLL_REM(l);
+		reqs[i] = container_of(l, struct spl_req, list);
+	}
+	sp->npending = 0;
+
+	qsort(reqs, nreqs, sizeof(*reqs), spl_req_cmp);
+
+	b = calloc(1, sizeof(*b));
+	assert(b != NULL);
+	b->sp  = sp;
+	nalloc = 4;
+	b->ios = malloc(nalloc * sizeof(*b->ios));
+	assert(b->ios != NULL);
+
+	for (i = 0; i < nreqs; i++) {
+		struct spl_req	*r = reqs[i];
+
+		if (io != NULL && io->rw == r->rw &&
+				io->off + io->len == r->aoff) {
+			sp->nmerged++;
+		}
+
+		for (j = 0; j < r->nslices; j++) {
+			uint64_t	off = r->slice[j].off;
+			size_t		len = r->slice[j].len;
+			char		*buf = r->slice[j].buf;
+			size_t		n;
+
+			while (len != 0) {
+				if (io == NULL || io->rw != r->rw ||
+						io->off + io->len != off ||
+						io->len == sp->maxio ||
+						io->niov == SPL_MAXIOV) {
+					io = spl_batch_newio(b, &nalloc, r->rw,
+							off);
+				}
+				n = sp->maxio - io->len;
+				if (n > len) {
+					n = len;
+				}
+				io->iov[io->niov].iov_base = buf;
+				io->iov[io->niov].iov_len  = n;
+				io->req[io->niov]          = r;
+				io->niov++;
+				io->len += n;
+				r->pending++;
+
+				off += n;
+				buf += n;
+				len -= n;
+			}
+		}
+	}
+
+	free(reqs);
+	return (b);
+}
+
+/*
+ * step 3: issue backend I/Os until the batch is drained
+ */
+static void spl_dispatch(struct spl_batch *b)
+{
+	struct splitter	*sp = b->sp;
+	struct spl_io	*io;
+	ssize_t		ret;
+	int		rc;
+	int		i;
+
+	while (b->next < b->nios) {
+		io = &b->ios[b->next++];
+		sp->nios++;
+
+		rc = task_aiorwv(sp->fd, io->iov, io->niov, io->off, io->rw,
+				&ret);
+
+		for (i = 0; i < io->niov; i++) {
+			struct spl_req	*r = io->req[i];
+
+			if (rc != 0 || ret != (ssize_t) io->len) {
+				r->status = -1;
+			}
+			if (--r->pending == 0) {
+				spl_req_finish(sp, r);
+			}
+		}
+	}
+}
+
+static void spl_dispatch_task(void *arg)
+{
+	struct spl_batch	*b = arg;
+
+	taskname("%s", __func__);
+
+	spl_dispatch(b);
+	if (--b->nrunning == 0) {
+		taskwakeup(&b->done);
+	}
+}
+
+static void spl_batch_run(struct splitter *sp, struct spl_batch *b)
+{
+	int	i;
+
+	b->nrunning = b->nios < sp->fanout ? b->nios : sp->fanout;
+	for (i = 1; i < b->nrunning; i++) {
+		taskcreate(spl_dispatch_task, b, SPL_TASKSZ);
+	}
+
+	spl_dispatch(b);
+	b->nrunning--;
+	while (b->nrunning != 0) {
+		tasksleep(&b->done);
+	}
+
+	free(b->ios);
+	free(b);
+}
+
+/*
+ * build and dispatch one batch, then pass leadership on to a queued request
+ * if there is room for another batch
+ */
+static void spl_lead(struct splitter *sp)
+{
+	struct spl_req	*r;
+
+	sp->nbatches++;
+	spl_batch_run(sp, spl_batch_build(sp));
+	sp->nbatches--;
+
+	if (sp->npending != 0 && sp->nbatches < SPL_MAXBATCH) {
+		r = container_of(sp->pending.dll_next, struct spl_req, list);
+		r->lead = 1;
+		taskwakeup(&r->done);
+	}
+}
+
+static int spl_submit(struct splitter *sp, struct spl_req *r)
+{
+	int	rc;
+	int	i;
+
+	sp->nreqs++;
+
+	rc = spl_req_split(sp, r);
+	if (rc != 0) {
+		r->status = -1;
+		goto out;
+	}
+
+	DLL_REVADD(&sp->pending, &r->list);
+	sp->npending++;
+
+	if (sp->nbatches < SPL_MAXBATCH) {
+		spl_lead(sp);
+	}
+
+	while (r->finished == 0) {
+		tasksleep(&r->done);
+		if (r->lead == 0) {
+			continue;
+		}
+		/* r may have been taken by another leader in the meantime */
+		r->lead = 0;
+		if (sp->npending != 0 && sp->nbatches < SPL_MAXBATCH) {
+			spl_lead(sp);
+		}
+	}
+
+out:
+	for (i = 0; i < 2; i++) {
+		if (r->range[i] != NULL) {
+			range_unlock(&sp->rl, r->range[i]);
+		}
+		free(r->bounce[i]);
+	}
+	return (r->status);
+}
+
+static int spl_rw(struct splitter *sp, tirw_t rw, char *buf, uint64_t len,
+		uint64_t offset)
+{
+	struct spl_req	r;
+
+	if (len == 0) {
+		return (0);
+	}
+
+	memset(&r, 0, sizeof(r));
+	r.rw  = rw;
+	r.buf = buf;
+	r.off = offset;
+	r.len = len;
+	DLL_INIT(&r.list);
+
+	return (spl_submit(sp, &r));
+}
+
+int splitter_read(struct splitter *sp, char *buf, uint64_t len,
+		uint64_t offset)
+{
+	return (spl_rw(sp, TASKIO_READ, buf, len, offset));
+}
+
+int splitter_write(struct splitter *sp, char *buf, uint64_t len,
+		uint64_t offset)
+{
+	return (spl_rw(sp, TASKIO_WRITE, buf, len, offset));
+}
+
+#ifdef SOLOTEST_SPLITTER
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+ * NTASKS tasks issue random unaligned reads and writes through the splitter
+ * against a scratch file, a shadow copy in memory is updated with pwrite
+ * semantics. Every task owns a disjoint region so the result does not depend
+ * on the order in which batches are dispatched. At the end the file must
+ * match the shadow copy.
+ *
+ *	cc -DSOLOTEST_SPLITTER -I.. -I../include splitter.c \
+ *		../common/range_lock.c -L../libtask -ltask -laio
+ */
+#define NTASKS	16
+#define REGION	(256 * 1024)
+#define NOPS	200
+
+static struct splitter	sp;
+static char		*shadow;
+static int		ndone;
+static Rendez		alldone;
+
+static void solo_task(void *arg)
+{
+	uint64_t	base = (uintptr_t) arg * REGION;
+	char		*buf;
+	uint64_t	off;
+	uint64_t	len;
+	int		i;
+	int		rc;
+
+	buf = malloc(REGION);
+	assert(buf != NULL);
+
+	for (i = 0; i < NOPS; i++) {
+		off = base + random() % REGION;
+		len = 1 + random() % (base + REGION - off);
+
+		if (random() % 2) {
+			memset(buf, 'a' + random() % 26, len);
+			memcpy(shadow + off, buf, len);
+			rc = splitter_write(&sp, buf, len, off);
+			assert(rc == 0);
+		} else {
+			rc = splitter_read(&sp, buf, len, off);
+			assert(rc == 0);
+			assert(memcmp(buf, shadow + off, len) == 0);
+		}
+	}
+	free(buf);
+
+	if (++ndone == NTASKS) {
+		taskwakeup(&alldone);
+	}
+}
+
+static void solo_main(void *arg)
+{
+	char	*path = arg;
+	char	*b;
+	int	fd;
+	int	rc;
+	int	i;
+
+	rc = taskio_init();
+	assert(rc == 0);
+	taskio_start();
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	assert(fd >= 0);
+	shadow = calloc(NTASKS, REGION);
+	assert(shadow != NULL);
+	rc = pwrite(fd, shadow, NTASKS * REGION, 0);
+	assert(rc == NTASKS * REGION);
+
+	rc = splitter_init(&sp, fd, SPL_FANOUT, 16 * SPL_BLKSZ);
+	assert(rc == 0);
+
+	for (i = 0; i < NTASKS; i++) {
+		taskcreate(solo_task, (void *) (uintptr_t) i, SPL_TASKSZ);
+	}
+	tasksleep(&alldone);
+
+	b = malloc(NTASKS * REGION);
+	assert(b != NULL);
+	rc = pread(fd, b, NTASKS * REGION, 0);
+	assert(rc == NTASKS * REGION);
+	assert(memcmp(b, shadow, NTASKS * REGION) == 0);
+
+	printf("reqs %lu ios %lu merged %lu rmw %lu: PASS\n", sp.nreqs,
+			sp.nios, sp.nmerged, sp.nrmw);
+	splitter_deinit(&sp);
+	close(fd);
+	unlink(path);
+	exit(0);
+}
+
+int main(int argc, char **argv)
+{
+	libtask_start(solo_main, argc > 1 ? argv[1] : "/tmp/splitter.img");
+	return (0);
+}
+
+#endif /* SOLOTEST_SPLITTER */
@@ -0,0 +1,48 @@
+/*
+ * splitter.h
+ *	request splitting and merging between MPP request sizes and the 4K
+ *	blocks handled by CVA
+ */
+
+#ifndef __SPLITTER_H__
+#define __SPLITTER_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "libtask/task.h"
+#include "dll.h"
+#include "range_lock.h"
+
+#define SPL_BLKSZ	(1 << 12)	/* CVA block size, BLKSZ of vssd.h */
+#define SPL_MAXIO	(1 << 20)	/* largest backend I/O */
+#define SPL_MAXIOV	64		/* iovec entries in one backend I/O */
+#define SPL_FANOUT	4		/* default backend I/Os per batch */
+#define SPL_MAXBATCH	2		/* batches in flight per session */
+
+/*
+ * one per session, only used by tasks of the thread owning the session
+ */
+struct splitter {
+	int			fd;		/* backend device */
+	int			fanout;		/* backend I/Os in flight */
+	size_t			maxio;		/* multiple of SPL_BLKSZ */
+
+	dll_t			pending;	/* requests for next batch */
+	int			npending;
+	int			nbatches;	/* batches being dispatched */
+	struct range_lock	rl;		/* blocks being RMW */
+
+	uint64_t		nreqs;
+	uint64_t		nios;		/* backend I/Os issued */
+	uint64_t		nmerged;	/* requests sharing a backend I/O */
+	uint64_t		nrmw;		/* partial blocks read-modify-written */
+};
+
+int splitter_init(struct splitter *sp, int fd, int fanout, size_t maxio);
+void splitter_deinit(struct splitter *sp);
+int splitter_read(struct splitter *sp, char *buf, uint64_t len,
+		uint64_t offset);
+int splitter_write(struct splitter *sp, char *buf, uint64_t len,
+		uint64_t offset);
+
+#endif
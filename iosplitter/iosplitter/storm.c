@@ -0,0 +1,214 @@
+/*
+ * storm: reconnect storm benchmark
+ *
+ * Opens N sessions against a running iosplitter as fast as possible and
+ * reports the time until every session has completed its RPC_OPEN_MSG
+ * round trip. Sessions are spread over T client threads, each running its
+ * own libtask scheduler with one task per session.
+ *
+ *	storm [-n <sessions>] [-t <threads>] <serverip>
+ *
+ * Compare
+ *	iosplitter -d <SSD> -w 8 -q 4		(acceptor + eventfd handoff)
+ *	iosplitter -d <SSD> -w 8 -r -q 4	(SO_REUSEPORT listener per worker)
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <assert.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include "rpc.h"
+#include "bufpool.h"
+#include "libtask/task.h"
+#include "libtask/taskio.h"
+#include "tst-rpc.h"
+
+#define STORM_THREADS_MAX	64
+#define STORM_PAYLOADSZ		4096
+
+struct storm_thread {
+	pthread_t	thread;
+	int		id;
+	int		nsessions;
+	Rendez		hold;
+};
+
+static char			*serverip;
+static int			nsessions = 1000;
+static int			nthreads = 4;
+static struct storm_thread	threads[STORM_THREADS_MAX];
+static pthread_barrier_t	start_barrier;
+
+static volatile int		nready;
+static volatile int		nfailed;
+static struct timespec		t_start;
+static struct timespec		t_end;
+
+static uint64_t ts_diff_us(struct timespec *s, struct timespec *e)
+{
+	return ((e->tv_sec - s->tv_sec) * 1000000ULL +
+			(e->tv_nsec - s->tv_nsec) / 1000);
+}
+
+static void storm_handler(void *arg)
+{
+	rpc_msg_t *rm = arg;
+
+	if (RPC_IS_CONNCLOSED(rm)) {
+		rpc_chan_close(rm->rcp);
+		task_fd_deregister(rm->rcp->infd);
+		return;
+	}
+	rpc_default_handler(arg);
+}
+
+static void session_ready(int failed)
+{
+	if (failed) {
+		__sync_fetch_and_add(&nfailed, 1);
+	}
+
+	if (__sync_add_and_fetch(&nready, 1) == nsessions) {
+		clock_gettime(CLOCK_MONOTONIC, &t_end);
+	}
+}
+
+static void storm_session_task(void *arg)
+{
+	session_t		s;
+	rpc_chan_t		*rcp;
+	rpc_msg_t		*rm;
+	int			fd;
+	int			rc;
+
+	taskname("%s", __func__);
+
+	rc = tasknet_connect(serverip, SPORT, &fd);
+	if (rc != 0) {
+		session_ready(1);
+		return;
+	}
+
+	memset(&s, 0, sizeof(s));
+	s.type = SESSION_CLIENT;
+	rc = task_netwrite(fd, (char *) &s, sizeof(s));
+	if (rc != 0) {
+		session_ready(1);
+		return;
+	}
+
+	rcp = rpc_chan_new();
+	assert(rcp != NULL);
+
+	rc = rpc_chan_init(rcp, fd, fd, 1, MAXMSGSZ, STORM_PAYLOADSZ, 2,
+			storm_handler, NULL);
+	assert(rc == 0);
+
+	rpc_msg_get(rcp, RPC_OPEN_MSG, sizeof(open_cmd_t), 0, NULL, &rm);
+	rc = rpc_request(rcp, rm);
+	session_ready(rc != 0 || rm->resp->hdr.status != 0);
+	rpc_msg_put(rcp, rm);
+}
+
+static void storm_main(void *arg)
+{
+	struct storm_thread	*st = arg;
+	int			i;
+	int			rc;
+
+	rc = taskio_init();
+	assert(rc == 0);
+
+	taskio_start();
+
+	pthread_barrier_wait(&start_barrier);
+
+	for (i = 0; i < st->nsessions; i++) {
+		taskcreate(storm_session_task, NULL, 32 * 1024);
+	}
+
+	/* hold sessions open until the main thread reports and exits */
+	tasksleep(&st->hold);
+}
+
+static void *storm_thread(void *arg)
+{
+	libtask_start(storm_main, arg);
+	return (NULL);
+}
+
+static void usage(const char *s)
+{
+	fprintf(stderr, "%s [-n <sessions>] [-t <threads>] <serverip>\n", s);
+}
+
+int main(int argc, char *argv[])
+{
+	struct rlimit	rl;
+	struct timespec	ts;
+	int		opt;
+	int		i;
+	int		rc;
+
+	while ((opt = getopt(argc, argv, "n:t:h")) != -1) {
+		switch (opt) {
+			case 'n':
+				nsessions = atoi(optarg);
+				break;
+			case 't':
+				nthreads = atoi(optarg);
+				break;
+			case 'h':
+			default:
+				usage(argv[0]);
+				return (EINVAL);
+		}
+	}
+
+	if (optind >= argc || nsessions <= 0 || nthreads <= 0 ||
+			nthreads > STORM_THREADS_MAX) {
+		usage(argv[0]);
+		return (EINVAL);
+	}
+	serverip = argv[optind];
+
+	rc = getrlimit(RLIMIT_NOFILE, &rl);
+	assert(rc == 0);
+	if (rl.rlim_cur < (rlim_t) nsessions + 64) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	rc = pthread_barrier_init(&start_barrier, NULL, nthreads + 1);
+	assert(rc == 0);
+
+	for (i = 0; i < nthreads; i++) {
+		threads[i].id        = i;
+		threads[i].nsessions = nsessions / nthreads +
+			(i < nsessions % nthreads);
+		rc = pthread_create(&threads[i].thread, NULL, storm_thread,
+				&threads[i]);
+		assert(rc == 0);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t_start);
+	pthread_barrier_wait(&start_barrier);
+
+	ts.tv_sec  = 0;
+	ts.tv_nsec = 1000 * 1000;
+	while (nready < nsessions) {
+		nanosleep(&ts, NULL);
+	}
+
+	printf("%d sessions (%d failed) over %d threads ready in %.3f ms\n",
+			nsessions, nfailed, nthreads,
+			ts_diff_us(&t_start, &t_end) / 1000.0);
+	fflush(stdout);
+
+	/* sessions are torn down with the process */
+	exit(nfailed ? 1 : 0);
+}
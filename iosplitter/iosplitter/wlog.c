@@ -0,0 +1,855 @@
+/*
+ * wlog.c
+ *	write staging log with group commit on a region of the SSD
+ *
+ * Small random writes are not written to their home location on the SSD.
+ * wlog_write() copies the data into a record, indexes it and queues it for
+ * the flusher thread. The flusher takes every record queued since its last
+ * round, writes them back to back at the head of an append only log with
+ * one pwritev per contiguous run, syncs, and only then acks the writers.
+ * While it is busy the next group collects in the queue, so the more
+ * writers there are the larger the commit.
+ *
+ * Acks cross threads: the writer is a task of a worker thread, the flusher
+ * a pthread. Each worker thread gets a port, an eventfd registered with its
+ * taskio and a list of durable records. The flusher appends to the list
+ * and rings the eventfd, aiotask of the worker spawns wlog_port_task()
+ * which wakes the writer.
+ *
+ * The destager thread writes acked records to their home location in log
+ * order, every WLOG_DESTAGE_MS or as soon as the log is half full, syncs,
+ * and then moves the log tail in the super block past them. Until a
+ * record is at home reads overlay it on the data read from home, see
+ * wlog_overlay().
+ *
+ * Layout of the region:
+ *	[super block][records ... wraps around]
+ * A record is a header sector followed by its data padded to a sector. A
+ * record never wraps, the end of the region is skipped instead. On startup
+ * wlog_init() replays the records after the tail recorded in the super
+ * block as long as their sequence numbers follow each other, their
+ * checksums match and they carry the epoch of the super block, writes them
+ * home and starts with an empty log in the next epoch. A record a torn
+ * write left behind can hold the right sequence number and checksum if the
+ * log had reached past it in an earlier run, the epoch tells them apart.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+
+#include "libtask/task.h"
+#include "libtask/taskio.h"
+#include "wlog.h"
+
+#define WLOG_SUPER_MAGIC	0x574c4f47	/* WLOG */
+#define WLOG_REC_MAGIC		0x57524543	/* WREC */
+
+#define WLOG_REGIONSHIFT	20
+#define WLOG_MAXREC		(WLOG_SECTOR + WLOG_MAXIO)
+#define WLOG_DESTAGE_MS		100
+#define WLOG_DESTAGE_BATCH	256
+
+#define WLOG_ROUNDUP(x)	(((x) + WLOG_SECTOR - 1) & ~((uint64_t) WLOG_SECTOR - 1))
+
+#define WLOG_FNV_INIT	2166136261U
+#define WLOG_FNV_PRIME	16777619U
+
+struct wlog_super {
+	uint32_t	magic;
+	uint32_t	crc;
+	uint64_t	tail;		/* oldest record not at home */
+	uint64_t	seq;		/* last record at home */
+	uint64_t	epoch;		/* of the records after tail */
+};
+
+struct wlog_rechdr {
+	uint32_t	magic;
+	uint32_t	crc;		/* of header and data */
+	uint64_t	seq;
+	uint64_t	epoch;
+	uint64_t	off;		/* home location */
+	uint32_t	len;
+	uint32_t	reclen;		/* header sector and padded data */
+};
+
+struct wlog_port {
+	int		efd;
+	pthread_mutex_t	lock;
+	dll_t		done;		/* durable records */
+};
+
+struct wlog_blink {
+	dll_t			link;
+	struct wlog_rec		*rec;
+};
+
+struct wlog_rec {
+	dll_t			list;		/* staged or committed */
+	dll_t			plink;		/* port done list */
+	struct wlog_blink	blink[2];	/* buckets */
+	int			nbuckets;
+	uint64_t		seq;
+	uint64_t		off;
+	uint64_t		len;
+	uint64_t		pos;		/* in the log */
+	uint64_t		reclen;
+	uint64_t		skip;		/* end of region skipped before */
+	char			*buf;		/* header sector, then data */
+	struct wlog_port	*port;
+	int			durable;
+	int			acked;		/* writer is done with it */
+	Rendez			done;
+};
+
+static __thread struct wlog_port	*wlog_port;
+
+static uint32_t wlog_fnv(uint32_t h, const void *p, size_t n)
+{
+	const uint8_t	*c = p;
+
+	while (n-- != 0) {
+		h ^= *c++;
+		h *= WLOG_FNV_PRIME;
+	}
+	return (h);
+}
+
+static inline uint64_t wlog_bucket(uint64_t off)
+{
+	return ((off >> WLOG_REGIONSHIFT) % WLOG_NBUCKETS);
+}
+
+static void wlog_pio(int fd, char *buf, size_t len, uint64_t off, int wr)
+{
+	ssize_t	rc;
+
+	while (len != 0) {
+		rc = wr ? pwrite(fd, buf, len, off) : pread(fd, buf, len, off);
+		if (rc < 0 && errno == EINTR) {
+			continue;
+		}
+		assert(rc > 0);
+		buf += rc;
+		len -= rc;
+		off += rc;
+	}
+}
+
+static void wlog_super_write(wlog_t *wl, uint64_t tail, uint64_t seq)
+{
+	char			*b;
+	struct wlog_super	*s;
+	int			rc;
+
+	rc = posix_memalign((void **) &b, WLOG_SECTOR, WLOG_SUPERSZ);
+	assert(rc == 0);
+	memset(b, 0, WLOG_SUPERSZ);
+
+	s        = (struct wlog_super *) b;
+	s->magic = WLOG_SUPER_MAGIC;
+	s->tail  = tail;
+	s->seq   = seq;
+	s->epoch = wl->epoch;
+	s->crc   = wlog_fnv(WLOG_FNV_INIT, s, sizeof(*s));
+
+	wlog_pio(wl->fd, b, WLOG_SUPERSZ, wl->base, 1);
+	rc = fdatasync(wl->fd);
+	assert(rc == 0);
+	free(b);
+}
+
+/* add to the buckets of the regions it covers, lock held */
+static void wlog_index(wlog_t *wl, struct wlog_rec *r)
+{
+	uint64_t	b0 = wlog_bucket(r->off);
+	uint64_t	b1 = wlog_bucket(r->off + r->len - 1);
+
+	r->blink[0].rec = r;
+	r->blink[1].rec = r;
+	DLL_REVADD(&wl->bucket[b0], &r->blink[0].link);
+	r->nbuckets = 1;
+	if (b1 != b0) {
+		DLL_REVADD(&wl->bucket[b1], &r->blink[1].link);
+		r->nbuckets = 2;
+	}
+}
+
+static void wlog_unindex(wlog_t *wl, struct wlog_rec *r)
+{
+	int	i;
+
+	for (i = 0; i < r->nbuckets; i++) {
+		DLL_REM(&r->blink[i].link);
+	}
+	wl->gen[wlog_bucket(r->off)]++;
+	wl->gen[wlog_bucket(r->off + r->len - 1)]++;
+}
+
+/*
+ * the flusher side of a port, runs in the worker thread owning it
+ */
+static void wlog_port_task(void *arg)
+{
+	struct wlog_port	*p = arg;
+	struct wlog_rec		*r;
+
+	pthread_mutex_lock(&p->lock);
+	assert(!DLL_ISEMPTY(&p->done));
+	r = container_of(DLL_NEXT(&p->done), struct wlog_rec, plink);
+	DLL_REM(&r->plink);
+	pthread_mutex_unlock(&p->lock);
+
+	r->durable = 1;
+	taskwakeup(&r->done);
+}
+
+static struct wlog_port *wlog_port_get(void)
+{
+	struct wlog_port	*p;
+
+	if (wlog_port != NULL) {
+		return (wlog_port);
+	}
+
+	p = calloc(1, sizeof(*p));
+	if (p == NULL) {
+		return (NULL);
+	}
+	p->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (p->efd < 0) {
+		free(p);
+		return (NULL);
+	}
+	pthread_mutex_init(&p->lock, NULL);
+	DLL_INIT(&p->done);
+
+	if (task_eventfd_register(p->efd, wlog_port_task, p) != 0) {
+		close(p->efd);
+		free(p);
+		return (NULL);
+	}
+	wlog_port = p;
+	return (p);
+}
+
+static void wlog_port_post(struct wlog_rec *r)
+{
+	struct wlog_port	*p = r->port;
+	uint64_t		v = 1;
+
+	pthread_mutex_lock(&p->lock);
+	DLL_REVADD(&p->done, &r->plink);
+	pthread_mutex_unlock(&p->lock);
+
+	if (write(p->efd, &v, sizeof(v)) != sizeof(v)) {
+		perror("wlog_port_post: eventfd write");
+		assert(0);
+	}
+}
+
+/*
+ * give r a place at the head of the log, 0 if there is no space left
+ */
+static int wlog_place(wlog_t *wl, struct wlog_rec *r)
+{
+	uint64_t	pos = wl->head;
+	uint64_t	skip = 0;
+
+	if (pos + r->reclen > wl->dsize) {
+		skip = wl->dsize - pos;
+		pos  = 0;
+	}
+	if (wl->used + skip + r->reclen > wl->dsize) {
+		return (0);
+	}
+
+	r->skip   = skip;
+	r->pos    = pos;
+	wl->head  = pos + r->reclen;
+	wl->used += skip + r->reclen;
+	return (1);
+}
+
+/* records placed back to back */
+static void wlog_writev(wlog_t *wl, struct wlog_rec **recs, int n)
+{
+	struct iovec	iov[WLOG_MAXBATCH];
+	uint64_t	off;
+	size_t		len;
+	ssize_t		rc;
+	int		i;
+
+	for (i = 0, len = 0; i < n; i++) {
+		iov[i].iov_base = recs[i]->buf;
+		iov[i].iov_len  = recs[i]->reclen;
+		len            += recs[i]->reclen;
+	}
+
+	off = wl->base + WLOG_SUPERSZ + recs[0]->pos;
+	do {
+		rc = pwritev(wl->fd, iov, n, off);
+	} while (rc < 0 && errno == EINTR);
+	assert(rc == (ssize_t) len);
+}
+
+static void *wlog_flusher(void *arg)
+{
+	wlog_t		*wl = arg;
+	struct wlog_rec	*batch[WLOG_MAXBATCH];
+	struct wlog_rec	*r;
+	int		n;
+	int		i;
+	int		first;
+	int		rc;
+
+	pthread_mutex_lock(&wl->lock);
+	while (1) {
+		while (DLL_ISEMPTY(&wl->staged)) {
+			pthread_cond_wait(&wl->kick, &wl->lock);
+		}
+
+		for (n = 0; n < WLOG_MAXBATCH && !DLL_ISEMPTY(&wl->staged);) {
+			r = container_of(DLL_NEXT(&wl->staged), struct wlog_rec,
+					list);
+			if (!wlog_place(wl, r)) {
+				if (n != 0) {
+					break;
+				}
+				/* log full, wait for the destager */
+				pthread_cond_signal(&wl->dirty);
+				pthread_cond_wait(&wl->space, &wl->lock);
+				continue;
+			}
+			DLL_REM(&r->list);
+			batch[n++] = r;
+		}
+		pthread_mutex_unlock(&wl->lock);
+
+		for (first = 0, i = 1; i <= n; i++) {
+			if (i == n || batch[i]->pos != batch[i - 1]->pos +
+					batch[i - 1]->reclen) {
+				wlog_writev(wl, batch + first, i - first);
+				first = i;
+			}
+		}
+		rc = fdatasync(wl->fd);
+		assert(rc == 0);
+
+		pthread_mutex_lock(&wl->lock);
+		for (i = 0; i < n; i++) {
+			DLL_REVADD(&wl->committed, &batch[i]->list);
+			wl->nlogged += batch[i]->reclen;
+		}
+		wl->nrecs += n;
+		wl->ncommits++;
+		pthread_mutex_unlock(&wl->lock);
+
+		for (i = 0; i < n; i++) {
+			wlog_port_post(batch[i]);
+		}
+		pthread_mutex_lock(&wl->lock);
+	}
+	return (NULL);
+}
+
+static void *wlog_destager(void *arg)
+{
+	wlog_t		*wl = arg;
+	struct wlog_rec	*batch[WLOG_DESTAGE_BATCH];
+	struct wlog_rec	*r;
+	struct timespec	ts;
+	dll_t		*d;
+	int		n;
+	int		i;
+	int		rc;
+
+	pthread_mutex_lock(&wl->lock);
+	while (1) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += WLOG_DESTAGE_MS * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		rc = pthread_cond_timedwait(&wl->dirty, &wl->lock, &ts);
+		if (rc != ETIMEDOUT && wl->used * 2 < wl->dsize) {
+			continue;
+		}
+
+		/* oldest first, stop at a record its writer still uses */
+		n = 0;
+		for (d = DLL_NEXT(&wl->committed); d != &wl->committed &&
+				n < WLOG_DESTAGE_BATCH; d = DLL_NEXT(d)) {
+			r = container_of(d, struct wlog_rec, list);
+			if (!r->acked) {
+				break;
+			}
+			batch[n++] = r;
+		}
+		if (n == 0) {
+			continue;
+		}
+		pthread_mutex_unlock(&wl->lock);
+
+		for (i = 0; i < n; i++) {
+			r = batch[i];
+			wlog_pio(wl->fd, r->buf + WLOG_SECTOR, r->len, r->off,
+					1);
+		}
+		rc = fdatasync(wl->fd);
+		assert(rc == 0);
+		r = batch[n - 1];
+		wlog_super_write(wl, r->pos + r->reclen, r->seq);
+
+		pthread_mutex_lock(&wl->lock);
+		for (i = 0; i < n; i++) {
+			r = batch[i];
+			DLL_REM(&r->list);
+			wlog_unindex(wl, r);
+			wl->used -= r->skip + r->reclen;
+			wl->ndestaged++;
+			free(r->buf);
+			free(r);
+		}
+		pthread_cond_broadcast(&wl->space);
+	}
+	return (NULL);
+}
+
+/*
+ * read the record at pos into buf, 1 if it is the one with sequence seq
+ */
+static int wlog_rec_read(wlog_t *wl, uint64_t pos, uint64_t seq, char *buf)
+{
+	struct wlog_rechdr	*h = (struct wlog_rechdr *) buf;
+	uint64_t		off = wl->base + WLOG_SUPERSZ + pos;
+	uint32_t		crc;
+
+	if (pos + WLOG_SECTOR > wl->dsize) {
+		return (0);
+	}
+	wlog_pio(wl->fd, buf, WLOG_SECTOR, off, 0);
+	if (h->magic != WLOG_REC_MAGIC || h->seq != seq ||
+			h->epoch != wl->epoch || h->len == 0 ||
+			h->len > WLOG_MAXIO ||
+			h->reclen != WLOG_SECTOR + WLOG_ROUNDUP(h->len) ||
+			pos + h->reclen > wl->dsize) {
+		return (0);
+	}
+	wlog_pio(wl->fd, buf + WLOG_SECTOR, h->reclen - WLOG_SECTOR,
+			off + WLOG_SECTOR, 0);
+
+	crc    = h->crc;
+	h->crc = 0;
+	return (crc == wlog_fnv(wlog_fnv(WLOG_FNV_INIT, buf + WLOG_SECTOR,
+			h->len), h, sizeof(*h)));
+}
+
+static void wlog_replay(wlog_t *wl, uint64_t tail, uint64_t seq)
+{
+	struct wlog_rechdr	*h;
+	char			*buf;
+	uint64_t		pos = tail;
+	int			wrapped = 0;
+	int			rc;
+
+	rc = posix_memalign((void **) &buf, WLOG_SECTOR, WLOG_MAXREC);
+	assert(rc == 0);
+	h = (struct wlog_rechdr *) buf;
+
+	while (1) {
+		if (!wlog_rec_read(wl, pos, seq + 1, buf)) {
+			/* the end of the region may have been skipped */
+			if (pos == 0 || wrapped) {
+				break;
+			}
+			pos     = 0;
+			wrapped = 1;
+			continue;
+		}
+		wlog_pio(wl->fd, buf + WLOG_SECTOR, h->len, h->off, 1);
+		wl->nreplayed++;
+		seq++;
+		pos += h->reclen;
+	}
+	free(buf);
+
+	/*
+	 * replayed records are at home, start with an empty log in a new
+	 * epoch, so that none of the old records past pos can follow the
+	 * first new one
+	 */
+	rc = fdatasync(wl->fd);
+	assert(rc == 0);
+	wl->epoch++;
+	wlog_super_write(wl, pos, seq);
+	wl->head = pos;
+	wl->seq  = seq;
+}
+
+int wlog_init(wlog_t *wl, int fd, uint64_t base, uint64_t size)
+{
+	struct wlog_super	*s;
+	char			*b;
+	uint32_t		crc;
+	int			rc;
+	int			i;
+
+	if (fd < 0 || size < WLOG_SUPERSZ + 4 * WLOG_MAXREC ||
+			(base % WLOG_SUPERSZ) != 0) {
+		return (-1);
+	}
+
+	memset(wl, 0, sizeof(*wl));
+	wl->fd    = fd;
+	wl->base  = base;
+	wl->dsize = (size - WLOG_SUPERSZ) & ~((uint64_t) WLOG_SECTOR - 1);
+	pthread_mutex_init(&wl->lock, NULL);
+	pthread_cond_init(&wl->kick, NULL);
+	pthread_cond_init(&wl->space, NULL);
+	pthread_cond_init(&wl->dirty, NULL);
+	DLL_INIT(&wl->staged);
+	DLL_INIT(&wl->committed);
+	for (i = 0; i < WLOG_NBUCKETS; i++) {
+		DLL_INIT(&wl->bucket[i]);
+	}
+
+	rc = posix_memalign((void **) &b, WLOG_SECTOR, WLOG_SUPERSZ);
+	if (rc != 0) {
+		return (-1);
+	}
+	wlog_pio(fd, b, WLOG_SUPERSZ, base, 0);
+	s      = (struct wlog_super *) b;
+	crc    = s->crc;
+	s->crc = 0;
+	if (s->magic == WLOG_SUPER_MAGIC &&
+			crc == wlog_fnv(WLOG_FNV_INIT, s, sizeof(*s)) &&
+			s->tail <= wl->dsize) {
+		wl->epoch = s->epoch;
+		wlog_replay(wl, s->tail, s->seq);
+	} else {
+		wl->epoch = ((uint64_t) time(NULL) << 20) ^ getpid();
+		wlog_super_write(wl, 0, 0);
+	}
+	free(b);
+
+	rc = pthread_create(&wl->flusher, NULL, wlog_flusher, wl);
+	assert(rc == 0);
+	rc = pthread_create(&wl->destager, NULL, wlog_destager, wl);
+	assert(rc == 0);
+	return (0);
+}
+
+/*
+ * called by a task, returns once the data is in the log
+ */
+int wlog_write(wlog_t *wl, char *buf, uint64_t len, uint64_t off)
+{
+	struct wlog_rec		*r;
+	struct wlog_rechdr	*h;
+	uint32_t		crc;
+
+	if (len == 0 || len > WLOG_MAXIO || wlog_inlog(wl, off, len) ||
+			wlog_port_get() == NULL) {
+		return (-1);
+	}
+
+	r = calloc(1, sizeof(*r));
+	if (r == NULL) {
+		return (-1);
+	}
+	r->reclen = WLOG_SECTOR + WLOG_ROUNDUP(len);
+	if (posix_memalign((void **) &r->buf, WLOG_SECTOR, r->reclen) != 0) {
+		free(r);
+		return (-1);
+	}
+	r->off  = off;
+	r->len  = len;
+	r->port = wlog_port;
+
+	memset(r->buf, 0, WLOG_SECTOR);
+	memcpy(r->buf + WLOG_SECTOR, buf, len);
+	memset(r->buf + WLOG_SECTOR + len, 0, r->reclen - WLOG_SECTOR - len);
+	crc = wlog_fnv(WLOG_FNV_INIT, buf, len);
+
+	h         = (struct wlog_rechdr *) r->buf;
+	h->magic  = WLOG_REC_MAGIC;
+	h->epoch  = wl->epoch;
+	h->off    = off;
+	h->len    = len;
+	h->reclen = r->reclen;
+
+	pthread_mutex_lock(&wl->lock);
+	r->seq = h->seq = ++wl->seq;
+	h->crc = wlog_fnv(crc, h, sizeof(*h));
+	wlog_index(wl, r);
+	DLL_REVADD(&wl->staged, &r->list);
+	pthread_cond_signal(&wl->kick);
+	pthread_mutex_unlock(&wl->lock);
+
+	while (!r->durable) {
+		tasksleep(&r->done);
+	}
+
+	pthread_mutex_lock(&wl->lock);
+	r->acked = 1;
+	pthread_mutex_unlock(&wl->lock);
+	return (0);
+}
+
+/*
+ * does [off, off + len) touch the super block or the records? Such I/O
+ * would corrupt the log and is not the client's to do.
+ */
+int wlog_inlog(wlog_t *wl, uint64_t off, uint64_t len)
+{
+	uint64_t	end = wl->base + WLOG_SUPERSZ + wl->dsize;
+
+	return (off + len < off || (off < end && off + len > wl->base));
+}
+
+/*
+ * taken before reading [off, off + len) from home
+ */
+void wlog_ticket(wlog_t *wl, uint64_t off, uint64_t len, wlog_ticket_t *tkt)
+{
+	pthread_mutex_lock(&wl->lock);
+	tkt->gen[0] = wl->gen[wlog_bucket(off)];
+	tkt->gen[1] = wl->gen[wlog_bucket(off + len - 1)];
+	pthread_mutex_unlock(&wl->lock);
+}
+
+/*
+ * copy staged data over buf read from home. If a record left the log since
+ * the ticket was taken, buf may predate it and -1 is returned, the caller
+ * has to read home again.
+ */
+int wlog_overlay(wlog_t *wl, char *buf, uint64_t len, uint64_t off,
+		wlog_ticket_t *tkt)
+{
+	struct wlog_rec	*r;
+	uint64_t	reg;
+	uint64_t	s;
+	uint64_t	e;
+	uint64_t	b;
+	dll_t		*d;
+
+	assert(len != 0 && len <= WLOG_MAXIO);
+
+	pthread_mutex_lock(&wl->lock);
+	if (tkt->gen[0] != wl->gen[wlog_bucket(off)] ||
+			tkt->gen[1] != wl->gen[wlog_bucket(off + len - 1)]) {
+		pthread_mutex_unlock(&wl->lock);
+		return (-1);
+	}
+
+	/* every byte is covered by exactly one region, records in seq order */
+	for (reg = off >> WLOG_REGIONSHIFT;
+			reg <= (off + len - 1) >> WLOG_REGIONSHIFT; reg++) {
+		b = reg % WLOG_NBUCKETS;
+		for (d = DLL_NEXT(&wl->bucket[b]); d != &wl->bucket[b];
+				d = DLL_NEXT(d)) {
+			r = (container_of(d, struct wlog_blink, link))->rec;
+
+			s = off > r->off ? off : r->off;
+			e = off + len < r->off + r->len ? off + len :
+				r->off + r->len;
+			if (s < reg << WLOG_REGIONSHIFT) {
+				s = reg << WLOG_REGIONSHIFT;
+			}
+			if (e > (reg + 1) << WLOG_REGIONSHIFT) {
+				e = (reg + 1) << WLOG_REGIONSHIFT;
+			}
+			if (s < e) {
+				memcpy(buf + (s - off),
+					r->buf + WLOG_SECTOR + (s - r->off),
+					e - s);
+			}
+		}
+	}
+	pthread_mutex_unlock(&wl->lock);
+	return (0);
+}
+
+void wlog_stats(wlog_t *wl)
+{
+	pthread_mutex_lock(&wl->lock);
+	printf("wlog: commits %lu records %lu (%.1f per commit) logged %lu KB "
+			"destaged %lu replayed %lu log %lu%% full\n",
+			wl->ncommits, wl->nrecs,
+			wl->ncommits ? (double) wl->nrecs / wl->ncommits : 0,
+			wl->nlogged >> 10, wl->ndestaged, wl->nreplayed,
+			wl->used * 100 / wl->dsize);
+	pthread_mutex_unlock(&wl->lock);
+}
+
+#ifdef SOLOTEST_WLOG
+
+#include <fcntl.h>
+#include <sys/wait.h>
+
+/*
+ * A child process runs NTASKS tasks writing random ranges of their own
+ * region through the log and reading them back, then exits without waiting
+ * for the destager, like a crash. The parent replays the log and checks
+ * the file against the writes, which it regenerates from the same seeds.
+ *
+ *	cc -DSOLOTEST_WLOG -I.. -I../include wlog.c -L../libtask -ltask \
+ *		-laio -lpthread
+ */
+#define NTASKS	16
+#define REGION	(512 * 1024)
+#define NOPS	300
+#define LOGSZ	(8 << 20)
+#define LOGBASE	(NTASKS * REGION)
+
+static wlog_t	wl;
+static char	*shadow;
+static int	fd;
+static int	ndone;
+static Rendez	alldone;
+
+/* the writes of task i, applied to shadow */
+static void solo_op(unsigned *seed, int i, uint64_t *off, uint64_t *len,
+		int *c)
+{
+	uint64_t	base = (uint64_t) i * REGION;
+
+	*off = base + rand_r(seed) % REGION;
+	*len = 1 + rand_r(seed) % (base + REGION - *off);
+	if (*len > 64 * 1024) {
+		*len = 64 * 1024;
+	}
+	*c = 'a' + rand_r(seed) % 26;
+	memset(shadow + *off, *c, *len);
+}
+
+static void solo_task(void *arg)
+{
+	int		i = (uintptr_t) arg;
+	unsigned	seed = i;
+	wlog_ticket_t	t;
+	uint64_t	off;
+	uint64_t	len;
+	char		*buf;
+	int		c;
+	int		n;
+	int		rc;
+
+	buf = malloc(REGION);
+	assert(buf != NULL);
+
+	for (n = 0; n < NOPS; n++) {
+		solo_op(&seed, i, &off, &len, &c);
+		memset(buf, c, len);
+		rc = wlog_write(&wl, buf, len, off);
+		assert(rc == 0);
+
+		do {
+			wlog_ticket(&wl, i * REGION, REGION, &t);
+			rc = pread(fd, buf, REGION, i * REGION);
+			assert(rc == REGION);
+		} while (wlog_overlay(&wl, buf, REGION, i * REGION, &t) != 0);
+		assert(memcmp(buf, shadow + i * REGION, REGION) == 0);
+	}
+	free(buf);
+
+	if (++ndone == NTASKS) {
+		taskwakeup(&alldone);
+	}
+}
+
+static void solo_child(void *arg)
+{
+	char	*b;
+	int	rc;
+	int	i;
+
+	rc = taskio_init();
+	assert(rc == 0);
+	taskio_start();
+
+	rc = wlog_init(&wl, fd, LOGBASE, LOGSZ);
+	assert(rc == 0);
+
+	/* the log's own blocks are refused, the replay below checks it */
+	b = calloc(1, 8192);
+	assert(b != NULL);
+	rc = wlog_write(&wl, b, 8192, LOGBASE - 4096);
+	assert(rc == -1);
+	rc = wlog_write(&wl, b, 512, LOGBASE);
+	assert(rc == -1);
+	rc = wlog_write(&wl, b, 512, LOGBASE + LOGSZ - 512);
+	assert(rc == -1);
+	free(b);
+
+	for (i = 0; i < NTASKS; i++) {
+		taskcreate(solo_task, (void *) (uintptr_t) i, 32 * 1024);
+	}
+	tasksleep(&alldone);
+	wlog_stats(&wl);
+	fflush(stdout);
+	_exit(0);
+}
+
+int main(int argc, char **argv)
+{
+	char		*path = argc > 1 ? argv[1] : "/tmp/wlog.img";
+	unsigned	seed;
+	uint64_t	off;
+	uint64_t	len;
+	char		*b;
+	pid_t		pid;
+	int		status;
+	int		c;
+	int		rc;
+	int		i;
+	int		n;
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	assert(fd >= 0);
+	rc = ftruncate(fd, LOGBASE + LOGSZ);
+	assert(rc == 0);
+	shadow = calloc(1, LOGBASE);
+	assert(shadow != NULL);
+
+	pid = fork();
+	assert(pid >= 0);
+	if (pid == 0) {
+		libtask_start(solo_child, NULL);
+		_exit(1);
+	}
+	rc = waitpid(pid, &status, 0);
+	assert(rc == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	for (i = 0; i < NTASKS; i++) {
+		seed = i;
+		for (n = 0; n < NOPS; n++) {
+			solo_op(&seed, i, &off, &len, &c);
+		}
+	}
+
+	rc = wlog_init(&wl, fd, LOGBASE, LOGSZ);
+	assert(rc == 0);
+	b = malloc(LOGBASE);
+	assert(b != NULL);
+	rc = pread(fd, b, LOGBASE, 0);
+	assert(rc == LOGBASE);
+	assert(memcmp(b, shadow, LOGBASE) == 0);
+	wlog_stats(&wl);
+	printf("PASS\n");
+
+	close(fd);
+	unlink(path);
+	return (0);
+}
+
+#endif /* SOLOTEST_WLOG */
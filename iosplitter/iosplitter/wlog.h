@@ -0,0 +1,68 @@
+/*
+ * wlog.h
+ *	write staging log with group commit on a region of the SSD
+ */
+
+#ifndef __WLOG_H__
+#define __WLOG_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "dll.h"
+
+#define WLOG_SECTOR	512
+#define WLOG_SUPERSZ	(1 << 12)	/* super block at start of region */
+#define WLOG_MAXIO	(1 << 20)	/* largest write, PAYLOADSZ */
+#define WLOG_MAXBATCH	64		/* records in one group commit */
+#define WLOG_NBUCKETS	1024		/* index of staged records */
+
+/*
+ * one log shared by all sessions and worker threads of the server,
+ * everything below is protected by lock
+ */
+typedef struct wlog {
+	int		fd;
+	uint64_t	base;		/* super block, records follow it */
+	uint64_t	dsize;		/* bytes for records */
+
+	pthread_mutex_t	lock;
+	pthread_cond_t	kick;		/* flusher: records staged */
+	pthread_cond_t	space;		/* flusher: destager freed log space */
+	pthread_cond_t	dirty;		/* destager: log filling up */
+	pthread_t	flusher;
+	pthread_t	destager;
+
+	dll_t		staged;		/* not yet in the log */
+	dll_t		committed;	/* in the log, not yet at home */
+	uint64_t	seq;		/* of last staged record */
+	uint64_t	head;		/* next record goes here */
+	uint64_t	used;		/* from oldest record to head */
+	uint64_t	epoch;		/* of the super block and new records */
+
+	/* staged and committed records by 1MB region, in seq order */
+	dll_t		bucket[WLOG_NBUCKETS];
+	/* bumped when records leave a bucket, see wlog_overlay */
+	uint32_t	gen[WLOG_NBUCKETS];
+
+	uint64_t	ncommits;	/* group commits */
+	uint64_t	nrecs;		/* records committed */
+	uint64_t	nlogged;	/* bytes written to the log */
+	uint64_t	ndestaged;	/* records written home */
+	uint64_t	nreplayed;	/* records replayed by wlog_init */
+} wlog_t;
+
+/* snapshot of bucket generations covering a read, see wlog_overlay */
+typedef struct wlog_ticket {
+	uint32_t	gen[2];
+} wlog_ticket_t;
+
+int wlog_init(wlog_t *wl, int fd, uint64_t base, uint64_t size);
+int wlog_write(wlog_t *wl, char *buf, uint64_t len, uint64_t off);
+int wlog_inlog(wlog_t *wl, uint64_t off, uint64_t len);
+void wlog_ticket(wlog_t *wl, uint64_t off, uint64_t len, wlog_ticket_t *tkt);
+int wlog_overlay(wlog_t *wl, char *buf, uint64_t len, uint64_t off,
+		wlog_ticket_t *tkt);
+void wlog_stats(wlog_t *wl);
+
+#endif
@@ -0,0 +1,205 @@
+/*
+ * combinebench: many tasks sending on one socket, one after the other
+ * under a QLock or handing their messages to a QCombine
+ *
+ *	combinebench [-t tasks] [-n count] [-s size] [-b maxbatch]
+ *
+ * Each of tasks senders writes its share of count messages of size bytes
+ * to one end of a unix socketpair, a reader drains the other. With the
+ * QLock every message is a write of its own; with the QCombine the holder
+ * sends up to maxbatch queued messages in one writev. Reports messages/s,
+ * messages per system call and the statistics of both locks.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <task.h>
+#include "taskio.h"
+
+#define TASKSTACKSZ	(32 * 1024)
+
+static int		ntasks = 64;
+static long		count = 1000000;
+static size_t		msize = 64;
+static int		maxbatch = 64;
+static long		permsg;		/* messages each sender sends */
+static int		sendfd;
+static int		combined;
+static char		*msg;
+static int		running;
+static Rendez		finished;
+static QLock		sendlock;
+static QCombine		sendcomb;
+static struct iovec	*iov;
+static LockStats	lockstats, combstats;
+
+static uint64_t now(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static void sendbatch(void *ctx, QCombineOp *ops, int nops)
+{
+	QCombineOp	*op;
+	int		fd = *(int *) ctx;
+	int		i, rc;
+
+	for (i = 0, op = ops; op != NULL; op = op->next, i++) {
+		iov[i].iov_base = op->arg;
+		iov[i].iov_len = msize;
+	}
+	assert(i == nops);
+	rc = task_netwritev(fd, iov, nops);
+	for (op = ops; op != NULL; op = op->next) {
+		op->res = rc;
+	}
+}
+
+static void sendtask(void *arg)
+{
+	long	i;
+	int	rc;
+
+	taskname("sendtask");
+	for (i = 0; i < permsg; i++) {
+		if (combined) {
+			rc = qcombine(&sendcomb, msg);
+		} else {
+			qlock(&sendlock);
+			rc = task_netrw(sendfd, msg, msize, TASKIO_WRITE);
+			qunlock(&sendlock);
+		}
+		assert(rc == 0);
+	}
+	if (--running == 0) {
+		taskwakeup(&finished);
+	}
+}
+
+static void readtask(void *arg)
+{
+	int		fd = *(int *) arg;
+	static char	buf[65536];
+	uint64_t	left = (uint64_t) permsg * ntasks * msize;
+	size_t		n;
+	int		rc;
+
+	taskname("readtask");
+	while (left > 0) {
+		n = left < sizeof(buf) ? left : sizeof(buf);
+		rc = task_netread(fd, buf, n);
+		assert(rc == 0);
+		left -= n;
+	}
+	if (--running == 0) {
+		taskwakeup(&finished);
+	}
+}
+
+static void run(void)
+{
+	uint64_t	t, nwrites;
+	int		sv[2];
+	int		i, rc;
+
+	rc = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+	assert(rc == 0);
+	for (i = 0; i < 2; i++) {
+		rc = tasknet_setnoblock(sv[i]);
+		assert(rc == 0);
+		rc = task_sockfd_register(sv[i]);
+		assert(rc == 0);
+	}
+	sendfd = sv[0];
+
+	t = now();
+	running = ntasks + 1;
+	taskcreate(readtask, &sv[1], TASKSTACKSZ);
+	for (i = 0; i < ntasks; i++) {
+		taskcreate(sendtask, NULL, TASKSTACKSZ);
+	}
+	tasksleep(&finished);
+	t = now() - t;
+
+	nwrites = combined ? sendcomb.nbatches : (uint64_t) permsg * ntasks;
+	printf("%-8s %d tasks: %ld msgs of %zu in %.3fs, %.0f/s, "
+			"%.1f msgs per write\n", combined ? "qcombine" : "qlock",
+			ntasks, permsg * ntasks, msize, t / 1e9,
+			permsg * ntasks / (t / 1e9),
+			(double) permsg * ntasks / nwrites);
+
+	for (i = 0; i < 2; i++) {
+		close(sv[i]);
+		task_fd_deregister(sv[i]);
+	}
+}
+
+static void benchmain(void *arg)
+{
+	int	rc;
+
+	rc = taskio_init();
+	assert(rc == 0);
+	taskio_start();
+
+	msg = malloc(msize);
+	iov = calloc(maxbatch, sizeof(*iov));
+	assert(msg != NULL && iov != NULL);
+	memset(msg, 'x', msize);
+	qlockstats(&sendlock, &lockstats, "qlock");
+	qcombineinit(&sendcomb, sendbatch, &sendfd, maxbatch);
+	qlockstats(&sendcomb.l, &combstats, "qcombine");
+
+	run();
+	combined = 1;
+	run();
+	fflush(stdout);
+	lockstatsprint(1);
+	exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+	int	opt;
+
+	while ((opt = getopt(argc, argv, "t:n:s:b:")) != -1) {
+		switch (opt) {
+		case 't':
+			ntasks = atoi(optarg);
+			break;
+		case 'n':
+			count = atol(optarg);
+			break;
+		case 's':
+			msize = atol(optarg);
+			break;
+		case 'b':
+			maxbatch = atoi(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc || ntasks <= 0 || count < ntasks || msize == 0 ||
+			maxbatch <= 0) {
+		goto usage;
+	}
+	permsg = count / ntasks;
+
+	libtask_start(benchmain, NULL);
+	return (0);
+
+usage:
+	fprintf(stderr, "Usage: %s [-t tasks] [-n count] [-s size] "
+			"[-b maxbatch]\n", argv[0]);
+	return (1);
+}
@@ -0,0 +1,197 @@
+/*
+ * contbench: random reads at a fixed queue depth, from stackful tasks or
+ * from continuations
+ *
+ *	contbench [-t] [-q depth] [-n count] [-b blocksize] file
+ *
+ * Without -t each of depth taskcont_t's chains its next read from its
+ * completion; with -t as many tasks of TASKSTACKSZ loop on task_aioread.
+ * Reports reads/s and the memory each in-flight read holds.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <task.h>
+#include "taskio.h"
+
+#define TASKSTACKSZ	(32 * 1024)
+
+struct reader {
+	taskcont_t	k;
+	char		*buf;
+};
+
+static int		fd;
+static int		usetasks;
+static int		depth = 1024;
+static long		count = 1000000;
+static size_t		bsize = 4096;
+static off_t		nblocks;
+static long		issued, done;
+static struct reader	*readers;
+static Rendez		finished;
+
+static uint64_t now(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static off_t randoff(void)
+{
+	return ((off_t) (random() % nblocks) * bsize);
+}
+
+static long vmkb(const char *what)
+{
+	char	line[128];
+	FILE	*f;
+	long	kb = -1;
+
+	if ((f = fopen("/proc/self/status", "r")) == NULL) {
+		return (-1);
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (strncmp(line, what, strlen(what)) == 0) {
+			kb = atol(line + strlen(what) + 1);
+			break;
+		}
+	}
+	fclose(f);
+	return (kb);
+}
+
+static void readdone(taskcont_t *k)
+{
+	struct reader	*r = k->arg;
+	int		rc;
+
+	assert(k->res == 0);
+	if (++done == count) {
+		taskwakeup(&finished);
+		return;
+	}
+	if (issued < count) {
+		issued++;
+		rc = task_cont_aiorw(&r->k, fd, r->buf, bsize, randoff(),
+				TASKIO_READ);
+		assert(rc == 0);
+	}
+}
+
+static void readtask(void *arg)
+{
+	struct reader	*r = arg;
+	ssize_t		n;
+	int		rc;
+
+	taskname("readtask");
+	while (issued < count) {
+		issued++;
+		rc = task_aioread(fd, r->buf, bsize, randoff(), &n);
+		assert(rc == 0);
+		if (++done == count) {
+			taskwakeup(&finished);
+		}
+	}
+}
+
+static void benchmain(void *arg)
+{
+	uint64_t	t;
+	size_t		perio;
+	long		rss0;
+	int		i, rc;
+
+	rc = taskio_init();
+	assert(rc == 0);
+	taskio_start();
+
+	readers = calloc(depth, sizeof(*readers));
+	assert(readers != NULL);
+	for (i = 0; i < depth; i++) {
+		rc = posix_memalign((void **) &readers[i].buf, 4096, bsize);
+		assert(rc == 0);
+	}
+	rss0 = vmkb("VmRSS:");
+
+	t = now();
+	for (i = 0; i < depth && issued < count; i++) {
+		if (usetasks) {
+			taskcreate(readtask, &readers[i], TASKSTACKSZ);
+			continue;
+		}
+		task_cont_init(&readers[i].k, readdone, &readers[i]);
+		issued++;
+		rc = task_cont_aiorw(&readers[i].k, fd, readers[i].buf, bsize,
+				randoff(), TASKIO_READ);
+		assert(rc == 0);
+	}
+	tasksleep(&finished);
+	t = now() - t;
+
+	perio = usetasks ? TASKSTACKSZ + 512 : sizeof(taskcont_t);
+	printf("%s, depth %d: %ld reads of %zu in %.3fs, %.0f/s\n",
+			usetasks ? "tasks" : "continuations", depth, count,
+			bsize, t / 1e9, count / (t / 1e9));
+	printf("per read in flight: %zu bytes, %zu KB at this depth; "
+			"rss +%ld KB, peak %ld KB\n", perio,
+			perio * depth / 1024, vmkb("VmRSS:") - rss0,
+			vmkb("VmHWM:"));
+	printf("%lu continuations run, %lu waits for an aio slot\n",
+			g_task_cont_runs, g_task_aio_waits);
+	exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+	struct stat	st;
+	int		opt;
+
+	while ((opt = getopt(argc, argv, "tq:n:b:")) != -1) {
+		switch (opt) {
+		case 't':
+			usetasks = 1;
+			break;
+		case 'q':
+			depth = atoi(optarg);
+			break;
+		case 'n':
+			count = atol(optarg);
+			break;
+		case 'b':
+			bsize = atol(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1 || depth <= 0 || count <= 0 || bsize == 0) {
+		goto usage;
+	}
+	if ((fd = open(argv[optind], O_RDONLY)) == -1 ||
+			fstat(fd, &st) == -1) {
+		perror(argv[optind]);
+		return (1);
+	}
+	if ((nblocks = st.st_size / bsize) == 0) {
+		fprintf(stderr, "%s: smaller than a block\n", argv[optind]);
+		return (1);
+	}
+
+	libtask_start(benchmain, NULL);
+	return (0);
+
+usage:
+	fprintf(stderr, "Usage: %s [-t] [-q depth] [-n count] [-b blocksize] "
+			"file\n", argv[0]);
+	return (1);
+}
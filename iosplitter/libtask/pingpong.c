@@ -0,0 +1,158 @@
+/*
+ * pingpong: round trip latency between the task schedulers of two threads
+ *
+ *	pingpong [-n count] [-p spin_us]
+ *
+ * A task of each thread receives a message on its XChannel and sends it
+ * back to the other's. -p makes both aiotasks poll before sleeping, see
+ * taskio_set_spin().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+#include <time.h>
+#include <task.h>
+#include "taskio.h"
+#include "taskpost.h"
+
+struct side {
+	XChannel	ch;
+	struct side	*peer;
+	pthread_t	thread;
+};
+
+struct ball {
+	MpscNode	node;		/* MUST BE FIRST */
+	int		last;
+};
+
+static struct side	sides[2];
+static pthread_barrier_t ready;
+static long		count = 100000;
+static uint64_t		spinns;
+static uint64_t		*rtt;
+
+static uint64_t now(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static int cmp(const void *a, const void *b)
+{
+	uint64_t	x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return (x < y ? -1 : x > y);
+}
+
+static void pinger(struct side *me)
+{
+	struct ball	b;
+	uint64_t	t, start;
+	long		i;
+
+	memset(&b, 0, sizeof(b));
+	start = now();
+	for (i = 0; i < count; i++) {
+		t = now();
+		b.last = (i == count - 1);
+		xchansend(&me->peer->ch, &b.node);
+		assert(xchanrecv(&me->ch) == &b.node);
+		rtt[i] = now() - t;
+	}
+	t = now() - start;
+
+	qsort(rtt, count, sizeof(*rtt), cmp);
+	printf("%ld round trips in %.3fs, %.0f/s, spin %luus\n", count,
+			t / 1e9, count / (t / 1e9), spinns / 1000);
+	printf("rtt ns: min %lu p50 %lu p90 %lu p99 %lu p99.9 %lu max %lu\n",
+			rtt[0], rtt[count / 2], rtt[count * 90 / 100],
+			rtt[count * 99 / 100], rtt[count * 999 / 1000],
+			rtt[count - 1]);
+	printf("polled %luns: %lu hits, %lu misses, %lu epoll sleeps\n",
+			g_taskio_spin_ns, g_taskio_spin_hits,
+			g_taskio_spin_misses, g_taskio_blocks);
+	exit(0);
+}
+
+static void ponger(struct side *me)
+{
+	struct ball	*b;
+	int		last;
+
+	do {
+		b = (struct ball *) xchanrecv(&me->ch);
+		last = b->last;		/* the pinger's again once sent */
+		xchansend(&me->peer->ch, &b->node);
+	} while (!last);
+}
+
+static void sidemain(void *arg)
+{
+	struct side	*me = arg;
+	int		rc;
+
+	taskname("pingpong %d", (int) (me - sides));
+	rc = taskio_init();
+	assert(rc == 0);
+	taskio_set_spin(spinns);
+	taskio_start();
+
+	xchaninit(&me->ch);
+	/* blocks the thread, nothing else runs on it yet */
+	pthread_barrier_wait(&ready);
+
+	if (me == &sides[0]) {
+		pinger(me);
+	} else {
+		ponger(me);
+	}
+}
+
+static void *sidethread(void *arg)
+{
+	libtask_start(sidemain, arg);
+	return (NULL);
+}
+
+int main(int argc, char *argv[])
+{
+	int	opt, i;
+
+	while ((opt = getopt(argc, argv, "n:p:")) != -1) {
+		switch (opt) {
+		case 'n':
+			count = atol(optarg);
+			break;
+		case 'p':
+			spinns = (uint64_t) atoi(optarg) * 1000;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n count] [-p spin_us]\n",
+					argv[0]);
+			return (1);
+		}
+	}
+	if (count <= 0 || (rtt = calloc(count, sizeof(*rtt))) == NULL) {
+		return (1);
+	}
+
+	pthread_barrier_init(&ready, NULL, 2);
+	sides[0].peer = &sides[1];
+	sides[1].peer = &sides[0];
+	for (i = 0; i < 2; i++) {
+		if (pthread_create(&sides[i].thread, NULL, sidethread,
+					&sides[i]) != 0) {
+			perror("pthread_create");
+			return (1);
+		}
+	}
+	pthread_join(sides[0].thread, NULL);
+	return (0);
+}
@@ -59,3 +59,21 @@ lrand(void)
 {
 	return rand();
 }
+
+static int mainargc;
+static char **mainargv;
+
+static void
+mainstart(void *v)
+{
+	taskmain(mainargc, mainargv);
+}
+
+int
+main(int argc, char **argv)
+{
+	mainargc = argc;
+	mainargv = argv;
+	libtask_start(mainstart, 0);
+	return 0;
+}
@@ -1,4 +1,109 @@
 #include "taskimpl.h"
+#include <stdio.h>
+#include "timer.h"
+
+/*
+ * statistics
+ */
+static LockStats *lockstatslist;
+static pthread_mutex_t lockstatsmu = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+lockstatsadd(LockStats *s, char *name)
+{
+	memset(s, 0, sizeof *s);
+	s->name = name;
+	pthread_mutex_lock(&lockstatsmu);
+	s->next = lockstatslist;
+	lockstatslist = s;
+	pthread_mutex_unlock(&lockstatsmu);
+}
+
+void
+qlockstats(QLock *l, LockStats *s, char *name)
+{
+	lockstatsadd(s, name);
+	l->stats = s;
+}
+
+void
+rwlockstats(RWLock *l, LockStats *s, char *name)
+{
+	lockstatsadd(s, name);
+	l->stats = s;
+}
+
+/* blocked is when the task started waiting, 0 if it did not */
+static void
+lockacquired(LockStats *s, uint64_t blocked, int hold)
+{
+	uint64_t now, w;
+	int b;
+
+	now = timer_now();
+	s->nacquire++;
+	if(blocked){
+		w = now - blocked;
+		s->ncontended++;
+		s->waitns += w;
+		if(w > s->maxwait)
+			s->maxwait = w;
+		b = w ? 64 - __builtin_clzll(w) : 0;
+		if(b >= LOCKSTAT_NBUCKETS)
+			b = LOCKSTAT_NBUCKETS - 1;
+		s->waithist[b]++;
+	}
+	if(hold)
+		s->since = now;
+}
+
+static void
+lockreleased(LockStats *s)
+{
+	uint64_t h;
+
+	h = timer_now() - s->since;
+	s->holdns += h;
+	if(h > s->maxhold)
+		s->maxhold = h;
+}
+
+static uint64_t
+lockblocked(LockStats *s)
+{
+	return s ? timer_now() : 0;
+}
+
+/*
+ * one line per lock with statistics, of all threads
+ */
+void
+lockstatsprint(int fd)
+{
+	LockStats *s;
+	uint64_t n, p99;
+	int b;
+
+	pthread_mutex_lock(&lockstatsmu);
+	for(s = lockstatslist; s != nil; s = s->next){
+		n = 0;
+		for(b = 0; b < LOCKSTAT_NBUCKETS - 1; b++){
+			n += s->waithist[b];
+			if(n * 100 >= s->ncontended * 99)
+				break;
+		}
+		p99 = 1ULL << b;
+		dprintf(fd, "%-24s %12"PRIu64" acquired %5.1f%% contended "
+			"wait avg %"PRIu64" p99 <%"PRIu64" max %"PRIu64"ns "
+			"hold avg %"PRIu64" max %"PRIu64"ns\n", s->name,
+			s->nacquire, s->nacquire ?
+				100.0 * s->ncontended / s->nacquire : 0.0,
+			s->ncontended ? s->waitns / s->ncontended : 0,
+			s->ncontended ? p99 : 0, s->maxwait,
+			s->nacquire ? s->holdns / s->nacquire : 0, s->maxhold);
+	}
+	pthread_mutex_unlock(&lockstatsmu);
+}
 
 /*
  * locking
@@ -6,12 +111,17 @@
 static int
 _qlock(QLock *l, int block)
 {
+	uint64_t blocked;
+
 	if(l->owner == nil){
 		l->owner = taskrunning;
+		if(l->stats)
+			lockacquired(l->stats, 0, 1);
 		return 1;
 	}
 	if(!block)
 		return 0;
+	blocked = lockblocked(l->stats);
 	addtask(&l->waiting, taskrunning);
 	taskstate("qlock");
 	taskswitch();
@@ -19,6 +129,8 @@ _qlock(QLock *l, int block)
 		fprint(2, "qlock: owner=%p self=%p oops\n", l->owner, taskrunning);
 		abort();
 	}
+	if(l->stats)
+		lockacquired(l->stats, blocked, 1);
 	return 1;
 }
 
@@ -43,6 +155,8 @@ qunlock(QLock *l)
 		fprint(2, "qunlock: owner=0\n");
 		abort();
 	}
+	if(l->stats)
+		lockreleased(l->stats);
 	if((l->owner = ready = l->waiting.head) != nil){
 		deltask(&l->waiting, ready);
 		taskready(ready);
@@ -52,15 +166,22 @@ qunlock(QLock *l)
 static int
 _rlock(RWLock *l, int block)
 {
+	uint64_t blocked;
+
 	if(l->writer == nil && l->wwaiting.head == nil){
 		l->readers++;
+		if(l->stats)
+			lockacquired(l->stats, 0, 0);
 		return 1;
 	}
 	if(!block)
 		return 0;
+	blocked = lockblocked(l->stats);
 	addtask(&l->rwaiting, taskrunning);
 	taskstate("rlock");
 	taskswitch();
+	if(l->stats)
+		lockacquired(l->stats, blocked, 0);
 	return 1;
 }
 
@@ -79,15 +200,22 @@ canrlock(RWLock *l)
 static int
 _wlock(RWLock *l, int block)
 {
+	uint64_t blocked;
+
 	if(l->writer == nil && l->readers == 0){
 		l->writer = taskrunning;
+		if(l->stats)
+			lockacquired(l->stats, 0, 1);
 		return 1;
 	}
 	if(!block)
 		return 0;
+	blocked = lockblocked(l->stats);
 	addtask(&l->wwaiting, taskrunning);
 	taskstate("wlock");
 	taskswitch();
+	if(l->stats)
+		lockacquired(l->stats, blocked, 1);
 	return 1;
 }
 
@@ -124,6 +252,8 @@ wunlock(RWLock *l)
 		fprint(2, "wunlock: not locked\n");
 		abort();
 	}
+	if(l->stats)
+		lockreleased(l->stats);
 	l->writer = nil;
 	if(l->readers != 0){
 		fprint(2, "wunlock: readers\n");
@@ -140,3 +270,105 @@ wunlock(RWLock *l)
 		taskready(t);
 	}
 }
+
+/*
+ * flat combining
+ */
+void
+qcombineinit(QCombine *c, qcombinefn fn, void *ctx, int maxbatch)
+{
+	memset(c, 0, sizeof *c);
+	c->fn = fn;
+	c->ctx = ctx;
+	c->maxbatch = maxbatch > 0 ? maxbatch : 1;
+}
+
+/*
+ * with the lock held: run what is queued, in batches, until the queue is
+ * empty or, once mine is done, after running 4 batches worth of others'.
+ * Then the first waiter is woken holding the lock, to go on combining.
+ */
+static void
+qcombinerun(QCombine *c, QCombineOp *mine)
+{
+	QCombineOp *batch, *op, *next;
+	int n, share;
+
+	share = 4 * c->maxbatch;
+	while((batch = c->head) != nil){
+		if(share <= 0 && (mine == nil || mine->done)){
+			if(c->l.stats)
+				lockreleased(c->l.stats);
+			c->l.owner = batch->task;
+			taskready(batch->task);
+			return;
+		}
+		for(n = 1, op = batch; n < c->maxbatch && op->next != nil; n++)
+			op = op->next;
+		if((c->head = op->next) == nil)
+			c->tail = nil;
+		op->next = nil;
+
+		c->fn(c->ctx, batch, n);
+		c->nbatches++;
+		c->nops += n;
+
+		for(op = batch; op != nil; op = next){
+			next = op->next;
+			op->done = 1;
+			if(op != mine){
+				taskready(op->task);
+				share--;
+			}
+		}
+	}
+}
+
+int
+qcombine(QCombine *c, void *arg)
+{
+	QCombineOp op;
+	uint64_t blocked;
+
+	op.next = nil;
+	op.task = taskrunning;
+	op.arg = arg;
+	op.res = 0;
+	op.done = 0;
+	if(c->tail)
+		c->tail->next = &op;
+	else
+		c->head = &op;
+	c->tail = &op;
+
+	if(!canqlock(&c->l)){
+		blocked = lockblocked(c->l.stats);
+		taskstate("qcombine");
+		taskswitch();
+		if(op.done)
+			return op.res;
+		/* handed the lock and the queue */
+		assert(c->l.owner == taskrunning);
+		if(c->l.stats)
+			lockacquired(c->l.stats, blocked, 1);
+	}
+	qcombinerun(c, &op);
+	if(c->l.owner == taskrunning)
+		qunlock(&c->l);
+	assert(op.done);
+	return op.res;
+}
+
+void
+qcombinelock(QCombine *c)
+{
+	qlock(&c->l);
+}
+
+void
+qcombineunlock(QCombine *c)
+{
+	qcombinerun(c, nil);
+	if(c->l.owner == taskrunning)
+		qunlock(&c->l);
+}
@@ -3,9 +3,17 @@
 #include "taskimpl.h"
 #include <fcntl.h>
 #include <stdio.h>
+#include <sys/mman.h>
 
-#define CACHE_STACK_SIZE	(32 * 1024)
+#define CACHE_STACK_SIZE	(32 * 1024)	/* cached: stacks up to this */
 #define TASKS_CACHE_MAX		(32)
+#define TASKNSTACKFN		64
+#define STACK_MIN		(8 * 1024)	/* smallest auto size */
+#define STACK_MARGIN		(4 * 1024)	/* auto size over the deepest */
+#define STACK_PAINT		0xa5a5a5a5a5a5a5a5ULL
+#define STACK_GUARD		1024		/* least headroom left at exit */
+#define STACK_NCHECK		8		/* lowest words checked at switch */
+#define TASKNCLASS		64	/* the last one takes the rest */
 
 __thread int	taskdebuglevel;
 __thread int	taskcount;
@@ -25,6 +33,37 @@ __thread int	nalltask;
 static __thread char *argv0;
 static __thread int taskidgen;
 
+typedef struct Taskclass Taskclass;
+struct Taskclass
+{
+	char	name[32];
+	uvlong	ntask;
+	uvlong	nrun;
+	uvlong	cycles;
+};
+
+static __thread Taskclass	taskclasses[TASKNCLASS];	/* of exited tasks */
+static __thread int		ntaskclass;
+static __thread uvlong		taskcyclestart;
+static __thread uvlong		taskidlecycles;
+static __thread uvlong		taskidlesince;
+static int			tasknkey;
+
+typedef struct Taskstack Taskstack;
+struct Taskstack
+{
+	void	(*fn)(void*);
+	char	name[32];
+	uvlong	ntask;
+	uint	maxused;
+	uint	maxsize;	/* largest stack it had */
+	int	full;		/* a task came near its limit: no auto size */
+};
+
+static int			taskstackmodeset;
+static __thread Taskstack	taskstacks[TASKNSTACKFN];
+static __thread int		ntaskstack;
+
 
 static void contextswitch(Context *from, Context *to);
 
@@ -97,6 +136,10 @@ static void _task_init(Task *t, void (*fn)(void*), void *arg)
 	t->startfn	= fn;
 	t->startarg	= arg;
 	t->udata	= NULL;
+	memset(t->slot, 0, sizeof t->slot);
+	t->class	= NULL;
+	t->cycles	= 0;
+	t->nrun		= 0;
 	t->cached	= 0;
 }
 
@@ -143,19 +186,211 @@ static void task_init(Task *t, void (*fn)(void*), void *arg)
 	makecontext(&t->context.uc, (void(*)())taskstart, 2, y, x);
 }
 
+/*
+ * stack profiling
+ */
+
+void
+taskstackmode(int mode)
+{
+	taskstackmodeset = mode;
+}
+
+static Taskstack*
+stackfind(void (*fn)(void*), int add)
+{
+	int i;
+
+	for(i=0; i<ntaskstack; i++)
+		if(taskstacks[i].fn == fn)
+			return &taskstacks[i];
+	if(!add || ntaskstack == TASKNSTACKFN)
+		return nil;
+	taskstacks[ntaskstack].fn = fn;
+	return &taskstacks[ntaskstack++];
+}
+
+static void
+stackpaint(Task *t)
+{
+	uvlong *p, *e;
+
+	p = (uvlong*)t->stk;
+	e = (uvlong*)(t->stk + (t->stksize & ~7));
+	while(p < e)
+		*p++ = STACK_PAINT;
+}
+
+/* bytes from the top down to the deepest one written */
+static uint
+stackused(Task *t)
+{
+	uvlong *p, *e;
+
+	p = (uvlong*)t->stk;
+	e = (uvlong*)(t->stk + (t->stksize & ~7));
+	while(p < e && *p == STACK_PAINT)
+		p++;
+	return t->stk + t->stksize - (uchar*)p;
+}
+
+/*
+ * a frame may leave words unwritten, check a few; t->stk of a stack after
+ * its Task may have been overwritten, go by where taskalloc put the stack
+ */
+static int
+stackbottom(Task *t)
+{
+	uvlong *p;
+	int i;
+
+	p = t->guarded ? (uvlong*)t->stk : (uvlong*)(t+1);
+	for(i=0; i<STACK_NCHECK; i++)
+		if(p[i] != STACK_PAINT)
+			return 1;
+	return 0;
+}
+
+/*
+ * the task ran into the guard at the bottom of its stack, or off it into
+ * its Task below, and the program cannot go on
+ */
+static void
+stackexhausted(Task *t)
+{
+	fprint(2, "task %d (%s): stack of %ud bytes exhausted\n",
+		t->id, t->name[0] ? t->name : "-", t->stksize);
+	abort();
+}
+
+/* SIGSEGV in the guard page under the running task's stack */
+static void
+stackfault(int sig, siginfo_t *si, void *uc)
+{
+	Task *t;
+
+	t = taskrunning;
+	if(t != nil && t->guarded && (uchar*)si->si_addr < t->stk &&
+	   (uchar*)si->si_addr >= t->stk - getpagesize())
+		stackexhausted(t);
+	/* not ours: SA_RESETHAND, the fault repeats with the default */
+}
+
+/* the fault handler runs on a stack of its own, set up once per thread */
+static void
+stackguardinit(void)
+{
+	static __thread int done;
+	struct sigaction sa;
+	stack_t ss;
+
+	if(done)
+		return;
+	done = 1;
+	ss.ss_size = SIGSTKSZ;
+	ss.ss_sp = malloc(ss.ss_size);
+	ss.ss_flags = 0;
+	if(ss.ss_sp == nil || sigaltstack(&ss, nil) < 0){
+		fprint(2, "sigaltstack: %r\n");
+		abort();
+	}
+	memset(&sa, 0, sizeof sa);
+	sa.sa_sigaction = stackfault;
+	sa.sa_flags = SA_SIGINFO|SA_ONSTACK|SA_RESETHAND;
+	sigaction(SIGSEGV, &sa, nil);
+}
+
+static void
+stackrecord(Task *t)
+{
+	Taskstack *s;
+	uint used;
+
+	if(!t->painted)
+		return;
+	used = stackused(t);
+	if(t->stksize > 2*STACK_GUARD && used > t->stksize - STACK_GUARD)
+		stackexhausted(t);
+	if((s = stackfind(t->startfn, 1)) == nil)
+		return;
+	if(used > t->stksize - t->stksize/4)
+		s->full = 1;
+	strecpy(s->name, s->name+sizeof s->name, t->name[0] ? t->name : "-");
+	s->ntask++;
+	if(used > s->maxused)
+		s->maxused = used;
+	if(t->stksize > s->maxsize)
+		s->maxsize = t->stksize;
+}
+
+static uint
+stacksize(void (*fn)(void*), uint stack)
+{
+	Taskstack *s;
+	uint size;
+
+	if(taskstackmodeset != TASKSTACK_AUTO ||
+	   (s = stackfind(fn, 0)) == nil || s->ntask < TASKSTACK_LEARN ||
+	   s->full)
+		return stack;
+	for(size=STACK_MIN; size < 2*s->maxused ||
+	    size < s->maxused+STACK_MARGIN; size*=2)
+		;
+	return size < stack ? size : stack;
+}
+
+void
+taskstackprint(int fd)
+{
+	Taskstack *s;
+
+	fprint(fd, "%-31s %10s %8s %8s %8s\n",
+		"task stacks", "exited", "deepest", "size", "auto");
+	for(s=taskstacks; s<taskstacks+ntaskstack; s++)
+		fprint(fd, "%-31s %10llud %8ud %8ud %8ud\n",
+			s->name, s->ntask, s->maxused, s->maxsize,
+			stacksize(s->fn, s->maxsize));
+}
+
+static uint
+stackmapsize(uint stack)
+{
+	uint pg;
+
+	pg = getpagesize();
+	return pg + (stack+pg-1)/pg*pg;
+}
+
+/*
+ * an auto sized stack is mapped on its own above a PROT_NONE page, a task
+ * that goes deeper than those before it faults there instead of writing
+ * over its neighbour
+ */
 static Task*
-taskalloc(void (*fn)(void*), void *arg, uint stack)
+taskalloc(void (*fn)(void*), void *arg, uint stack, int guard)
 {
 	Task *t;
+	uchar *m;
 
-	/* allocate the task and stack together */
-	t = malloc(sizeof *t+stack);
+	/* allocate the task and, unguarded, its stack together */
+	t = malloc(guard ? sizeof *t : sizeof *t+stack);
 	if(t == nil){
 		fprint(2, "taskalloc malloc: %r\n");
 		abort();
 	}
 	memset(t, 0, sizeof *t);
 	t->stk = (uchar*)(t+1);
+	if(guard){
+		stackguardinit();
+		m = mmap(nil, stackmapsize(stack), PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if(m == MAP_FAILED || mprotect(m, getpagesize(), PROT_NONE) < 0){
+			fprint(2, "taskalloc mmap: %r\n");
+			abort();
+		}
+		t->stk = m + getpagesize();
+		t->guarded = 1;
+	}
 	t->stksize = stack;
 	t->id = ++taskidgen;
 
@@ -163,6 +398,8 @@ taskalloc(void (*fn)(void*), void *arg, uint stack)
 	t->stkid = VALGRIND_STACK_REGISTER(t->stk, t->stk + t->stksize);
 #endif
 
+	if((t->painted = taskstackmodeset != TASKSTACK_OFF))
+		stackpaint(t);
 	task_init(t, fn, arg);
 	return t;
 }
@@ -170,18 +407,24 @@ taskalloc(void (*fn)(void*), void *arg, uint stack)
 int
 taskcreate(void (*fn)(void*), void *arg, uint stack)
 {
-	int id;
+	int id, guard;
 	Task *t;
-
-	t = nil;
-	if (stack == CACHE_STACK_SIZE) {
-		/* we cache a task iff stack size is CACHE_STACK_SIZE */
-		t = taskscache.head;
+	uint size;
+
+	size = stacksize(fn, stack);
+	guard = size < stack;
+	stack = size;
+	if (stack <= CACHE_STACK_SIZE) {
+		/* we cache tasks of stacks up to CACHE_STACK_SIZE */
+		for (t = taskscache.head; t != nil; t = t->next)
+			if (t->stksize == stack && t->guarded == guard)
+				break;
+	} else {
+		t = nil;
 	}
 
 	if (t == nil) {
-		assert(taskcachecount == 0);
-		t = taskalloc(fn, arg, stack);
+		t = taskalloc(fn, arg, stack, guard);
 		taskcount++;
 		if(nalltask%64 == 0){
 			alltask = realloc(alltask, (nalltask+64)*sizeof(alltask[0]));
@@ -196,6 +439,8 @@ taskcreate(void (*fn)(void*), void *arg, uint stack)
 		deltask(&taskscache, t);
 		assert(taskcachecount > 0);
 		taskcachecount--;
+		if((t->painted = taskstackmodeset != TASKSTACK_OFF))
+			stackpaint(t);
 		task_init(t, fn, arg);
 	}
 
@@ -259,6 +504,19 @@ taskexit(int val)
 	taskswitch();
 }
 
+static inline uvlong
+cyclecount(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+#endif
+}
+
 static void
 contextswitch(Context *from, Context *to)
 {
@@ -280,16 +538,53 @@ static void taskfree(Task *t)
 #ifdef VALGRIND
 	VALGRIND_STACK_DEREGISTER(t->stkid);
 #endif
+	if (t->guarded)
+		munmap(t->stk - getpagesize(), stackmapsize(t->stksize));
 	free(t);
 }
 
+static Taskclass*
+classfind(Taskclass *tab, int *n, char *name)
+{
+	int i;
+
+	for(i=0; i<*n; i++)
+		if(strncmp(tab[i].name, name, sizeof tab[i].name-1) == 0)
+			return &tab[i];
+	if(*n == TASKNCLASS-1)
+		name = "(other)";
+	else if(*n == TASKNCLASS)
+		return &tab[TASKNCLASS-1];
+	memset(&tab[*n], 0, sizeof tab[*n]);
+	strecpy(tab[*n].name, tab[*n].name+sizeof tab[*n].name, name);
+	return &tab[(*n)++];
+}
+
+static char*
+taskclassof(Task *t)
+{
+	if(t->class)
+		return t->class;
+	return t->name[0] ? t->name : "-";
+}
+
+static void
+classadd(Taskclass *c, Task *t)
+{
+	c->ntask++;
+	c->nrun += t->nrun;
+	c->cycles += t->cycles;
+}
+
 static void
 taskscheduler(void)
 {
 	int i;
 	Task *t;
+	uvlong t0, idle0;
 
 	taskdebug("scheduler enter");
+	taskcyclestart = cyclecount();
 	for(;;){
 		if(taskcount == 0)
 			pthread_exit(&taskexitval);
@@ -309,11 +604,20 @@ taskscheduler(void)
 		taskrunning = t;
 		tasknswitch++;
 		taskdebug("run %d (%s)", t->id, t->name);
+		idle0 = taskidlecycles;
+		t0 = cyclecount();
 		contextswitch(&taskschedcontext, &t->context);
 		//print("back in scheduler\n");
+		t->cycles += cyclecount() - t0 - (taskidlecycles - idle0);
+		t->nrun++;
 		taskrunning = nil;
+		if(t->painted && stackbottom(t))
+			stackexhausted(t);
 		if(t->exiting){
-			if (t->stksize != CACHE_STACK_SIZE ||
+			classadd(classfind(taskclasses, &ntaskclass,
+				taskclassof(t)), t);
+			stackrecord(t);
+			if (t->stksize > CACHE_STACK_SIZE ||
 			    taskcachecount >= TASKS_CACHE_MAX) {
 				/* do not cache */
 				taskfree(t);
@@ -355,6 +659,91 @@ taskdata(void)
 	return &taskrunning->udata;
 }
 
+int
+taskkey(void)
+{
+	int k;
+
+	if((k = __sync_fetch_and_add(&tasknkey, 1)) >= TASKNSLOT)
+		return -1;
+	return k;
+}
+
+void**
+taskslot(int key)
+{
+	assert(key >= 0 && key < TASKNSLOT);
+	return &taskrunning->slot[key];
+}
+
+/*
+ * cpu accounting
+ */
+
+void
+taskclass(char *cls)
+{
+	taskrunning->class = cls;
+}
+
+uint64_t
+taskcycles(void)
+{
+	return taskrunning->cycles;
+}
+
+void
+taskcpuidle(int idle)
+{
+	if(idle)
+		taskidlesince = cyclecount();
+	else
+		taskidlecycles += cyclecount() - taskidlesince;
+}
+
+static int
+classcmp(const void *a, const void *b)
+{
+	const Taskclass *x = a, *y = b;
+
+	return x->cycles < y->cycles ? 1 : x->cycles > y->cycles ? -1 : 0;
+}
+
+/*
+ * the top classes of this thread by cycles, live tasks included
+ * (without the run they are in)
+ */
+void
+taskcpuprint(int fd, int top)
+{
+	Taskclass tab[TASKNCLASS];
+	uvlong total, busy;
+	int i, n;
+
+	n = ntaskclass;
+	memcpy(tab, taskclasses, n*sizeof tab[0]);
+	for(i=0; i<nalltask; i++)
+		if(!alltask[i]->cached)
+			classadd(classfind(tab, &n, taskclassof(alltask[i])),
+				alltask[i]);
+	qsort(tab, n, sizeof tab[0], classcmp);
+
+	total = cyclecount() - taskcyclestart;
+	for(busy=0, i=0; i<n; i++)
+		busy += tab[i].cycles;
+	fprint(fd, "task cpu: %llud cycles, tasks %llud percent, "
+		"idle %llud percent\n",
+		total, total ? busy*100/total : 0,
+		total ? taskidlecycles*100/total : 0);
+	fprint(fd, "%-31s %8s %12s %16s %4s %10s\n",
+		"class", "tasks", "runs", "cycles", "%", "per run");
+	for(i=0; i<n && i<top; i++)
+		fprint(fd, "%-31s %8llud %12llud %16llud %4llud %10llud\n",
+			tab[i].name, tab[i].ntask, tab[i].nrun, tab[i].cycles,
+			busy ? tab[i].cycles*100/busy : 0,
+			tab[i].nrun ? tab[i].cycles/tab[i].nrun : 0);
+}
+
 /*
  * debugging
  */
@@ -432,10 +821,12 @@ taskinfo(int s)
 			extra = "(cached)";
 		else
 			extra = "";
-		fprint(2, "%6d%c %-20s %s%s\n",
+		fprint(2, "%6d%c %-20s %12llud %s%s\n",
 			t->id, t->system ? 's' : ' ',
-			t->name, t->state, extra);
+			t->name, t->cycles, t->state, extra);
 	}
+	taskcpuprint(2, 16);
+	taskstackprint(2);
 }
 
 /*
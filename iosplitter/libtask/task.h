@@ -36,16 +36,84 @@ void		taskstate(char*, ...);
 char*		taskgetname(void);
 char*		taskgetstate(void);
 void		tasksystem(void);
-unsigned int	taskdelay(unsigned int);
+unsigned int	taskdelay(unsigned int);	/* needs taskio_start() */
 unsigned int	taskid(void);
 void		taskcachefree(void);
 
+/*
+ * task-local storage: a key from taskkey() names a slot that every task
+ * has, nil when the task starts
+ */
+#define TASKNSLOT	8
+
+int		taskkey(void);		/* -1 when all are taken */
+void**		taskslot(int key);	/* of the running task */
+
+/*
+ * cpu accounting: the scheduler charges each task the cycles it ran
+ * (TSC ticks on x86, ns elsewhere), less what aiotask sleeps in
+ * epoll_wait. Exited tasks are summed up by class, per thread.
+ */
+void		taskclass(char *cls);	/* cls is kept; default is the name */
+uint64_t	taskcycles(void);	/* of the running task */
+void		taskcpuprint(int fd, int top);
+
+/*
+ * stack profiling. TASKSTACK_MEASURE paints stacks when a task starts
+ * and scans for the deepest use when it exits, kept per entry function
+ * and thread. TASKSTACK_AUTO also makes taskcreate give an entry function
+ * that exited TASKSTACK_LEARN times the smallest power of two from 8K
+ * that is at least twice its deepest use so far and 4K more than it,
+ * never more than asked; once one of its tasks used more than three
+ * quarters of its stack it gets what it asks for again. A smaller stack
+ * is mapped above a guard page. A painted task that wrote the lowest
+ * words of its stack, checked whenever it switches out, that exits with
+ * less than 1K of it untouched or that faults on its guard page aborts
+ * the program.
+ * Set the mode before creating tasks.
+ */
+enum
+{
+	TASKSTACK_OFF,
+	TASKSTACK_MEASURE,
+	TASKSTACK_AUTO,
+};
+#define TASKSTACK_LEARN	8
+
+void		taskstackmode(int mode);
+void		taskstackprint(int fd);
+
 struct Tasklist	/* used internally */
 {
 	Task	*head;
 	Task	*tail;
 };
 
+/*
+ * lock statistics, kept when attached with qlockstats() or rwlockstats().
+ * Wait is from blocking to running with the lock, hold from taking the
+ * lock to releasing it (write holds only, for an RWLock). Updated by the
+ * lock's thread without synchronization.
+ */
+#define LOCKSTAT_NBUCKETS	40	/* wait histogram, bucket b: < 2^b ns */
+
+typedef struct LockStats LockStats;
+struct LockStats
+{
+	char		*name;
+	uint64_t	nacquire;
+	uint64_t	ncontended;	/* had to wait */
+	uint64_t	waitns;
+	uint64_t	maxwait;
+	uint64_t	holdns;
+	uint64_t	maxhold;
+	uint64_t	waithist[LOCKSTAT_NBUCKETS];
+	uint64_t	since;		/* when the holder took it */
+	LockStats	*next;		/* on the list lockstatsprint() walks */
+};
+
+void	lockstatsprint(int fd);
+
 /*
  * queuing locks
  */
@@ -54,6 +122,7 @@ struct QLock
 {
 	Task	*owner;
 	Tasklist waiting;
+	LockStats *stats;	/* nil: not profiled */
 };
 
 void	qlock(QLock*);
@@ -70,6 +139,7 @@ struct RWLock
 	Task	*writer;
 	Tasklist rwaiting;
 	Tasklist wwaiting;
+	LockStats *stats;	/* nil: not profiled */
 };
 
 void	rlock(RWLock*);
@@ -80,6 +150,48 @@ void	wlock(RWLock*);
 int	canwlock(RWLock*);
 void	wunlock(RWLock*);
 
+void	qlockstats(QLock*, LockStats*, char *name);
+void	rwlockstats(RWLock*, LockStats*, char *name);
+
+/*
+ * flat combining: tasks hand the operation they need done under the lock
+ * to qcombine(). Whoever holds the lock runs the queued operations, up to
+ * maxbatch in one call of fn, instead of handing the lock to one waiter
+ * after the other; fn sets each op's res. fn may block, operations queued
+ * meanwhile go into the next call. A holder that did its share passes the
+ * lock and the queue to the first waiter. qcombinelock()/unlock() give
+ * plain exclusive use, the unlock runs what queued up meanwhile.
+ */
+typedef struct QCombineOp QCombineOp;
+struct QCombineOp
+{
+	QCombineOp	*next;
+	Task		*task;
+	void		*arg;
+	int		res;
+	int		done;
+};
+
+typedef void (*qcombinefn)(void *ctx, QCombineOp *ops, int nops);
+
+typedef struct QCombine QCombine;
+struct QCombine
+{
+	QLock		l;
+	qcombinefn	fn;
+	void		*ctx;
+	int		maxbatch;
+	QCombineOp	*head;		/* queued, oldest first */
+	QCombineOp	*tail;
+	uint64_t	nbatches;	/* calls of fn */
+	uint64_t	nops;		/* operations they ran */
+};
+
+void	qcombineinit(QCombine*, qcombinefn fn, void *ctx, int maxbatch);
+int	qcombine(QCombine*, void *arg);
+void	qcombinelock(QCombine*);
+void	qcombineunlock(QCombine*);
+
 /*
  * sleep and wakeup (condition variables)
  */
@@ -158,15 +270,14 @@ int		chansendp(Channel *c, void *v);
 int		chansendul(Channel *c, unsigned long v);
 
 /*
- * Threaded I/O.
+ * Threaded I/O, on taskio's epoll loop: needs taskio_start().
  */
 int		fdread(int, void*, int);
 int		fdread1(int, void*, int);	/* always uses fdwait */
 int		fdwrite(int, void*, int);
 void		fdwait(int, int);
 int		fdnoblock(int);
-
-void		fdtask(void*);
+int		fdclose(int);		/* for fds fdwait may have seen */
 
 /*
  * Network dialing - sets non-blocking automatically
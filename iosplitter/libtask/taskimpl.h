@@ -156,6 +156,7 @@ struct Task
 {
 	char	name[256];	// offset known to acid
 	char	state[256];
+	int	painted;	/* stack profiling: away from the stack end */
 	Task	*next;
 	Task	*prev;
 	Task	*allnext;
@@ -165,6 +166,7 @@ struct Task
 	uint	id;
 	uchar	*stk;
 	uint	stksize;
+	int	guarded;	/* stk mapped above a PROT_NONE page */
 	int	exiting;
 	int	alltaskslot;
 	int	system;
@@ -172,6 +174,10 @@ struct Task
 	void	(*startfn)(void*);
 	void	*startarg;
 	void	*udata;
+	void	*slot[TASKNSLOT];
+	char	*class;
+	uvlong	cycles;
+	uvlong	nrun;
 #ifdef VALGRIND
 	int	stkid;
 #endif
@@ -183,6 +189,15 @@ void	taskswitch(void);
 
 void	addtask(Tasklist*, Task*);
 void	deltask(Tasklist*, Task*);
+void	taskcpuidle(int idle);		/* not charged to the running task */
 
 extern __thread Task	*taskrunning;
 extern __thread int	taskcount;
+
+/* taskpost.c, driven by taskio.c's aiotask */
+int	taskschedinit(void);		/* returns the doorbell eventfd */
+void	taskscheddeinit(void);
+int	taskschedrun(void);
+int	taskschedidle(int idle);
+void	taskscheddoorbell(void);
+int	taskschedpending(void);
@@ -13,9 +13,11 @@
 #include <netinet/tcp.h>
 #include <netdb.h>
 #include <sys/epoll.h>
+#include <sys/poll.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
@@ -27,6 +29,7 @@
 #include <unistd.h>
 #include "taskio.h"
 #include "taskimpl.h"
+#include "timer.h"
 #define STATIC 
 
 /*#define TRACE(X)	{ printf("TRACE: %s(%d):", __FILE__, __LINE__); printf X; fflush(stdout); }*/
@@ -39,12 +42,19 @@
 #define PERROR(X)   perror(X)
 #define ERROR(...) { fprintf(stderr, __VA_ARGS__); fflush(stderr); }
 
-unsigned long long g_task_net_io_sleep;
-unsigned long long g_task_net_io_wakeup;
-unsigned long long g_task_aio_io_sleep;
-unsigned long long g_task_aio_io_wakeup;
-unsigned long long g_libaio_done;
-unsigned long long g_libaio_wakeup;
+__thread uint64_t g_task_net_io_sleep;
+__thread uint64_t g_task_net_io_wakeup;
+__thread uint64_t g_task_aio_io_sleep;
+__thread uint64_t g_task_aio_io_wakeup;
+__thread uint64_t g_libaio_done;
+__thread uint64_t g_libaio_wakeup;
+__thread uint64_t g_taskio_spin_ns;		/* polling, the CPU cost */
+__thread uint64_t g_taskio_spin_hits;		/* idle gaps that ended polling */
+__thread uint64_t g_taskio_spin_hit_ns;		/* of g_taskio_spin_ns, in them */
+__thread uint64_t g_taskio_spin_misses;		/* windows that ran out */
+__thread uint64_t g_taskio_blocks;		/* epoll_waits that slept */
+__thread uint64_t g_task_cont_runs;		/* continuations called */
+__thread uint64_t g_task_aio_waits;		/* submits that found the ioctx full */
 
 struct TaskContext {
 	uint32_t	tasktype;  // TASKIO_LIBAIO or TASKIO_SOCK
@@ -70,29 +80,50 @@ struct TaskEventContext {
 	void			*arg;
 };
 
-struct LibaioState {
-	Task	*waiter;
-	int	res;
-	int	res2;
-};
-
 void dump_epoll_event(char *msg, struct epoll_event *p);
 void dump_event(char * msg, struct io_event *p);
 void dump_iocb(char * msg, struct iocb *p);
 
 STATIC void eventio_done(struct epoll_event *evp);
 STATIC void aiotask(void *v);
+STATIC void conttask(void *v);
 STATIC int ctxt_insert(int fd, struct TaskContext *p);
 STATIC int ctxt_lookup(int fd, struct TaskContext **pp);
 STATIC int ctxt_delete(int fd);
 
 
 /* ----- global thread-local variables ---*/
-// XXX We can make this array grow on demand by using realloc
-STATIC __thread struct TaskContext *TCarray[TASKIO_MAXFDVALUE];
+STATIC __thread struct TaskContext **TCarray;		//grows in ctxt_insert
+STATIC __thread int TCsize;
 STATIC __thread int taskio_epollfd = -1;			//see taskio_init
 STATIC __thread int taskio_eventfd = -1;			//see taskio_init
 STATIC __thread io_context_t taskio_ioctx;			//see taskio_init
+STATIC __thread int taskio_timerfd = -1;			//drives timer.c's wheel
+STATIC __thread uint64_t taskio_timerarmed;			//its expiry, 0 if none
+STATIC __thread int taskio_postfd = -1;				//taskpost.c's doorbell
+
+/*
+ * libaio requests in flight on taskio_ioctx, at most TASKIO_NIOEVENT;
+ * tasks and continuations beyond that wait for a slot
+ */
+STATIC __thread int taskio_aioinflight;
+STATIC __thread Rendez taskio_aioslot;
+STATIC __thread taskcont_t *taskio_aiopend, *taskio_aiopendtail;
+
+/* continuations to call, and the task that calls them */
+STATIC __thread taskcont_t *taskio_contq, *taskio_contqtail;
+STATIC __thread Task *taskio_conttask;
+STATIC __thread int taskio_contidle;
+
+/*
+ * adaptive polling, see taskio_set_spin
+ */
+struct taskio_spin {
+	uint64_t	max;		/* ns, 0: off */
+	uint64_t	win;		/* ns to poll on the next idle gap */
+	uint64_t	avg;		/* moving average of idle gaps, ns */
+};
+STATIC __thread struct taskio_spin taskio_spin;
 
 #if 0
 static void
@@ -116,6 +147,7 @@ taskio_init(void)
 	int							res;
 	struct epoll_event			ev;
 	struct TaskLibaioContext	*tlcp = NULL;
+	struct TaskContext		*tcp;
 
 	memset(&taskio_ioctx, 0, sizeof(taskio_ioctx));
 	if ((res = io_setup(TASKIO_NIOEVENT, &taskio_ioctx)) != 0) {
@@ -130,8 +162,8 @@ taskio_init(void)
 		res = errno;
 		goto out;
 	}
-	assert(taskio_eventfd < TASKIO_MAXFDVALUE);
-	assert(taskio_eventfd >= 0 && TCarray[taskio_eventfd] == NULL);
+	assert(taskio_eventfd >= 0);
+	assert(ctxt_lookup(taskio_eventfd, NULL) == TASKIO_ENOENT);
 	if ((tlcp = (struct TaskLibaioContext*)calloc(1, sizeof(*tlcp))) == NULL) {
 		res = TASKIO_ENOMEM;
 		goto out;
@@ -147,6 +179,48 @@ taskio_init(void)
 		goto out;
 	}
 	ctxt_insert(taskio_eventfd, (struct TaskContext*)tlcp);
+
+	/* one timerfd for all of the thread's timeouts */
+	if ((taskio_timerfd = timerfd_create(CLOCK_MONOTONIC,
+					TFD_NONBLOCK | TFD_CLOEXEC)) == -1) {
+		res = errno;
+		goto out;
+	}
+	if ((tcp = calloc(1, sizeof(*tcp))) == NULL) {
+		res = TASKIO_ENOMEM;
+		goto out;
+	}
+	tcp->tasktype = TASKIO_TYPE_TIMER;
+	tcp->fd = taskio_timerfd;
+	ev.events = EPOLLIN;
+	ev.data.ptr = tcp;
+	if (epoll_ctl(taskio_epollfd, EPOLL_CTL_ADD, taskio_timerfd, &ev) != 0) {
+		res = errno;
+		free(tcp);
+		goto out;
+	}
+	ctxt_insert(taskio_timerfd, tcp);
+	taskio_timerarmed = 0;
+
+	/* the doorbell other threads ring when posting to this one */
+	if ((taskio_postfd = taskschedinit()) == -1) {
+		res = TASKIO_ENOMEM;
+		goto out;
+	}
+	if ((tcp = calloc(1, sizeof(*tcp))) == NULL) {
+		res = TASKIO_ENOMEM;
+		goto out;
+	}
+	tcp->tasktype = TASKIO_TYPE_POST;
+	tcp->fd = taskio_postfd;
+	ev.events = EPOLLIN;
+	ev.data.ptr = tcp;
+	if (epoll_ctl(taskio_epollfd, EPOLL_CTL_ADD, taskio_postfd, &ev) != 0) {
+		res = errno;
+		free(tcp);
+		goto out;
+	}
+	ctxt_insert(taskio_postfd, tcp);
 	return 0;
 
 out:
@@ -158,6 +232,26 @@ void
 taskio_start(void)
 {
 	taskcreate(aiotask, 0, 32*1024);
+	taskcreate(conttask, 0, 32*1024);
+}
+
+/*
+ * Make this thread's aiotask poll epoll with a zero timeout, for up to
+ * max_ns, before it blocks: an event that comes while polling costs no
+ * sleep and wakeup. The window is twice the average idle gap, at least
+ * TASKIO_SPIN_MIN; when gaps average over max_ns/2, polling would mostly
+ * miss and the window stays at the minimum. 0 turns polling off.
+ * libaio completions signal the eventfd, so polling epoll covers them.
+ */
+void
+taskio_set_spin(uint64_t max_ns)
+{
+	if (max_ns != 0 && max_ns < TASKIO_SPIN_MIN) {
+		max_ns = TASKIO_SPIN_MIN;
+	}
+	taskio_spin.max = max_ns;
+	taskio_spin.win = TASKIO_SPIN_MIN;
+	taskio_spin.avg = 0;
 }
 
 
@@ -184,6 +278,35 @@ taskio_deinit(void)
 		taskio_eventfd = -1;
 	}
 
+	if (taskio_timerfd != -1) {
+		struct TaskContext *t;
+		struct epoll_event e = {0};
+
+		if (ctxt_lookup(taskio_timerfd, &t) == 0) {
+			ctxt_delete(taskio_timerfd);
+			free(t);
+		}
+
+		epoll_ctl(taskio_epollfd, EPOLL_CTL_DEL, taskio_timerfd, &e);
+
+		close(taskio_timerfd);
+		taskio_timerfd = -1;
+	}
+
+	if (taskio_postfd != -1) {
+		struct TaskContext *t;
+		struct epoll_event e = {0};
+
+		if (ctxt_lookup(taskio_postfd, &t) == 0) {
+			ctxt_delete(taskio_postfd);
+			free(t);
+		}
+
+		epoll_ctl(taskio_epollfd, EPOLL_CTL_DEL, taskio_postfd, &e);
+		taskio_postfd = -1;
+	}
+	taskscheddeinit();
+
 	if (taskio_epollfd) {
 		close(taskio_epollfd);
 		taskio_epollfd = -1;
@@ -344,50 +467,231 @@ static inline ssize_t task_aiorw_ret(struct LibaioState *ls)
 	return ((ssize_t)(((uint64_t)ls->res2 << 32) | ls->res));
 }
 
-int
-task_aiorw(int fd, char *buf, size_t nbytes, off_t offset, tirw_t rw,
-		ssize_t *ret)
+/*
+ * submit one iocb on this thread's io context and sleep until aiotask reaps
+ * its completion
+ */
+static int
+task_aio_submit(struct iocb *cb, ssize_t *ret)
 {
 	struct TaskLibaioContext	*tlcp = NULL;
 	struct iocb 			*iba[1];
 	struct LibaioState		ls;
-	struct iocb			cb;
 	int				res;
 
-	switch(rw) {
-	case TASKIO_READ: break;
-	case TASKIO_WRITE: break;
-	default:
-		assert(0);
-		return TASKIO_EINVAL;
-	}
 	/* note: we don't really need tlcp except to verify that taskio_eventfd was registered */
 	if ((res = ctxt_lookup(taskio_eventfd, (struct TaskContext**)&tlcp)) != 0) {
 		return res;
 	}
 	assert(tlcp && tlcp->hdr.tasktype == TASKIO_TYPE_LIBAIO);
 
-	if (rw == TASKIO_WRITE) {
-		io_prep_pwrite(&cb, fd, buf, nbytes, offset);
-	} else {
-		io_prep_pread(&cb, fd, buf, nbytes, offset);
+	while (taskio_aioinflight == TASKIO_NIOEVENT) {
+		g_task_aio_waits++;
+		tasksleep(&taskio_aioslot);
 	}
-	io_set_eventfd(&cb, taskio_eventfd);
+	io_set_eventfd(cb, taskio_eventfd);
 	memset(&ls, 0, sizeof(ls));
 	ls.waiter = taskrunning;
-	cb.data = &ls;
-	iba[0] = &cb;
+	cb->data = &ls;
+	iba[0] = cb;
 	res = io_submit(taskio_ioctx, 1, iba);
 	assert(res == 1);
+	taskio_aioinflight++;
 	g_task_aio_io_sleep++;
 	taskswitch();
 	g_task_aio_io_wakeup++;
 	/* wake up after io completion. LibaioState ls has been filled up for us */
 	// XXX can we do a better job of reporting errors here?
 	*ret = task_aiorw_ret(&ls);
+	return 0;
+}
+
+int
+task_aiorw(int fd, char *buf, size_t nbytes, off_t offset, tirw_t rw,
+		ssize_t *ret)
+{
+	struct iocb			cb;
+	int				res;
+
+	switch(rw) {
+	case TASKIO_READ: break;
+	case TASKIO_WRITE: break;
+	default:
+		assert(0);
+		return TASKIO_EINVAL;
+	}
+
+	if (rw == TASKIO_WRITE) {
+		io_prep_pwrite(&cb, fd, buf, nbytes, offset);
+	} else {
+		io_prep_pread(&cb, fd, buf, nbytes, offset);
+	}
+	if ((res = task_aio_submit(&cb, ret)) != 0) {
+		return res;
+	}
+	return (*ret == nbytes) ? 0 : TASKIO_IOERR;
+}
+
+/*
+ * scatter/gather variant of task_aiorw, one iocb for the whole iovec
+ */
+int
+task_aiorwv(int fd, const struct iovec *iov, int iovcnt, off_t offset,
+		tirw_t rw, ssize_t *ret)
+{
+	struct iocb			cb;
+	size_t				nbytes;
+	int				res;
+	int				i;
+
+	switch(rw) {
+	case TASKIO_READ: break;
+	case TASKIO_WRITE: break;
+	default:
+		assert(0);
+		return TASKIO_EINVAL;
+	}
+
+	for (nbytes = 0, i = 0; i < iovcnt; i++) {
+		nbytes += iov[i].iov_len;
+	}
+
+	if (rw == TASKIO_WRITE) {
+		io_prep_pwritev(&cb, fd, iov, iovcnt, offset);
+	} else {
+		io_prep_preadv(&cb, fd, iov, iovcnt, offset);
+	}
+	if ((res = task_aio_submit(&cb, ret)) != 0) {
+		return res;
+	}
 	return (*ret == nbytes) ? 0 : TASKIO_IOERR;
 }
 
+void
+task_cont_init(taskcont_t *k, taskcontfn_t fn, void *arg)
+{
+	memset(k, 0, sizeof(*k));
+	k->fn = fn;
+	k->arg = arg;
+}
+
+STATIC void
+task_cont_submit(taskcont_t *k)
+{
+	struct iocb	*iba[1];
+	int		res;
+
+	iba[0] = &k->cb;
+	res = io_submit(taskio_ioctx, 1, iba);
+	assert(res == 1);
+	taskio_aioinflight++;
+}
+
+/*
+ * task_aiorw, calling k->fn when done instead of sleeping. Returns 0,
+ * or an error and then k->fn is not called.
+ */
+int
+task_cont_aiorw(taskcont_t *k, int fd, char *buf, size_t nbytes,
+		off_t offset, tirw_t rw)
+{
+	switch(rw) {
+	case TASKIO_READ:
+		io_prep_pread(&k->cb, fd, buf, nbytes, offset);
+		break;
+	case TASKIO_WRITE:
+		io_prep_pwrite(&k->cb, fd, buf, nbytes, offset);
+		break;
+	default:
+		assert(0);
+		return TASKIO_EINVAL;
+	}
+	if (taskio_eventfd == -1) {
+		return TASKIO_ENOENT;
+	}
+	io_set_eventfd(&k->cb, taskio_eventfd);
+	k->ls.waiter = NULL;
+	k->cb.data = &k->ls;
+	k->nbytes = nbytes;
+	k->next = NULL;
+	if (taskio_aioinflight == TASKIO_NIOEVENT) {
+		g_task_aio_waits++;
+		if (taskio_aiopend == NULL) {
+			taskio_aiopend = k;
+		} else {
+			taskio_aiopendtail->next = k;
+		}
+		taskio_aiopendtail = k;
+		return 0;
+	}
+	task_cont_submit(k);
+	return 0;
+}
+
+/*
+ * have conttask call k->fn
+ */
+void
+task_cont_ready(taskcont_t *k)
+{
+	k->next = NULL;
+	if (taskio_contq == NULL) {
+		taskio_contq = k;
+	} else {
+		taskio_contqtail->next = k;
+	}
+	taskio_contqtail = k;
+	if (taskio_contidle) {
+		taskio_contidle = 0;
+		taskready(taskio_conttask);
+	}
+}
+
+STATIC void
+conttask(void *v)
+{
+	taskcont_t	*k;
+
+	taskname("conttask");
+	tasksystem();
+	taskio_conttask = taskrunning;
+	for (;;) {
+		while ((k = taskio_contq) != NULL) {
+			if ((taskio_contq = k->next) == NULL) {
+				taskio_contqtail = NULL;
+			}
+			g_task_cont_runs++;
+			k->fn(k);
+		}
+		taskio_contidle = 1;
+		taskstate("idle");
+		taskswitch();
+	}
+}
+
+/*
+ * ioctx slots were freed: submit waiting continuations, then let
+ * waiting tasks try
+ */
+STATIC void
+task_aio_admit(void)
+{
+	taskcont_t	*k;
+	int		n;
+
+	while (taskio_aioinflight < TASKIO_NIOEVENT &&
+			(k = taskio_aiopend) != NULL) {
+		taskio_aiopend = k->next;
+		task_cont_submit(k);
+	}
+	/* one task per free slot, not a herd */
+	for (n = TASKIO_NIOEVENT - taskio_aioinflight; n > 0; n--) {
+		if (taskwakeup(&taskio_aioslot) == 0) {
+			break;
+		}
+	}
+}
+
 int
 task_netrw(int fd, char *buf, size_t nbytes, tirw_t rw)
 {
@@ -451,6 +755,59 @@ task_netrw(int fd, char *buf, size_t nbytes, tirw_t rw)
 
 }
 
+/*
+ * write all of iov to a socket or fifo, sleeping while it is full.
+ * Advances iov past what was written.
+ */
+int
+task_netwritev(int fd, struct iovec *iov, int iovcnt)
+{
+	struct TaskSocketContext	*tscp;
+	ssize_t				res;
+	int				err;
+
+	if ((err = ctxt_lookup(fd, (struct TaskContext**)&tscp)) != 0) {
+		return err;
+	}
+	assert(tscp && (tscp->hdr.tasktype == TASKIO_TYPE_SOCKET ||
+			tscp->hdr.tasktype == TASKIO_TYPE_FIFO) &&
+			tscp->hdr.fd == fd);
+
+	while (iovcnt > 0) {
+		if (iov->iov_len == 0) {
+			iov++;
+			iovcnt--;
+			continue;
+		}
+		res = writev(fd, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX);
+		if (res > 0) {
+			for (; res > 0 && (size_t) res >= iov->iov_len; iovcnt--) {
+				res -= iov->iov_len;
+				iov++;
+			}
+			if (res > 0) {
+				iov->iov_base = (char *) iov->iov_base + res;
+				iov->iov_len -= res;
+			}
+		} else if (res < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				assert(tscp->writer == NULL);
+				tscp->writer = taskrunning;
+				g_task_net_io_sleep++;
+				taskswitch();
+				g_task_net_io_wakeup++;
+			} else {
+				err = errno;
+				assert(err);
+				return err; /* fatal error */
+			}
+		} else {
+			return TASKIO_ECONN;
+		}
+	}
+	return 0;
+}
+
 /*
  * case EPOLLERR or EPOLLHUP: wake up both reader and writer
  * otherwise, wake up reader for EPOLLIN, writer for EPOLLOUT
@@ -464,7 +821,7 @@ sockio_done(struct epoll_event *evp)
 
 	assert(tscp && (tscp->hdr.tasktype == TASKIO_TYPE_SOCKET ||
 				tscp->hdr.tasktype == TASKIO_TYPE_FIFO));
-	assert (tscp->reader || tscp->writer);
+	/* may find no one waiting: fdwait polls before it sleeps */
 
 	if (evp->events & EPOLLERR) wakey |= 0x3;
 	if (evp->events & EPOLLHUP) wakey |= 0x3;
@@ -517,6 +874,7 @@ libaio_done(struct epoll_event *evp)
 	uint64_t		nio;
 	int			res;
 	struct LibaioState	*lsp;
+	taskcont_t		*k;
 	struct io_event		*ep;
 	static __thread struct io_event	ea[TASKIO_NIOEVENT];
 
@@ -545,18 +903,27 @@ restart:
 		/* signal each sleeper on task_aiorw */
 		/* note: ep res,res2 are unsigned but may carry negative error codes */
 		g_libaio_done++;
+		taskio_aioinflight -= res;
 		for (ep = ea; ep < ea + res; ep++) {
 			//dump_event("libaio_done", ep);
 			lsp = ep->data;
+			assert(lsp);
 			lsp->res = ep->res;
 			lsp->res2 = ep->res2;
-			assert(lsp && lsp->waiter);
+			if (lsp->waiter == NULL) {
+				k = (taskcont_t *) lsp;
+				k->ret = task_aiorw_ret(lsp);
+				k->res = (k->ret == k->nbytes) ? 0 : TASKIO_IOERR;
+				task_cont_ready(k);
+				continue;
+			}
 			taskready(lsp->waiter);
 			g_libaio_wakeup++;
 		}
 
 		events -= nio;
 	}
+	task_aio_admit();
 }
 
 STATIC void
@@ -566,7 +933,7 @@ eventio_done(struct epoll_event *evp)
 	int			res, k;
 	struct TaskEventContext	*tscp = evp->data.ptr;
 
-	res = read(taskio_eventfd, &nio, sizeof(nio));
+	res = read(tscp->hdr.fd, &nio, sizeof(nio));
 	assert(res == 8);
 	assert(nio > 0);
 	// XXX this is dangerous. Need to put upper limit on nio
@@ -575,6 +942,110 @@ eventio_done(struct epoll_event *evp)
 	}
 }
 
+/*
+ * point the timerfd at the wheel's next expiry, if that moved
+ */
+STATIC void
+timerfd_rearm(void)
+{
+	struct itimerspec	its;
+	uint64_t		next;
+
+	next = timer_wheel_next();
+	if (next == taskio_timerarmed) {
+		return;
+	}
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = next / 1000000000ULL;
+	its.it_value.tv_nsec = next % 1000000000ULL;
+	if (timerfd_settime(taskio_timerfd, TFD_TIMER_ABSTIME, &its, NULL) == 0) {
+		taskio_timerarmed = next;
+	}
+}
+
+STATIC void
+timerio_done(struct epoll_event *evp)
+{
+	uint64_t	n;
+
+	/* nonblocking: may find nothing when rearmed meanwhile */
+	if (read(taskio_timerfd, &n, sizeof(n)) == sizeof(n)) {
+		taskio_timerarmed = 0;
+	}
+}
+
+/*
+ * sleep in epoll_wait, unless another thread posted to this one
+ */
+STATIC int
+taskio_block(struct epoll_event *ev)
+{
+	int	n;
+
+	if (taskschedidle(1)) {
+		taskschedidle(0);
+		return (0);
+	}
+	g_taskio_blocks++;
+	timerfd_rearm();
+	taskcpuidle(1);
+	n = epoll_wait(taskio_epollfd, ev, TASKIO_NIOEVENT, -1);
+	taskcpuidle(0);
+	taskschedidle(0);
+	return (n);
+}
+
+/*
+ * wait for events, polling first if this thread spins
+ * returns epoll_wait's, 0 when a timeout came due or a post came
+ */
+STATIC int
+taskio_wait(struct epoll_event *ev)
+{
+	struct taskio_spin	*sp = &taskio_spin;
+	uint64_t		start, now, end, next;
+	int			n = 0, posted = 0;
+
+	if (sp->max == 0) {
+		return (taskio_block(ev));
+	}
+
+	start = now = timer_now();
+	end = start + sp->win;
+	if ((next = timer_wheel_next()) != 0 && next < end) {
+		end = next;
+	}
+	do {
+		if ((posted = taskschedpending()) ||
+		    (n = epoll_wait(taskio_epollfd, ev, TASKIO_NIOEVENT, 0)) != 0) {
+			now = timer_now();
+			break;
+		}
+		now = timer_now();
+	} while (now < end);
+	g_taskio_spin_ns += now - start;
+
+	if (n > 0 || posted) {
+		g_taskio_spin_hits++;
+		g_taskio_spin_hit_ns += now - start;
+	} else if (n == 0) {
+		if (next != 0 && now >= next) {
+			return (0);
+		}
+		g_taskio_spin_misses++;
+		n = taskio_block(ev);
+		now = timer_now();
+	}
+
+	/* the gap, polled or slept, steers the next window */
+	sp->avg += ((int64_t) (now - start) - (int64_t) sp->avg) / 8;
+	sp->win = 2 * sp->avg;
+	if (sp->win < TASKIO_SPIN_MIN || sp->win > sp->max) {
+		sp->win = TASKIO_SPIN_MIN;
+	}
+	return (n);
+}
+
 STATIC void
 aiotask(void *v)
 {
@@ -585,10 +1056,11 @@ aiotask(void *v)
 	tasksystem();
 	assert(taskio_epollfd >= 0);
 	for (;;) {
-		while((k = taskyield()) > 0) {
-			/* wait until all other tasks sleep */
-			//printf("aiotask: taskyield gave %d\n", k);
-		}
+		do {
+			/* fire timeouts and posts, until all other tasks sleep */
+			timer_wheel_run();
+			taskschedrun();
+		} while ((k = taskyield()) > 0);
 		//printf("aiotask: starting pollwait\n");
 		memset(ev, 0, sizeof(ev));
 		if (taskio_epollfd == -1) {
@@ -604,11 +1076,9 @@ aiotask(void *v)
 			break;
 		}
 
-		n = epoll_wait(taskio_epollfd, ev, TASKIO_NIOEVENT, -1);
-		if (n < 0) {
-			if (errno == EINTR) {
-				continue;
-			}
+		n = taskio_wait(ev);
+		if (n == 0 || (n < 0 && errno == EINTR)) {
+			continue;
 		}
 		assert(n > 0); // XXX handle signals n==-1, errno==EINTR
 		for(k = 0; k < n; k++) {
@@ -626,6 +1096,12 @@ aiotask(void *v)
 			case TASKIO_TYPE_EVENT:
 				eventio_done(&ev[k]);
 				break;
+			case TASKIO_TYPE_TIMER:
+				timerio_done(&ev[k]);
+				break;
+			case TASKIO_TYPE_POST:
+				taskscheddoorbell();
+				break;
 			default:
 				assert(0);
 			}
@@ -641,14 +1117,38 @@ aiotask(void *v)
  *  XXX it is possible to return existing ptr instead of just EEXIST error, 
  *  XXX but don't see the need for it now.
  */
+static int
+ctxt_grow(int fd)
+{
+	struct TaskContext	**p;
+	int			n;
+
+	n = TCsize ? TCsize : TASKIO_MAXFDVALUE;
+	while (n <= fd) {
+		n *= 2;
+	}
+	if (n > TASKIO_FDLIMIT) {
+		return TASKIO_EBIGFD;
+	}
+	if ((p = realloc(TCarray, n * sizeof(*p))) == NULL) {
+		return TASKIO_ENOMEM;
+	}
+	memset(p + TCsize, 0, (n - TCsize) * sizeof(*p));
+	TCarray = p;
+	TCsize  = n;
+	return 0;
+}
+
 STATIC int
 ctxt_insert(int fd, struct TaskContext *p)
 {
+	int	res;
+
 	if (fd < 0) {
 		return TASKIO_EBADFD;
 	}
-	if (fd >= TASKIO_MAXFDVALUE) {
-		return TASKIO_EBIGFD;
+	if (fd >= TCsize && (res = ctxt_grow(fd)) != 0) {
+		return res;
 	}
 	if (TCarray[fd] != NULL ) {
 		return TASKIO_EEXIST;
@@ -667,7 +1167,7 @@ ctxt_delete(int fd)
 	if (fd < 0) {
 		return TASKIO_EBADFD;
 	}
-	if (fd >= TASKIO_MAXFDVALUE) {
+	if (fd >= TCsize) {
 		return TASKIO_EBIGFD;
 	}
 	assert(TCarray[fd] != NULL);
@@ -684,10 +1184,7 @@ ctxt_lookup(int fd, struct TaskContext **pp)
 	if (fd < 0) {
 		return TASKIO_EBADFD;
 	}
-	if (fd >= TASKIO_MAXFDVALUE) {
-		return TASKIO_EBIGFD;
-	}
-	if (TCarray[fd] == NULL ) {
+	if (fd >= TCsize || TCarray[fd] == NULL) {
 		return TASKIO_ENOENT;
 	}
 	if (pp) {
@@ -751,11 +1248,14 @@ tasknet_setnoblock(int fd)
 /*
  *  create and bind a TCP socket to given address, put it in *fdp
  *  char *server may be NULL, then listen on all available addresses.
+ *  if reuseport is set, SO_REUSEPORT lets several sockets (typically one
+ *  per thread) listen on the same address; the kernel spreads incoming
+ *  connections across them.
  *	return 0 on success, else error code
  *  (adapted from libtask netannounce)
  */
-int
-tasknet_announce(char *server, int port, int *fdp)
+static int
+_tasknet_announce(char *server, int port, int *fdp, int reuseport)
 {
 	int 			fd, n;
 	socklen_t		sn;
@@ -779,17 +1279,24 @@ tasknet_announce(char *server, int port, int *fdp)
 		return errno;
 	}
 	/* set reuse flag for tcp */
+	sn = sizeof(n);
 	if (getsockopt(fd, SOL_SOCKET, SO_TYPE, (void*)&n, &sn) == 0) {
 		n = 1;
 		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (char*)&n, sizeof n);
 	} else {
 		PERROR("tasknet_announce: getsockopt failed");
 	}
+	n = 1;
+	if (reuseport &&
+	    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (char*)&n, sizeof n)) {
+		PERROR("tasknet_announce: SO_REUSEPORT");
+		goto errout;
+	}
 	if (bind(fd, (struct sockaddr*)&sa, sizeof sa))  {
 		PERROR("tasknet_announce: bind");
 		goto errout;
 	}
-	if (listen(fd, 16)) {
+	if (listen(fd, TASKNET_BACKLOG)) {
 		PERROR("tasknet_announce: listen");
 		goto errout;
 	}
@@ -805,8 +1312,21 @@ tasknet_announce(char *server, int port, int *fdp)
 	return 0;
 
 errout:
+	res = errno;
 	close(fd);
-	return errno;
+	return res;
+}
+
+int
+tasknet_announce(char *server, int port, int *fdp)
+{
+	return _tasknet_announce(server, port, fdp, 0);
+}
+
+int
+tasknet_announce_reuseport(char *server, int port, int *fdp)
+{
+	return _tasknet_announce(server, port, fdp, 1);
 }
 
 /*
@@ -814,11 +1334,12 @@ errout:
  * fd is a listen socket on well-known port
  * returns 0 on success and sets new socket fd for incoming connection in *cfdp.
  * fills up name and port of client if server and port are non-null, respectively
+ * if reg is set, the new socket is registered with this thread's taskio.
  * (adapted from libtask netaccept)
  * WARNING: only one task can invoke this at a time on a given fd.
  */
-int
-tasknet_accept(int fd, char *server, int *port, int *cfdp)
+static int
+_tasknet_accept(int fd, char *server, int *port, int *cfdp, int reg)
 {
 	int cfd, one;
 	struct sockaddr_in sa;
@@ -860,7 +1381,7 @@ tasknet_accept(int fd, char *server, int *port, int *cfdp)
 	one = 1;
 	/* Turn off Nagle algorithm, we expect to do write-write-read patterns */
 	setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, (char*)&one, sizeof one);
-	if ((res = task_sockfd_register(cfd)) != 0) {
+	if (reg && (res = task_sockfd_register(cfd)) != 0) {
 		ERROR("tasknet_accept: task_sockfd_reigster failed: %d\n",
 						res)
 		close(cfd);
@@ -870,6 +1391,24 @@ tasknet_accept(int fd, char *server, int *port, int *cfdp)
 	return 0;
 }
 
+int
+tasknet_accept(int fd, char *server, int *port, int *cfdp)
+{
+	return _tasknet_accept(fd, server, port, cfdp, 1);
+}
+
+/*
+ * Same as tasknet_accept, but the new socket is NOT registered with this
+ * thread's taskio. Use it when the connection is handed off to a task
+ * scheduler running in another pthread; that thread must call
+ * task_sockfd_register() on the fd before doing any task_netrw on it.
+ */
+int
+tasknet_accept_raw(int fd, char *server, int *port, int *cfdp)
+{
+	return _tasknet_accept(fd, server, port, cfdp, 0);
+}
+
 /*
  * Client connects to given server, port.
  * returns 0 on success and sets *fdp to socket fd connected to server
@@ -1127,16 +1666,115 @@ out:
 	return (rc);
 }
 
-/* HACKY FIX for undefined references from net.c (because I removed fd.c)*/
+/*
+ * libtask's fd interface (fd.c), on this thread's epoll loop instead of a
+ * poll() task of its own. An fd is registered as a socket on its first
+ * fdwait. Registration is edge triggered: readiness that came before the
+ * wait may already have been reported, so fdwait checks for it first.
+ */
 void
-fdwait(int a, int b) {
-	fprintf(stderr, "DO NOT USE fdwait\n");
-	abort();
+fdwait(int fd, int rw)
+{
+	struct TaskSocketContext	*tscp;
+	struct pollfd			pfd;
+	int				res;
+
+	assert(rw == 'r' || rw == 'w');
+	if ((res = ctxt_lookup(fd, (struct TaskContext**)&tscp)) == TASKIO_ENOENT &&
+			(res = task_sockfd_register(fd)) == 0) {
+		res = ctxt_lookup(fd, (struct TaskContext**)&tscp);
+	}
+	if (res != 0) {
+		ERROR("fdwait: fd %d: error %d\n", fd, res)
+		abort();
+	}
+	assert(tscp->hdr.tasktype == TASKIO_TYPE_SOCKET ||
+			tscp->hdr.tasktype == TASKIO_TYPE_FIFO);
+
+	pfd.fd = fd;
+	pfd.events = (rw == 'r') ? POLLIN : POLLOUT;
+	pfd.revents = 0;
+	if (poll(&pfd, 1, 0) > 0) {
+		return;
+	}
+	taskstate("fdwait for %s", rw == 'r' ? "read" : "write");
+	if (rw == 'r') {
+		assert(tscp->reader == NULL);
+		tscp->reader = taskrunning;
+	} else {
+		assert(tscp->writer == NULL);
+		tscp->writer = taskrunning;
+	}
+	taskswitch();
 }
+
+/* Like fdread but always calls fdwait before reading. */
 int
-fdnoblock(int a)
+fdread1(int fd, void *buf, int n)
 {
-	fprintf(stderr, "DO NOT USE fdnoblock\n");
-	abort();
-	return 0;
+	int m;
+
+	do
+		fdwait(fd, 'r');
+	while((m = read(fd, buf, n)) < 0 && errno == EAGAIN);
+	return m;
+}
+
+int
+fdread(int fd, void *buf, int n)
+{
+	int m;
+
+	while((m=read(fd, buf, n)) < 0 && errno == EAGAIN)
+		fdwait(fd, 'r');
+	return m;
+}
+
+int
+fdwrite(int fd, void *buf, int n)
+{
+	int m, tot;
+
+	for(tot=0; tot<n; tot+=m){
+		while((m=write(fd, (char*)buf+tot, n-tot)) < 0 && errno == EAGAIN)
+			fdwait(fd, 'w');
+		if(m < 0)
+			return m;
+		if(m == 0)
+			break;
+	}
+	return tot;
+}
+
+/*
+ * close an fd fdwait registered: the fd number is free for reuse once
+ * closed, its context must be gone by then. Waiters are woken and find
+ * the fd closed.
+ */
+int
+fdclose(int fd)
+{
+	struct TaskSocketContext	*tscp;
+	struct epoll_event		e = {0};
+
+	if (ctxt_lookup(fd, (struct TaskContext**)&tscp) == 0) {
+		assert(tscp->hdr.tasktype == TASKIO_TYPE_SOCKET ||
+				tscp->hdr.tasktype == TASKIO_TYPE_FIFO);
+		epoll_ctl(taskio_epollfd, EPOLL_CTL_DEL, fd, &e);
+		ctxt_delete(fd);
+		if (tscp->reader != NULL) {
+			taskready(tscp->reader);
+		}
+		if (tscp->writer != NULL) {
+			taskready(tscp->writer);
+		}
+		free(tscp);
+	}
+	return close(fd);
+}
+
+int
+fdnoblock(int fd)
+{
+	return (tasknet_setnoblock(fd) == 0 ? 0 : -1);
 }
@@ -10,6 +10,8 @@
 #include <unistd.h>
 #include <inttypes.h>
 #include <stdint.h>
+#include <sys/uio.h>
+#include <libaio.h>
 
 #include "task.h"
 
@@ -29,12 +31,22 @@
 
 #define TASKIO_NIOEVENT	128
 
+/* shortest adaptive polling window, see taskio_set_spin() */
+#define TASKIO_SPIN_MIN	2000
+
 /*
  * we don't expect one CVA to support more than eighty sessions.
  *	each session will require upto {4 sockets, 1 event fd, 1 epoll fd}
  *  so N >  80 * 6 = 480
+ * The fd table starts with TASKIO_MAXFDVALUE slots and grows on demand,
+ * fd values are process wide so a reconnect storm on a multi-threaded
+ * server easily goes past it. TASKIO_FDLIMIT is the hard upper bound.
  */
 #define TASKIO_MAXFDVALUE	512
+#define TASKIO_FDLIMIT		(1 << 20)
+
+/* listen backlog, large enough to absorb a reconnect storm */
+#define TASKNET_BACKLOG		1024
 
 typedef enum ti_rw {
 	TASKIO_READ = 'r',
@@ -46,11 +58,14 @@ typedef enum ti_tasktype {
 	TASKIO_TYPE_SOCKET = 2,
 	TASKIO_TYPE_EVENT  = 3,
 	TASKIO_TYPE_FIFO   = 4,
+	TASKIO_TYPE_TIMER  = 5,
+	TASKIO_TYPE_POST   = 6,
 } titasktype_t;
 
 int taskio_init(void);
 void taskio_start(void);
 void taskio_deinit(void);
+void taskio_set_spin(uint64_t max_ns);
 
 int task_sockfd_register(int fd);
 int task_eventfd_register(int fd, taskfnptr_t task, void *arg);
@@ -59,7 +74,10 @@ int task_fd_deregister(int fd);
 
 int task_aiorw(int fd, char *buf, size_t nbytes, off_t offset, tirw_t rw,
 		ssize_t *ret);
+int task_aiorwv(int fd, const struct iovec *iov, int iovcnt, off_t offset,
+		tirw_t rw, ssize_t *ret);
 int task_netrw(int fd, char *buf, size_t nbytes, tirw_t rw);
+int task_netwritev(int fd, struct iovec *iov, int iovcnt);
 
 static inline int task_netread(int fd, char *buf, size_t nbytes)
 {
@@ -81,9 +99,46 @@ static inline int task_aiowrite(int fd, char *buf, size_t nbytes, off_t offset,
 	return task_aiorw(fd, buf, nbytes, offset, TASKIO_WRITE, ret);
 }
 
+/*
+ * completion of a libaio request, the waiter's or a continuation's
+ */
+struct LibaioState {
+	Task	*waiter;	/* NULL: a taskcont_t's */
+	int	res;
+	int	res2;
+};
+
+/*
+ * continuations: file I/O that calls back instead of sleeping a task,
+ * for handlers too simple to need a stack of their own. fn runs in this
+ * thread's conttask. It may start the next I/O; it may block, briefly,
+ * to send a response, but every other continuation waits meanwhile.
+ * A taskcont_t is the caller's again once fn is called.
+ */
+typedef struct taskcont taskcont_t;
+typedef void (*taskcontfn_t)(taskcont_t *k);
+
+struct taskcont {
+	struct LibaioState	ls;	/* MUST BE FIRST */
+	taskcontfn_t		fn;
+	void			*arg;
+	int			res;	/* 0, or TASKIO_IOERR on a short I/O */
+	ssize_t			ret;	/* bytes done or -errno, as task_aiorw's */
+	size_t			nbytes;
+	struct iocb		cb;
+	taskcont_t		*next;
+};
+
+void task_cont_init(taskcont_t *k, taskcontfn_t fn, void *arg);
+int task_cont_aiorw(taskcont_t *k, int fd, char *buf, size_t nbytes,
+		off_t offset, tirw_t rw);
+void task_cont_ready(taskcont_t *k);
+
 int tasknet_setnoblock(int fd);
 int tasknet_announce(char *server, int port, int *fdp);
+int tasknet_announce_reuseport(char *server, int port, int *fdp);
 int tasknet_accept(int fd, char *server, int *port, int *cfdp);
+int tasknet_accept_raw(int fd, char *server, int *port, int *cfdp);
 int tasknet_connect(char *server, int port, int *fdp);
 
 
@@ -91,4 +146,19 @@ int taskfifo_announce(const char *in, const char *out);
 void taskfifo_denounce(const char *in, const char *out);
 int taskfifo_accept(const char *in, const char *out, int *infd, int *outfd);
 int taskfifo_connect(const char *in, const char *out, int *infd, int *outfd);
+
+/* event counts of the calling thread */
+extern __thread uint64_t g_task_net_io_sleep;
+extern __thread uint64_t g_task_net_io_wakeup;
+extern __thread uint64_t g_task_aio_io_sleep;
+extern __thread uint64_t g_task_aio_io_wakeup;
+extern __thread uint64_t g_libaio_done;
+extern __thread uint64_t g_libaio_wakeup;
+extern __thread uint64_t g_taskio_spin_ns;
+extern __thread uint64_t g_taskio_spin_hits;
+extern __thread uint64_t g_taskio_spin_hit_ns;
+extern __thread uint64_t g_taskio_spin_misses;
+extern __thread uint64_t g_taskio_blocks;
+extern __thread uint64_t g_task_cont_runs;
+extern __thread uint64_t g_task_aio_waits;
 #endif /*TASKIO_H*/
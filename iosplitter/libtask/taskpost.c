@@ -0,0 +1,272 @@
+/*
+ * taskpost.c
+ *	wakeups and messages between task schedulers of different threads
+ */
+
+#include "taskimpl.h"
+#include <stdio.h>
+#include <sys/eventfd.h>
+#include "taskpost.h"
+
+struct TaskSched
+{
+	MpscQueue	inbox;
+	int		efd;		/* doorbell */
+	int		idle;		/* aiotask is about to sleep or sleeps */
+};
+
+static __thread TaskSched	*schedself;
+
+/* ---- MPSC queue ---- */
+
+void
+mpscinit(MpscQueue *q)
+{
+	q->stub.next = nil;
+	q->head = &q->stub;
+	q->tail = &q->stub;
+}
+
+void
+mpscpush(MpscQueue *q, MpscNode *n)
+{
+	MpscNode	*prev;
+
+	n->next = nil;
+	prev = __atomic_exchange_n(&q->head, n, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
+}
+
+MpscNode *
+mpscpop(MpscQueue *q)
+{
+	MpscNode	*tail = q->tail;
+	MpscNode	*next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+	if (tail == &q->stub) {
+		if (next == nil) {
+			return nil;
+		}
+		q->tail = next;
+		tail = next;
+		next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	}
+	if (next != nil) {
+		q->tail = next;
+		return tail;
+	}
+	if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)) {
+		return nil;		/* a push is half done */
+	}
+	/* tail is the last node: put the stub behind it to take it */
+	mpscpush(q, &q->stub);
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (next != nil) {
+		q->tail = next;
+		return tail;
+	}
+	return nil;
+}
+
+/*
+ * for the owner; counts half done pushes as not empty
+ */
+int
+mpscempty(MpscQueue *q)
+{
+	/* past the stub, tail is a node not yet popped */
+	return (q->tail == &q->stub &&
+		__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == &q->stub);
+}
+
+/* ---- scheduler inbox ---- */
+
+TaskSched *
+tasksched(void)
+{
+	assert(schedself != nil);	/* taskio_init() not called */
+	return schedself;
+}
+
+int
+taskschedinit(void)
+{
+	TaskSched	*s;
+
+	assert(schedself == nil);
+	if ((s = calloc(1, sizeof(*s))) == nil) {
+		return -1;
+	}
+	if ((s->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+		free(s);
+		return -1;
+	}
+	mpscinit(&s->inbox);
+	schedself = s;
+	return s->efd;
+}
+
+/*
+ * nothing may post to this thread any more
+ */
+void
+taskscheddeinit(void)
+{
+	if (schedself == nil) {
+		return;
+	}
+	close(schedself->efd);
+	free(schedself);
+	schedself = nil;
+}
+
+/*
+ * run what other threads posted, returns how many
+ */
+int
+taskschedrun(void)
+{
+	TaskSched	*s = schedself;
+	MpscNode	*n;
+	TaskPost	*p;
+	int		k = 0;
+
+	while ((n = mpscpop(&s->inbox)) != nil) {
+		p = (TaskPost *) n;
+		p->fn(p->arg);		/* may post p again */
+		k++;
+	}
+	return k;
+}
+
+/*
+ * aiotask calls this with 1 before it sleeps, and sleeps only if it
+ * returns 0: posts made from then on ring the doorbell. With 0 after.
+ */
+int
+taskschedidle(int idle)
+{
+	TaskSched	*s = schedself;
+
+	if (!idle) {
+		__atomic_store_n(&s->idle, 0, __ATOMIC_RELAXED);
+		return 0;
+	}
+	__atomic_store_n(&s->idle, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return !mpscempty(&s->inbox);
+}
+
+int
+taskschedpending(void)
+{
+	return !mpscempty(&schedself->inbox);
+}
+
+void
+taskscheddoorbell(void)
+{
+	uint64_t	n;
+
+	/* nonblocking, all rings at once */
+	if (read(schedself->efd, &n, sizeof(n)) < 0) {
+		assert(errno == EAGAIN);
+	}
+}
+
+void
+taskpostinit(TaskPost *p, void (*fn)(void *), void *arg)
+{
+	p->node.next = nil;
+	p->fn = fn;
+	p->arg = arg;
+}
+
+void
+taskpost(TaskSched *s, TaskPost *p)
+{
+	uint64_t	one = 1;
+
+	mpscpush(&s->inbox, &p->node);
+	/* pairs with the fence in taskschedidle */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&s->idle, __ATOMIC_RELAXED)) {
+		if (write(s->efd, &one, sizeof(one)) != sizeof(one)) {
+			/* only fails when the count would overflow */
+			assert(errno == EAGAIN);
+		}
+	}
+}
+
+/* ---- cross-thread Rendez ---- */
+
+static void
+xrendezfire(void *arg)
+{
+	XRendez	*x = arg;
+
+	/* clear first: a wakeup from now on posts again */
+	__atomic_store_n(&x->pending, 0, __ATOMIC_SEQ_CST);
+	taskwakeupall(&x->r);
+}
+
+void
+xrendezinit(XRendez *x)
+{
+	memset(&x->r, 0, sizeof(x->r));
+	x->owner = tasksched();
+	taskpostinit(&x->post, xrendezfire, x);
+	x->pending = 0;
+}
+
+void
+xtasksleep(XRendez *x)
+{
+	assert(x->owner == schedself);
+	tasksleep(&x->r);
+}
+
+void
+xtaskwakeupall(XRendez *x)
+{
+	if (x->owner == schedself) {
+		taskwakeupall(&x->r);
+		return;
+	}
+	if (__atomic_exchange_n(&x->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+		taskpost(x->owner, &x->post);
+	}
+}
+
+/* ---- cross-thread channel ---- */
+
+void
+xchaninit(XChannel *c)
+{
+	mpscinit(&c->q);
+	xrendezinit(&c->x);
+}
+
+void
+xchansend(XChannel *c, MpscNode *n)
+{
+	mpscpush(&c->q, n);
+	xtaskwakeupall(&c->x);
+}
+
+MpscNode *
+xchanrecv(XChannel *c)
+{
+	MpscNode	*n;
+
+	while ((n = mpscpop(&c->q)) == nil) {
+		xtasksleep(&c->x);
+	}
+	return n;
+}
+
+MpscNode *
+xchannbrecv(XChannel *c)
+{
+	return mpscpop(&c->q);
+}
@@ -0,0 +1,94 @@
+/*
+ * taskpost.h
+ *	wakeups and messages between task schedulers of different threads
+ *
+ * Rendez, QLock and Channel only work among the tasks of one thread.
+ * Every thread that called taskio_init() also has a TaskSched with an
+ * inbox other threads post to; its aiotask runs the posts, and when it
+ * sleeps in epoll_wait a post rings an eventfd doorbell to wake it.
+ */
+
+#ifndef TASKPOST_H
+#define TASKPOST_H
+
+#include "task.h"
+
+/*
+ * Lock-free multi-producer single-consumer queue of intrusive nodes
+ * (D. Vyukov). Any thread pushes; only the owner pops. A pop may find
+ * nothing while a push is half done; the pusher has a wakeup to send
+ * after it, so the consumer just tries again then.
+ */
+typedef struct MpscNode MpscNode;
+struct MpscNode
+{
+	MpscNode	*next;
+};
+
+typedef struct MpscQueue MpscQueue;
+struct MpscQueue
+{
+	MpscNode	*head;		/* pushed to, by any thread */
+	char		pad[64 - sizeof(MpscNode *)];
+	MpscNode	*tail;		/* popped from, by the owner */
+	MpscNode	stub;
+};
+
+void		mpscinit(MpscQueue *q);
+void		mpscpush(MpscQueue *q, MpscNode *n);
+MpscNode	*mpscpop(MpscQueue *q);
+int		mpscempty(MpscQueue *q);
+
+/*
+ * fn(arg) run on another scheduler. It runs in that thread's aiotask:
+ * it must not block, it may ready, wake or create tasks. A TaskPost is
+ * the caller's until fn starts and must not be posted twice meanwhile.
+ */
+typedef struct TaskSched TaskSched;
+typedef struct TaskPost TaskPost;
+struct TaskPost
+{
+	MpscNode	node;		/* MUST BE FIRST */
+	void		(*fn)(void *);
+	void		*arg;
+};
+
+TaskSched	*tasksched(void);	/* the calling thread's */
+void		taskpostinit(TaskPost *p, void (*fn)(void *), void *arg);
+void		taskpost(TaskSched *s, TaskPost *p);
+
+/*
+ * A Rendez that tasks of its owner thread sleep on and any thread wakes.
+ * Wakeups coalesce into one post: sleepers must recheck what they wait
+ * for, as with any Rendez.
+ */
+typedef struct XRendez XRendez;
+struct XRendez
+{
+	Rendez		r;
+	TaskSched	*owner;
+	TaskPost	post;
+	int		pending;	/* post in flight */
+};
+
+void		xrendezinit(XRendez *x);	/* on the owner thread */
+void		xtasksleep(XRendez *x);		/* owner thread only */
+void		xtaskwakeupall(XRendez *x);	/* any thread */
+
+/*
+ * Unbounded channel of intrusive nodes: any thread sends, tasks of the
+ * owner thread receive. Embed the MpscNode first in the message.
+ */
+typedef struct XChannel XChannel;
+struct XChannel
+{
+	MpscQueue	q;
+	XRendez		x;
+};
+
+void		xchaninit(XChannel *c);		/* on the owner thread */
+void		xchansend(XChannel *c, MpscNode *n);
+MpscNode	*xchanrecv(XChannel *c);
+MpscNode	*xchannbrecv(XChannel *c);	/* NULL when empty */
+
+#endif /*TASKPOST_H*/
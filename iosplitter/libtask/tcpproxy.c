@@ -3,6 +3,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <task.h>
+#include "taskio.h"
 #include <stdlib.h>
 #include <sys/socket.h>
 
@@ -11,24 +12,38 @@ enum
 	STACK = 32768
 };
 
+/*
+ * one proxied connection: the last of its two rwtasks closes both
+ * fds, so neither number is reused while the other still writes it.
+ */
+typedef struct Conn Conn;
+struct Conn
+{
+	int fd[2];
+	int nrw;	/* rwtasks started, the i'th reads fd[i] */
+	int ndone;
+};
+
 char *server;
 int port;
 void proxytask(void*);
 void rwtask(void*);
 
-int*
-mkfd2(int fd1, int fd2)
+Conn*
+mkconn(int fd1, int fd2)
 {
-	int *a;
+	Conn *c;
 
-	a = malloc(2*sizeof a[0]);
-	if(a == 0){
+	c = malloc(sizeof *c);
+	if(c == 0){
 		fprintf(stderr, "out of memory\n");
 		abort();
 	}
-	a[0] = fd1;
-	a[1] = fd2;
-	return a;
+	c->fd[0] = fd1;
+	c->fd[1] = fd2;
+	c->nrw = 0;
+	c->ndone = 0;
+	return c;
 }
 
 void
@@ -60,32 +75,62 @@ void
 proxytask(void *v)
 {
 	int fd, remotefd;
+	Conn *c;
 
 	fd = (int)v;
 	if((remotefd = netdial(TCP, server, port)) < 0){
-		close(fd);
+		fdclose(fd);
 		return;
 	}
 
 	fprintf(stderr, "connected to %s:%d\n", server, port);
 
-	taskcreate(rwtask, mkfd2(fd, remotefd), STACK);
-	taskcreate(rwtask, mkfd2(remotefd, fd), STACK);
+	c = mkconn(fd, remotefd);
+	taskcreate(rwtask, c, STACK);
+	taskcreate(rwtask, c, STACK);
 }
 
 void
 rwtask(void *v)
 {
-	int *a, rfd, wfd, n;
+	Conn *c;
+	int i, rfd, wfd, n;
 	char buf[2048];
 
-	a = v;
-	rfd = a[0];
-	wfd = a[1];
-	free(a);
+	c = v;
+	i = c->nrw++;
+	rfd = c->fd[i];
+	wfd = c->fd[1-i];
 
 	while((n = fdread(rfd, buf, sizeof buf)) > 0)
 		fdwrite(wfd, buf, n);
 	shutdown(wfd, SHUT_WR);
-	close(rfd);
+	if(++c->ndone < 2)
+		return;
+	fdclose(c->fd[0]);
+	fdclose(c->fd[1]);
+	free(c);
+}
+
+static int mainargc;
+static char **mainargv;
+
+static void
+mainstart(void *v)
+{
+	if(taskio_init() != 0){
+		fprintf(stderr, "taskio_init failed\n");
+		exit(1);
+	}
+	taskio_start();
+	taskmain(mainargc, mainargv);
+}
+
+int
+main(int argc, char **argv)
+{
+	mainargc = argc;
+	mainargv = argv;
+	libtask_start(mainstart, 0);
+	return 0;
 }
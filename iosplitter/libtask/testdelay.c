@@ -4,6 +4,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <task.h>
+#include "taskio.h"
 
 enum { STACK = 32768 };
 
@@ -38,3 +39,26 @@ taskmain(int argc, char **argv)
 	}
 	taskexitall(0);
 }
+
+static int mainargc;
+static char **mainargv;
+
+static void
+mainstart(void *v)
+{
+	if(taskio_init() != 0){
+		fprintf(stderr, "taskio_init failed\n");
+		exit(1);
+	}
+	taskio_start();
+	taskmain(mainargc, mainargv);
+}
+
+int
+main(int argc, char **argv)
+{
+	mainargc = argc;
+	mainargv = argv;
+	libtask_start(mainstart, 0);
+	return 0;
+}
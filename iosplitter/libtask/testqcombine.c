@@ -0,0 +1,121 @@
+/*
+ * testqcombine: flat combining under many tasks
+ *
+ *	testqcombine
+ *
+ * NTASKS tasks each hand NOPS operations to qcombine(), every eighth task
+ * also takes the lock with qcombinelock() for a plain critical section.
+ * Batches and critical sections yield in the middle, so operations queue
+ * up behind them. Checks that no two ever overlap, that every operation
+ * ran once in a batch of at most MAXBATCH and got its own result, and
+ * that the counts add up.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <task.h>
+
+enum { STACK = 32768, NTASKS = 64, NOPS = 2000, MAXBATCH = 16 };
+
+struct op {
+	int	task;
+	int	n;
+};
+
+static QCombine		comb;
+static LockStats	combstats;
+static int		inside;
+static uint64_t		sum;		/* of the operations run */
+static uint64_t		nlocked;	/* plain critical sections */
+static int		ran[NTASKS][NOPS];
+static int		ndone;
+static Rendez		alldone;
+
+static void
+batch(void *ctx, QCombineOp *ops, int nops)
+{
+	QCombineOp *op;
+	struct op *o;
+	int n;
+
+	assert(ctx == &comb);
+	assert(!inside);
+	inside = 1;
+	assert(nops > 0 && nops <= MAXBATCH);
+	for(n=0, op=ops; op!=NULL; op=op->next, n++){
+		o = op->arg;
+		assert(!op->done && ran[o->task][o->n] == 0);
+		ran[o->task][o->n] = 1;
+		sum += o->n;
+		op->res = o->task*NOPS + o->n;
+	}
+	assert(n == nops);
+	if(nops % 3 == 0)
+		taskyield();
+	inside = 0;
+}
+
+static void
+worker(void *v)
+{
+	struct op o;
+	int i, res;
+
+	o.task = (int)(long)v;
+	for(i=0; i<NOPS; i++){
+		o.n = i;
+		res = qcombine(&comb, &o);
+		assert(res == o.task*NOPS + i);
+		if(o.task % 8 == 0 && i % 16 == 0){
+			qcombinelock(&comb);
+			assert(!inside);
+			inside = 1;
+			nlocked++;
+			taskyield();
+			inside = 0;
+			qcombineunlock(&comb);
+		}
+		if(i % 7 == 0)
+			taskyield();
+	}
+	if(++ndone == NTASKS)
+		taskwakeup(&alldone);
+}
+
+static void
+testmain(void *v)
+{
+	int i, j;
+
+	qcombineinit(&comb, batch, &comb, MAXBATCH);
+	qlockstats(&comb.l, &combstats, "qcombine");
+	for(i=0; i<NTASKS; i++)
+		taskcreate(worker, (void*)(long)i, STACK);
+	tasksleep(&alldone);
+
+	for(i=0; i<NTASKS; i++)
+		for(j=0; j<NOPS; j++)
+			assert(ran[i][j] == 1);
+	assert(comb.nops == (uint64_t)NTASKS*NOPS);
+	assert(sum == (uint64_t)NTASKS*NOPS*(NOPS-1)/2);
+	assert(nlocked == (uint64_t)NTASKS/8*(NOPS/16));
+	assert(comb.nbatches < comb.nops);
+	assert(comb.head == NULL && comb.l.owner == NULL);
+
+	printf("%lu ops in %lu batches, %.1f per batch, %lu locked\n",
+		comb.nops, comb.nbatches, (double)comb.nops/comb.nbatches,
+		nlocked);
+	fflush(stdout);
+	lockstatsprint(1);
+	printf("PASS\n");
+	exit(0);
+}
+
+int
+main(int argc, char **argv)
+{
+	libtask_start(testmain, NULL);
+	return 0;
+}
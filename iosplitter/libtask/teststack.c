@@ -0,0 +1,104 @@
+/*
+ * teststack: stack auto sizing and its guard page
+ *
+ *	teststack
+ *
+ * Each case runs in a child. Tasks asking for 256K but using 2K teach
+ * TASKSTACK_AUTO a small size, more such tasks then run on it. A task
+ * that goes 64K deep after that runs into the guard page and has to take
+ * the program down with SIGABRT, while the same task is fine when stacks
+ * are only measured.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <assert.h>
+#include <sys/wait.h>
+#include <task.h>
+
+enum { STACK = 256*1024, SHALLOW = 2*1024, DEEP = 64*1024 };
+
+static int	ndone;
+static int	deep;
+
+static int
+use(int n)
+{
+	volatile char buf[512];
+
+	memset((char*)buf, n, sizeof buf);
+	if(n <= (int)sizeof buf)
+		return buf[0];
+	return use(n - sizeof buf) + buf[1];
+}
+
+static void
+worker(void *v)
+{
+	use((int)(long)v);
+	ndone++;
+}
+
+static void
+run(int n, int depth)
+{
+	int i;
+
+	for(i=0; i<n; i++){
+		taskcreate(worker, (void*)(long)depth, STACK);
+		while(ndone == 0)
+			taskyield();
+		ndone = 0;
+	}
+}
+
+static void
+casemain(void *v)
+{
+	taskname("case");
+	run(TASKSTACK_LEARN, SHALLOW);
+	run(2*TASKSTACK_LEARN, SHALLOW);
+	if(deep)
+		run(1, DEEP);
+	taskstackprint(1);
+	exit(0);
+}
+
+/* status of a child running casemain */
+static int
+child(int mode, int d)
+{
+	pid_t pid;
+	int status;
+
+	fflush(stdout);
+	pid = fork();
+	assert(pid >= 0);
+	if(pid == 0){
+		taskstackmode(mode);
+		deep = d;
+		libtask_start(casemain, NULL);
+		_exit(1);
+	}
+	assert(waitpid(pid, &status, 0) == pid);
+	return status;
+}
+
+int
+main(int argc, char **argv)
+{
+	int status;
+
+	status = child(TASKSTACK_AUTO, 0);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	status = child(TASKSTACK_MEASURE, 1);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	printf("expect an exhausted stack:\n");
+	status = child(TASKSTACK_AUTO, 1);
+	assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+	printf("PASS\n");
+	return 0;
+}
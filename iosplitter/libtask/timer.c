@@ -1,5 +1,3 @@
-#include <sys/timerfd.h>
-
 #include "taskimpl.h"
 #include "task.h"
 #include "taskio.h"
@@ -12,7 +10,8 @@
  * ==============================
  *
  * Helper functions to delay/block/periodic callback functionality for tasks.
- * Works at nanosecond granularity.
+ * Built on the thread's timer wheel below; expiries are rounded up to the
+ * wheel tick (TW_TICKNS).
  *
  * A task might need to use timer functionality in 3 situations
  *
@@ -75,100 +74,289 @@
  *	}
  */
 
+
 /*
- * timer_init: Initialize Timer
+ * Timer wheel
+ * ===========
  *
- * Input:
- *	t      - Uninitialized task_timer_t
- *	cbfn   - Call back function
- *	opaque - Argument passed to call back function
+ * TW_LEVELS levels of TW_SLOTS slots. Level k slot s holds the timeouts
+ * expiring in a block of TW_SLOTS^k ticks whose block number is s modulo
+ * TW_SLOTS; a timeout goes to the lowest level whose span covers it. When
+ * now enters a block, the level k slot of that block is cascaded: its
+ * timeouts are placed again, now on a lower level. Level 0 slots hold
+ * single ticks and are fired.
  *
- * Return:
- *	0      - Sucess
- *	< 0    - Error
+ * now only moves forward when timer_wheel_run() is called, and then jumps
+ * from one nonempty slot to the next (bits[] tells which are), so an idle
+ * wheel costs nothing.
  */
-int timer_init(task_timer_t *t, timer_cb cbfn, void *opaque)
+#define TW_TICKSHIFT	14			/* ~16us per tick */
+#define TW_TICKNS	(1ULL << TW_TICKSHIFT)
+#define TW_BITS		6
+#define TW_SLOTS	(1 << TW_BITS)
+#define TW_MASK		(TW_SLOTS - 1)
+#define TW_LEVELS	6			/* spans ~13 days */
+#define TW_SPAN(k)	(1ULL << (TW_BITS * (k)))
+
+struct timer_wheel {
+	uint64_t	now;			/* last tick processed */
+	uint64_t	count;			/* timeouts armed */
+	uint64_t	bits[TW_LEVELS];	/* nonempty slots */
+	timeout_link_t	slot[TW_LEVELS][TW_SLOTS];
+	int		init;
+	int		firing;			/* in tw_tick(), now is fixed */
+};
+
+static __thread struct timer_wheel	tw;
+
+uint64_t timer_now(void)
 {
-	int fd;
-	int rc;
+	struct timespec	ts;
 
-	assert(t->init != 1);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
 
-	memset(t, 0, sizeof(*t));
+static void tw_init(struct timer_wheel *w)
+{
+	int	k, s;
 
-	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
-	if (fd < 0) {
-		return -1;
+	for (k = 0; k < TW_LEVELS; k++) {
+		for (s = 0; s < TW_SLOTS; s++) {
+			w->slot[k][s].next = w->slot[k][s].prev = &w->slot[k][s];
+		}
+		w->bits[k] = 0;
 	}
+	w->count = 0;
+	w->now = timer_now() >> TW_TICKSHIFT;
+	w->init = 1;
+}
+
+static void tw_place(struct timer_wheel *w, task_timeout_t *to)
+{
+	timeout_link_t	*h;
+	uint64_t	e = to->expires;
+	int		k, s;
 
-	rc = task_fifofd_register(fd, 1);
-	if (rc < 0) {
-		goto error;
+	assert(e >= w->now);
+	for (k = 0; k < TW_LEVELS - 1; k++) {
+		if (e - w->now < TW_SPAN(k + 1)) {
+			break;
+		}
+	}
+	if (e - w->now >= TW_SPAN(TW_LEVELS)) {
+		/* past the last level: park it there, placed again later */
+		e = w->now + TW_SPAN(TW_LEVELS) - 1;
 	}
+	s = (e >> (TW_BITS * k)) & TW_MASK;
+	h = &w->slot[k][s];
+	to->link.next = h;
+	to->link.prev = h->prev;
+	h->prev->next = &to->link;
+	h->prev = &to->link;
+	w->bits[k] |= 1ULL << s;
+}
 
-	t->timerfd = fd;
-	t->cbfn    = cbfn;
-	t->opaque  = opaque;
-	t->init    = 1;
-	return 0;
-error:
-	close(fd);
-	t->closed = 1;
-	t->init   = 0;
-	return rc;
+static void tw_unlink(struct timer_wheel *w, task_timeout_t *to)
+{
+	timeout_link_t	*n = to->link.next;
+	int		i;
+
+	n->prev = to->link.prev;
+	to->link.prev->next = n;
+	if (n == n->next) {
+		/* n is the slot's head, now empty */
+		i = n - &w->slot[0][0];
+		w->bits[i / TW_SLOTS] &= ~(1ULL << (i % TW_SLOTS));
+	}
+	to->link.next = to->link.prev = NULL;
 }
 
 /*
- * Uninitialize Timer
- *
- * Input:
- *	t	- Initialized task_timer_t
+ * move a slot's list to l
  */
-void timer_deinit(task_timer_t *t)
+static void tw_take(struct timer_wheel *w, int k, int s, timeout_link_t *l)
 {
-	assert(t != NULL);
+	timeout_link_t	*h = &w->slot[k][s];
+
+	if (h->next == h) {
+		l->next = l->prev = l;
+		return;
+	}
+	l->next = h->next;
+	l->prev = h->prev;
+	l->next->prev = l;
+	l->prev->next = l;
+	h->next = h->prev = h;
+	w->bits[k] &= ~(1ULL << s);
+}
+
+/*
+ * first tick after now at which a slot fires or cascades
+ */
+static uint64_t tw_next(struct timer_wheel *w)
+{
+	uint64_t	cur, r, t, best = UINT64_MAX;
+	int		k, j, sh;
+
+	for (k = 0; k < TW_LEVELS; k++) {
+		if (w->bits[k] == 0) {
+			continue;
+		}
+		cur = w->now >> (TW_BITS * k);
+		sh = (cur + 1) & TW_MASK;
+		r = sh ? (w->bits[k] >> sh) | (w->bits[k] << (TW_SLOTS - sh)) :
+			w->bits[k];
+		j = __builtin_ctzll(r);
+		t = (cur + 1 + j) << (TW_BITS * k);
+		if (t < best) {
+			best = t;
+		}
+	}
+	return (best);
+}
+
+static void tw_tick(struct timer_wheel *w)
+{
+	timeout_link_t	l, *h;
+	task_timeout_t	*to;
+	int		k;
+
+	for (k = TW_LEVELS - 1; k > 0; k--) {
+		if ((w->now & (TW_SPAN(k) - 1)) != 0) {
+			continue;
+		}
+		tw_take(w, k, (w->now >> (TW_BITS * k)) & TW_MASK, &l);
+		while (l.next != &l) {
+			to = (task_timeout_t *) l.next;
+			l.next = to->link.next;
+			tw_place(w, to);
+		}
+	}
+
+	/* fn may arm or cancel others, but never into this slot */
+	h = &w->slot[0][w->now & TW_MASK];
+	w->firing = 1;
+	while (h->next != h) {
+		to = (task_timeout_t *) h->next;
+		tw_unlink(w, to);
+		w->count--;
+		to->fn(to->arg);
+	}
+	w->firing = 0;
+}
+
+void timeout_init(task_timeout_t *to, timeout_fn fn, void *arg)
+{
+	to->link.next = to->link.prev = NULL;
+	to->expires = 0;
+	to->fn = fn;
+	to->arg = arg;
+}
+
+/*
+ * arm (or re-arm) to to expire at deadline, CLOCK_MONOTONIC nanoseconds
+ */
+void timeout_arm_at(task_timeout_t *to, uint64_t deadline)
+{
+	struct timer_wheel	*w = &tw;
+	uint64_t		t;
+
+	assert(to->fn != NULL);
+	if (!w->init) {
+		tw_init(w);
+	}
+	if (timeout_pending(to)) {
+		tw_unlink(w, to);
+		w->count--;
+	}
+	if (w->count == 0 && !w->firing) {
+		/* nothing to cascade, catch up with the clock */
+		w->now = timer_now() >> TW_TICKSHIFT;
+	}
+	t = (deadline + TW_TICKNS - 1) >> TW_TICKSHIFT;
+	to->expires = t > w->now ? t : w->now + 1;
+	tw_place(w, to);
+	w->count++;
+}
+
+void timeout_arm(task_timeout_t *to, uint64_t ns)
+{
+	timeout_arm_at(to, timer_now() + ns);
+}
+
+/*
+ * returns 1 if to was armed
+ */
+int timeout_cancel(task_timeout_t *to)
+{
+	if (!timeout_pending(to)) {
+		return (0);
+	}
+	tw_unlink(&tw, to);
+	tw.count--;
+	return (1);
+}
 
-	t->closed  = 1;
-	t->init    = 0;
+/*
+ * fire what is due
+ */
+void timer_wheel_run(void)
+{
+	struct timer_wheel	*w = &tw;
+	uint64_t		target, next;
 
-	if (t->timerfd > 0) {
-		close(t->timerfd);
-		task_fd_deregister(t->timerfd);
+	if (w->count == 0) {
+		return;
 	}
+	target = timer_now() >> TW_TICKSHIFT;
+	while (w->now < target) {
+		if (w->count == 0) {
+			w->now = target;
+			break;
+		}
+		next = tw_next(w);
+		if (next > target) {
+			w->now = target;
+			break;
+		}
+		w->now = next;
+		tw_tick(w);
+	}
+}
 
-	t->timerfd = -1;
+/*
+ * CLOCK_MONOTONIC ns at which timer_wheel_run() next has work, 0 if none
+ */
+uint64_t timer_wheel_next(void)
+{
+	if (tw.count == 0) {
+		return (0);
+	}
+	return (tw_next(&tw) << TW_TICKSHIFT);
 }
 
 /*
- * Internal function
+ * task_timer_t
+ * ============
+ */
+
+/*
+ * Internal function: runs the callback in a task of its own, so that it
+ * may block
  */
-void _timer_func(void *arg)
+static void _timer_func(void *arg)
 {
 	task_timer_t *t = arg;
 	uint64_t     v;
-	int          rc;
 
 	tasksystem();
 
-	while (1) {
-		v = 0;
-		rc = task_netread(t->timerfd, (char *) &v, sizeof(v));
-		if (rc != 0) {
-			if (rc == TASKIO_ECONN || rc == EBADF) {
-				/* timerfd closed */
-				assert(t->closed == 1);
-				taskexit(0);
-				break;
-			}
-
-			assert(0);
-		}
-
-		taskwakeupall(&t->rendez);
+	while (t->expired != 0 && t->closed == 0) {
+		v = t->expired;
+		t->expired = 0;
 
-		if (t->cbfn) {
-			t->cbfn(t->opaque, v);
-		}
+		t->cbfn(t->opaque, v);
 
 		if (t->repeat > 0) {
 			t->repeat--;
@@ -177,51 +365,92 @@ void _timer_func(void *arg)
 		if (t->repeat == 0) {
 			/* disarm timer */
 			timer_unset(t);
-			taskexit(0);
 			break;
 		}
 	}
+	t->running = 0;
+	taskexit(0);
 }
 
 /*
- * Internal function
+ * Internal function: timeout callback, in aiotask
  */
-static int timer_mod(task_timer_t *t, struct timespec *ts, int repeat)
+static void timer_expire(void *arg)
 {
-	struct itimerspec its = {
-		.it_value    = {0},
-		.it_interval = {0},
-	};
-	int rc;
-
-	assert(t->timer_set != 0);
-	assert(t->init == 1);
-
-	its.it_value.tv_sec  = ts->tv_sec;
-	its.it_value.tv_nsec = ts->tv_nsec;
-	if (repeat != 0) {
-		its.it_interval.tv_sec  = ts->tv_sec;
-		its.it_interval.tv_nsec = ts->tv_nsec;
+	task_timer_t *t = arg;
+	uint64_t     now;
+	uint64_t     n = 1;
+
+	if (t->interval != 0) {
+		/* keep the period; expiries we were too late for count too */
+		now = timer_now();
+		t->deadline += t->interval;
+		while (t->deadline <= now) {
+			t->deadline += t->interval;
+			n++;
+		}
+		timeout_arm_at(&t->to, t->deadline);
+	} else {
+		t->timer_set = 0;
 	}
 
-	rc = timerfd_settime(t->timerfd, 0, &its, NULL);
-	if (rc < 0) {
-		return -1;
+	taskwakeupall(&t->rendez);
+
+	if (t->cbfn) {
+		t->expired += n;
+		if (t->running == 0) {
+			t->running = 1;
+			taskcreate(_timer_func, t, TASKSZ);
+		}
 	}
+}
 
-	t->ts.tv_sec  = ts->tv_sec;
-	t->ts.tv_nsec = ts->tv_nsec;
-	t->repeat     = repeat;
+/*
+ * timer_init: Initialize Timer
+ *
+ * Input:
+ *	t      - Uninitialized task_timer_t
+ *	cbfn   - Call back function
+ *	opaque - Argument passed to call back function
+ *
+ * Return:
+ *	0      - Sucess
+ */
+int timer_init(task_timer_t *t, timer_cb cbfn, void *opaque)
+{
+	assert(t->init != 1);
+
+	memset(t, 0, sizeof(*t));
+	timeout_init(&t->to, timer_expire, t);
 
+	t->cbfn    = cbfn;
+	t->opaque  = opaque;
+	t->init    = 1;
 	return 0;
 }
 
+/*
+ * Uninitialize Timer
+ *
+ * Input:
+ *	t	- Initialized task_timer_t
+ */
+void timer_deinit(task_timer_t *t)
+{
+	assert(t != NULL);
+
+	timeout_cancel(&t->to);
+	t->timer_set = 0;
+	t->closed    = 1;
+	t->init      = 0;
+}
+
 /*
  * timer_set: set the timer
  *
  * Input:
  *	t	- Initialized task_timer_t
- *	ts	- time specifications for timer expiration
+ *	ts	- time specifications for timer expiration, zero disarms
  *	repeat	- determines how many times to invoke call back function
  *		  NOTE: This parameter determines number of times the callback
  *		  function must be invoked and does not determine number of
@@ -241,42 +470,28 @@ static int timer_mod(task_timer_t *t, struct timespec *ts, int repeat)
  *
  * Return:
  *	0	- Success
- *	< 0	- Error
  */
 int timer_set(task_timer_t *t, struct timespec *ts, int repeat)
 {
-	struct itimerspec its = {
-		.it_value    = {0},
-		.it_interval = {0},
-	};
-	int rc;
+	uint64_t ns;
 
 	assert(t->closed == 0);
 	assert(t->init   == 1);
 
-	if (t->timer_set) {
-		return timer_mod(t, ts, repeat);
-	}
-
-	its.it_value.tv_sec  = ts->tv_sec;
-	its.it_value.tv_nsec = ts->tv_nsec;
-	if (repeat != 0) {
-		its.it_interval.tv_sec  = ts->tv_sec;
-		its.it_interval.tv_nsec = ts->tv_nsec;
-	}
-
-	rc = timerfd_settime(t->timerfd, 0, &its, NULL);
-	if (rc < 0) {
-		return -1;
+	ns = ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+	if (ns == 0) {
+		timer_unset(t);
+		return 0;
 	}
 
 	t->ts.tv_sec  = ts->tv_sec;
 	t->ts.tv_nsec = ts->tv_nsec;
 	t->repeat     = repeat;
+	t->interval   = repeat != 0 ? ns : 0;
+	t->deadline   = timer_now() + ns;
 	t->timer_set  = 1;
 
-	taskcreate(_timer_func, t, TASKSZ);
-
+	timeout_arm_at(&t->to, t->deadline);
 	return 0;
 }
 
@@ -286,14 +501,8 @@ int timer_set(task_timer_t *t, struct timespec *ts, int repeat)
  * Input:
  *	t	- Initialized task_timer_t
  */
-inline void timer_unset(task_timer_t *t)
+void timer_unset(task_timer_t *t)
 {
-	int               rc;
-	struct itimerspec its = {
-		.it_value    = {0},
-		.it_interval = {0},
-	};
-
 	assert(t->init      == 1);
 	assert(t->closed    == 0);
 
@@ -301,9 +510,8 @@ inline void timer_unset(task_timer_t *t)
 		return;
 	}
 
-	rc = timerfd_settime(t->timerfd, 0, &its, NULL);
-	assert(rc == 0);
-
+	timeout_cancel(&t->to);
+	t->expired   = 0;
 	t->timer_set = 0;
 }
 
@@ -317,24 +525,44 @@ inline void timer_unset(task_timer_t *t)
  *
  * Return:
  *	0	- Success
- *	< 0	- Error
  */
 int timer_wait(task_timer_t *t, struct timespec *ts)
 {
-	int rc;
-
 	assert(t->closed == 0);
 	assert(t->init   == 1);
 
-	rc = timer_set(t, ts, 0);
-	if (rc < 0) {
-		return -1;
+	timer_set(t, ts, 0);
+	while (t->timer_set) {
+		tasksleep(&t->rendez);
 	}
-
-	tasksleep(&t->rendez);
 	return 0;
 }
 
+static void
+taskdelay_wake(void *arg)
+{
+	taskready(arg);
+}
+
+/*
+ * taskdelay: libtask's millisecond sleep, on the wheel.
+ *
+ * Return:
+ *	ms actually slept
+ */
+unsigned int taskdelay(unsigned int ms)
+{
+	task_timeout_t	to;
+	uint64_t	start = timer_now();
+
+	timeout_init(&to, taskdelay_wake, taskrunning);
+	timeout_arm(&to, (uint64_t) ms * 1000000);
+	taskstate("delay");
+	taskswitch();
+
+	return (timer_now() - start) / 1000000;
+}
+
 /*
  * task_delay: Blocks task for specified time specification.
  *
@@ -343,25 +571,104 @@ int timer_wait(task_timer_t *t, struct timespec *ts)
  *
  * Return:
  *	0	- Success
- *	< 0	- Error
  */
 int task_delay(struct timespec *ts)
 {
-	int          rc;
 	task_timer_t t;
 
-	rc = timer_init(&t, NULL, NULL);
-	if (rc < 0) {
-		return -1;
-	}
-
-	rc = timer_wait(&t, ts);
-	if (rc < 0) {
-		timer_deinit(&t);
-		return -1;
-	}
-
+	t.init = 0;
+	timer_init(&t, NULL, NULL);
+	timer_wait(&t, ts);
 	timer_deinit(&t);
 
 	return 0;
 }
+
+#ifdef SOLOTEST_TIMER
+/*
+ * cc -DSOLOTEST_TIMER -I. timer.c libtask.a -laio -lpthread
+ * drives the wheel by hand, no scheduler needed
+ */
+#include <stdio.h>
+
+#define NTO	20000
+
+static task_timeout_t	to[NTO];
+static uint64_t		deadline[NTO];
+static uint64_t		fired[NTO];
+static uint64_t		prevtick;	/* clock before the previous run */
+static int		nfired;
+
+static void fire(void *arg)
+{
+	int	i = (int) (intptr_t) arg;
+
+	/* not early, and not due at the previous run already */
+	assert(fired[i] == 0);
+	fired[i] = timer_now();
+	assert(fired[i] >= deadline[i]);
+	assert((deadline[i] + TW_TICKNS - 1) >> TW_TICKSHIFT > prevtick);
+	nfired++;
+	/* re-arming from fn while the wheel may be empty */
+	if (i == 0 && nfired < NTO / 2) {
+		deadline[0] = timer_now() + 1000000;
+		fired[0] = 0;
+		nfired--;
+		timeout_arm_at(&to[0], deadline[0]);
+	}
+}
+
+int main(void)
+{
+	struct timespec	d = { 0, 50000 };
+	uint64_t	now, t;
+	int		i, ncancel = 0, want;
+
+	srandom(1);
+	now = timer_now();
+	for (i = 0; i < NTO; i++) {
+		timeout_init(&to[i], fire, (void *) (intptr_t) i);
+		switch (i % 4) {
+		case 0:		/* within a millisecond */
+			deadline[i] = now + random() % 1000000;
+			break;
+		case 1:		/* within 100ms */
+			deadline[i] = now + random() % 100000000;
+			break;
+		case 2:		/* within 2s */
+			deadline[i] = now + random() % 2000000000;
+			break;
+		default:	/* already due */
+			deadline[i] = now - random() % 1000000;
+			break;
+		}
+		timeout_arm_at(&to[i], deadline[i]);
+	}
+	/* cancel and re-arm some */
+	for (i = 1; i < NTO; i += 7) {
+		assert(timeout_cancel(&to[i]) == 1);
+		assert(timeout_cancel(&to[i]) == 0);
+		ncancel++;
+	}
+	for (i = 1; i < NTO; i += 49) {
+		deadline[i] = timer_now() + 3000000;
+		timeout_arm_at(&to[i], deadline[i]);
+		ncancel--;
+	}
+	want = NTO - ncancel;
+
+	while (nfired < want) {
+		assert(timer_wheel_next() != 0);
+		nanosleep(&d, NULL);
+		t = timer_now() >> TW_TICKSHIFT;
+		timer_wheel_run();
+		prevtick = t;
+	}
+	assert(timer_wheel_next() == 0);
+	for (i = 0; i < NTO; i++) {
+		assert(fired[i] != 0 || timeout_pending(&to[i]) == 0);
+	}
+	printf("%d fired, %d cancelled\n", nfired, ncancel);
+	return (0);
+}
+#endif
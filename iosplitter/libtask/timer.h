@@ -1,6 +1,49 @@
 #ifndef __TIMER_H__
 #define __TIMER_H__
 
+#include <stdint.h>
+#include <time.h>
+#include "task.h"
+
+/*
+ * Timeouts on the calling scheduler thread, kept in a hierarchical timing
+ * wheel: arm and cancel are O(1), however many are outstanding. All of a
+ * thread's timeouts share one timerfd that its aiotask polls, so the
+ * thread must have called taskio_init() and taskio_start().
+ *
+ * fn runs in aiotask when the timeout expires. It must not block; it may
+ * ready or wake tasks and arm or cancel timeouts. A timeout is armed,
+ * cancelled and expires on the thread that armed it.
+ */
+typedef void (*timeout_fn)(void *arg);
+
+typedef struct timeout_link {
+	struct timeout_link	*next;
+	struct timeout_link	*prev;
+} timeout_link_t;
+
+typedef struct task_timeout {
+	timeout_link_t	link;		/* MUST BE FIRST; next NULL if idle */
+	uint64_t	expires;	/* wheel tick */
+	timeout_fn	fn;
+	void		*arg;
+} task_timeout_t;
+
+uint64_t timer_now(void);
+void timeout_init(task_timeout_t *to, timeout_fn fn, void *arg);
+void timeout_arm(task_timeout_t *to, uint64_t ns);
+void timeout_arm_at(task_timeout_t *to, uint64_t deadline);
+int timeout_cancel(task_timeout_t *to);
+
+static inline int timeout_pending(task_timeout_t *to)
+{
+	return (to->link.next != NULL);
+}
+
+/* for aiotask */
+void timer_wheel_run(void);
+uint64_t timer_wheel_next(void);
+
 typedef void (*timer_cb) (void *, uint64_t expire_count);
 
 typedef struct task_timer {
@@ -8,11 +51,15 @@ typedef struct task_timer {
 	struct timespec ts;			/**/
 	void            *opaque;		/**/
 	timer_cb        cbfn;			/**/
-	int             timerfd;		/**/
+	task_timeout_t  to;
+	uint64_t        deadline;		/* ns of the armed expiry */
+	uint64_t        interval;		/* ns, 0 if one shot */
+	uint64_t        expired;		/* not yet passed to cbfn */
 	int             repeat;
 	int             timer_set;
 	int		init;
 	int             closed;
+	int             running;		/* cbfn task exists */
 } task_timer_t;
 
 int timer_init(task_timer_t *t, timer_cb cbfn, void *opaque);
@@ -14,6 +14,7 @@
 #include <fcntl.h>
 
 #include "rpc.h"
+#include "trace.h"
 #include "../libtask/taskio.h"
 
 #define TRACE(...) {}
@@ -30,13 +31,19 @@
 #define NOPRINT(...) { }
 
 #define TASKSTACKSZ (32*1024)
+#define RPC_SEND_BATCH	32	/* messages per writev */
 #define STATIC
 
-unsigned long long g_rsp_sent;
-unsigned long long g_rpc_recv_task_reads_done;
-unsigned long long g_rpc_recv_task_reads_issued;
+__thread uint64_t g_rsp_sent;
+__thread uint64_t g_rpc_recv_task_reads_done;
+__thread uint64_t g_rpc_recv_task_reads_issued;
+__thread uint64_t g_rpc_timeouts;
+__thread uint64_t g_rpc_late_rsp;
+__thread uint64_t g_rpc_send_msgs;
+__thread uint64_t g_rpc_send_writevs;
 
 STATIC void rpc_recv_task(void *arg);
+STATIC void rpc_send_batch(void *ctx, QCombineOp *ops, int nops);
 STATIC void _rpc_response(rpc_chan_t *rcp, rpc_msg_t *resp);
 STATIC void _rpc_receive(rpc_chan_t *rcp, rpc_msg_t **msgpp);
 
@@ -45,6 +52,40 @@ static inline int get_bucket(hash_table_t *ht, seqid_t id)
 	return id % hash_no_buckets(ht);
 }
 
+/*
+ * end an in flight request without a response: take it out of the hash so
+ * that a late response is dropped, and wake the requester with err.
+ * Runs in the requester's thread, from a task or from the timer wheel.
+ */
+STATIC void
+rpc_abort(rpc_msg_t *msgp, int err)
+{
+	assert(msgp->resp == NULL && msgp->err == 0);
+
+	hash_rem(&msgp->rcp->hash, &msgp->h_entry);
+	timeout_cancel(&msgp->to);
+	msgp->err = err;
+	TASKWAKEUP(&msgp->rendez);
+}
+
+STATIC void
+rpc_timeout(void *arg)
+{
+	rpc_msg_t	*msgp = arg;
+
+	g_rpc_timeouts++;
+	rpc_abort(msgp, RPC_ETIMEDOUT);
+}
+
+/*
+ * the recv task is gone, nothing will answer
+ */
+STATIC void
+rpc_abort_closed(hash_entry_t *e)
+{
+	rpc_abort(container_of(e, rpc_msg_t, h_entry), RPC_EDISABLED);
+}
+
 /*
  * Just read a message from channel into new buffers and return msgp
  * return 0 on success. set CONNCLOSED bit on error.
@@ -135,9 +176,9 @@ _rpc_response(rpc_chan_t *rcp, rpc_msg_t *resp)
 
 	rc = hash_lookup(&rcp->hash, bucket, &e, resp);
 	if (rc != 0) {
-		/* Orphan response. Flag an error */
-		PRINT("_rpc_response: matching msgp not found in hash table\n");
-		assert(0);
+		/* request timed out or was cancelled */
+		g_rpc_late_rsp++;
+		rpc_msg_put(rcp, resp);
 		return;
 	}
 
@@ -146,7 +187,9 @@ _rpc_response(rpc_chan_t *rcp, rpc_msg_t *resp)
 	assert(msgp != NULL);
 
 	hash_rem(&rcp->hash, e);
+	timeout_cancel(&msgp->to);
 
+	trace(resp->hdr.traceid, TR_CLI_DONE);
 	msgp->resp = resp;
 	TASKWAKEUP(&msgp->rendez);
 	//PRINT("response seqid=%d signalled\n", RPC_MSG_SEQID(resp));
@@ -179,6 +222,15 @@ rpc_recv_task(void *arg)
 		g_rpc_recv_task_reads_done++;
 
 		if (RPC_ISREQ(msgp)) {
+			if (msgp->hdr.traceid != 0) {
+				/* the client's send stamp stands for it */
+				trace_rec(msgp->hdr.traceid, TR_RPC_SEND,
+						msgp->hdr.tsend);
+				trace(msgp->hdr.traceid, TR_SRV_RECV);
+			}
+			if (rcp->fastpath != NULL && rcp->fastpath(msgp) == 0) {
+				continue;
+			}
 			TASKCREATE(rcp->handler, msgp, TASKSTACKSZ);
 		} else {
 			_rpc_response(rcp, msgp);
@@ -188,6 +240,7 @@ rpc_recv_task(void *arg)
 	//PRINT("rpc_recv_task: fatal error on read: channel disabled\n");
 	/* leave the sockfd open until everything is shut down */
 	rcp->enabled = 0;
+	hash_cleanup(&rcp->hash, rpc_abort_closed);
 	/* Send handler this message to tell it that channel is closed */
 	TASKCREATE(rcp->handler, msgp, TASKSTACKSZ);
 }
@@ -276,7 +329,8 @@ rpc_chan_init(
 	assert(msgsz >= sizeof(rpc_msghdr_t) && msgsz <= MAXUINT16);
 	//assert(datasz < MAXUINT16);
 
-	BZERO(rcp); // zero out all members in one stroke, including QLock
+	BZERO(rcp); // zero out all members in one stroke
+	qcombineinit(&rcp->sendq, rpc_send_batch, rcp, RPC_SEND_BATCH);
 	if (handler == NULL) {
 		printf("handler is NULL. using rpc_default_handler\n");
 	}
@@ -351,6 +405,25 @@ void rpc_chan_close(rpc_chan_t *rcp)
 	rcp->outfd = -1;
 }
 
+/*
+ * must be called right after rpc_chan_init, before the recv task gets to run
+ */
+void rpc_chan_set_fastpath(rpc_chan_t *rcp, rpcfastpath_t fastpath)
+{
+	assert(rcp && rcp->enabled);
+	rcp->fastpath = fastpath;
+}
+
+/*
+ * deadline of every rpc_request() on the channel, 0 (the default) waits
+ * for the response however long it takes
+ */
+void rpc_chan_set_timeout(rpc_chan_t *rcp, uint64_t ns)
+{
+	assert(rcp);
+	rcp->timeout = ns;
+}
+
 void
 rpc_chan_deinit(rpc_chan_t *rcp)
 {
@@ -403,6 +476,8 @@ rpc_msg_get(
 	msgp->resp = NULL;
 	msgp->rcp  = rcp;
 	memset(&msgp->rendez, 0, sizeof(msgp->rendez));
+	timeout_init(&msgp->to, rpc_timeout, msgp);
+	msgp->err = 0;
 
 	msgp->hdr.seqid = rcp->seqid++; // hbkt.seqid is set in rpc_request
 	RPC_SETMSGTYPE(msgp, msgtype)
@@ -443,6 +518,20 @@ rpc_msg_put(rpc_chan_t *rcp, rpc_msg_t *msgp)
  */
 int
 rpc_request(rpc_chan_t *rcp, rpc_msg_t *msgp)
+{
+	return rpc_request_timed(rcp, msgp, rcp->timeout);
+}
+
+/*
+ * rpc_request, giving up after ns (0: never)
+ * returns 0 with msgp->resp set, or
+ *	RPC_ETIMEDOUT	no response in time, a late one is dropped
+ *	RPC_ECANCELED	rpc_cancel() was called
+ *	RPC_EDISABLED	channel closed
+ * or a send error, which closes the channel.
+ */
+int
+rpc_request_timed(rpc_chan_t *rcp, rpc_msg_t *msgp, uint64_t ns)
 {
 	int		bucket;
 	int		res;
@@ -459,33 +548,119 @@ rpc_request(rpc_chan_t *rcp, rpc_msg_t *msgp)
 	assert(bucket >= 0 && bucket < rcp->hash.no_buckets);
 
 	RPC_SETREQ(msgp)
+	msgp->err = 0;
 	hash_add(&rcp->hash, &msgp->h_entry, bucket);
-	RPC_CHAN_LOCK(rcp)
-	/* send the message header */
-	if ((res = task_netwrite(rcp->outfd, (char*)&msgp->hdr, msgp->hdr.msglen)) != 0) {
-		PRINT("rpc_request: header send failed with %d\n", res);
+	if (ns != 0) {
+		/* the deadline counts the send too */
+		timeout_arm(&msgp->to, ns);
+	}
+	if (msgp->hdr.traceid == 0) {
+		msgp->hdr.traceid = trace_sample();
+	}
+	if ((res = qcombine(&rcp->sendq, msgp)) != 0) {
+		PRINT("rpc_request: send failed with %d\n", res);
 		goto errout;
 	}
-	if (msgp->payload) {
-		if ((res = task_netwrite(rcp->outfd, msgp->payload, msgp->hdr.payloadlen)) != 0) {
-			PRINT("rpc_request: payload send failed with %d\n", res);
-			goto errout;
-		}
+	/*
+	 * now wait for response that will appear in msgp->resp; it, or the
+	 * deadline, may have come while we were writing
+	 */
+	while (msgp->resp == NULL && msgp->err == 0) {
+		TASKSLEEP(&msgp->rendez);
 	}
-	RPC_CHAN_UNLOCK(rcp)
-	/* now wait for response that will appear in msgp->resp */
-	TASKSLEEP(&msgp->rendez);
-	assert(msgp->resp);
-	return 0;
+	return msgp->err;
 
 errout:
-	/* task_netwrite errors are irrecoverable. close the socket to trigger clean up.*/
-	PRINT("rpc_request: error %d, closing fd\n", res);
-	rpc_chan_close(rcp);
-	RPC_CHAN_UNLOCK(rcp)
+	/* rpc_send_batch has closed the channel */
+	hash_rem(&rcp->hash, &msgp->h_entry);
+	timeout_cancel(&msgp->to);
+	return res;
+}
+
+/*
+ * rpc_request_timed, sent again under a new seqid on timeout, at most
+ * ntries times in all. Only for requests that are safe to repeat, like
+ * reads: the server may well have executed the ones that timed out.
+ */
+int
+rpc_request_retry(rpc_chan_t *rcp, rpc_msg_t *msgp, uint64_t ns, int ntries)
+{
+	int		res;
+
+	assert(ns != 0 && ntries > 0);
+
+	while ((res = rpc_request_timed(rcp, msgp, ns)) == RPC_ETIMEDOUT &&
+			--ntries > 0) {
+		msgp->hdr.seqid = rcp->seqid++;
+	}
 	return res;
 }
 
+/*
+ * called by another task of the requester's thread: make a pending
+ * rpc_request return RPC_ECANCELED. A response still on its way is
+ * dropped. Returns non zero if the request was no longer pending.
+ */
+int
+rpc_cancel(rpc_chan_t *rcp, rpc_msg_t *msgp)
+{
+	assert(rcp && msgp && msgp->rcp == rcp);
+
+	if (msgp->resp != NULL || msgp->err != 0 ||
+			DLL_ISEMPTY(&msgp->h_entry.list)) {
+		return -1;
+	}
+	rpc_abort(msgp, RPC_ECANCELED);
+	return 0;
+}
+
+/*
+ * the channel's writers queue their messages on rcp->sendq; whichever
+ * holds it sends what queued up meanwhile, up to RPC_SEND_BATCH, in one
+ * writev and wakes their tasks. Send errors are irrecoverable: the
+ * channel is closed to trigger clean up.
+ */
+STATIC void
+rpc_send_batch(void *ctx, QCombineOp *ops, int nops)
+{
+	rpc_chan_t	*rcp = ctx;
+	struct iovec	iov[2 * RPC_SEND_BATCH];
+	QCombineOp	*op;
+	rpc_msg_t	*msgp;
+	int		n = 0;
+	int		res;
+
+	assert(nops <= RPC_SEND_BATCH);
+	for (op = ops; op != NULL; op = op->next) {
+		msgp = op->arg;
+		if (msgp->hdr.traceid != 0) {
+			msgp->hdr.tsend = trace_now();
+			if (!RPC_ISREQ(msgp)) {
+				trace_rec(msgp->hdr.traceid, TR_RSP_SEND,
+						msgp->hdr.tsend);
+			}
+		}
+		iov[n].iov_base = &msgp->hdr;
+		iov[n++].iov_len = msgp->hdr.msglen;
+		if (msgp->payload) {
+			iov[n].iov_base = msgp->payload;
+			iov[n++].iov_len = msgp->hdr.payloadlen;
+		}
+	}
+	if (!rcp->enabled) {
+		res = RPC_EDISABLED;
+	} else if ((res = task_netwritev(rcp->outfd, iov, n)) != 0) {
+		PRINT("rpc_send_batch: error %d, closing fd\n", res);
+		rpc_chan_close(rcp);
+	} else {
+		g_rpc_send_writevs++;
+		g_rpc_send_msgs += nops;
+	}
+	for (op = ops; op != NULL; op = op->next) {
+		op->res = res;
+	}
+}
+
 /*
  *  To be called from a request handler task
  *  Send the response, deep free msgp,
@@ -504,27 +679,12 @@ rpc_response(rpc_chan_t *rcp, rpc_msg_t *msgp)
 		goto done;
 	}
 	RPC_SETRESP(msgp)
-	RPC_CHAN_LOCK(rcp)
-	/* send the message header */
-	if ((res = task_netwrite(rcp->outfd, (char*)&msgp->hdr, msgp->hdr.msglen)) != 0) {
-		//PRINT("rpc_response: header send failed with %d\n", res);
-		goto errout;
+	if ((res = qcombine(&rcp->sendq, msgp)) != 0) {
+		//PRINT("rpc_response send failed with %d: channel disabled and fd closed\n", res);
+		// XXX Is this sufficient, or does somebody have to kill the receiver task?
 	}
-	if (msgp->payload) {
-		if ((res = task_netwrite(rcp->outfd, msgp->payload, msgp->hdr.payloadlen)) != 0) {
-			//PRINT("rpc_response: payload send failed with %d\n", res);
-			goto errout;
-		}
-	}
-	goto done;
-
-errout:
-	rpc_chan_close(rcp);
-	//PRINT("rpc_response send failed: channel disabled and fd closed\n");
-	// XXX Is this sufficient, or does somebody have to kill the receiver task?
 
 done:
-	RPC_CHAN_UNLOCK(rcp)
 	/* now reclaim payload and msgp */
 	rpc_msg_put(rcp, msgp);
 	g_rsp_sent++;
@@ -540,6 +700,7 @@ dump_rpc_msghdr(rpc_msghdr_t *p)
 	printf("\t\tmsglen       %d\n", p->msglen);
 	printf("\t\tpayloadlen   %d\n", p->payloadlen);
 	printf("\t\tstatus       %d\n", p->status);
+	printf("\t\ttraceid      %08x\n", p->traceid);
 }
 
 void
@@ -0,0 +1,325 @@
+/*
+ * cbstat.c
+ *	print the statistics a process publishes with stats_shm_start()
+ *
+ *	cbstat			list the processes publishing
+ *	cbstat [-i secs] [-n count] <pid | /name>
+ *
+ * The first report shows totals, the following ones rates and
+ * percentiles over the interval. The segment is only read.
+ */
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "stats.h"
+
+static struct statshm_hdr	*shm;
+static size_t			shmsize;
+
+static int attach(const char *name)
+{
+	struct stat	st;
+	int		fd;
+
+	if ((fd = shm_open(name, O_RDONLY, 0)) < 0) {
+		fprintf(stderr, "cbstat: %s: %s\n", name, strerror(errno));
+		return (-1);
+	}
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(*shm)) {
+		fprintf(stderr, "cbstat: %s: not a statistics segment\n", name);
+		close(fd);
+		return (-1);
+	}
+	shmsize = st.st_size;
+	shm = mmap(NULL, shmsize, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED) {
+		fprintf(stderr, "cbstat: %s: %s\n", name, strerror(errno));
+		return (-1);
+	}
+	if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != STATSHM_MAGIC ||
+	    shm->version != STATSHM_VERSION ||
+	    shm->hdrsize != sizeof(struct statshm_hdr) ||
+	    shm->entsize != sizeof(struct statshm_ent) ||
+	    shm->hdrsize + (size_t) shm->maxents * shm->entsize > shmsize) {
+		fprintf(stderr, "cbstat: %s: unknown layout version %u\n",
+				name, shm->version);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * consistent copy of the segment: seq even and unchanged around it
+ */
+static int snapshot(struct statshm_hdr *copy)
+{
+	uint64_t	seq;
+	int		tries;
+
+	for (tries = 0; tries < 10000; tries++) {
+		seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			usleep(100);
+			continue;
+		}
+		memcpy(copy, shm, shmsize);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) == seq &&
+		    copy->nents <= copy->maxents) {
+			return (0);
+		}
+	}
+	return (-1);
+}
+
+static struct statshm_ent *find(struct statshm_hdr *h, int i,
+	struct statshm_ent *e)
+{
+	uint32_t	j;
+
+	if (h == NULL) {
+		return (NULL);
+	}
+	if ((uint32_t) i < h->nents &&
+	    strcmp(h->e[i].name, e->name) == 0 && h->e[i].type == e->type) {
+		return (&h->e[i]);
+	}
+	for (j = 0; j < h->nents; j++) {
+		if (strcmp(h->e[j].name, e->name) == 0 &&
+		    h->e[j].type == e->type) {
+			return (&h->e[j]);
+		}
+	}
+	return (NULL);
+}
+
+static uint64_t pct(uint64_t *b, uint64_t count, uint64_t max, double p)
+{
+	uint64_t	want, seen;
+	int		i;
+
+	if (count == 0) {
+		return (0);
+	}
+	want = (uint64_t) (count * p / 100.0);
+	if (want == 0) {
+		want = 1;
+	}
+	for (seen = 0, i = 0; i < STAT_LAT_NBUCKETS - 1; i++) {
+		seen += b[i];
+		if (seen >= want) {
+			break;
+		}
+	}
+	return (stat_lat_bucket_max(i) < max ? stat_lat_bucket_max(i) : max);
+}
+
+static char *nsfmt(char *buf, uint64_t ns)
+{
+	if (ns < 10000) {
+		sprintf(buf, "%" PRIu64 "ns", ns);
+	} else if (ns < 10000000) {
+		sprintf(buf, "%.1fus", ns / 1e3);
+	} else if (ns < 10000000000ULL) {
+		sprintf(buf, "%.1fms", ns / 1e6);
+	} else {
+		sprintf(buf, "%.1fs", ns / 1e9);
+	}
+	return (buf);
+}
+
+static void report(struct statshm_hdr *cur, struct statshm_hdr *prev)
+{
+	struct statshm_ent	*e, *p, zero;
+	uint64_t		b[STAT_LAT_NBUCKETS], n, d0, d1;
+	double			dt = 0;
+	char			t[5][32];
+	uint32_t		i;
+	int			k;
+
+	if (prev != NULL && cur->stamp_ns > prev->stamp_ns) {
+		dt = (cur->stamp_ns - prev->stamp_ns) / 1e9;
+	} else {
+		prev = NULL;
+	}
+	memset(&zero, 0, sizeof(zero));
+	printf("--- pid %" PRIu64 ", %u statistics", cur->pid, cur->nents);
+	if (cur->ndropped != 0) {
+		printf(" (%" PRIu64 " not published)", cur->ndropped);
+	}
+	if (prev != NULL) {
+		printf(", rates over %.2fs\n", dt);
+	} else {
+		printf(", totals\n");
+	}
+
+	for (i = 0; i < cur->nents; i++) {
+		e = &cur->e[i];
+		if ((p = find(prev, i, e)) == NULL) {
+			p = &zero;
+		}
+		d0 = e->v[0] - p->v[0];
+		d1 = e->v[1] - p->v[1];
+		switch (e->type) {
+		case STATSHM_U64:
+			printf("%-32s %14" PRIu64, e->name, e->v[0]);
+			if (prev != NULL) {
+				printf(" %12.1f/s", d0 / dt);
+			}
+			break;
+		case COUNTER:
+			printf("%-32s %14" PRIu64, e->name, e->v[0]);
+			if (prev != NULL) {
+				printf(" %12.1f/s", d0 / dt);
+			}
+			printf(" avg %.1f", d0 ? (double) d1 / d0 : 0.0);
+			break;
+		case QUEUE:
+			printf("%-32s depth %8" PRId64, e->name,
+					(int64_t) (e->v[0] - e->v[1]));
+			if (prev != NULL) {
+				printf(" %12.1f/s", d0 / dt);
+			}
+			break;
+		case RATIO:
+			printf("%-32s %13.2f%% of %" PRIu64, e->name,
+					d1 ? 100.0 * d0 / d1 : 0.0, d1);
+			if (prev != NULL) {
+				printf(" %12.1f/s", d1 / dt);
+			}
+			break;
+		case LATENCY:
+		case PROFILER:
+			for (n = 0, k = 0; k < STAT_LAT_NBUCKETS; k++) {
+				b[k] = e->lat_buckets[k] - p->lat_buckets[k];
+				n += b[k];
+			}
+			printf("%-32s %14" PRIu64, e->name, n);
+			if (prev != NULL) {
+				printf(" %12.1f/s", n / dt);
+			}
+			printf(" avg %s p50 %s p99 %s p99.9 %s max %s",
+				nsfmt(t[0], n ? (e->lat_total - p->lat_total) /
+					n : 0),
+				nsfmt(t[1], pct(b, n, e->lat_max, 50)),
+				nsfmt(t[2], pct(b, n, e->lat_max, 99)),
+				nsfmt(t[3], pct(b, n, e->lat_max, 99.9)),
+				nsfmt(t[4], e->lat_max));
+			break;
+		default:
+			printf("%-32s type %u", e->name, e->type);
+			break;
+		}
+		printf("\n");
+	}
+	fflush(stdout);
+}
+
+static void list(void)
+{
+	struct dirent	*d;
+	DIR		*dir;
+	int		pid, n = 0;
+
+	if ((dir = opendir("/dev/shm")) == NULL) {
+		perror("cbstat: /dev/shm");
+		return;
+	}
+	while ((d = readdir(dir)) != NULL) {
+		if (sscanf(d->d_name, "cbstat.%d", &pid) != 1) {
+			continue;
+		}
+		printf("%d%s\n", pid, kill(pid, 0) == 0 || errno == EPERM ?
+				"" : " (exited)");
+		n++;
+	}
+	closedir(dir);
+	if (n == 0) {
+		printf("no process publishes statistics\n");
+	}
+}
+
+static void usage(const char *s)
+{
+	fprintf(stderr, "Usage:\n");
+	fprintf(stderr, "%s\t\t\t\tlist publishing processes\n", s);
+	fprintf(stderr, "%s [-i <secs>] [-n <count>] <pid | /name>\n", s);
+	fprintf(stderr, "\t-i: seconds between reports (default 1)\n");
+	fprintf(stderr, "\t-n: stop after count reports\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct statshm_hdr	*cur, *prev, *tmp;
+	char			name[64];
+	int			interval = 1, count = -1, opt, n;
+
+	while ((opt = getopt(argc, argv, "i:n:h")) != -1) {
+		switch (opt) {
+		case 'i':
+			interval = atoi(optarg);
+			if (interval <= 0) {
+				usage(argv[0]);
+				return (EINVAL);
+			}
+			break;
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			return (opt == 'h' ? 0 : EINVAL);
+		}
+	}
+	if (optind == argc) {
+		list();
+		return (0);
+	}
+	if (argv[optind][0] == '/') {
+		snprintf(name, sizeof(name), "%s", argv[optind]);
+	} else {
+		snprintf(name, sizeof(name), "/cbstat.%d", atoi(argv[optind]));
+	}
+	if (attach(name) != 0) {
+		return (1);
+	}
+
+	cur = malloc(shmsize);
+	prev = malloc(shmsize);
+	assert(cur != NULL && prev != NULL);
+	for (n = 0; count < 0 || n < count; n++) {
+		if (n > 0) {
+			sleep(interval);
+		}
+		if (snapshot(cur) != 0) {
+			fprintf(stderr, "cbstat: %s: no consistent snapshot\n",
+					name);
+			return (1);
+		}
+		if (n > 0 && cur->npublish == prev->npublish &&
+		    kill(cur->pid, 0) != 0 && errno == ESRCH) {
+			fprintf(stderr, "cbstat: process %" PRIu64
+					" exited\n", cur->pid);
+			return (0);
+		}
+		report(cur, n > 0 ? prev : NULL);
+		tmp = prev;
+		prev = cur;
+		cur = tmp;
+	}
+	return (0);
+}
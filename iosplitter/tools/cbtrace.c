@@ -0,0 +1,208 @@
+/*
+ * cbtrace.c
+ *	per-stage latency breakdown of traced requests
+ *
+ *	cbtrace <file>...
+ *
+ * Reads the files trace_start() appends to, from any number of
+ * processes, and vmkernel logs holding the MPP's "cbtrace: " lines,
+ * groups the records by trace id and reports, for every pair of
+ * consecutive stages a request went through, the time between them.
+ * Stages recorded in different processes are only as comparable as their
+ * clocks; negative gaps are shown in the min column.
+ */
+
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+struct gaps {
+	int64_t		*v;
+	size_t		n;
+	size_t		max;
+};
+
+static struct trace_rec	*recs;
+static size_t		nrecs, maxrecs;
+static struct gaps	gaps[TR_NSTAGES][TR_NSTAGES];
+static struct gaps	total;
+
+static int stage_of(const char *name)
+{
+	int	i;
+
+	for (i = 0; i < TR_NSTAGES; i++) {
+		if (strcmp(trace_stage_name[i], name) == 0) {
+			return (i);
+		}
+	}
+	return (-1);
+}
+
+static int load(const char *fname)
+{
+	char		line[512], name[32], *l;
+	unsigned	id, tid;
+	uint64_t	ns;
+	FILE		*fp;
+	int		stage, bad = 0;
+
+	if ((fp = fopen(fname, "r")) == NULL) {
+		fprintf(stderr, "cbtrace: %s: %s\n", fname, strerror(errno));
+		return (-1);
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if ((l = strstr(line, "cbtrace: ")) != NULL) {
+			l += strlen("cbtrace: ");
+		} else if (isxdigit((unsigned char) line[0])) {
+			l = line;
+		} else {
+			continue;	/* other log lines */
+		}
+		if (l[0] == '#') {
+			continue;
+		}
+		if (sscanf(l, "%x %31s %" SCNu64 " %u", &id, name, &ns,
+				&tid) != 4 || (stage = stage_of(name)) < 0) {
+			bad++;
+			continue;
+		}
+		if (nrecs == maxrecs) {
+			maxrecs = maxrecs ? 2 * maxrecs : 65536;
+			recs = realloc(recs, maxrecs * sizeof(*recs));
+			assert(recs != NULL);
+		}
+		recs[nrecs].id = id;
+		recs[nrecs].stage = stage;
+		recs[nrecs].tid = tid;
+		recs[nrecs].ns = ns;
+		nrecs++;
+	}
+	fclose(fp);
+	if (bad != 0) {
+		fprintf(stderr, "cbtrace: %s: %d lines skipped\n", fname, bad);
+	}
+	return (0);
+}
+
+static int rec_cmp(const void *a, const void *b)
+{
+	const struct trace_rec	*x = a, *y = b;
+
+	if (x->id != y->id) {
+		return (x->id < y->id ? -1 : 1);
+	}
+	if (x->stage != y->stage) {
+		return (x->stage < y->stage ? -1 : 1);
+	}
+	return (x->ns < y->ns ? -1 : x->ns > y->ns);
+}
+
+static int gap_cmp(const void *a, const void *b)
+{
+	int64_t	x = *(const int64_t *) a, y = *(const int64_t *) b;
+
+	return (x < y ? -1 : x > y);
+}
+
+static void gap_add(struct gaps *g, int64_t v)
+{
+	if (g->n == g->max) {
+		g->max = g->max ? 2 * g->max : 1024;
+		g->v = realloc(g->v, g->max * sizeof(*g->v));
+		assert(g->v != NULL);
+	}
+	g->v[g->n++] = v;
+}
+
+static char *nsfmt(char *buf, int64_t ns)
+{
+	int64_t	a = ns < 0 ? -ns : ns;
+
+	if (a < 10000) {
+		sprintf(buf, "%" PRId64 "ns", ns);
+	} else if (a < 10000000) {
+		sprintf(buf, "%.1fus", ns / 1e3);
+	} else if (a < 10000000000LL) {
+		sprintf(buf, "%.1fms", ns / 1e6);
+	} else {
+		sprintf(buf, "%.1fs", ns / 1e9);
+	}
+	return (buf);
+}
+
+static void report(const char *from, const char *to, struct gaps *g)
+{
+	char		t[6][32];
+	double		sum = 0;
+	size_t		i;
+
+	if (g->n == 0) {
+		return;
+	}
+	qsort(g->v, g->n, sizeof(*g->v), gap_cmp);
+	for (i = 0; i < g->n; i++) {
+		sum += g->v[i];
+	}
+	printf("%-11s -> %-11s %8zu %9s %9s %9s %9s %9s %9s\n", from, to, g->n,
+		nsfmt(t[0], g->v[0]),
+		nsfmt(t[1], (int64_t) (sum / g->n)),
+		nsfmt(t[2], g->v[g->n / 2]),
+		nsfmt(t[3], g->v[g->n * 90 / 100]),
+		nsfmt(t[4], g->v[g->n * 99 / 100]),
+		nsfmt(t[5], g->v[g->n - 1]));
+}
+
+int main(int argc, char *argv[])
+{
+	struct trace_rec	*r, *e, *p;
+	size_t			ntraces = 0, nsingle = 0;
+	int			i, j;
+
+	if (argc < 2 || strcmp(argv[1], "-h") == 0) {
+		fprintf(stderr, "Usage: %s <file>...\n", argv[0]);
+		return (argc < 2 ? EINVAL : 0);
+	}
+	for (i = 1; i < argc; i++) {
+		if (load(argv[i]) != 0) {
+			return (1);
+		}
+	}
+	qsort(recs, nrecs, sizeof(*recs), rec_cmp);
+
+	for (r = recs; r < recs + nrecs; r = e) {
+		for (e = r + 1; e < recs + nrecs && e->id == r->id; e++)
+			;
+		ntraces++;
+		if (e - r < 2) {
+			nsingle++;
+			continue;
+		}
+		for (p = r; p + 1 < e; p++) {
+			if (p[1].stage != p->stage) {
+				gap_add(&gaps[p->stage][p[1].stage],
+					(int64_t) (p[1].ns - p->ns));
+			}
+		}
+		gap_add(&total, (int64_t) (e[-1].ns - r->ns));
+	}
+
+	printf("%zu records, %zu traces (%zu with one stage)\n", nrecs,
+			ntraces, nsingle);
+	printf("%-26s %8s %9s %9s %9s %9s %9s %9s\n", "stages", "count",
+			"min", "avg", "p50", "p90", "p99", "max");
+	for (i = 0; i < TR_NSTAGES; i++) {
+		for (j = i + 1; j < TR_NSTAGES; j++) {
+			report(trace_stage_name[i], trace_stage_name[j],
+					&gaps[i][j]);
+		}
+	}
+	report("first", "last", &total);
+	return (0);
+}
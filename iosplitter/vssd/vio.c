@@ -0,0 +1,1373 @@
+/*
+ * vio.c
+ *	vssd engine: a cache of HDD blocks on an SSD behind the vio_* API
+ *
+ * The SSD holds a super block, the metadata area (see vssd_meta.c) and
+ * nblocks BLKSZ data blocks. A data block caches one BLKSZ aligned HDD
+ * block, rmap finds the cache block of an HDD block.
+ *
+ * Writes are two phase. VIO_WRITEP1 writes the data to free cache blocks
+ * and records them under the transaction id, nothing is visible yet.
+ * VIO_COMMIT maps all blocks of the transaction at once, writes their
+ * metadata and returns when it is on the SSD; VIO_ABORT frees them. A
+ * crash before the metadata is written leaves the old mappings.
+ *
+ * A block that loses its mapping (overwrite, eviction, invalidation) goes
+ * to limbo. It is reused once the metadata batch not pointing at it any
+ * more is on the SSD and all reads that might have looked it up earlier
+ * are done.
+ *
+ * Blocks are allocated from a free stack. When it runs dry clean blocks
+ * are evicted in the order of an eviction hand sweeping the cache; dirty
+ * blocks, not yet written back to the HDD, are never evicted.
+ *
+ * The SSD is opened O_DIRECT | O_DSYNC: buffered, io_submit would do the
+ * write itself before returning. This way the data and journal writes of
+ * all tasks of the thread that attached a vssd are in flight at once, and
+ * a write is on the SSD when its task_aiorw returns. Buffers of data I/O
+ * must be VSSD_DIOALIGN aligned, vssd_bounce() copies those that are not.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "libtask/taskio.h"
+#include "vssd_int.h"
+
+#define VIO_MAXVSSD	64
+#define VIO_MAXHANDLES	256
+#define VSSD_TRANBUCKETS 1024
+
+enum vio_htype {
+	VH_FREE = 0,
+	VH_DEV,
+	VH_META,
+};
+
+struct vio_handle {
+	int		type;
+	vssd_t		*vs;
+	int		mode;		/* VH_META: enum vio_metamode */
+	uint64_t	pos;		/* VH_META: next cblk to report */
+};
+
+/* only the tables are shared between threads */
+static pthread_mutex_t		vio_lock = PTHREAD_MUTEX_INITIALIZER;
+static vssd_t			*vio_vssds[VIO_MAXVSSD];
+static struct vio_handle	vio_handles[VIO_MAXHANDLES];
+
+/*--------------------------- maps and allocation ---------------------------*/
+
+/* cache block of hddblk or -1 */
+static inline int64_t vssd_rmap_lookup(vssd_t *vs, uint64_t hddblk)
+{
+	uint32_t	c;
+
+	return (lbaindex_get(&vs->rmap, hddblk, &c) == 0 ? (int64_t) c : -1);
+}
+
+static void vssd_map(vssd_t *vs, uint64_t cblk, uint64_t hddblk, int dirty)
+{
+	/* sized for nblocks keys, it grows but cannot fail here */
+	lbaindex_insert(&vs->rmap, hddblk, cblk);
+	hbitmap_set(&vs->valid, cblk);
+	if (dirty) {
+		hbitmap_set(&vs->dirty, cblk);
+	}
+}
+
+/* invalidate the record of cblk, returns the metadata batch to wait for */
+static uint64_t vssd_limbo(vssd_t *vs, uint64_t cblk)
+{
+	struct vssd_limbo	*l;
+
+	l = &vs->limbo[vs->ltail++ % vs->nblocks];
+	l->cblk = cblk;
+	l->mgen = vssd_meta_set(vs, cblk, 0, 0);
+	l->rgen = ++vs->rgen;
+	return (l->mgen);
+}
+
+/* drop the mapping of cblk */
+static uint64_t vssd_unmap(vssd_t *vs, uint64_t cblk)
+{
+	lbaindex_remove(&vs->rmap, vs->meta[cblk].hddaddr / VSSD_SECPERBLK);
+	hbitmap_clear(&vs->valid, cblk);
+	hbitmap_clear(&vs->dirty, cblk);
+	return (vssd_limbo(vs, cblk));
+}
+
+static void vssd_free(vssd_t *vs, uint64_t cblk)
+{
+	assert(vs->nfree < vs->nblocks);
+	vs->freeblks[vs->nfree++] = cblk;
+}
+
+/*
+ * move blocks out of limbo, in the order they entered it; returns the
+ * number freed
+ */
+int vssd_reclaim(vssd_t *vs)
+{
+	struct vssd_limbo	*l;
+	struct vssd_read	*r;
+	int			n = 0;
+
+	while (vs->lhead != vs->ltail) {
+		l = &vs->limbo[vs->lhead % vs->nblocks];
+		if (l->mgen > vs->mdone) {
+			break;
+		}
+		if (!DLL_ISEMPTY(&vs->reads)) {
+			r = container_of(DLL_NEXT(&vs->reads), struct vssd_read,
+					list);
+			if (r->gen < l->rgen) {
+				break;
+			}
+		}
+		vssd_free(vs, l->cblk);
+		vs->lhead++;
+		n++;
+	}
+	return (n);
+}
+
+/* unmap up to n clean blocks, returns the number unmapped */
+static uint64_t vssd_evict(vssd_t *vs, uint64_t n)
+{
+	uint64_t	scanned = 0;
+	uint64_t	done = 0;
+	int64_t		c;
+
+	while (done < n && scanned < vs->nblocks) {
+		c = hbitmap_next(&vs->valid, vs->hand);
+		if (c < 0) {
+			if (vs->hand == 0) {
+				break;
+			}
+			scanned += vs->nblocks - vs->hand;
+			vs->hand = 0;
+			continue;
+		}
+		scanned += c - vs->hand + 1;
+		vs->hand = (c + 1) % vs->nblocks;
+		if (hbitmap_get(&vs->dirty, c)) {
+			continue;
+		}
+		vssd_unmap(vs, c);
+		done++;
+	}
+	vs->nevict += done;
+	return (done);
+}
+
+/*
+ * take n free blocks, waiting for limbo and evicting clean blocks as
+ * needed; they come off the stack in ascending order after a format, so
+ * most runs are contiguous
+ */
+static int vssd_alloc(vssd_t *vs, uint64_t n, struct vssd_p1 *p1)
+{
+	struct vssd_limbo	*l;
+	uint64_t		pending;
+	uint64_t		i;
+
+	if (n > vs->nblocks) {
+		return (VE_NOSPC);
+	}
+	while (vs->nfree < n) {
+		vssd_reclaim(vs);
+		if (vs->nfree >= n) {
+			break;
+		}
+		pending = vs->ltail - vs->lhead;
+		if (vs->nfree + pending < n &&
+				vssd_evict(vs, n - vs->nfree - pending) == 0 &&
+				pending == 0) {
+			return (VE_NOSPC);
+		}
+		if (vs->lhead == vs->ltail) {
+			continue;
+		}
+
+		/* the newest limbo entry needs this batch on the SSD */
+		l = &vs->limbo[(vs->ltail - 1) % vs->nblocks];
+		if (l->mgen > vs->mwant) {
+			vs->mwant = l->mgen;
+		}
+		taskwakeup(&vs->mkick);
+		tasksleep(&vs->mwait);
+	}
+	for (i = 0; i < n; i++) {
+		p1[i].cblk = vs->freeblks[--vs->nfree];
+	}
+	return (VE_OK);
+}
+
+/* run of blocks starting at p1[0] with adjacent cache block numbers */
+static int vssd_run(struct vssd_p1 *p1, int n)
+{
+	int	i;
+
+	for (i = 1; i < n && i < VSSD_MAXRUN; i++) {
+		if (p1[i].cblk != p1[0].cblk + i) {
+			break;
+		}
+	}
+	return (i);
+}
+
+/*------------------------------- reads -------------------------------------*/
+
+static void vssd_read_begin(vssd_t *vs, struct vssd_read *r)
+{
+	r->gen = vs->rgen;
+	DLL_REVADD(&vs->reads, &r->list);
+}
+
+static void vssd_read_end(vssd_t *vs, struct vssd_read *r)
+{
+	int	oldest = DLL_NEXT(&vs->reads) == &r->list;
+
+	DLL_REM(&r->list);
+	if (oldest && vs->lhead != vs->ltail && vssd_reclaim(vs) != 0) {
+		taskwakeupall(&vs->mwait);
+	}
+}
+
+/* buf itself if O_DIRECT can use it, else an aligned buffer of len */
+static char *vssd_bounce(char *buf, size_t len)
+{
+	char	*b;
+
+	if (((uintptr_t) buf & (VSSD_DIOALIGN - 1)) == 0) {
+		return (buf);
+	}
+	if (posix_memalign((void **) &b, BLKSZ, len) != 0) {
+		return (NULL);
+	}
+	return (b);
+}
+
+/*
+ * read sectors [hddaddr, hddaddr + sectors), all of them must be cached
+ * (and dirty if dirtyonly)
+ */
+static int vssd_read(vssd_t *vs, char *buf, hddaddr_t hddaddr, int sectors,
+		int dirtyonly)
+{
+	struct vssd_read	r;
+	uint64_t		first = hddaddr / VSSD_SECPERBLK;
+	uint64_t		nblk;
+	uint64_t		*cblk;
+	uint64_t		i;
+	uint64_t		j;
+	uint64_t		sec;
+	uint64_t		nsec;
+	ssize_t			ret;
+	char			*b;
+	int			rc = VE_OK;
+
+	if (sectors <= 0) {
+		return (VE_BADCMD);
+	}
+	nblk = (hddaddr + sectors + VSSD_SECPERBLK - 1) / VSSD_SECPERBLK -
+			first;
+	cblk = malloc(nblk * sizeof(*cblk));
+	if (cblk == NULL) {
+		return (VE_IOERR);
+	}
+
+	vs->nreads++;
+	for (i = 0; i < nblk; i++) {
+		int64_t	c = vssd_rmap_lookup(vs, first + i);
+
+		if (c < 0 || (dirtyonly && !hbitmap_get(&vs->dirty, c))) {
+			vs->nrdmiss++;
+			free(cblk);
+			return (VE_INVALID_BLK);
+		}
+		cblk[i] = c;
+	}
+	b = vssd_bounce(buf, (size_t) sectors * RPC_DSKBLKSZ);
+	if (b == NULL) {
+		free(cblk);
+		return (VE_IOERR);
+	}
+	vssd_read_begin(vs, &r);
+
+	/* runs of blocks adjacent on the SSD, sec is the next hdd sector */
+	sec = hddaddr;
+	for (i = 0; i < nblk; i = j) {
+		for (j = i + 1; j < nblk && j - i < VSSD_MAXRUN; j++) {
+			if (cblk[j] != cblk[i] + j - i) {
+				break;
+			}
+		}
+		nsec = (first + j) * VSSD_SECPERBLK - sec;
+		if (sec + nsec > hddaddr + sectors) {
+			nsec = hddaddr + sectors - sec;
+		}
+		rc = task_aiorw(vs->fd, b + (sec - hddaddr) * RPC_DSKBLKSZ,
+				nsec * RPC_DSKBLKSZ, vs->dataoff +
+				cblk[i] * BLKSZ + (sec - (first + i) *
+				VSSD_SECPERBLK) * RPC_DSKBLKSZ,
+				TASKIO_READ, &ret);
+		if (rc != 0 || ret != (ssize_t) (nsec * RPC_DSKBLKSZ)) {
+			rc = VE_IOERR;
+			break;
+		}
+		sec += nsec;
+	}
+	vs->nrdblks += nblk;
+
+	vssd_read_end(vs, &r);
+	if (b != buf) {
+		if (rc == VE_OK) {
+			memcpy(buf, b, (size_t) sectors * RPC_DSKBLKSZ);
+		}
+		free(b);
+	}
+	free(cblk);
+	return (rc);
+}
+
+/*---------------------------- transactions ---------------------------------*/
+
+static int vssd_tran_cmp(hash_entry_t *h, void *opaque)
+{
+	struct vssd_tran	*t = container_of(h, struct vssd_tran, h_entry);
+
+	return (t->tranid == *(tranid_t *) opaque);
+}
+
+static struct vssd_tran *vssd_tran_get(vssd_t *vs, tranid_t tranid,
+		int create)
+{
+	struct vssd_tran	*t;
+	hash_entry_t		*h;
+	int			b = tranid % VSSD_TRANBUCKETS;
+
+	if (hash_lookup(&vs->trans, b, &h, &tranid) == 0) {
+		return (container_of(h, struct vssd_tran, h_entry));
+	}
+	if (!create) {
+		return (NULL);
+	}
+	t = calloc(1, sizeof(*t));
+	if (t == NULL) {
+		return (NULL);
+	}
+	hash_entry_init(&t->h_entry);
+	t->tranid = tranid;
+	hash_add(&vs->trans, &t->h_entry, b);
+	return (t);
+}
+
+static int vssd_tran_append(struct vssd_tran *t, struct vssd_p1 *p1, int n)
+{
+	struct vssd_p1	*np;
+	int		max;
+
+	if (t->n + n > t->max) {
+		max = t->max ? t->max : 8;
+		while (max < t->n + n) {
+			max *= 2;
+		}
+		np = realloc(t->p1, max * sizeof(*np));
+		if (np == NULL) {
+			return (-1);
+		}
+		t->p1  = np;
+		t->max = max;
+	}
+	memcpy(t->p1 + t->n, p1, n * sizeof(*p1));
+	t->n += n;
+	return (0);
+}
+
+static void vssd_tran_free(vssd_t *vs, struct vssd_tran *t)
+{
+	hash_rem(&vs->trans, &t->h_entry);
+	free(t->p1);
+	free(t);
+}
+
+static int vssd_writep1(vssd_t *vs, vio_writep1_t *vwp, char *buf)
+{
+	struct vssd_tran	*t;
+	struct vssd_p1		*p1;
+	uint64_t		first = vwp->addr / VSSD_SECPERBLK;
+	uint64_t		n = vwp->len / VSSD_SECPERBLK;
+	uint64_t		i;
+	uint16_t		flags;
+	ssize_t			ret;
+	char			*b;
+	int			run;
+	int			rc;
+
+	if (vwp->addr % VSSD_SECPERBLK != 0 || vwp->len % VSSD_SECPERBLK != 0 ||
+			n == 0) {
+		return (VE_BADCMD);
+	}
+	p1 = malloc(n * sizeof(*p1));
+	b = vssd_bounce(buf, n * BLKSZ);
+	if (p1 == NULL || b == NULL) {
+		if (b != buf) {
+			free(b);
+		}
+		free(p1);
+		return (VE_IOERR);
+	}
+	rc = vssd_alloc(vs, n, p1);
+	if (rc != VE_OK) {
+		if (b != buf) {
+			free(b);
+		}
+		free(p1);
+		return (rc);
+	}
+	if (b != buf) {
+		memcpy(b, buf, n * BLKSZ);
+	}
+
+	flags = VM_VALID | (vwp->flags & VIO_MARK_DIRTY ? VM_DIRTY : 0);
+	for (i = 0; i < n; i++) {
+		p1[i].hddblk = first + i;
+		p1[i].flags  = flags;
+	}
+	for (i = 0; i < n; i += run) {
+		run = vssd_run(p1 + i, n - i);
+		rc = task_aiorw(vs->fd, b + i * BLKSZ, run * BLKSZ,
+				vs->dataoff + p1[i].cblk * BLKSZ, TASKIO_WRITE,
+				&ret);
+		if (rc != 0 || ret != run * BLKSZ) {
+			rc = VE_IOERR;
+			break;
+		}
+	}
+
+	/* the transaction may have been committed meanwhile, start a new one */
+	if (rc == 0 && ((t = vssd_tran_get(vs, vwp->tranid, 1)) == NULL ||
+			vssd_tran_append(t, p1, n) != 0)) {
+		rc = VE_IOERR;
+	}
+	if (rc != 0) {
+		for (i = 0; i < n; i++) {
+			vssd_free(vs, p1[i].cblk);
+		}
+	} else {
+		vs->nwrites++;
+		vs->nwrblks += n;
+	}
+	if (b != buf) {
+		free(b);
+	}
+	free(p1);
+	return (rc);
+}
+
+static int vssd_commit(vssd_t *vs, tranid_t tranid, enum viocommit mode)
+{
+	struct vssd_tran	*t;
+	struct vssd_p1		*p;
+	uint64_t		gen = 0;
+	int64_t			old;
+	int			i;
+
+	t = vssd_tran_get(vs, tranid, 0);
+	if (t == NULL) {
+		return (mode == VIOCOMMIT ? VE_BADCMD : VE_OK);
+	}
+	if (mode != VIOCOMMIT) {
+		for (i = 0; i < t->n; i++) {
+			vssd_free(vs, t->p1[i].cblk);
+		}
+		vssd_tran_free(vs, t);
+		vs->naborts++;
+		return (VE_OK);
+	}
+
+	/* no task switch until every block is mapped */
+	for (i = 0; i < t->n; i++) {
+		p = &t->p1[i];
+		old = vssd_rmap_lookup(vs, p->hddblk);
+		if (old >= 0) {
+			vssd_unmap(vs, old);
+		}
+		gen = vssd_meta_set(vs, p->cblk, p->hddblk * VSSD_SECPERBLK,
+				p->flags);
+		vssd_map(vs, p->cblk, p->hddblk, p->flags & VM_DIRTY);
+	}
+	vssd_tran_free(vs, t);
+	vs->ncommits++;
+
+	vssd_meta_wait(vs, gen);
+	return (VE_OK);
+}
+
+static int vssd_mark(vssd_t *vs, hddaddr_t hddaddr, int dirty)
+{
+	uint64_t	hddblk = hddaddr / VSSD_SECPERBLK;
+	int64_t		c;
+
+	c = vssd_rmap_lookup(vs, hddblk);
+	if (c < 0) {
+		return (VE_INVALID_BLK);
+	}
+	if (dirty) {
+		hbitmap_set(&vs->dirty, c);
+	} else {
+		hbitmap_clear(&vs->dirty, c);
+	}
+	vssd_meta_wait(vs, vssd_meta_set(vs, c, hddblk * VSSD_SECPERBLK,
+			VM_VALID | (dirty ? VM_DIRTY : 0)));
+	return (VE_OK);
+}
+
+/*------------------------------- handles -----------------------------------*/
+
+static devhandle_t vio_handle_alloc(vssd_t *vs, int type)
+{
+	int	i;
+
+	pthread_mutex_lock(&vio_lock);
+	for (i = 0; i < VIO_MAXHANDLES; i++) {
+		if (vio_handles[i].type == VH_FREE) {
+			memset(&vio_handles[i], 0, sizeof(vio_handles[i]));
+			vio_handles[i].type = type;
+			vio_handles[i].vs   = vs;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&vio_lock);
+	return (i < VIO_MAXHANDLES ? i + 1 : 0);
+}
+
+static struct vio_handle *vio_handle(devhandle_t h, int type)
+{
+	if (h == 0 || h > VIO_MAXHANDLES || vio_handles[h - 1].type != type) {
+		return (NULL);
+	}
+	return (&vio_handles[h - 1]);
+}
+
+static void vio_handle_free(struct vio_handle *vh)
+{
+	pthread_mutex_lock(&vio_lock);
+	vh->type = VH_FREE;
+	vh->vs   = NULL;
+	pthread_mutex_unlock(&vio_lock);
+}
+
+vssd_t *vio_vssd(devhandle_t h)
+{
+	struct vio_handle	*vh = vio_handle(h, VH_DEV);
+
+	return (vh == NULL ? NULL : vh->vs);
+}
+
+int vio_open(cdevid_t cdevid, vssdid_t vssdid, enum rflag r, devhandle_t *hp)
+{
+	vssd_t	*vs = NULL;
+	int	i;
+
+	pthread_mutex_lock(&vio_lock);
+	for (i = 0; i < VIO_MAXVSSD; i++) {
+		if (vio_vssds[i] != NULL && vio_vssds[i]->vssdid == vssdid &&
+				vio_vssds[i]->cdevid == cdevid &&
+				!vio_vssds[i]->closing) {
+			vs = vio_vssds[i];
+			break;
+		}
+	}
+	pthread_mutex_unlock(&vio_lock);
+	if (vs == NULL) {
+		return (VE_OPEN);
+	}
+
+	*hp = vio_handle_alloc(vs, VH_DEV);
+	if (*hp == 0) {
+		return (VE_NFILE);
+	}
+	vs->nopen++;
+	return (VE_OK);
+}
+
+int vio_close(devhandle_t h)
+{
+	struct vio_handle	*vh = vio_handle(h, VH_DEV);
+
+	if (vh == NULL) {
+		return (VE_BADCMD);
+	}
+	vh->vs->nopen--;
+	vio_handle_free(vh);
+	return (VE_OK);
+}
+
+int vio_writep1(devhandle_t handle, vio_writep1_t *vwp, char *buf)
+{
+	vssd_t	*vs = vio_vssd(handle);
+
+	if (vs == NULL) {
+		return (VE_BADCMD);
+	}
+	return (vssd_writep1(vs, vwp, buf));
+}
+
+int vio_commit(devhandle_t handle, tranid_t tranid, enum viocommit mode)
+{
+	vssd_t	*vs = vio_vssd(handle);
+
+	if (vs == NULL || mode < VIOCOMMIT || mode > VIODONE) {
+		return (VE_BADCMD);
+	}
+	return (vssd_commit(vs, tranid, mode));
+}
+
+err_t vio_read(devhandle_t h, char *buf, hddaddr_t hddaddr, int sectors)
+{
+	vssd_t	*vs = vio_vssd(h);
+
+	if (vs == NULL) {
+		return (VE_BADCMD);
+	}
+	return (vssd_read(vs, buf, hddaddr, sectors, 0));
+}
+
+/*
+ * fill buf with records of the blocks after the cursor, returns the bytes
+ * filled, 0 at the end
+ */
+static uint32_t vio_metanext(struct vio_handle *vh, char *buf, uint32_t size)
+{
+	vssd_t		*vs = vh->vs;
+	hbitmap_t	*hb;
+	size_t		rsz;
+	uint32_t	done = 0;
+	int64_t		c;
+
+	if (vh->mode == VIO_DIRTYDATA) {
+		hb  = &vs->dirty;
+		rsz = sizeof(vio_metadirty_t);
+	} else {
+		hb  = &vs->valid;
+		rsz = sizeof(vio_meta_t);
+	}
+	while (done + rsz <= size && vh->pos < vs->nblocks) {
+		c = hbitmap_next(hb, vh->pos);
+		if (c < 0) {
+			vh->pos = vs->nblocks;
+			break;
+		}
+		if (vh->mode == VIO_DIRTYDATA) {
+			((vio_metadirty_t *) (buf + done))->hddaddr =
+					vs->meta[c].hddaddr;
+		} else {
+			memcpy(buf + done, &vs->meta[c], rsz);
+		}
+		done += rsz;
+		vh->pos = c + 1;
+	}
+	return (done);
+}
+
+int vio_request(vio_req_t *reqp)
+{
+	struct vio_handle	*vh;
+	vssd_t			*vs;
+
+	switch (reqp->type) {
+	case VIO_OPEN:
+		return (vio_open(reqp->u.open.cdevid, reqp->u.open.vssdid,
+				REMOTE_OK, &reqp->handle));
+	case VIO_CLOSE:
+		return (vio_close(reqp->handle));
+	case VIO_WRITEP1:
+		return (vio_writep1(reqp->handle, &reqp->u.writep1, reqp->buf));
+	case VIO_READ:
+		return (vio_read(reqp->handle, reqp->buf, reqp->u.read.addr,
+				reqp->u.read.len));
+	case VIO_COMMIT:
+		return (vio_commit(reqp->handle, reqp->u.commit.tranid,
+				reqp->u.commit.mode));
+	case VIO_ABORT:
+		return (vio_commit(reqp->handle, reqp->u.commit.tranid,
+				VIOABORT));
+	case VIO_DONE:
+		return (vio_commit(reqp->handle, reqp->u.commit.tranid,
+				VIODONE));
+	case VIO_METAOPEN:
+	case VIO_METACLOSE:
+	case VIO_METANEXT:
+	case VIO_METASET:
+	case VIO_READDIRTY:
+	case VIO_MARK:
+		break;
+	default:
+		return (VE_BADCMD);
+	}
+
+	vs = vio_vssd(reqp->handle);
+	if (vs == NULL) {
+		return (VE_BADCMD);
+	}
+	switch (reqp->type) {
+	case VIO_READDIRTY:
+		return (vssd_read(vs, reqp->buf, reqp->u.readdirty.addr,
+				reqp->u.readdirty.len, 1));
+	case VIO_MARK:
+		return (vssd_mark(vs, reqp->u.mark.addr,
+				reqp->u.mark.flags == VIO_MARK_DIRTY));
+	case VIO_METAOPEN:
+		if (reqp->u.metaopenclose.mode != VIO_DIRTYDATA &&
+				reqp->u.metaopenclose.mode != VIO_ALLDATA) {
+			return (VE_BADCMD);
+		}
+		reqp->u.metaopenclose.metahandle = vio_handle_alloc(vs,
+				VH_META);
+		if (reqp->u.metaopenclose.metahandle == 0) {
+			return (VE_NFILE);
+		}
+		vh = vio_handle(reqp->u.metaopenclose.metahandle, VH_META);
+		vh->mode = reqp->u.metaopenclose.mode;
+		return (VE_OK);
+	}
+
+	/* metahandle is the first member of all three */
+	vh = vio_handle(reqp->u.metanext.metahandle, VH_META);
+	if (vh == NULL || vh->vs != vs) {
+		return (VE_BADCMD);
+	}
+	switch (reqp->type) {
+	case VIO_METACLOSE:
+		vio_handle_free(vh);
+		return (VE_OK);
+	case VIO_METANEXT:
+		reqp->u.metanext.bufsize = vio_metanext(vh, reqp->buf,
+				reqp->u.metanext.bufsize);
+		return (VE_OK);
+	case VIO_METASET: {
+		/* continue the walk at the block caching hddaddr */
+		int64_t	c = vssd_rmap_lookup(vs, reqp->u.metaset.hddaddr /
+				VSSD_SECPERBLK);
+
+		if (c < 0) {
+			return (VE_INVALID_BLK);
+		}
+		vh->pos = c;
+		return (VE_OK);
+	}
+	}
+	return (VE_BADCMD);
+}
+
+/*------------------------- invalidation and flush --------------------------*/
+
+/* hand the cached block cblk of hddblk to cb */
+static err_t vssd_flushblk(vssd_t *vs, uint64_t cblk, uint64_t hddblk,
+		char *buf, cache_flush_fn_t cb, void *opaque)
+{
+	struct vssd_read	r;
+	ssize_t			ret;
+	int			rc;
+
+	vssd_read_begin(vs, &r);
+	rc = task_aiorw(vs->fd, buf, BLKSZ, vs->dataoff + cblk * BLKSZ,
+			TASKIO_READ, &ret);
+	vssd_read_end(vs, &r);
+	if (rc != 0 || ret != BLKSZ) {
+		return (ERR);
+	}
+	return (cb(buf, BLKSZ, hddblk * BLKSZ, opaque));
+}
+
+/*
+ * drop the block caching hddaddr, writing it through cb first if it is
+ * dirty
+ */
+err_t voi_mark_invl(vssd_t *vs, tranid_t tid, hddaddr_t hddaddr,
+		cache_flush_fn_t cb, void *opaque)
+{
+	uint64_t	hddblk = hddaddr / VSSD_SECPERBLK;
+	char		*buf;
+	int64_t		c;
+	err_t		rc = OK;
+
+	c = vssd_rmap_lookup(vs, hddblk);
+	if (c < 0) {
+		return (OK);
+	}
+	if (hbitmap_get(&vs->dirty, c) && cb != NULL) {
+		if (posix_memalign((void **) &buf, BLKSZ, BLKSZ) != 0) {
+			return (ERR);
+		}
+		rc = vssd_flushblk(vs, c, hddblk, buf, cb, opaque);
+		free(buf);
+		if (rc != OK) {
+			return (rc);
+		}
+		/* may have been rewritten meanwhile */
+		c = vssd_rmap_lookup(vs, hddblk);
+		if (c < 0) {
+			return (OK);
+		}
+	}
+	vssd_meta_wait(vs, vssd_unmap(vs, c));
+	return (OK);
+}
+
+/* write every dirty block through cb and mark it clean */
+err_t voi_flush(vssd_t *vs, cache_flush_fn_t cb, void *opaque)
+{
+	uint64_t	hddblk;
+	uint64_t	gen = 0;
+	uint64_t	pos = 0;
+	char		*buf;
+	int64_t		c;
+	err_t		rc = OK;
+
+	if (posix_memalign((void **) &buf, BLKSZ, BLKSZ) != 0) {
+		return (ERR);
+	}
+	while ((c = hbitmap_next(&vs->dirty, pos)) >= 0) {
+		pos = c + 1;
+		hddblk = vs->meta[c].hddaddr / VSSD_SECPERBLK;
+		rc = vssd_flushblk(vs, c, hddblk, buf, cb, opaque);
+		if (rc != OK) {
+			break;
+		}
+		/* a commit replacing the block moved it to another cblk */
+		if (vssd_rmap_lookup(vs, hddblk) == c &&
+				hbitmap_get(&vs->dirty, c)) {
+			hbitmap_clear(&vs->dirty, c);
+			gen = vssd_meta_set(vs, c, hddblk * VSSD_SECPERBLK,
+					VM_VALID);
+		}
+	}
+	free(buf);
+	vssd_meta_wait(vs, gen);
+	return (rc);
+}
+
+void vssd_stats_display(int ssd_id, vssd_t *vs)
+{
+	printf("vssd %d (%lu): %lu blocks, %lu valid, %lu dirty, %lu free, "
+			"%lu in limbo\n", ssd_id, vs->vssdid, vs->nblocks,
+			hbitmap_count(&vs->valid), hbitmap_count(&vs->dirty),
+			vs->nfree, vs->ltail - vs->lhead);
+	printf("\treads %lu (%lu blocks, %lu misses) writes %lu (%lu blocks) "
+			"commits %lu aborts %lu evictions %lu\n", vs->nreads,
+			vs->nrdblks, vs->nrdmiss, vs->nwrites, vs->nwrblks,
+			vs->ncommits, vs->naborts, vs->nevict);
+	printf("\tmetadata batches %lu (%.1f commits/batch), %lu journal "
+			"blocks, %lu checkpoints (%lu pages)\n", vs->nmetabatch,
+			vs->nmetabatch ? (double) vs->ncommits /
+			vs->nmetabatch : 0.0, vs->njblocks, vs->ncheckpoints,
+			vs->nmetapages);
+}
+
+/*---------------------------- attach, detach -------------------------------*/
+
+/*
+ * in core state from the metadata; of two records for the same hddaddr
+ * the one with the smaller cookie is reset and its block kept in limbo
+ * until that is on the SSD
+ */
+static int vssd_rebuild(vssd_t *vs)
+{
+	vio_meta_t	*m;
+	uint64_t	hddblk;
+	uint64_t	c;
+	uint64_t	i;
+	int64_t		o;
+
+	vs->cseq = 0;
+	for (c = 0; c < vs->nblocks; c++) {
+		m = &vs->meta[c];
+		if (!(m->flags & VM_VALID)) {
+			continue;
+		}
+		if (vssd_cookie(&m->cookie) > vs->cseq) {
+			vs->cseq = vssd_cookie(&m->cookie);
+		}
+		hddblk = m->hddaddr / VSSD_SECPERBLK;
+		o = vssd_rmap_lookup(vs, hddblk);
+		if (o >= 0) {
+			if (vssd_cookie(&vs->meta[o].cookie) >
+					vssd_cookie(&m->cookie)) {
+				vssd_limbo(vs, c);
+				continue;
+			}
+			vssd_unmap(vs, o);
+		}
+		vssd_map(vs, c, hddblk, m->flags & VM_DIRTY);
+	}
+
+	/* pushed in reverse, so they are popped in ascending order */
+	for (i = vs->lhead; i != vs->ltail; i++) {
+		hbitmap_set(&vs->valid, vs->limbo[i % vs->nblocks].cblk);
+	}
+	for (c = vs->nblocks; c-- > 0; ) {
+		if (!hbitmap_get(&vs->valid, c)) {
+			vssd_free(vs, c);
+		}
+	}
+	for (i = vs->lhead; i != vs->ltail; i++) {
+		hbitmap_clear(&vs->valid, vs->limbo[i % vs->nblocks].cblk);
+	}
+	return (0);
+}
+
+static void vssd_destroy(vssd_t *vs)
+{
+	if (vs->rmap.cur != NULL) {
+		lbaindex_deinit(&vs->rmap);
+	}
+	if (vs->trans.buckets != NULL) {
+		hash_deinit(&vs->trans);
+	}
+	hbitmap_deinit(&vs->valid);
+	hbitmap_deinit(&vs->dirty);
+	hbitmap_deinit(&vs->mdirty);
+	vssd_meta_unload(vs);
+	free(vs->freeblks);
+	free(vs->limbo);
+	if (vs->fd >= 0) {
+		close(vs->fd);
+	}
+	free(vs);
+}
+
+static int vssd_setup(vssd_t *vs)
+{
+	/* cache block numbers are 32 bit in rmap */
+	if (vs->nblocks > UINT32_MAX) {
+		return (-1);
+	}
+	vs->freeblks = malloc(vs->nblocks * sizeof(*vs->freeblks));
+	vs->limbo    = malloc(vs->nblocks * sizeof(*vs->limbo));
+	if (vs->freeblks == NULL || vs->limbo == NULL) {
+		return (-1);
+	}
+	if (lbaindex_init(&vs->rmap, vs->nblocks) != 0 ||
+			hash_init(&vs->trans, VSSD_TRANBUCKETS,
+			vssd_tran_cmp) != 0) {
+		return (-1);
+	}
+	if (hbitmap_init(&vs->valid, vs->nblocks) != 0 ||
+			hbitmap_init(&vs->dirty, vs->nblocks) != 0 ||
+			hbitmap_init(&vs->mdirty, vs->npages) != 0) {
+		return (-1);
+	}
+	DLL_INIT(&vs->reads);
+	return (0);
+}
+
+int vssd_attach(vssdid_t vssdid, cdevid_t cdevid, const char *path)
+{
+	struct vssd_super	*sb;
+	vssd_t			*vs;
+	off_t			size;
+	int			format;
+	int			slot = -1;
+	int			rc = VE_OK;
+	int			i;
+
+	pthread_mutex_lock(&vio_lock);
+	for (i = 0; i < VIO_MAXVSSD; i++) {
+		if (vio_vssds[i] != NULL && vio_vssds[i]->vssdid == vssdid) {
+			pthread_mutex_unlock(&vio_lock);
+			return (VE_EXIST);
+		}
+		if (vio_vssds[i] == NULL && slot < 0) {
+			slot = i;
+		}
+	}
+	if (slot < 0) {
+		pthread_mutex_unlock(&vio_lock);
+		return (VE_NFILE);
+	}
+	vs = calloc(1, sizeof(*vs));
+	if (vs == NULL) {
+		pthread_mutex_unlock(&vio_lock);
+		return (VE_NFILE);
+	}
+	/* reserve the slot, vio_open skips closing vssds */
+	vs->vssdid  = vssdid;
+	vs->cdevid  = cdevid;
+	vs->closing = 1;
+	vio_vssds[slot] = vs;
+	pthread_mutex_unlock(&vio_lock);
+
+	sb = NULL;
+	vs->fd = open(path, O_RDWR | O_DIRECT | O_DSYNC);
+	if (vs->fd < 0) {
+		rc = VE_OPEN;
+		goto out;
+	}
+	if (posix_memalign((void **) &sb, BLKSZ, BLKSZ) != 0) {
+		rc = VE_OPEN;
+		goto out;
+	}
+	if (pread(vs->fd, sb, BLKSZ, 0) != BLKSZ) {
+		memset(sb, 0, BLKSZ);
+	}
+
+	if (sb->magic == VSSD_MAGIC && sb->version == VSSD_VERSION) {
+		if (sb->vssdid != vssdid || sb->cdevid != cdevid) {
+			rc = VE_EXIST;
+			goto out;
+		}
+		format = 0;
+		rc = vssd_meta_layout(vs, sb, 0);
+	} else {
+		size = lseek(vs->fd, 0, SEEK_END);
+		format = 1;
+		rc = vssd_meta_layout(vs, NULL, size < 0 ? 0 : size / BLKSZ);
+	}
+	if (rc != 0) {
+		rc = VE_ELSEEK;
+		goto out;
+	}
+	if (vssd_setup(vs) != 0 || (format && vssd_meta_format(vs) != 0) ||
+			vssd_meta_load(vs) != 0 || vssd_rebuild(vs) != 0) {
+		rc = VE_METAIOERR;
+		goto out;
+	}
+	vs->closing = 0;
+	vssd_meta_start(vs);
+
+out:
+	free(sb);
+	if (rc != VE_OK) {
+		pthread_mutex_lock(&vio_lock);
+		vio_vssds[slot] = NULL;
+		pthread_mutex_unlock(&vio_lock);
+		vssd_destroy(vs);
+	}
+	return (rc);
+}
+
+/* from a task of the thread that attached it, once nothing uses it */
+int vssd_detach(vssdid_t vssdid)
+{
+	struct vssd_tran	*t;
+	vssd_t			*vs = NULL;
+	int			i;
+	int			b;
+
+	pthread_mutex_lock(&vio_lock);
+	for (i = 0; i < VIO_MAXVSSD; i++) {
+		if (vio_vssds[i] != NULL && vio_vssds[i]->vssdid == vssdid &&
+				!vio_vssds[i]->closing) {
+			vs = vio_vssds[i];
+			break;
+		}
+	}
+	if (vs == NULL || vs->nopen != 0) {
+		pthread_mutex_unlock(&vio_lock);
+		return (vs == NULL ? VE_OPEN : VE_EXIST);
+	}
+	vs->closing = 1;
+	pthread_mutex_unlock(&vio_lock);
+
+	/* transactions never committed */
+	for (b = 0; b < VSSD_TRANBUCKETS; b++) {
+		while (!DLL_ISEMPTY(&vs->trans.buckets[b])) {
+			t = container_of(DLL_NEXT(&vs->trans.buckets[b]),
+					struct vssd_tran, h_entry.list);
+			vssd_tran_free(vs, t);
+		}
+	}
+	vssd_meta_stop(vs);
+
+	pthread_mutex_lock(&vio_lock);
+	vio_vssds[i] = NULL;
+	pthread_mutex_unlock(&vio_lock);
+	vssd_destroy(vs);
+	return (VE_OK);
+}
+
+#ifdef SOLOTEST_VIO
+
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+/*
+ * A child process runs NTASKS tasks that write, commit (or abort), read
+ * back and mark random blocks of their own HDD range through a vssd on a
+ * scratch file small enough to force evictions, and then exits without a
+ * detach, like a crash. Committed data goes to a shadow shared with the
+ * parent, which attaches again, replaying the metadata journal, checks
+ * every mapped block against the shadow, flushes, detaches and checks the
+ * clean attach the same way.
+ *
+ *	cc -DSOLOTEST_VIO -I.. -I../include vio.c vssd_meta.c \
+ *		../common/hash.c ../common/hbitmap.c ../common/lbaindex.c \
+ *		-L../libtask -ltask -laio -lpthread
+ */
+#define NTASKS	64
+#define NOPS	400
+#define RANGE	256		/* hdd blocks per task */
+#define MAXLEN	8		/* blocks per write */
+#define SSDSZ	(NTASKS * RANGE * BLKSZ / 2)
+
+static char	*shadow;	/* shared, ndirty at the end */
+static uint64_t	*ndirty;
+static int	ndone;
+static Rendez	alldone;
+static uint64_t	nops;
+
+static void solo_fill(char *b, uint64_t hddblk, unsigned v)
+{
+	unsigned	*p = (unsigned *) b;
+	int		i;
+
+	for (i = 0; i < BLKSZ / sizeof(*p); i++) {
+		p[i] = v ^ (hddblk << 12) ^ i;
+	}
+}
+
+static void solo_task(void *arg)
+{
+	int		i = (uintptr_t) arg;
+	unsigned	seed = i;
+	devhandle_t	h;
+	vio_writep1_t	w;
+	vio_req_t	req;
+	uint64_t	b;
+	uint64_t	k;
+	uint64_t	n;
+	char		*buf;
+	int		op;
+	int		rc;
+
+	rc = vio_open(2, 1, REMOTE_OK, &h);
+	assert(rc == VE_OK);
+	buf = malloc(MAXLEN * BLKSZ);
+	assert(buf != NULL);
+
+	for (op = 0; op < NOPS; op++) {
+		b = (uint64_t) i * RANGE + rand_r(&seed) % (RANGE - MAXLEN);
+		n = 1 + rand_r(&seed) % MAXLEN;
+		for (k = 0; k < n; k++) {
+			solo_fill(buf + k * BLKSZ, b + k, rand_r(&seed));
+		}
+		w.tranid = ((uint64_t) i << 32) | op;
+		w.addr   = b * VSSD_SECPERBLK;
+		w.len    = n * VSSD_SECPERBLK;
+		w.flags  = rand_r(&seed) % 2 ? VIO_MARK_DIRTY : 0;
+		rc = vio_writep1(h, &w, buf);
+		if (rc == VE_NOSPC) {
+			continue;
+		}
+		assert(rc == VE_OK);
+		if (rand_r(&seed) % 8 == 0) {
+			rc = vio_commit(h, w.tranid, VIOABORT);
+			assert(rc == VE_OK);
+			continue;
+		}
+		rc = vio_commit(h, w.tranid, VIOCOMMIT);
+		assert(rc == VE_OK);
+		memcpy(shadow + b * BLKSZ, buf, n * BLKSZ);
+		nops++;
+
+		/* sectors straddling blocks, the data may be evicted already */
+		memset(buf, 0, MAXLEN * BLKSZ);
+		rc = vio_read(h, buf, w.addr + 3, w.len - 5);
+		assert(rc == VE_OK || rc == VE_INVALID_BLK);
+		if (rc == VE_OK) {
+			assert(memcmp(buf, shadow + b * BLKSZ + 3 * 512,
+					n * BLKSZ - 5 * 512) == 0);
+		}
+
+		memset(&req, 0, sizeof(req));
+		req.handle       = h;
+		req.type         = VIO_MARK;
+		req.u.mark.addr  = w.addr;
+		req.u.mark.flags = VIO_MARK_CLEAN;
+		rc = vio_request(&req);
+		assert(rc == VE_OK || rc == VE_INVALID_BLK);
+	}
+	free(buf);
+	vio_close(h);
+
+	if (++ndone == NTASKS) {
+		taskwakeup(&alldone);
+	}
+}
+
+static err_t solo_flush(char *buf, size_t size, uint64_t hdd_off,
+		void *opaque)
+{
+	assert(memcmp(buf, shadow + hdd_off, size) == 0);
+	(*(int *) opaque)++;
+	return (OK);
+}
+
+static void solo_crash(void *arg)
+{
+	struct timeval	t0;
+	struct timeval	t1;
+	devhandle_t	h;
+	int		rc;
+	int		i;
+
+	rc = taskio_init();
+	assert(rc == 0);
+	taskio_start();
+
+	rc = vssd_attach(1, 2, arg);
+	assert(rc == VE_OK);
+
+	gettimeofday(&t0, NULL);
+	for (i = 0; i < NTASKS; i++) {
+		taskcreate(solo_task, (void *) (uintptr_t) i, 32 * 1024);
+	}
+	tasksleep(&alldone);
+	gettimeofday(&t1, NULL);
+	printf("%lu commits in %.3f s\n", nops, (t1.tv_sec - t0.tv_sec) +
+			(t1.tv_usec - t0.tv_usec) / 1e6);
+
+	rc = vio_open(2, 1, REMOTE_OK, &h);
+	assert(rc == VE_OK);
+	vssd_stats_display(0, vio_vssd(h));
+	*ndirty = hbitmap_count(&vio_vssd(h)->dirty);
+	fflush(stdout);
+	_exit(0);
+}
+
+/* attach, every mapped block must match the shadow */
+static devhandle_t solo_check(char *path, int clean)
+{
+	struct timeval	t0;
+	struct timeval	t1;
+	vio_req_t	req;
+	devhandle_t	h;
+	char		*buf;
+	char		*rbuf;
+	uint32_t	off;
+	uint64_t	nchecked = 0;
+	uint64_t	nd = 0;
+	int		rc;
+
+	gettimeofday(&t0, NULL);
+	rc = vssd_attach(1, 2, path);
+	assert(rc == VE_OK);
+	gettimeofday(&t1, NULL);
+	rc = vio_open(2, 1, REMOTE_OK, &h);
+	assert(rc == VE_OK);
+
+	buf = malloc(64 * sizeof(vio_meta_t));
+	rbuf = malloc(BLKSZ);
+	assert(buf != NULL && rbuf != NULL);
+	memset(&req, 0, sizeof(req));
+	req.handle = h;
+	req.type   = VIO_METAOPEN;
+	req.u.metaopenclose.mode = VIO_ALLDATA;
+	rc = vio_request(&req);
+	assert(rc == VE_OK);
+	req.u.metanext.metahandle = req.u.metaopenclose.metahandle;
+	req.type = VIO_METANEXT;
+	req.buf  = buf;
+	do {
+		req.u.metanext.bufsize = 64 * sizeof(vio_meta_t);
+		rc = vio_request(&req);
+		assert(rc == VE_OK);
+		for (off = 0; off < req.u.metanext.bufsize;
+				off += sizeof(vio_meta_t)) {
+			vio_meta_t	*m = (vio_meta_t *) (buf + off);
+
+			nd += (m->flags & VM_DIRTY) != 0;
+			rc = vio_read(h, rbuf, m->hddaddr, VSSD_SECPERBLK);
+			assert(rc == VE_OK);
+			assert(memcmp(rbuf, shadow + m->hddaddr * 512,
+					BLKSZ) == 0);
+			nchecked++;
+		}
+	} while (req.u.metanext.bufsize != 0);
+	req.type = VIO_METACLOSE;
+	rc = vio_request(&req);
+	assert(rc == VE_OK);
+	assert(nd == (clean ? 0 : *ndirty));
+
+	printf("attach in %.3f ms, %lu blocks checked, %lu dirty\n",
+			(t1.tv_sec - t0.tv_sec) * 1e3 +
+			(t1.tv_usec - t0.tv_usec) / 1e3, nchecked, nd);
+	free(buf);
+	free(rbuf);
+	return (h);
+}
+
+static void solo_main(void *arg)
+{
+	devhandle_t	h;
+	vssd_t		*vs;
+	int		nflushed = 0;
+	int		rc;
+
+	rc = taskio_init();
+	assert(rc == 0);
+	taskio_start();
+
+	h = solo_check(arg, 0);
+	vs = vio_vssd(h);
+	rc = voi_flush(vs, solo_flush, &nflushed);
+	assert(rc == OK && hbitmap_count(&vs->dirty) == 0);
+	printf("%d blocks flushed\n", nflushed);
+	vio_close(h);
+	rc = vssd_detach(1);
+	assert(rc == VE_OK);
+
+	h = solo_check(arg, 1);
+	vssd_stats_display(0, vio_vssd(h));
+	vio_close(h);
+	rc = vssd_detach(1);
+	assert(rc == VE_OK);
+	printf("PASS\n");
+	unlink(arg);
+	exit(0);
+}
+
+int main(int argc, char **argv)
+{
+	char	*path = argc > 1 ? argv[1] : "/tmp/vio.img";
+	size_t	len = NTASKS * RANGE * BLKSZ + BLKSZ;
+	pid_t	pid;
+	int	status;
+	int	fd;
+	int	rc;
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	assert(fd >= 0);
+	rc = ftruncate(fd, SSDSZ);
+	assert(rc == 0);
+	close(fd);
+	shadow = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	assert(shadow != MAP_FAILED);
+	ndirty = (uint64_t *) (shadow + len - BLKSZ);
+
+	pid = fork();
+	assert(pid >= 0);
+	if (pid == 0) {
+		libtask_start(solo_crash, path);
+		_exit(1);
+	}
+	rc = waitpid(pid, &status, 0);
+	assert(rc == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	libtask_start(solo_main, path);
+	return (1);
+}
+
+#endif /* SOLOTEST_VIO */
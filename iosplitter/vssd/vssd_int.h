@@ -0,0 +1,197 @@
+/*
+ * vssd_int.h
+ *	vssd engine internals, shared by vio.c and vssd_meta.c
+ */
+
+#ifndef __VSSD_INT_H__
+#define __VSSD_INT_H__
+
+#include <stdint.h>
+#include <time.h>
+#include "libtask/task.h"
+#include "vssd.h"
+#include "dll.h"
+#include "hash.h"
+#include "hbitmap.h"
+#include "lbaindex.h"
+
+#define VSSD_MAGIC		0x56535344	/* VSSD */
+#define VSSD_VERSION		2
+#define VSSD_SECPERBLK		(BLKSZ / RPC_DSKBLKSZ)
+#define VSSD_MAXRUN		64		/* blocks in one data I/O */
+#define VSSD_DIOALIGN		RPC_DSKBLKSZ	/* O_DIRECT buffers */
+
+/* vio_meta_t.flags on the SSD */
+#define VM_VALID		0x1
+#define VM_DIRTY		0x2		/* not on the HDD yet */
+
+#define VSSD_METAPERPG		(BLKSZ / sizeof(vio_meta_t))
+#define VSSD_COOKIEMAX		((1ULL << (8 * COOKIESZ)) - 1)
+
+/*
+ * block 0 of the SSD; the metadata area, the journal and the data blocks
+ * follow it
+ */
+struct vssd_super {
+	uint32_t	magic;
+	uint32_t	version;
+	vssdid_t	vssdid;
+	cdevid_t	cdevid;
+	uint64_t	nblocks;	/* data blocks */
+	uint64_t	metaoff;	/* bytes */
+	uint64_t	jouroff;	/* bytes */
+	uint64_t	jblocks;
+	uint64_t	dataoff;	/* bytes */
+	uint64_t	epoch;		/* of the journal blocks to replay */
+};
+
+/* journal block, entries apply in order on top of the metadata area */
+struct vssd_jent {
+	uint64_t	cblk;
+	vio_meta_t	m;
+};
+
+struct vssd_jblk {
+	uint32_t	magic;
+	uint32_t	crc;		/* of the block with crc 0 */
+	uint64_t	epoch;
+	uint64_t	seq;		/* position in the journal */
+	uint32_t	n;
+	uint32_t	pad;
+	struct vssd_jent e[0];
+};
+
+#define VSSD_JMAGIC		0x564a524e	/* VJRN */
+#define VSSD_JPERBLK		((BLKSZ - sizeof(struct vssd_jblk)) / \
+				sizeof(struct vssd_jent))
+
+/* block written by WRITEP1, not visible before COMMIT */
+struct vssd_p1 {
+	uint64_t	hddblk;
+	uint64_t	cblk;
+	uint16_t	flags;
+};
+
+struct vssd_tran {
+	hash_entry_t	h_entry;
+	tranid_t	tranid;
+	struct vssd_p1	*p1;
+	int		n;
+	int		max;
+};
+
+/*
+ * freed block waiting until the metadata no longer pointing at it is on
+ * the SSD (mgen) and no read that may still use it runs (rgen)
+ */
+struct vssd_limbo {
+	uint64_t	cblk;
+	uint64_t	mgen;
+	uint64_t	rgen;
+};
+
+struct vssd_read {
+	dll_t		list;
+	uint64_t	gen;
+};
+
+/*
+ * all tasks using a vssd run on the thread that attached it
+ */
+struct vssdic {
+	vssdid_t		vssdid;
+	cdevid_t		cdevid;
+	int			fd;
+	int			nopen;
+	int			closing;
+
+	uint64_t		nblocks;
+	uint64_t		metaoff;
+	uint64_t		jouroff;
+	uint64_t		jblocks;
+	uint64_t		dataoff;
+
+	/* metadata, see vssd_meta.c */
+	vio_meta_t		*meta;		/* private mapping, by cblk */
+	uint64_t		npages;		/* of meta on the SSD */
+	hbitmap_t		mdirty;		/* pages for the checkpoint */
+	uint64_t		*jpend;		/* cblks to journal */
+	uint64_t		njpend;
+	uint64_t		jpmax;
+	uint64_t		jhead;		/* next journal block */
+	uint64_t		epoch;
+	time_t			lastcp;
+	int			cpwant;
+	uint64_t		mgen;		/* batch collecting updates */
+	uint64_t		mdone;		/* last batch on the SSD */
+	uint64_t		mwant;		/* batch a waiter waits for */
+	uint64_t		cseq;		/* last cookie handed out */
+	int			mexited;
+	Rendez			mkick;		/* flusher */
+	Rendez			mwait;		/* committers, allocators */
+
+	hbitmap_t		valid;		/* by cblk */
+	hbitmap_t		dirty;
+
+	lbaindex_t		rmap;		/* hddaddr / VSSD_SECPERBLK -> cblk */
+	hash_table_t		trans;		/* tranid -> vssd_tran */
+
+	uint64_t		*freeblks;
+	uint64_t		nfree;
+	uint64_t		hand;		/* eviction clock */
+	struct vssd_limbo	*limbo;		/* ring of nblocks */
+	uint64_t		lhead;
+	uint64_t		ltail;
+
+	dll_t			reads;		/* in flight, oldest first */
+	uint64_t		rgen;
+
+	uint64_t		nreads;
+	uint64_t		nrdblks;
+	uint64_t		nrdmiss;
+	uint64_t		nwrites;
+	uint64_t		nwrblks;
+	uint64_t		ncommits;
+	uint64_t		naborts;
+	uint64_t		nevict;
+	uint64_t		nmetabatch;
+	uint64_t		nmetapages;
+	uint64_t		njblocks;
+	uint64_t		ncheckpoints;
+};
+
+/* vssd_meta.c */
+int vssd_meta_layout(vssd_t *vs, struct vssd_super *sb, uint64_t total);
+int vssd_meta_format(vssd_t *vs);
+int vssd_meta_load(vssd_t *vs);
+void vssd_meta_unload(vssd_t *vs);
+int vssd_meta_start(vssd_t *vs);
+void vssd_meta_stop(vssd_t *vs);
+uint64_t vssd_meta_set(vssd_t *vs, uint64_t cblk, hddaddr_t hddaddr,
+		uint16_t flags);
+void vssd_meta_wait(vssd_t *vs, uint64_t gen);
+
+/* vio.c */
+int vssd_reclaim(vssd_t *vs);
+
+static inline uint64_t vssd_cookie(vio_cookie_t *c)
+{
+	uint64_t	v = 0;
+	int		i;
+
+	for (i = COOKIESZ - 1; i >= 0; i--) {
+		v = (v << 8) | c->c[i];
+	}
+	return (v);
+}
+
+static inline void vssd_setcookie(vio_cookie_t *c, uint64_t v)
+{
+	int	i;
+
+	for (i = 0; i < COOKIESZ; i++, v >>= 8) {
+		c->c[i] = v & 0xff;
+	}
+}
+
+#endif
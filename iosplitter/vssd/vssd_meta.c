@@ -0,0 +1,463 @@
+/*
+ * vssd_meta.c
+ *	persistent block metadata of a vssd
+ *
+ * The metadata area holds one packed vio_meta_t per cache block, indexed
+ * by block number, VSSD_METAPERPG of them per BLKSZ page. It is mapped
+ * private at attach, so only the pages touched are read, and changed in
+ * core by vssd_meta_set(), which returns the generation of the batch the
+ * change belongs to.
+ *
+ * A batch is not written in place. The flusher task appends the records
+ * changed since the previous batch, with their block numbers, to the
+ * journal, packed VSSD_JPERBLK to a block, and then bumps mdone. Callers
+ * that need a change on the SSD, commit and mark, wait in
+ * vssd_meta_wait(), so every commit that arrives while a batch is written
+ * shares the next one and a batch costs one sequential write.
+ *
+ * When the journal is full, VSSD_CPSECS after the last checkpoint and at
+ * detach the flusher checkpoints instead: it writes the pages changed
+ * since the last checkpoint in place, runs of adjacent pages in one I/O,
+ * and then moves the super block to a new epoch, which empties the
+ * journal. Journal blocks carry epoch and position, so load replays the
+ * blocks of the current epoch up to the first torn or stale one, then
+ * checkpoints so that the next append starts from a clean journal.
+ *
+ * A record is valid if VM_VALID is set. Its cookie is taken from a 48 bit
+ * counter whenever a block gets a new hddaddr, when two records claim the
+ * same hddaddr after a crash the one with the larger cookie wins.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "libtask/taskio.h"
+#include "vssd_int.h"
+
+#define VSSD_TASKSZ	(32 * 1024)
+#define VSSD_ZEROSZ	(1 << 20)
+#define VSSD_MINJOUR	64		/* journal blocks */
+#define VSSD_MAXJOUR	16384
+#define VSSD_CPSECS	30		/* checkpoint interval while busy */
+
+static uint32_t vssd_crc(void *buf, size_t len)
+{
+	unsigned char	*p = buf;
+	uint32_t	h = 2166136261u;
+
+	while (len-- > 0) {
+		h = (h ^ *p++) * 16777619u;
+	}
+	return (h);
+}
+
+/* task_aiorw from the flusher, plain pread/pwrite at attach */
+static int vssd_meta_io(vssd_t *vs, char *buf, size_t len, off_t off,
+		tirw_t rw, int aio)
+{
+	ssize_t	ret;
+
+	if (aio) {
+		if (task_aiorw(vs->fd, buf, len, off, rw, &ret) != 0) {
+			return (-1);
+		}
+	} else if (rw == TASKIO_WRITE) {
+		ret = pwrite(vs->fd, buf, len, off);
+	} else {
+		ret = pread(vs->fd, buf, len, off);
+	}
+	return (ret == (ssize_t) len ? 0 : -1);
+}
+
+static int vssd_meta_super(vssd_t *vs, int aio)
+{
+	struct vssd_super	*sb;
+	int			rc;
+
+	if (posix_memalign((void **) &sb, BLKSZ, BLKSZ) != 0) {
+		return (-1);
+	}
+	memset(sb, 0, BLKSZ);
+	sb->magic   = VSSD_MAGIC;
+	sb->version = VSSD_VERSION;
+	sb->vssdid  = vs->vssdid;
+	sb->cdevid  = vs->cdevid;
+	sb->nblocks = vs->nblocks;
+	sb->metaoff = vs->metaoff;
+	sb->jouroff = vs->jouroff;
+	sb->jblocks = vs->jblocks;
+	sb->dataoff = vs->dataoff;
+	sb->epoch   = vs->epoch;
+	rc = vssd_meta_io(vs, (char *) sb, BLKSZ, 0, TASKIO_WRITE, aio);
+	free(sb);
+	return (rc);
+}
+
+/*
+ * layout from the super block sb, or of a new vssd on total blocks:
+ * super, metadata pages, journal, data blocks
+ */
+int vssd_meta_layout(vssd_t *vs, struct vssd_super *sb, uint64_t total)
+{
+	uint64_t	room;
+
+	if (sb != NULL) {
+		vs->nblocks = sb->nblocks;
+		vs->metaoff = sb->metaoff;
+		vs->jouroff = sb->jouroff;
+		vs->jblocks = sb->jblocks;
+		vs->dataoff = sb->dataoff;
+		vs->epoch   = sb->epoch;
+	} else {
+		if (total < 1 + VSSD_MINJOUR + 2) {
+			return (-1);
+		}
+		vs->jblocks = total / (VSSD_METAPERPG + 1) / 8;
+		if (vs->jblocks < VSSD_MINJOUR) {
+			vs->jblocks = VSSD_MINJOUR;
+		} else if (vs->jblocks > VSSD_MAXJOUR) {
+			vs->jblocks = VSSD_MAXJOUR;
+		}
+		room = total - 1 - vs->jblocks;
+		vs->nblocks = room * VSSD_METAPERPG / (VSSD_METAPERPG + 1);
+		vs->metaoff = BLKSZ;
+		vs->jouroff = vs->metaoff + ((vs->nblocks + VSSD_METAPERPG -
+				1) / VSSD_METAPERPG) * BLKSZ;
+		vs->dataoff = vs->jouroff + vs->jblocks * BLKSZ;
+		vs->epoch   = ((uint64_t) time(NULL) << 20) ^ getpid();
+	}
+	vs->npages = (vs->nblocks + VSSD_METAPERPG - 1) / VSSD_METAPERPG;
+	return (vs->nblocks == 0 ? -1 : 0);
+}
+
+/* zero the metadata area, then write the super block */
+int vssd_meta_format(vssd_t *vs)
+{
+	char		*z;
+	uint64_t	off;
+	uint64_t	end = vs->metaoff + vs->npages * BLKSZ;
+	size_t		n;
+	int		rc = 0;
+
+	/* the fd is O_DIRECT */
+	if (posix_memalign((void **) &z, BLKSZ, VSSD_ZEROSZ) != 0) {
+		return (-1);
+	}
+	memset(z, 0, VSSD_ZEROSZ);
+	for (off = vs->metaoff; off < end && rc == 0; off += n) {
+		n = end - off < VSSD_ZEROSZ ? end - off : VSSD_ZEROSZ;
+		rc = vssd_meta_io(vs, z, n, off, TASKIO_WRITE, 0);
+	}
+	free(z);
+	return (rc == 0 ? vssd_meta_super(vs, 0) : -1);
+}
+
+/*
+ * write the pages changed since the last checkpoint, then start a new
+ * epoch; buf holds VSSD_MAXRUN blocks
+ */
+static int vssd_meta_checkpoint(vssd_t *vs, char *buf, int aio)
+{
+	hbitmap_iter_t	it;
+	uint64_t	p0 = 0;
+	uint64_t	n = 0;
+	int64_t		p;
+
+	hbitmap_iter_init(&it, &vs->mdirty, 0);
+	do {
+		p = hbitmap_iter_next(&it);
+		if (n != 0 && (p != p0 + n || n == VSSD_MAXRUN)) {
+			memcpy(buf, (char *) vs->meta + p0 * BLKSZ, n * BLKSZ);
+			hbitmap_clear_range(&vs->mdirty, p0, n);
+			if (vssd_meta_io(vs, buf, n * BLKSZ, vs->metaoff +
+					p0 * BLKSZ, TASKIO_WRITE, aio) != 0) {
+				return (-1);
+			}
+			vs->nmetapages += n;
+			n = 0;
+		}
+		if (n == 0) {
+			p0 = p;
+		}
+		n++;
+	} while (p >= 0);
+
+	/* pages on the SSD before the super block drops the journal */
+	if (fdatasync(vs->fd) != 0) {
+		return (-1);
+	}
+	vs->epoch++;
+	if (vssd_meta_super(vs, aio) != 0) {
+		return (-1);
+	}
+	vs->jhead  = 0;
+	vs->lastcp = time(NULL);
+	vs->cpwant = 0;
+	vs->ncheckpoints++;
+	return (0);
+}
+
+/* append the records of cblk[0, n) to the journal */
+static int vssd_meta_journal(vssd_t *vs, char *buf, uint64_t *cblk,
+		uint64_t n)
+{
+	struct vssd_jblk	*jb;
+	uint64_t		i = 0;
+	uint64_t		nb;
+	uint32_t		k;
+
+	while (i < n) {
+		for (nb = 0; nb < VSSD_MAXRUN && i < n; nb++) {
+			jb = (struct vssd_jblk *) (buf + nb * BLKSZ);
+			memset(jb, 0, BLKSZ);
+			jb->magic = VSSD_JMAGIC;
+			jb->epoch = vs->epoch;
+			jb->seq   = vs->jhead + nb;
+			for (k = 0; k < VSSD_JPERBLK && i < n; k++, i++) {
+				jb->e[k].cblk = cblk[i];
+				jb->e[k].m    = vs->meta[cblk[i]];
+			}
+			jb->n   = k;
+			jb->crc = vssd_crc(jb, BLKSZ);
+		}
+		if (vssd_meta_io(vs, buf, nb * BLKSZ, vs->jouroff +
+				vs->jhead * BLKSZ, TASKIO_WRITE, 1) != 0) {
+			return (-1);
+		}
+		vs->jhead    += nb;
+		vs->njblocks += nb;
+	}
+	return (0);
+}
+
+/* apply the journal blocks of the current epoch, returns how many */
+static int64_t vssd_meta_replay(vssd_t *vs, char *buf)
+{
+	struct vssd_jblk	*jb;
+	uint64_t		pos;
+	uint64_t		nb;
+	uint64_t		i;
+	uint32_t		crc;
+	uint32_t		k;
+
+	for (pos = 0; pos < vs->jblocks; pos += nb) {
+		nb = vs->jblocks - pos < VSSD_MAXRUN ? vs->jblocks - pos :
+				VSSD_MAXRUN;
+		if (vssd_meta_io(vs, buf, nb * BLKSZ, vs->jouroff +
+				pos * BLKSZ, TASKIO_READ, 0) != 0) {
+			return (-1);
+		}
+		for (i = 0; i < nb; i++) {
+			jb = (struct vssd_jblk *) (buf + i * BLKSZ);
+			if (jb->magic != VSSD_JMAGIC ||
+					jb->epoch != vs->epoch ||
+					jb->seq != pos + i ||
+					jb->n > VSSD_JPERBLK) {
+				return (pos + i);
+			}
+			crc = jb->crc;
+			jb->crc = 0;
+			if (vssd_crc(jb, BLKSZ) != crc) {
+				return (pos + i);
+			}
+			for (k = 0; k < jb->n; k++) {
+				if (jb->e[k].cblk >= vs->nblocks) {
+					continue;
+				}
+				vs->meta[jb->e[k].cblk] = jb->e[k].m;
+				hbitmap_set(&vs->mdirty,
+						jb->e[k].cblk / VSSD_METAPERPG);
+			}
+		}
+	}
+	return (pos);
+}
+
+/*
+ * map the metadata area and bring it up to date with the journal; a
+ * replayed journal is checkpointed right away, a later append must not
+ * run into torn blocks of this one
+ */
+int vssd_meta_load(vssd_t *vs)
+{
+	char		*buf;
+	int64_t		n;
+	int		rc = 0;
+
+	vs->meta = mmap(NULL, vs->npages * BLKSZ, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE, vs->fd, vs->metaoff);
+	if (vs->meta == MAP_FAILED) {
+		vs->meta = NULL;
+		return (-1);
+	}
+	madvise(vs->meta, vs->npages * BLKSZ, MADV_SEQUENTIAL);
+
+	vs->jpmax = 1024;
+	vs->jpend = malloc(vs->jpmax * sizeof(*vs->jpend));
+	if (vs->jpend == NULL) {
+		return (-1);
+	}
+	vs->mgen   = 1;
+	vs->mdone  = 0;
+	vs->lastcp = time(NULL);
+
+	if (posix_memalign((void **) &buf, BLKSZ, VSSD_MAXRUN * BLKSZ) != 0) {
+		return (-1);
+	}
+	n = vssd_meta_replay(vs, buf);
+	if (n < 0) {
+		rc = -1;
+	} else if (n > 0) {
+		rc = vssd_meta_checkpoint(vs, buf, 0);
+	}
+	free(buf);
+	return (rc);
+}
+
+void vssd_meta_unload(vssd_t *vs)
+{
+	if (vs->meta != NULL) {
+		munmap(vs->meta, vs->npages * BLKSZ);
+		vs->meta = NULL;
+	}
+	free(vs->jpend);
+	vs->jpend = NULL;
+}
+
+uint64_t vssd_meta_set(vssd_t *vs, uint64_t cblk, hddaddr_t hddaddr,
+		uint16_t flags)
+{
+	vio_meta_t	*m = &vs->meta[cblk];
+	uint64_t	*np;
+
+	if (!(flags & VM_VALID)) {
+		memset(m, 0, sizeof(*m));
+	} else {
+		if (!(m->flags & VM_VALID) || m->hddaddr != hddaddr) {
+			vs->cseq = (vs->cseq + 1) & VSSD_COOKIEMAX;
+			vssd_setcookie(&m->cookie, vs->cseq);
+		}
+		m->hddaddr = hddaddr;
+		m->flags   = flags;
+	}
+	hbitmap_set(&vs->mdirty, cblk / VSSD_METAPERPG);
+
+	/* out of memory for the journal, the checkpoint covers it */
+	if (vs->njpend == vs->jpmax) {
+		np = realloc(vs->jpend, 2 * vs->jpmax * sizeof(*np));
+		if (np == NULL) {
+			vs->cpwant = 1;
+			return (vs->mgen);
+		}
+		vs->jpend  = np;
+		vs->jpmax *= 2;
+	}
+	vs->jpend[vs->njpend++] = cblk;
+	return (vs->mgen);
+}
+
+void vssd_meta_wait(vssd_t *vs, uint64_t gen)
+{
+	if (vs->mwant < gen) {
+		vs->mwant = gen;
+	}
+	taskwakeup(&vs->mkick);
+	while (vs->mdone < gen) {
+		tasksleep(&vs->mwait);
+	}
+}
+
+static void vssd_meta_flusher(void *arg)
+{
+	vssd_t		*vs = arg;
+	uint64_t	*cur;
+	uint64_t	*t;
+	uint64_t	curmax;
+	uint64_t	n;
+	uint64_t	gen;
+	char		*buf;
+	int		rc;
+
+	taskname("vssd_meta_flusher %lu", vs->vssdid);
+
+	rc = posix_memalign((void **) &buf, BLKSZ, VSSD_MAXRUN * BLKSZ);
+	assert(rc == 0);
+	curmax = 1024;
+	cur = malloc(curmax * sizeof(*cur));
+	assert(cur != NULL);
+
+	while (1) {
+		/* a waiter may want a batch whose records an earlier one wrote */
+		while (vs->njpend == 0 && !vs->cpwant &&
+				vs->mwant <= vs->mdone) {
+			if (vs->closing) {
+				goto out;
+			}
+			tasksleep(&vs->mkick);
+		}
+
+		/* let the other committers of this round join the batch */
+		taskyield();
+		gen = vs->mgen++;
+
+		/* take the pending records, leave the empty list */
+		t = cur;
+		cur = vs->jpend;
+		vs->jpend = t;
+		n = curmax;
+		curmax = vs->jpmax;
+		vs->jpmax = n;
+		n = vs->njpend;
+		vs->njpend = 0;
+
+		if (vs->cpwant || vs->jhead + (n + VSSD_JPERBLK - 1) /
+				VSSD_JPERBLK > vs->jblocks ||
+				time(NULL) - vs->lastcp >= VSSD_CPSECS) {
+			rc = vssd_meta_checkpoint(vs, buf, 1);
+		} else {
+			rc = vssd_meta_journal(vs, buf, cur, n);
+		}
+		if (rc != 0) {
+			fprintf(stderr, "vssd %lu: metadata write failed\n",
+					vs->vssdid);
+			assert(0);
+		}
+
+		vs->mdone = gen;
+		vs->nmetabatch++;
+		vssd_reclaim(vs);
+		taskwakeupall(&vs->mwait);
+	}
+
+out:
+	/* nothing to replay at the next attach */
+	if (vs->jhead != 0 || hbitmap_count(&vs->mdirty) != 0) {
+		rc = vssd_meta_checkpoint(vs, buf, 1);
+		assert(rc == 0);
+	}
+	free(cur);
+	free(buf);
+	vs->mexited = 1;
+	taskwakeupall(&vs->mwait);
+}
+
+int vssd_meta_start(vssd_t *vs)
+{
+	taskcreate(vssd_meta_flusher, vs, VSSD_TASKSZ);
+	return (0);
+}
+
+/* waits until everything is on the SSD */
+void vssd_meta_stop(vssd_t *vs)
+{
+	vs->closing = 1;
+	taskwakeup(&vs->mkick);
+	while (!vs->mexited) {
+		tasksleep(&vs->mwait);
+	}
+}
@@ -21,6 +21,7 @@
 #include "network.h"
 #include "tst-rpc.h"
 #include "stats.h"
+#include "trace.h"
 
 VMK_ReturnStatus start_test_thread(void);
 
@@ -145,6 +146,7 @@ struct ExampleCommand {
    vmk_ScsiCommand      *scsiCmd;   // =
    vmk_ScsiCommandDoneCbk done;     // =
    void                 *doneData;  // =
+   vmk_uint32           traceid;    // = 0 unless sampled
 };
 
 typedef enum { 
@@ -1355,6 +1357,7 @@ static VMK_ReturnStatus read_cmd(ExampleCommand *ex_cmd, rpc_chan_t *rcp)
 	rpc_msg_get(rcp, RPC_READ_MSG, sizeof(*r), &m);
 	assert(m != NULL);
 
+	m->hdr.traceid = ex_cmd->traceid;
 	m->opaque = ex_cmd;
 	r         = (read_cmd_t *) &m->hdr;
 	r->offset = offset;
@@ -1418,6 +1421,7 @@ static VMK_ReturnStatus write_cmd(ExampleCommand *ex_cmd, rpc_chan_t *rcp)
 		}
 	}
 
+	m->hdr.traceid = ex_cmd->traceid;
 	m->opaque = ex_cmd;
 	w         = (write_cmd_t *) &m->hdr;
 	w->offset = offset;
@@ -1875,6 +1879,8 @@ ExampleDeviceStartCommand(vmk_ScsiDevice *scsiDev)
 		exCmd->scsiCmd  = cmd;
 		exCmd->done     = cmd->done;
 		exCmd->doneData = cmd->doneData;
+		exCmd->traceid  = cb_trace_sample();
+		cb_trace(exCmd->traceid, TR_MPP_ENQUEUE);
 
 		w               = new_work(&send_tp);
 		assert(w != NULL);
@@ -3,6 +3,7 @@
 #include "rpc.h"
 #include "threadpool.h"
 #include "stats.h"
+#include "trace.h"
 
 extern cb_stat_t recv_tp_work_q_stat;
 extern cb_stat_t sock_write_fp_stat;
@@ -15,6 +16,7 @@ static inline void dump_rpc_msghdr(rpc_msghdr_t *p)
 	vmk_WarningMessage("\t\tmsglen       %d\n", p->msglen);
 	vmk_WarningMessage("\t\tpayloadlen   %lu\n", p->payloadlen);
 	vmk_WarningMessage("\t\tstatus       %d\n", p->status);
+	vmk_WarningMessage("\t\ttraceid      %08x\n", p->traceid);
 }
 
 static inline void dump_rpc_msg(rpc_msg_t *p)
@@ -76,6 +78,8 @@ static inline void _rpc_response(rpc_chan_t *rcp, rpc_msg_t *resp)
 	msgp       = container_of(e, rpc_msg_t, h_entry);
 	msgp->resp = resp;
 
+	cb_trace(resp->hdr.traceid, TR_CLI_DONE);
+
 	rcp->resp_handler(msgp);
 }
 
@@ -344,6 +348,11 @@ int rpc_async_request(rpc_chan_t *rcp, rpc_msg_t *msgp)
 	RPC_CHAN_LOCK(rcp);
 	hash_add(&rcp->hash, &msgp->h_entry, b);
 
+	/* the server records rpc_send from this stamp */
+	if (msgp->hdr.traceid != 0) {
+		msgp->hdr.tsend = cb_trace_now();
+	}
+
 	cb_stat_enter(&sock_write_fp_stat, &h);
 	rc = socket_write(rcp->socket, (char *) &msgp->hdr, msgp->hdr.msglen);
 	cb_stat_exit(&sock_write_fp_stat, h);
@@ -434,6 +443,8 @@ void rpc_msg_get(rpc_chan_t *rcp, int msgtype, size_t msglen, rpc_msg_t **msgpp)
 	rm->hdr.msglen     = msglen;
 	rm->hdr.payloadlen = 0;
 	rm->hdr.status     = 0;
+	rm->hdr.traceid    = 0;
+	rm->hdr.tsend      = 0;
 	RPC_SETMSGTYPE(rm, msgtype);
 
 	*msgpp             = rm;
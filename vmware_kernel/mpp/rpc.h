@@ -72,6 +72,8 @@ typedef struct rpc_msghdr {
 	uint16_t msglen;
 	uint64_t payloadlen;
 	uint16_t status;
+	uint32_t traceid;	/* nonzero when sampled, see trace.h */
+	uint64_t tsend;		/* sender's cb_trace_now() of a traced msg */
 } rpc_msghdr_t;
 
 typedef struct rpc_msg {
@@ -1,6 +1,7 @@
 #include "vmkapi.h"
 #include "vmware_include.h"
 #include "stats.h"
+#include "trace.h"
 
 static inline int _cb_stat_queue_init(cb_stat_t *stat)
 {
@@ -242,6 +243,10 @@ static void _cb_stats_update(vmk_TimerCookie data)
 
 	p       = VMK_FALSE;
 	samples = ++stats->sample;
+	if ((samples % 100) == 0) {
+		/* the timer also drains the trace ring, once a second */
+		cb_trace_dump();
+	}
 	if ((samples % 1000) == 0) {
 		p             = VMK_TRUE;
 		stats->sample = 0;
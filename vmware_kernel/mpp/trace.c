@@ -0,0 +1,128 @@
+#include "vmkapi.h"
+#include "vmware_include.h"
+#include "trace.h"
+
+/*
+ * One ring for all PCPUs. A writer claims a slot with an atomic add on
+ * head, fills it and publishes it by setting its seq to slot + 1; the
+ * dumper only reports slots whose seq matches before and after the copy.
+ */
+typedef struct cb_trace_slot {
+	vmk_atomic64 seq;
+	vmk_uint32   id;
+	vmk_uint16   stage;
+	vmk_uint16   pcpu;
+	vmk_uint64   ns;
+} cb_trace_slot_t;
+
+static const char *cb_trace_stage_name[TR_NSTAGES] = {
+	"mpp_enqueue",
+	"rpc_send",
+	"srv_recv",
+	"handler",
+	"io_submit",
+	"io_done",
+	"rsp_send",
+	"cli_done",
+};
+
+int                    cb_trace_rate = CB_TRACE_RATE;
+
+static cb_trace_slot_t cb_trace_ring[CB_TRACE_RINGSZ];
+static vmk_atomic64    cb_trace_head;
+static vmk_atomic64    cb_trace_count;
+static vmk_atomic64    cb_trace_nextid;
+static vmk_uint64      cb_trace_tail;		/* dumper only */
+static vmk_uint64      cb_trace_ndropped;
+static vmk_uint64      cb_trace_nreported;
+
+/*
+ * wall clock, so that records line up with the iosplitter's
+ */
+vmk_uint64 cb_trace_now(void)
+{
+	vmk_TimeVal tv;
+
+	vmk_GetTimeOfDay(&tv);
+	return tv.sec * 1000000000ULL + tv.usec * 1000ULL;
+}
+
+vmk_uint32 cb_trace_sample(void)
+{
+	vmk_uint32 id;
+
+	if (cb_trace_rate == 0 ||
+			vmk_AtomicReadInc64(&cb_trace_count) % cb_trace_rate != 0) {
+		return 0;
+	}
+	do {
+		id = (vmk_uint32) vmk_AtomicReadInc64(&cb_trace_nextid) + 1;
+	} while (id == 0);
+	return id;
+}
+
+void cb_trace_rec(vmk_uint32 id, int stage, vmk_uint64 ns)
+{
+	cb_trace_slot_t *s;
+	vmk_uint64      h;
+
+	assert(stage >= 0 && stage < TR_NSTAGES);
+
+	h = vmk_AtomicReadInc64(&cb_trace_head);
+	s = &cb_trace_ring[h & (CB_TRACE_RINGSZ - 1)];
+	vmk_AtomicWrite64(&s->seq, 0);
+	vmk_CPUMemFenceWrite();
+	s->id    = id;
+	s->stage = stage;
+	s->pcpu  = vmk_GetPCPUNum();
+	s->ns    = ns;
+	vmk_CPUMemFenceWrite();
+	vmk_AtomicWrite64(&s->seq, h + 1);
+}
+
+/*
+ * log the records written since the last dump, called from the stats
+ * timer only
+ */
+void cb_trace_dump(void)
+{
+	cb_trace_slot_t *s;
+	cb_trace_slot_t c;
+	vmk_uint64      h;
+	vmk_uint64      i;
+
+	h = vmk_AtomicRead64(&cb_trace_head);
+	if (h - cb_trace_tail > CB_TRACE_RINGSZ) {
+		cb_trace_ndropped += h - cb_trace_tail - CB_TRACE_RINGSZ;
+		cb_trace_tail = h - CB_TRACE_RINGSZ;
+	}
+
+	for (i = cb_trace_tail; i < h; i++) {
+		s = &cb_trace_ring[i & (CB_TRACE_RINGSZ - 1)];
+		if (vmk_AtomicRead64(&s->seq) != i + 1) {
+			/* still being written, or already reused */
+			if (vmk_AtomicRead64(&cb_trace_head) - i <= CB_TRACE_RINGSZ) {
+				break;
+			}
+			cb_trace_ndropped++;
+			continue;
+		}
+		vmk_CPUMemFenceRead();
+		c.id    = s->id;
+		c.stage = s->stage;
+		c.pcpu  = s->pcpu;
+		c.ns    = s->ns;
+		vmk_CPUMemFenceRead();
+		if (vmk_AtomicRead64(&s->seq) != i + 1) {
+			cb_trace_ndropped++;
+			continue;
+		}
+		vmk_LogMessage("cbtrace: %08x %s %lu %u\n", c.id,
+				cb_trace_stage_name[c.stage], c.ns, c.pcpu);
+	}
+	cb_trace_tail = i;
+	if (cb_trace_ndropped != cb_trace_nreported) {
+		vmk_LogMessage("cbtrace: # %lu dropped\n", cb_trace_ndropped);
+		cb_trace_nreported = cb_trace_ndropped;
+	}
+}
@@ -0,0 +1,42 @@
+#ifndef __CB_TRACE_H__
+#define __CB_TRACE_H__
+
+/*
+ * Sampled request tracing, the MPP end of iosplitter/include/trace.h.
+ * Stage numbers and names must match it; records are dumped to the
+ * vmkernel log as "cbtrace: <id> <stage> <ns> <pcpu>", which
+ * iosplitter/tools/cbtrace reads next to the iosplitter's trace file.
+ */
+
+#include "vmware_include.h"
+
+enum cb_trace_stage {
+	TR_MPP_ENQUEUE,
+	TR_RPC_SEND,
+	TR_SRV_RECV,
+	TR_HANDLER,
+	TR_IO_SUBMIT,
+	TR_IO_DONE,
+	TR_RSP_SEND,
+	TR_CLI_DONE,
+	TR_NSTAGES
+};
+
+#define CB_TRACE_RINGSZ	2048		/* power of 2 */
+#define CB_TRACE_RATE	64		/* trace 1 in CB_TRACE_RATE commands */
+
+extern int cb_trace_rate;		/* 0: off */
+
+vmk_uint64 cb_trace_now(void);
+vmk_uint32 cb_trace_sample(void);
+void cb_trace_rec(vmk_uint32 id, int stage, vmk_uint64 ns);
+void cb_trace_dump(void);
+
+static inline void cb_trace(vmk_uint32 id, int stage)
+{
+	if (id != 0) {
+		cb_trace_rec(id, stage, cb_trace_now());
+	}
+}
+
+#endif